@@ -11,6 +11,8 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
 #include "iptables.h"
 #include "ip6tables.h"
 #include "xshared.h"
@@ -20,7 +22,7 @@
 #include "iptables-multi.h"
 #include "ip6tables-multi.h"
 
-static int counters, verbose, noflush, wait;
+static int counters, verbose, noflush, wait, binary, diff;
 
 static struct timeval wait_interval = {
 	.tv_sec	= 1,
@@ -28,7 +30,9 @@ static struct timeval wait_interval = {
 
 /* Keeping track of external matches and targets.  */
 static const struct option options[] = {
+	{.name = "binary",        .has_arg = 0, .val = 'b'},
 	{.name = "counters",      .has_arg = 0, .val = 'c'},
+	{.name = "diff",          .has_arg = 0, .val = 'd'},
 	{.name = "verbose",       .has_arg = 0, .val = 'v'},
 	{.name = "version",       .has_arg = 0, .val = 'V'},
 	{.name = "test",          .has_arg = 0, .val = 't'},
@@ -43,8 +47,10 @@ static const struct option options[] = {
 
 static void print_usage(const char *name, const char *version)
 {
-	fprintf(stderr, "Usage: %s [-c] [-v] [-V] [-t] [-h] [-n] [-w secs] [-W usecs] [-T table] [-M command] [file]\n"
+	fprintf(stderr, "Usage: %s [-b] [-c] [-d] [-v] [-V] [-t] [-h] [-n] [-w secs] [-W usecs] [-T table] [-M command] [file]\n"
+			"	   [ --binary ]\n"
 			"	   [ --counters ]\n"
+			"	   [ --diff ]\n"
 			"	   [ --verbose ]\n"
 			"	   [ --version]\n"
 			"	   [ --test ]\n"
@@ -67,6 +73,25 @@ struct iptables_restore_cb {
 	int (*delete_chain)(const xt_chainlabel, int, struct xtc_handle *);
 	int (*do_command)(int argc, char *argv[], char **table,
 			  struct xtc_handle **handle, bool restore);
+	/* counters of a raw entry, returns the offset of the next one */
+	unsigned int (*entry_counters)(const void *entry,
+				       struct xt_counters *ctr);
+	/* rules of a chain, for --diff */
+	const void *(*first_rule)(const char *chain,
+				  struct xtc_handle *handle);
+	const void *(*next_rule)(const void *prev, struct xtc_handle *handle);
+	const char *(*get_target)(const void *entry,
+				  struct xtc_handle *handle);
+	int (*insert_entry)(const xt_chainlabel chain, const void *entry,
+			    unsigned int rulenum, struct xtc_handle *handle);
+	int (*replace_entry)(const xt_chainlabel chain, const void *entry,
+			     unsigned int rulenum, struct xtc_handle *handle);
+	int (*delete_num_entry)(const xt_chainlabel chain,
+				unsigned int rulenum,
+				struct xtc_handle *handle);
+	/* entries match the same packets, targets aside */
+	bool (*entry_same)(const void *a, const void *b);
+	struct xt_entry_target *(*entry_target)(void *entry);
 };
 
 static struct xtc_handle *
@@ -89,11 +114,387 @@ create_handle(const struct iptables_restore_cb *cb, const char *tablename)
 	return handle;
 }
 
+/* Replace tables by the blobs in a snapshot from iptables-save -b. */
+static void restore_binary(const struct iptables_restore_cb *cb, FILE *in,
+			   const char *tablename, int testing)
+{
+	struct ipt_getinfo *info = NULL, cur;
+	struct xt_counters_info *ci;
+	struct ipt_replace *repl;
+	unsigned int i, off;
+	uint32_t type, len;
+	socklen_t optlen;
+	int fd, lock;
+	void *blob;
+
+	xt_snapshot_read_hdr(in, XT_SNAPSHOT_LEGACY, afinfo->family);
+
+	fd = socket(afinfo->family, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+	if (fd < 0)
+		xtables_error(OTHER_PROBLEM, "Cannot open socket: %s\n",
+			      strerror(errno));
+
+	/* an info record, then the entries blob of the size it tells */
+	while ((blob = xt_snapshot_read(in, &type, &len,
+					info && info->size > sizeof(*info) ?
+					info->size : sizeof(*info)))) {
+		if (type == XT_SNAPSHOT_INFO && len == sizeof(*info)) {
+			free(info);
+			info = blob;
+			continue;
+		}
+		if (type != XT_SNAPSHOT_ENTRIES || !info || len != info->size)
+			xtables_error(PARAMETER_PROBLEM, "Snapshot is corrupt");
+
+		if (tablename && strcmp(tablename, info->name)) {
+			free(blob);
+			continue;
+		}
+
+		lock = xtables_lock_or_exit(wait, verbose);
+
+		/* the kernel wants the current number of entries */
+		memset(&cur, 0, sizeof(cur));
+		strcpy(cur.name, info->name);
+		optlen = sizeof(cur);
+		if (getsockopt(fd, afinfo->ipproto, IPT_SO_GET_INFO,
+			       &cur, &optlen) < 0) {
+			xtables_load_ko(xtables_modprobe_program, false);
+			optlen = sizeof(cur);
+			if (getsockopt(fd, afinfo->ipproto, IPT_SO_GET_INFO,
+				       &cur, &optlen) < 0)
+				xtables_error(PARAMETER_PROBLEM,
+					      "%s: unable to initialize table '%s'\n",
+					      xt_params->program_name,
+					      info->name);
+		}
+
+		repl = xtables_calloc(1, sizeof(*repl) + info->size);
+		strcpy(repl->name, info->name);
+		repl->valid_hooks = info->valid_hooks;
+		repl->num_entries = info->num_entries;
+		repl->size = info->size;
+		memcpy(repl->hook_entry, info->hook_entry,
+		       sizeof(repl->hook_entry));
+		memcpy(repl->underflow, info->underflow,
+		       sizeof(repl->underflow));
+		repl->num_counters = cur.num_entries;
+		repl->counters = xtables_calloc(cur.num_entries ? : 1,
+						sizeof(struct xt_counters));
+		memcpy(repl->entries, blob, info->size);
+
+		if (!testing &&
+		    setsockopt(fd, afinfo->ipproto, IPT_SO_SET_REPLACE, repl,
+			       sizeof(*repl) + info->size) < 0)
+			xtables_error(OTHER_PROBLEM,
+				      "%s: replacing table '%s' failed: %s\n",
+				      xt_params->program_name, info->name,
+				      cb->ops->strerror(errno));
+
+		/* counters in the blob are ignored on replace */
+		if (!testing && counters) {
+			ci = xtables_calloc(1, sizeof(*ci) + info->num_entries *
+						sizeof(struct xt_counters));
+			strcpy(ci->name, info->name);
+			ci->num_counters = info->num_entries;
+			for (i = 0, off = 0;
+			     i < info->num_entries && off < info->size; i++)
+				off += cb->entry_counters((char *)blob + off,
+							  &ci->counters[i]);
+
+			if (setsockopt(fd, afinfo->ipproto,
+				       IPT_SO_SET_ADD_COUNTERS, ci,
+				       sizeof(*ci) + info->num_entries *
+				       sizeof(struct xt_counters)) < 0)
+				xtables_error(OTHER_PROBLEM,
+					      "%s: setting counters of table '%s' failed: %s\n",
+					      xt_params->program_name,
+					      info->name,
+					      cb->ops->strerror(errno));
+			free(ci);
+		}
+
+		if (lock >= 0)
+			xtables_unlock(lock);
+
+		free(repl->counters);
+		free(repl);
+		free(blob);
+	}
+
+	free(info);
+	close(fd);
+}
+
+/* Compare the matches of two entries up to @target_offset, leaving out
+ * kernel-private match data.
+ */
+static bool entry_matches_same(const void *a, const void *b,
+			       unsigned int start, unsigned int target_offset)
+{
+	const struct xt_entry_match *ma, *mb;
+	unsigned int off;
+	size_t size;
+
+	for (off = start; off < target_offset; off += ma->u.match_size) {
+		ma = (const void *)((const char *)a + off);
+		mb = (const void *)((const char *)b + off);
+
+		if (ma->u.match_size < sizeof(*ma) ||
+		    ma->u.match_size != mb->u.match_size ||
+		    ma->u.user.revision != mb->u.user.revision ||
+		    strcmp(ma->u.user.name, mb->u.user.name))
+			return false;
+
+		size = xt_userspacesize(ma->u.user.name, false);
+		if (size > ma->u.match_size - sizeof(*ma))
+			size = ma->u.match_size - sizeof(*ma);
+		if (memcmp(ma->data, mb->data, size))
+			return false;
+	}
+	return true;
+}
+
+/* Verdicts and jumps are told apart by their label, see TC_GET_TARGET. */
+static bool target_is_module(const struct iptables_restore_cb *cb,
+			     const char *name, struct xtc_handle *handle)
+{
+	return *name && strcmp(name, "ACCEPT") && strcmp(name, "DROP") &&
+	       strcmp(name, "QUEUE") && strcmp(name, "RETURN") &&
+	       !cb->ops->is_chain(name, handle);
+}
+
+struct restore_diff_chain {
+	const struct iptables_restore_cb	*cb;
+	struct xtc_handle			*live;
+	struct xtc_handle			*want;
+	const void				**old;
+	const void				**new;
+};
+
+static bool restore_diff_same(unsigned int old, unsigned int new, void *data)
+{
+	struct restore_diff_chain *d = data;
+	const struct iptables_restore_cb *cb = d->cb;
+	const struct xt_entry_target *ta, *tb;
+	const char *name;
+	size_t size;
+
+	if (!cb->entry_same(d->old[old], d->new[new]))
+		return false;
+
+	/* --counters: rules to be given other counters are replaced */
+	if (counters) {
+		struct xt_counters a, b;
+
+		cb->entry_counters(d->old[old], &a);
+		cb->entry_counters(d->new[new], &b);
+		if (a.pcnt != b.pcnt || a.bcnt != b.bcnt)
+			return false;
+	}
+
+	name = cb->get_target(d->new[new], d->want);
+	if (strcmp(name, cb->get_target(d->old[old], d->live)))
+		return false;
+	if (!target_is_module(cb, name, d->want))
+		return true;
+
+	ta = cb->entry_target((void *)d->old[old]);
+	tb = cb->entry_target((void *)d->new[new]);
+	if (ta->u.target_size < sizeof(*ta) ||
+	    ta->u.target_size != tb->u.target_size ||
+	    ta->u.user.revision != tb->u.user.revision)
+		return false;
+
+	size = xt_userspacesize(name, true);
+	if (size > ta->u.target_size - sizeof(*ta))
+		size = ta->u.target_size - sizeof(*ta);
+	return !memcmp(ta->data, tb->data, size);
+}
+
+static unsigned int restore_diff_rules(const struct iptables_restore_cb *cb,
+				       const char *chain,
+				       struct xtc_handle *handle,
+				       const void ***rules)
+{
+	unsigned int n = 0, size = 0;
+	const void *e;
+
+	*rules = NULL;
+	for (e = cb->first_rule(chain, handle); e;
+	     e = cb->next_rule(e, handle)) {
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			*rules = xtables_realloc(*rules,
+						 size * sizeof(**rules));
+		}
+		(*rules)[n++] = e;
+	}
+	return n;
+}
+
+/* Copy of a rule of @want for adding it to another handle, which maps
+ * verdicts and jumps by their label again.
+ */
+static void *restore_diff_entry(const struct iptables_restore_cb *cb,
+				const void *e, struct xtc_handle *want)
+{
+	const char *name = cb->get_target(e, want);
+	struct xt_entry_target *t;
+	struct xt_counters ctr;
+	unsigned int size;
+	void *copy;
+
+	size = cb->entry_counters(e, &ctr);
+	copy = xtables_malloc(size);
+	memcpy(copy, e, size);
+
+	if (!target_is_module(cb, name, want)) {
+		t = cb->entry_target(copy);
+		memset(t->u.user.name, 0, sizeof(t->u.user.name));
+		strncpy(t->u.user.name, name, sizeof(t->u.user.name) - 1);
+	}
+	return copy;
+}
+
+static void restore_diff_chain(const struct iptables_restore_cb *cb,
+			       struct xtc_handle *live,
+			       struct xtc_handle *want, const char *chain,
+			       struct xt_diff_stats *stats)
+{
+	struct restore_diff_chain d = {
+		.cb	= cb,
+		.live	= live,
+		.want	= want,
+	};
+	unsigned int nold, nnew, nsteps, i, pos = 0;
+	struct xt_diff_step *steps;
+	void *e;
+	int ret = 1;
+
+	nold = restore_diff_rules(cb, chain, live, &d.old);
+	nnew = restore_diff_rules(cb, chain, want, &d.new);
+
+	steps = xtables_calloc(nold + nnew + 1, sizeof(*steps));
+	nsteps = xt_diff_rules(nold, nnew, restore_diff_same, &d, steps,
+			       stats);
+
+	for (i = 0; i < nsteps && ret; i++) {
+		switch (steps[i].op) {
+		case XT_DIFF_KEEP:
+			pos++;
+			break;
+		case XT_DIFF_REPLACE:
+			e = restore_diff_entry(cb, d.new[steps[i].new], want);
+			ret = cb->replace_entry(chain, e, pos++, live);
+			free(e);
+			break;
+		case XT_DIFF_INSERT:
+			e = restore_diff_entry(cb, d.new[steps[i].new], want);
+			ret = cb->insert_entry(chain, e, pos++, live);
+			free(e);
+			break;
+		case XT_DIFF_DELETE:
+			ret = cb->delete_num_entry(chain, pos, live);
+			break;
+		}
+	}
+	if (!ret)
+		xtables_error(OTHER_PROBLEM, "%s: can't update chain `%s': %s\n",
+			      xt_params->program_name, chain,
+			      cb->ops->strerror(errno));
+
+	free(steps);
+	free(d.new);
+	free(d.old);
+}
+
+/* Bring @live, the table as in the kernel, in line with @want, the table
+ * as restored, touching only rules and chains which differ. Rules left
+ * alone keep their counters, and if nothing differs the table is not
+ * replaced at all. With --counters, differing counters make a rule differ.
+ */
+static void restore_diff(const struct iptables_restore_cb *cb,
+			 struct xtc_handle *live, struct xtc_handle *want,
+			 const char *table)
+{
+	struct xt_diff_stats stats = {};
+	xt_chainlabel *gone = NULL;
+	struct xt_counters cnt, cur;
+	const char *chain, *policy;
+	unsigned int ngone = 0, i;
+	const void **rules;
+
+	/* rules may jump to chains which are new */
+	for (chain = cb->ops->first_chain(want); chain;
+	     chain = cb->ops->next_chain(want)) {
+		if (cb->ops->is_chain(chain, live))
+			continue;
+		if (!cb->ops->create_chain(chain, live))
+			xtables_error(OTHER_PROBLEM,
+				      "%s: can't create chain `%s': %s\n",
+				      xt_params->program_name, chain,
+				      cb->ops->strerror(errno));
+		stats.chains_added++;
+	}
+
+	for (chain = cb->ops->first_chain(want); chain;
+	     chain = cb->ops->next_chain(want)) {
+		restore_diff_chain(cb, live, want, chain, &stats);
+
+		if (cb->ops->builtin(chain, want) <= 0)
+			continue;
+
+		policy = cb->ops->get_policy(chain, &cnt, want);
+		if (!policy ||
+		    (!strcmp(policy,
+			     cb->ops->get_policy(chain, &cur, live) ? : "") &&
+		     (!counters || (cnt.pcnt == cur.pcnt &&
+				    cnt.bcnt == cur.bcnt))))
+			continue;
+		if (!cb->ops->set_policy(chain, policy,
+					 counters ? &cnt : NULL, live))
+			xtables_error(OTHER_PROBLEM,
+				      "Can't set policy `%s' on `%s': %s\n",
+				      policy, chain, cb->ops->strerror(errno));
+	}
+
+	for (chain = cb->ops->first_chain(live); chain;
+	     chain = cb->ops->next_chain(live)) {
+		if (cb->ops->is_chain(chain, want))
+			continue;
+		gone = xtables_realloc(gone, (ngone + 1) * sizeof(*gone));
+		snprintf(gone[ngone++], sizeof(*gone), "%s", chain);
+	}
+
+	/* chains going away may jump to each other */
+	for (i = 0; i < ngone; i++) {
+		stats.deleted += restore_diff_rules(cb, gone[i], live, &rules);
+		free(rules);
+		if (!cb->flush_entries(gone[i], 0, live))
+			xtables_error(OTHER_PROBLEM,
+				      "%s: can't flush chain `%s': %s\n",
+				      xt_params->program_name, gone[i],
+				      cb->ops->strerror(errno));
+	}
+	for (i = 0; i < ngone; i++) {
+		if (!cb->delete_chain(gone[i], 0, live))
+			xtables_error(OTHER_PROBLEM,
+				      "%s: can't delete chain `%s': %s\n",
+				      xt_params->program_name, gone[i],
+				      cb->ops->strerror(errno));
+		stats.chains_deleted++;
+	}
+	free(gone);
+
+	xt_diff_print(table, &stats);
+}
+
 static int
 ip46tables_restore_main(const struct iptables_restore_cb *cb,
 			int argc, char *argv[])
 {
-	struct xtc_handle *handle = NULL;
+	struct xtc_handle *handle = NULL, *live = NULL;
 	struct argv_store av_store = {};
 	char buffer[10240];
 	int c, lock;
@@ -105,14 +506,17 @@ ip46tables_restore_main(const struct iptables_restore_cb *cb,
 	line = 0;
 	lock = XT_LOCK_NOT_ACQUIRED;
 
-	while ((c = getopt_long(argc, argv, "bcvVthnwWM:T:", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "bcdvVthnwWM:T:", options, NULL)) != -1) {
 		switch (c) {
 			case 'b':
-				fprintf(stderr, "-b/--binary option is not implemented\n");
+				binary = 1;
 				break;
 			case 'c':
 				counters = 1;
 				break;
+			case 'd':
+				diff = 1;
+				break;
 			case 'v':
 				verbose = 1;
 				break;
@@ -170,6 +574,20 @@ ip46tables_restore_main(const struct iptables_restore_cb *cb,
 		exit(1);
 	}
 
+	if (diff && (noflush || binary))
+		xtables_error(PARAMETER_PROBLEM,
+			      "--diff does not support --%s",
+			      noflush ? "noflush" : "binary");
+
+	if (binary) {
+		if (noflush)
+			xtables_error(PARAMETER_PROBLEM,
+				      "--binary does not support --noflush");
+		restore_binary(cb, in, tablename, testing);
+		fclose(in);
+		return 0;
+	}
+
 	/* Grab standard input. */
 	while (fgets(buffer, sizeof(buffer), in)) {
 		int ret = 0;
@@ -182,6 +600,13 @@ ip46tables_restore_main(const struct iptables_restore_cb *cb,
 				fputs(buffer, stdout);
 			continue;
 		} else if ((strcmp(buffer, "COMMIT\n") == 0) && (in_table)) {
+			if (live) {
+				restore_diff(cb, live, handle, curtable);
+				cb->ops->free(handle);
+				handle = live;
+				live = NULL;
+			}
+
 			if (!testing) {
 				DEBUGP("Calling commit\n");
 				ret = cb->ops->commit(handle);
@@ -201,7 +626,7 @@ ip46tables_restore_main(const struct iptables_restore_cb *cb,
 			in_table = 0;
 		} else if ((buffer[0] == '*') && (!in_table)) {
 			/* Acquire a lock before we create a new table handle */
-			lock = xtables_lock_or_exit(wait, &wait_interval);
+			lock = xtables_lock_or_exit(wait, verbose);
 
 			/* New table */
 			char *table;
@@ -239,6 +664,13 @@ ip46tables_restore_main(const struct iptables_restore_cb *cb,
 						handle);
 			}
 
+			/* --diff: the table as it is, to apply the changes to */
+			if (diff) {
+				if (live)
+					cb->ops->free(live);
+				live = create_handle(cb, table);
+			}
+
 			ret = 1;
 			in_table = 1;
 
@@ -353,18 +785,88 @@ ip46tables_restore_main(const struct iptables_restore_cb *cb,
 		exit(1);
 	}
 
+	if (verbose)
+		xs_parse_cache_print();
+	xs_parse_cache_free();
+	xs_opts_cache_free();
 	fclose(in);
 	return 0;
 }
 
 
 #if defined ENABLE_IPV4
+static unsigned int entry_counters4(const void *entry,
+				    struct xt_counters *ctr)
+{
+	const struct ipt_entry *e = entry;
+
+	*ctr = e->counters;
+	return e->next_offset;
+}
+
+static const void *first_rule4(const char *chain, struct xtc_handle *handle)
+{
+	return iptc_first_rule(chain, handle);
+}
+
+static const void *next_rule4(const void *prev, struct xtc_handle *handle)
+{
+	return iptc_next_rule(prev, handle);
+}
+
+static const char *get_target4(const void *entry, struct xtc_handle *handle)
+{
+	return iptc_get_target(entry, handle);
+}
+
+static int insert_entry4(const xt_chainlabel chain, const void *entry,
+			 unsigned int rulenum, struct xtc_handle *handle)
+{
+	return iptc_insert_entry(chain, entry, rulenum, handle);
+}
+
+static int replace_entry4(const xt_chainlabel chain, const void *entry,
+			  unsigned int rulenum, struct xtc_handle *handle)
+{
+	return iptc_replace_entry(chain, entry, rulenum, handle);
+}
+
+static int delete_num_entry4(const xt_chainlabel chain, unsigned int rulenum,
+			     struct xtc_handle *handle)
+{
+	return iptc_delete_num_entry(chain, rulenum, handle);
+}
+
+static bool entry_same4(const void *a, const void *b)
+{
+	const struct ipt_entry *ea = a, *eb = b;
+
+	return !memcmp(&ea->ip, &eb->ip, sizeof(ea->ip)) &&
+	       ea->target_offset == eb->target_offset &&
+	       ea->next_offset == eb->next_offset &&
+	       entry_matches_same(a, b, sizeof(*ea), ea->target_offset);
+}
+
+static struct xt_entry_target *entry_target4(void *entry)
+{
+	return ipt_get_target(entry);
+}
+
 static const struct iptables_restore_cb ipt_restore_cb = {
 	.ops		= &iptc_ops,
 	.for_each_chain	= for_each_chain4,
 	.flush_entries	= flush_entries4,
 	.delete_chain	= delete_chain4,
 	.do_command	= do_command4,
+	.entry_counters	= entry_counters4,
+	.first_rule	= first_rule4,
+	.next_rule	= next_rule4,
+	.get_target	= get_target4,
+	.insert_entry	= insert_entry4,
+	.replace_entry	= replace_entry4,
+	.delete_num_entry = delete_num_entry4,
+	.entry_same	= entry_same4,
+	.entry_target	= entry_target4,
 };
 
 int
@@ -390,12 +892,78 @@ iptables_restore_main(int argc, char *argv[])
 #endif
 
 #if defined ENABLE_IPV6
+static unsigned int entry_counters6(const void *entry,
+				    struct xt_counters *ctr)
+{
+	const struct ip6t_entry *e = entry;
+
+	*ctr = e->counters;
+	return e->next_offset;
+}
+
+static const void *first_rule6(const char *chain, struct xtc_handle *handle)
+{
+	return ip6tc_first_rule(chain, handle);
+}
+
+static const void *next_rule6(const void *prev, struct xtc_handle *handle)
+{
+	return ip6tc_next_rule(prev, handle);
+}
+
+static const char *get_target6(const void *entry, struct xtc_handle *handle)
+{
+	return ip6tc_get_target(entry, handle);
+}
+
+static int insert_entry6(const xt_chainlabel chain, const void *entry,
+			 unsigned int rulenum, struct xtc_handle *handle)
+{
+	return ip6tc_insert_entry(chain, entry, rulenum, handle);
+}
+
+static int replace_entry6(const xt_chainlabel chain, const void *entry,
+			  unsigned int rulenum, struct xtc_handle *handle)
+{
+	return ip6tc_replace_entry(chain, entry, rulenum, handle);
+}
+
+static int delete_num_entry6(const xt_chainlabel chain, unsigned int rulenum,
+			     struct xtc_handle *handle)
+{
+	return ip6tc_delete_num_entry(chain, rulenum, handle);
+}
+
+static bool entry_same6(const void *a, const void *b)
+{
+	const struct ip6t_entry *ea = a, *eb = b;
+
+	return !memcmp(&ea->ipv6, &eb->ipv6, sizeof(ea->ipv6)) &&
+	       ea->target_offset == eb->target_offset &&
+	       ea->next_offset == eb->next_offset &&
+	       entry_matches_same(a, b, sizeof(*ea), ea->target_offset);
+}
+
+static struct xt_entry_target *entry_target6(void *entry)
+{
+	return ip6t_get_target(entry);
+}
+
 static const struct iptables_restore_cb ip6t_restore_cb = {
 	.ops		= &ip6tc_ops,
 	.for_each_chain	= for_each_chain6,
 	.flush_entries	= flush_entries6,
 	.delete_chain	= delete_chain6,
 	.do_command	= do_command6,
+	.entry_counters	= entry_counters6,
+	.first_rule	= first_rule6,
+	.next_rule	= next_rule6,
+	.get_target	= get_target6,
+	.insert_entry	= insert_entry6,
+	.replace_entry	= replace_entry6,
+	.delete_num_entry = delete_num_entry6,
+	.entry_same	= entry_same6,
+	.entry_target	= entry_target6,
 };
 
 int
@@ -15,6 +15,8 @@
 #include <time.h>
 #include <netdb.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netfilter/xt_comment.h>
 #include "libiptc/libiptc.h"
 #include "libiptc/libip6tc.h"
 #include "iptables.h"
@@ -24,9 +26,13 @@
 #include "xshared.h"
 
 static int show_counters;
+static int counters_only;
+static int binary;
 
 static const struct option options[] = {
+	{.name = "binary",   .has_arg = false, .val = 'b'},
 	{.name = "counters", .has_arg = false, .val = 'c'},
+	{.name = "counters-only", .has_arg = false, .val = 'C'},
 	{.name = "dump",     .has_arg = false, .val = 'd'},
 	{.name = "table",    .has_arg = true,  .val = 't'},
 	{.name = "modprobe", .has_arg = true,  .val = 'M'},
@@ -39,6 +45,8 @@ struct iptables_save_cb {
 	const struct xtc_ops *ops;
 
 	void (*dump_rules)(const char *chain, struct xtc_handle *handle);
+	void (*dump_counters)(const char *tablename, const char *chain,
+			      struct xtc_handle *handle);
 };
 
 static int
@@ -71,6 +79,109 @@ for_each_table(int (*func)(struct iptables_save_cb *cb, const char *tablename),
 	return ret;
 }
 
+/* Counters-only format, one line per chain policy or rule:
+ * table chain rulenum|- packets bytes [comment]
+ */
+static void print_counters(const char *tablename, const char *chain,
+			   unsigned int num, const struct xt_counters *count,
+			   const unsigned char *elems, size_t len)
+{
+	const struct xt_entry_match *m;
+	size_t off;
+
+	printf("%s %s %u %llu %llu", tablename, chain, num,
+	       (unsigned long long)count->pcnt,
+	       (unsigned long long)count->bcnt);
+
+	/* the comment is looked up raw, no extension needs loading */
+	for (off = 0; off < len; off += m->u.match_size) {
+		m = (const struct xt_entry_match *)(elems + off);
+		if (!m->u.match_size)
+			break;
+		if (!strcmp(m->u.user.name, "comment")) {
+			xtables_save_string(
+				((const struct xt_comment_info *)m->data)->comment);
+			break;
+		}
+	}
+	putchar('\n');
+}
+
+static void do_output_counters(struct iptables_save_cb *cb,
+			       const char *tablename, struct xtc_handle *h)
+{
+	struct xt_counters count;
+	const char *chain;
+
+	for (chain = cb->ops->first_chain(h);
+	     chain;
+	     chain = cb->ops->next_chain(h)) {
+		if (cb->ops->builtin(chain, h)) {
+			cb->ops->get_policy(chain, &count, h);
+			printf("%s %s - %llu %llu\n", tablename, chain,
+			       (unsigned long long)count.pcnt,
+			       (unsigned long long)count.bcnt);
+		}
+		cb->dump_counters(tablename, chain, h);
+	}
+}
+
+/* Binary snapshot of a table: its info and entries blob as handed out by
+ * the kernel, for iptables-restore -b to pass back as they are.
+ */
+static int do_output_binary(struct iptables_save_cb *cb,
+			    const char *tablename)
+{
+	struct ipt_get_entries *entries;
+	struct ipt_getinfo info;
+	socklen_t len;
+	int fd;
+
+	if (!tablename)
+		return for_each_table(&do_output_binary, cb);
+
+	fd = socket(afinfo->family, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+	if (fd < 0)
+		xtables_error(OTHER_PROBLEM, "Cannot open socket: %s\n",
+			      strerror(errno));
+
+	/* the ip6t_ variants of these are laid out the same */
+	memset(&info, 0, sizeof(info));
+	strncpy(info.name, tablename, sizeof(info.name) - 1);
+retry:
+	len = sizeof(info);
+	if (getsockopt(fd, afinfo->ipproto, IPT_SO_GET_INFO, &info, &len) < 0) {
+		xtables_load_ko(xtables_modprobe_program, false);
+		len = sizeof(info);
+		if (getsockopt(fd, afinfo->ipproto, IPT_SO_GET_INFO,
+			       &info, &len) < 0)
+			xtables_error(OTHER_PROBLEM, "Cannot initialize: %s\n",
+				      cb->ops->strerror(errno));
+	}
+
+	len = sizeof(*entries) + info.size;
+	entries = xtables_calloc(1, len);
+	strcpy(entries->name, info.name);
+	entries->size = info.size;
+	if (getsockopt(fd, afinfo->ipproto, IPT_SO_GET_ENTRIES,
+		       entries, &len) < 0) {
+		free(entries);
+		/* the table changed in between */
+		if (errno == EAGAIN)
+			goto retry;
+		xtables_error(OTHER_PROBLEM, "Cannot get entries: %s\n",
+			      cb->ops->strerror(errno));
+	}
+	close(fd);
+
+	xt_snapshot_write(stdout, XT_SNAPSHOT_INFO, &info, sizeof(info));
+	xt_snapshot_write(stdout, XT_SNAPSHOT_ENTRIES, entries->entrytable,
+			  info.size);
+	free(entries);
+
+	return 1;
+}
+
 static int do_output(struct iptables_save_cb *cb, const char *tablename)
 {
 	struct xtc_handle *h;
@@ -88,6 +199,12 @@ static int do_output(struct iptables_save_cb *cb, const char *tablename)
 		xtables_error(OTHER_PROBLEM, "Cannot initialize: %s\n",
 			      cb->ops->strerror(errno));
 
+	if (counters_only) {
+		do_output_counters(cb, tablename, h);
+		cb->ops->free(h);
+		return 1;
+	}
+
 	time_t now = time(NULL);
 
 	printf("# Generated by %s v%s on %s",
@@ -138,14 +255,17 @@ do_iptables_save(struct iptables_save_cb *cb, int argc, char *argv[])
 	FILE *file = NULL;
 	int ret, c;
 
-	while ((c = getopt_long(argc, argv, "bcdt:M:f:V", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "bcCdt:M:f:V", options, NULL)) != -1) {
 		switch (c) {
 		case 'b':
-			fprintf(stderr, "-b/--binary option is not implemented\n");
+			binary = 1;
 			break;
 		case 'c':
 			show_counters = 1;
 			break;
+		case 'C':
+			counters_only = 1;
+			break;
 
 		case 't':
 			/* Select specific table. */
@@ -190,6 +310,12 @@ do_iptables_save(struct iptables_save_cb *cb, int argc, char *argv[])
 		exit(1);
 	}
 
+	if (binary) {
+		xt_snapshot_write_hdr(stdout, XT_SNAPSHOT_LEGACY,
+				      afinfo->family);
+		return !do_output_binary(cb, tablename);
+	}
+
 	return !do_output(cb, tablename);
 }
 
@@ -206,9 +332,21 @@ static void iptables_dump_rules(const char *chain, struct xtc_handle *h)
 	}
 }
 
+static void iptables_dump_counters(const char *tablename, const char *chain,
+				   struct xtc_handle *h)
+{
+	const struct ipt_entry *e;
+	unsigned int num = 0;
+
+	for (e = iptc_first_rule(chain, h); e; e = iptc_next_rule(e, h))
+		print_counters(tablename, chain, ++num, &e->counters,
+			       e->elems, e->target_offset - sizeof(*e));
+}
+
 struct iptables_save_cb ipt_save_cb = {
 	.ops		= &iptc_ops,
 	.dump_rules	= iptables_dump_rules,
+	.dump_counters	= iptables_dump_counters,
 };
 
 /* Format:
@@ -247,9 +385,21 @@ static void ip6tables_dump_rules(const char *chain, struct xtc_handle *h)
 	}
 }
 
+static void ip6tables_dump_counters(const char *tablename, const char *chain,
+				    struct xtc_handle *h)
+{
+	const struct ip6t_entry *e;
+	unsigned int num = 0;
+
+	for (e = ip6tc_first_rule(chain, h); e; e = ip6tc_next_rule(e, h))
+		print_counters(tablename, chain, ++num, &e->counters,
+			       e->elems, e->target_offset - sizeof(*e));
+}
+
 struct iptables_save_cb ip6t_save_cb = {
 	.ops		= &ip6tc_ops,
 	.dump_rules	= ip6tables_dump_rules,
+	.dump_counters	= ip6tables_dump_counters,
 };
 
 /* Format:
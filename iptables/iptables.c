@@ -1136,6 +1136,7 @@ int do_command4(int argc, char *argv[], char **table,
 	struct iptables_command_state cs = {
 		.jumpto	= "",
 		.argv	= argv,
+		.restore = restore,
 	};
 	struct ipt_entry *e = NULL;
 	unsigned int nsaddrs = 0, ndaddrs = 0;
@@ -1154,7 +1155,6 @@ int do_command4(int argc, char *argv[], char **table,
 	const char *pcnt = NULL, *bcnt = NULL;
 	int ret = 1;
 	struct xtables_match *m;
-	struct xtables_rule_match *matchp;
 	struct xtables_target *t;
 	unsigned long long cnt;
 	bool table_set = false;
@@ -1177,9 +1177,9 @@ int do_command4(int argc, char *argv[], char **table,
            demand-load a protocol. */
 	opterr = 0;
 	opts = xt_params->orig_opts;
-	while ((cs.c = getopt_long(argc, argv,
+	while ((cs.c = xs_getopt_long(&cs, argc, argv,
 	   "-:A:C:D:R:I:L::S::M:F::Z::N:X::E:P:Vh::o:p:s:d:j:i:fbvw::W::nt:m:xc:g:46",
-					   opts, NULL)) != -1) {
+					   opts)) != -1) {
 		switch (cs.c) {
 			/*
 			 * Command selection
@@ -1537,10 +1537,7 @@ int do_command4(int argc, char *argv[], char **table,
 			"\nThe \"nat\" table is not intended for filtering, "
 		        "the use of DROP is therefore inhibited.\n\n");
 
-	for (matchp = cs.matches; matchp; matchp = matchp->next)
-		xtables_option_mfcall(matchp->match);
-	if (cs.target != NULL)
-		xtables_option_tfcall(cs.target);
+	xs_option_fcall(&cs);
 
 	/* Fix me: must put inverse options checking here --MN */
 
@@ -1581,7 +1578,7 @@ int do_command4(int argc, char *argv[], char **table,
 
 	/* Attempt to acquire the xtables lock */
 	if (!restore)
-		xtables_lock_or_exit(wait, &wait_interval);
+		xtables_lock_or_exit(wait, verbose);
 
 	/* only allocate handle if we weren't called with a handle */
 	if (!*handle)
@@ -1777,7 +1774,7 @@ int do_command4(int argc, char *argv[], char **table,
 	free(smasks);
 	free(daddrs);
 	free(dmasks);
-	xtables_free_opts(1);
+	xs_free_opts(&cs);
 
 	return ret;
 }
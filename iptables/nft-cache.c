@@ -11,13 +11,17 @@
 
 #include <assert.h>
 #include <errno.h>
+#include <stdlib.h>
 #include <string.h>
 #include <xtables.h>
 
 #include <linux/netfilter/nf_tables.h>
 
 #include <libmnl/libmnl.h>
+#include <libnftnl/chain.h>
+#include <libnftnl/expr.h>
 #include <libnftnl/gen.h>
+#include <libnftnl/rule.h>
 #include <libnftnl/set.h>
 #include <libnftnl/table.h>
 
@@ -45,7 +49,7 @@ out:
 	return MNL_CB_ERROR;
 }
 
-static void mnl_genid_get(struct nft_handle *h, uint32_t *genid)
+void mnl_genid_get(struct nft_handle *h, uint32_t *genid)
 {
 	char buf[MNL_SOCKET_BUFFER_SIZE];
 	struct nlmsghdr *nlh;
@@ -250,6 +254,9 @@ static int fetch_set_cache(struct nft_handle *h,
 			if (!h->tables[i].name)
 				continue;
 
+			if (h->cache->table[type].sets)
+				continue;
+
 			h->cache->table[type].sets = nftnl_set_list_alloc();
 			if (!h->cache->table[type].sets)
 				return -1;
@@ -362,9 +369,644 @@ static int fetch_chain_cache(struct nft_handle *h,
 	return ret;
 }
 
+/*
+ * Per-chain cache state.
+ *
+ * Chains are tracked by name in a small hash per table, so the cache knows
+ * whether the rules of a chain have been fetched from the kernel already,
+ * independently of the other chains. This also tells apart chains without
+ * rules from chains whose rules were never fetched.
+ *
+ * Rules may be appended or inserted at the head of a chain before its
+ * rules are fetched; these are new in this transaction and the kernel ones
+ * go in between once they are fetched.
+ *
+ * Cached rules are also hashed by a fingerprint of their expression stream,
+ * so that looking up a rule by its specification (-D, -C) only needs to
+ * decode and compare the few rules sharing the fingerprint of the rule
+ * being searched for. Fields that are not part of the rule specification
+ * (counter values, anonymous set names, kernel-private parts of
+ * match/target info) are left out of the fingerprint.
+ *
+ * A rule that is not found by fingerprint is not in the chain, unless the
+ * chain holds rules the encoder of this version would not produce the same
+ * way: rules with userdata, with expressions it never emits or with compat
+ * matches and targets it now translates natively where possible. Those
+ * "foreign" rules are counted, lookups need a full scan on a miss as long
+ * as there are any.
+ */
+#define NFT_CHAIN_STATE_HSIZE		256
+#define NFT_RULE_INDEX_MIN_HSIZE	64
+
+struct nft_rule_index_entry {
+	struct hlist_node	node;
+	uint32_t		hash;
+	bool			foreign;
+	struct nftnl_rule	*rule;
+};
+
+struct nft_rule_index {
+	unsigned int		hsize;
+	unsigned int		entries;
+	unsigned int		foreign;
+	struct hlist_head	*hash;
+};
+
+struct nft_chain_state {
+	struct hlist_node	node;
+	char			*chain;
+	bool			rules_loaded;
+	/* rules inserted at the head while rules were not loaded */
+	unsigned int		head_rules;
+	/* where fetched rules go, NULL to append them */
+	struct nftnl_rule	*fetch_pos;
+	struct nft_rule_index	*index;
+	/* rules merged by --optimize, listed as the rules they stand for */
+	struct nftnl_rule	**merged;
+	unsigned int		nmerged;
+};
+
+#define NFT_HASH_INIT	2166136261U
+
+/* FNV-1a */
+static uint32_t nft_hash_data(uint32_t hash, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static uint32_t nft_hash_attr(uint32_t hash, const struct nftnl_expr *e,
+			      uint16_t attr)
+{
+	const void *data;
+	uint32_t len;
+
+	if (!nftnl_expr_is_set(e, attr))
+		return nft_hash_data(hash, &attr, sizeof(attr));
+
+	data = nftnl_expr_get(e, attr, &len);
+	return nft_hash_data(hash, data, len);
+}
+
+static uint32_t nft_hash_xt_info(uint32_t hash, const struct nftnl_expr *e,
+				 bool is_target)
+{
+	uint16_t name_attr = is_target ? NFTNL_EXPR_TG_NAME : NFTNL_EXPR_MT_NAME;
+	uint16_t info_attr = is_target ? NFTNL_EXPR_TG_INFO : NFTNL_EXPR_MT_INFO;
+	const char *name = nftnl_expr_get_str(e, name_attr);
+	const void *info;
+	uint32_t len;
+	size_t size;
+
+	hash = nft_hash_attr(hash, e, name_attr);
+	hash = nft_hash_attr(hash, e, is_target ? NFTNL_EXPR_TG_REV :
+						  NFTNL_EXPR_MT_REV);
+
+	info = nftnl_expr_get(e, info_attr, &len);
+	if (!name || !info)
+		return hash;
+
+	hash = nft_hash_data(hash, &len, sizeof(len));
+
+	size = xt_userspacesize(name, is_target);
+	if (size > len)
+		size = len;
+
+	return nft_hash_data(hash, info, size);
+}
+
+/* extensions added as native expressions if possible, see above */
+static const char *nft_native_xt_names[] = {
+	"tcp", "udp", "multiport", "conntrack", "state", "mark", "connmark",
+	"set", "MARK", "CONNMARK", "SET",
+};
+
+static bool nft_xt_is_native(const struct nftnl_expr *e, bool is_target)
+{
+	const char *name;
+	unsigned int i;
+
+	name = nftnl_expr_get_str(e, is_target ? NFTNL_EXPR_TG_NAME :
+						 NFTNL_EXPR_MT_NAME);
+	if (!name)
+		return false;
+
+	for (i = 0; i < ARRAY_SIZE(nft_native_xt_names); i++) {
+		if (!strcmp(name, nft_native_xt_names[i]))
+			return true;
+	}
+	return false;
+}
+
+struct nft_rule_fp {
+	uint32_t	hash;
+	bool		foreign;
+};
+
+static int nft_rule_fingerprint_expr(struct nftnl_expr *e, void *data)
+{
+	const char *name = nftnl_expr_get_str(e, NFTNL_EXPR_NAME);
+	struct nft_rule_fp *fp = data;
+	uint32_t *hash = &fp->hash;
+
+	*hash = nft_hash_data(*hash, name, strlen(name));
+
+	if (!strcmp(name, "payload")) {
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_PAYLOAD_BASE);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_PAYLOAD_OFFSET);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_PAYLOAD_LEN);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_PAYLOAD_DREG);
+	} else if (!strcmp(name, "meta")) {
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_META_KEY);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_META_DREG);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_META_SREG);
+	} else if (!strcmp(name, "cmp")) {
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_CMP_SREG);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_CMP_OP);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_CMP_DATA);
+	} else if (!strcmp(name, "range")) {
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_RANGE_SREG);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_RANGE_OP);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_RANGE_FROM_DATA);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_RANGE_TO_DATA);
+	} else if (!strcmp(name, "bitwise")) {
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_BITWISE_SREG);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_BITWISE_LEN);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_BITWISE_MASK);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_BITWISE_XOR);
+	} else if (!strcmp(name, "ct")) {
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_CT_KEY);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_CT_DIR);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_CT_DREG);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_CT_SREG);
+	} else if (!strcmp(name, "byteorder")) {
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_BYTEORDER_SREG);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_BYTEORDER_OP);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_BYTEORDER_LEN);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_BYTEORDER_SIZE);
+	} else if (!strcmp(name, "immediate")) {
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_IMM_DREG);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_IMM_DATA);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_IMM_VERDICT);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_IMM_CHAIN);
+	} else if (!strcmp(name, "lookup")) {
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_LOOKUP_SREG);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_LOOKUP_FLAGS);
+	} else if (!strcmp(name, "dynset")) {
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_DYNSET_SREG_KEY);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_DYNSET_OP);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_DYNSET_SET_NAME);
+	} else if (!strcmp(name, "limit")) {
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_LIMIT_RATE);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_LIMIT_UNIT);
+		*hash = nft_hash_attr(*hash, e, NFTNL_EXPR_LIMIT_BURST);
+	} else if (!strcmp(name, "match")) {
+		*hash = nft_hash_xt_info(*hash, e, false);
+		if (nft_xt_is_native(e, false))
+			fp->foreign = true;
+	} else if (!strcmp(name, "target")) {
+		*hash = nft_hash_xt_info(*hash, e, true);
+		if (nft_xt_is_native(e, true))
+			fp->foreign = true;
+	} else if (strcmp(name, "counter")) {
+		fp->foreign = true;
+	}
+
+	return 0;
+}
+
+static uint32_t __nft_rule_fingerprint(struct nftnl_rule *r, bool *foreign)
+{
+	struct nft_rule_fp fp = {
+		.hash	= NFT_HASH_INIT,
+	};
+
+	nftnl_expr_foreach(r, nft_rule_fingerprint_expr, &fp);
+
+	if (foreign)
+		*foreign = fp.foreign ||
+			   nftnl_rule_is_set(r, NFTNL_RULE_USERDATA);
+
+	return fp.hash;
+}
+
+uint32_t nft_rule_fingerprint(struct nftnl_rule *r)
+{
+	return __nft_rule_fingerprint(r, NULL);
+}
+
+static struct nft_chain_state *
+nft_chain_state_get(struct nft_handle *h, const char *table,
+		    const char *chain, bool create)
+{
+	const struct builtin_table *t;
+	struct nft_chain_state *st;
+	struct hlist_head *bucket;
+	struct hlist_node *n;
+	uint32_t hash;
+
+	if (!table || !chain)
+		return NULL;
+
+	t = nft_table_builtin_find(h, table);
+	if (!t)
+		return NULL;
+
+	if (!h->cache->table[t->type].chain_state) {
+		if (!create)
+			return NULL;
+		h->cache->table[t->type].chain_state =
+			xtables_calloc(NFT_CHAIN_STATE_HSIZE,
+				       sizeof(struct hlist_head));
+	}
+
+	hash = nft_hash_data(NFT_HASH_INIT, chain, strlen(chain));
+	bucket = &h->cache->table[t->type].chain_state[hash % NFT_CHAIN_STATE_HSIZE];
+
+	hlist_for_each_entry(st, n, bucket, node) {
+		if (!strcmp(st->chain, chain))
+			return st;
+	}
+
+	if (!create)
+		return NULL;
+
+	st = xtables_calloc(1, sizeof(*st));
+	st->chain = xtables_malloc(strlen(chain) + 1);
+	strcpy(st->chain, chain);
+	hlist_add_head(&st->node, bucket);
+
+	return st;
+}
+
+static struct nft_chain_state *
+nft_chain_state_get_c(struct nft_handle *h, struct nftnl_chain *c, bool create)
+{
+	return nft_chain_state_get(h, nftnl_chain_get_str(c, NFTNL_CHAIN_TABLE),
+				   nftnl_chain_get_str(c, NFTNL_CHAIN_NAME),
+				   create);
+}
+
+static int nft_merged_index(struct nft_chain_state *st, uint64_t handle)
+{
+	unsigned int i;
+
+	for (i = 0; i < st->nmerged; i++) {
+		if (nftnl_rule_get_u64(st->merged[i],
+				       NFTNL_RULE_HANDLE) == handle)
+			return i;
+	}
+	return -1;
+}
+
+static void nft_rule_index_insert(struct nft_chain_state *st,
+				  struct nftnl_rule *r)
+{
+	struct nft_rule_index *idx = st->index;
+	bool foreign;
+	uint32_t hash = __nft_rule_fingerprint(r, &foreign);
+	struct nft_rule_index_entry *e;
+
+	/* The rules a merged rule stands for have their keys matched where
+	 * the merged rule looked them up, which need not be where a rule
+	 * built from the same options has them.
+	 */
+	if (st->nmerged && nftnl_rule_is_set(r, NFTNL_RULE_HANDLE) &&
+	    nft_merged_index(st, nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE)) >= 0)
+		foreign = true;
+
+	if (idx->entries >= idx->hsize * 2) {
+		struct hlist_head *old = idx->hash;
+		unsigned int i, old_hsize = idx->hsize;
+		struct hlist_node *n, *tmp;
+
+		idx->hsize <<= 2;
+		idx->hash = xtables_calloc(idx->hsize, sizeof(struct hlist_head));
+
+		for (i = 0; i < old_hsize; i++) {
+			hlist_for_each_entry_safe(e, n, tmp, &old[i], node) {
+				hlist_del(&e->node);
+				hlist_add_head(&e->node,
+					       &idx->hash[e->hash & (idx->hsize - 1)]);
+			}
+		}
+		free(old);
+	}
+
+	e = xtables_malloc(sizeof(*e));
+	e->hash = hash;
+	e->foreign = foreign;
+	e->rule = r;
+	hlist_add_head(&e->node, &idx->hash[hash & (idx->hsize - 1)]);
+	idx->entries++;
+	if (foreign)
+		idx->foreign++;
+}
+
+static void nft_rule_index_free(struct nft_chain_state *st)
+{
+	struct nft_rule_index *idx = st->index;
+	struct nft_rule_index_entry *e;
+	struct hlist_node *n, *tmp;
+	unsigned int i;
+
+	if (!idx)
+		return;
+
+	for (i = 0; i < idx->hsize; i++) {
+		hlist_for_each_entry_safe(e, n, tmp, &idx->hash[i], node) {
+			hlist_del(&e->node);
+			free(e);
+		}
+	}
+	free(idx->hash);
+	free(idx);
+	st->index = NULL;
+}
+
+static void nft_rule_index_build(struct nft_chain_state *st,
+				 struct nftnl_chain *c)
+{
+	struct nftnl_rule_iter *iter;
+	struct nft_rule_index *idx;
+	struct nftnl_rule *r;
+
+	idx = xtables_calloc(1, sizeof(*idx));
+	idx->hsize = NFT_RULE_INDEX_MIN_HSIZE;
+	idx->hash = xtables_calloc(idx->hsize, sizeof(struct hlist_head));
+	st->index = idx;
+
+	iter = nftnl_rule_iter_create(c);
+	if (!iter)
+		return;
+
+	r = nftnl_rule_iter_next(iter);
+	while (r) {
+		nft_rule_index_insert(st, r);
+		r = nftnl_rule_iter_next(iter);
+	}
+	nftnl_rule_iter_destroy(iter);
+}
+
+static void nft_merged_free(struct nft_chain_state *st)
+{
+	unsigned int i;
+
+	for (i = 0; i < st->nmerged; i++)
+		nftnl_rule_free(st->merged[i]);
+	free(st->merged);
+	st->merged = NULL;
+	st->nmerged = 0;
+}
+
+static void nft_chain_state_free(struct nft_chain_state *st)
+{
+	nft_rule_index_free(st);
+	nft_merged_free(st);
+	hlist_del(&st->node);
+	free(st->chain);
+	free(st);
+}
+
+static void nft_chain_state_table_free(struct hlist_head *table)
+{
+	struct nft_chain_state *st;
+	struct hlist_node *n, *tmp;
+	unsigned int i;
+
+	if (!table)
+		return;
+
+	for (i = 0; i < NFT_CHAIN_STATE_HSIZE; i++) {
+		hlist_for_each_entry_safe(st, n, tmp, &table[i], node)
+			nft_chain_state_free(st);
+	}
+	free(table);
+}
+
+/* The cached rules of @c are all there is, i.e. the chain was just created
+ * or flushed in this transaction.
+ */
+static void nft_chain_state_set_empty(struct nft_handle *h,
+				      struct nftnl_chain *c)
+{
+	struct nft_chain_state *st = nft_chain_state_get_c(h, c, true);
+
+	if (!st)
+		return;
+
+	nft_rule_index_free(st);
+	nft_merged_free(st);
+	st->rules_loaded = true;
+	st->head_rules = 0;
+}
+
+/* Return the first rule in chain @c (in rule order) whose fingerprint
+ * equals the one of @needle and for which the family specific comparison
+ * against @data succeeds. Returns NULL if no indexed rule matches, then
+ * @complete tells whether that means no rule in @c matches at all.
+ */
+struct nftnl_rule *
+nft_rule_index_lookup(struct nft_handle *h, struct nftnl_chain *c,
+		      struct nftnl_rule *needle, void *data, bool *complete)
+{
+	struct nftnl_rule *r, *found = NULL;
+	struct nft_rule_index_entry *e;
+	struct nftnl_rule_iter *iter;
+	struct nft_chain_state *st;
+	struct hlist_head *bucket;
+	struct hlist_node *n;
+	unsigned int matches = 0;
+	uint32_t hash;
+
+	*complete = false;
+
+	st = nft_chain_state_get_c(h, c, true);
+	if (!st)
+		return NULL;
+
+	if (!st->index)
+		nft_rule_index_build(st, c);
+
+	*complete = !st->index->foreign;
+
+	hash = nft_rule_fingerprint(needle);
+	bucket = &st->index->hash[hash & (st->index->hsize - 1)];
+
+	hlist_for_each_entry(e, n, bucket, node) {
+		if (e->hash != hash || !h->ops->rule_find(h, e->rule, data))
+			continue;
+
+		found = e->rule;
+		matches++;
+	}
+
+	if (matches <= 1)
+		return found;
+
+	/* Several identical rules, the first one in the chain wins. */
+	iter = nftnl_rule_iter_create(c);
+	if (!iter)
+		return found;
+
+	r = nftnl_rule_iter_next(iter);
+	while (r) {
+		hlist_for_each_entry(e, n, bucket, node) {
+			if (e->rule == r && e->hash == hash &&
+			    h->ops->rule_find(h, r, data))
+				goto out;
+		}
+		r = nftnl_rule_iter_next(iter);
+	}
+	r = found;
+out:
+	nftnl_rule_iter_destroy(iter);
+	return r;
+}
+
+/* Rule @r was added to chain @c in this transaction, at the head of the
+ * chain if @head is set, at the tail otherwise.
+ */
+void nft_cache_rule_add(struct nft_handle *h, struct nftnl_chain *c,
+			struct nftnl_rule *r, bool head)
+{
+	struct nft_chain_state *st;
+
+	st = nft_chain_state_get_c(h, c, head);
+	if (!st)
+		return;
+
+	if (head && !st->rules_loaded)
+		st->head_rules++;
+
+	if (st->index)
+		nft_rule_index_insert(st, r);
+}
+
+void nft_rule_index_del(struct nft_handle *h, struct nftnl_rule *r)
+{
+	struct nft_rule_index_entry *e;
+	struct nft_chain_state *st;
+	struct hlist_node *n;
+	uint32_t hash;
+
+	st = nft_chain_state_get(h, nftnl_rule_get_str(r, NFTNL_RULE_TABLE),
+				 nftnl_rule_get_str(r, NFTNL_RULE_CHAIN), false);
+	if (!st || !st->index)
+		return;
+
+	hash = nft_rule_fingerprint(r);
+	hlist_for_each_entry(e, n, &st->index->hash[hash & (st->index->hsize - 1)],
+			     node) {
+		if (e->rule != r)
+			continue;
+
+		hlist_del(&e->node);
+		st->index->entries--;
+		if (e->foreign)
+			st->index->foreign--;
+		free(e);
+		return;
+	}
+}
+
+/* Merged rule @r of chain @c was replaced by the rules it stands for, which
+ * carry its handle. The cache owns @r from now on.
+ */
+void nft_cache_merged_add(struct nft_handle *h, struct nftnl_chain *c,
+			  struct nftnl_rule *r)
+{
+	struct nft_chain_state *st;
+
+	st = nft_chain_state_get_c(h, c, true);
+	if (!st) {
+		nftnl_rule_free(r);
+		return;
+	}
+
+	st->merged = xtables_realloc(st->merged,
+				     (st->nmerged + 1) * sizeof(*st->merged));
+	st->merged[st->nmerged++] = r;
+}
+
+/* The merged rule @r stands for along with others, NULL for plain rules. */
+struct nftnl_rule *nft_cache_merged_find(struct nft_handle *h,
+					 struct nftnl_rule *r)
+{
+	struct nft_chain_state *st;
+	int i;
+
+	if (!nftnl_rule_is_set(r, NFTNL_RULE_HANDLE))
+		return NULL;
+
+	st = nft_chain_state_get(h, nftnl_rule_get_str(r, NFTNL_RULE_TABLE),
+				 nftnl_rule_get_str(r, NFTNL_RULE_CHAIN), false);
+	if (!st || !st->nmerged)
+		return NULL;
+
+	i = nft_merged_index(st, nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE));
+	return i < 0 ? NULL : st->merged[i];
+}
+
+void nft_cache_merged_del(struct nft_handle *h, struct nftnl_rule *r)
+{
+	struct nft_chain_state *st;
+	int i;
+
+	st = nft_chain_state_get(h, nftnl_rule_get_str(r, NFTNL_RULE_TABLE),
+				 nftnl_rule_get_str(r, NFTNL_RULE_CHAIN), false);
+	if (!st)
+		return;
+
+	i = nft_merged_index(st, nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE));
+	if (i < 0)
+		return;
+
+	nftnl_rule_free(st->merged[i]);
+	st->merged[i] = st->merged[--st->nmerged];
+}
+
+void nft_cache_chain_new(struct nft_handle *h, struct nftnl_chain *c)
+{
+	nft_chain_state_set_empty(h, c);
+}
+
+void nft_cache_chain_del(struct nft_handle *h, const char *table,
+			 const char *chain)
+{
+	struct nft_chain_state *st;
+
+	st = nft_chain_state_get(h, table, chain, false);
+	if (st)
+		nft_chain_state_free(st);
+}
+
+/* Rules of @c were just fetched. */
+static void nft_chain_rules_fetched(struct nft_handle *h, struct nftnl_chain *c)
+{
+	const struct builtin_table *t;
+
+	if (h->family == NFPROTO_BRIDGE)
+		nft_bridge_chain_postprocess(h, c);
+
+	t = nft_table_builtin_find(h, nftnl_chain_get_str(c, NFTNL_CHAIN_TABLE));
+	if (t && h->cache->table[t->type].sets)
+		nft_opt_chain_postprocess(h, c, h->cache->table[t->type].sets);
+}
+
+struct nftnl_rule_list_cb_data {
+	struct nftnl_chain *c;
+	struct nftnl_rule *pos;
+};
+
 static int nftnl_rule_list_cb(const struct nlmsghdr *nlh, void *data)
 {
-	struct nftnl_chain *c = data;
+	struct nftnl_rule_list_cb_data *d = data;
 	struct nftnl_rule *r;
 
 	r = nftnl_rule_alloc();
@@ -376,21 +1018,32 @@ static int nftnl_rule_list_cb(const struct nlmsghdr *nlh, void *data)
 		return MNL_CB_OK;
 	}
 
-	nftnl_chain_rule_add_tail(r, c);
+	if (d->pos)
+		nftnl_chain_rule_insert_at(r, d->pos);
+	else
+		nftnl_chain_rule_add_tail(r, d->c);
 	return MNL_CB_OK;
 }
 
 static int nft_rule_list_update(struct nftnl_chain *c, void *data)
 {
 	struct nft_handle *h = data;
+	struct nftnl_rule_list_cb_data d = {
+		.c = c,
+	};
+	struct nft_chain_state *st;
 	char buf[16536];
 	struct nlmsghdr *nlh;
 	struct nftnl_rule *rule;
 	int ret;
 
-	if (nftnl_rule_lookup_byindex(c, 0))
+	st = nft_chain_state_get_c(h, c, true);
+	if (!st || st->rules_loaded)
 		return 0;
 
+	nft_rule_index_free(st);
+	d.pos = nftnl_rule_lookup_byindex(c, st->head_rules);
+
 	rule = nftnl_rule_alloc();
 	if (!rule)
 		return -1;
@@ -404,14 +1057,164 @@ static int nft_rule_list_update(struct nftnl_chain *c, void *data)
 					NLM_F_DUMP, h->seq);
 	nftnl_rule_nlmsg_build_payload(nlh, rule);
 
-	ret = mnl_talk(h, nlh, nftnl_rule_list_cb, c);
+	ret = mnl_talk(h, nlh, nftnl_rule_list_cb, &d);
 	if (ret < 0 && errno == EINTR)
 		assert(nft_restart(h) >= 0);
 
 	nftnl_rule_free(rule);
 
-	if (h->family == NFPROTO_BRIDGE)
-		nft_bridge_chain_postprocess(h, c);
+	st->rules_loaded = true;
+	st->head_rules = 0;
+	h->cache_stats.rule_dumps++;
+
+	nft_chain_rules_fetched(h, c);
+
+	return 0;
+}
+
+struct nftnl_rule_table_list_cb_data {
+	struct nft_handle *h;
+	const char *table;
+	struct nftnl_chain_list *list;
+};
+
+static int nftnl_rule_table_list_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct nftnl_rule_table_list_cb_data *d = data;
+	struct nft_chain_state *st;
+	struct nftnl_chain *c;
+	struct nftnl_rule *r;
+	const char *table, *chain;
+
+	r = nftnl_rule_alloc();
+	if (r == NULL)
+		return MNL_CB_OK;
+
+	if (nftnl_rule_nlmsg_parse(nlh, r) < 0)
+		goto out;
+
+	table = nftnl_rule_get_str(r, NFTNL_RULE_TABLE);
+	chain = nftnl_rule_get_str(r, NFTNL_RULE_CHAIN);
+	if (!table || !chain || strcmp(table, d->table))
+		goto out;
+
+	c = nftnl_chain_list_lookup_byname(d->list, chain);
+	if (!c)
+		goto out;
+
+	/* rules of this chain were fetched before, keep those */
+	st = nft_chain_state_get_c(d->h, c, false);
+	if (st && st->rules_loaded)
+		goto out;
+
+	if (st && st->fetch_pos)
+		nftnl_chain_rule_insert_at(r, st->fetch_pos);
+	else
+		nftnl_chain_rule_add_tail(r, c);
+	return MNL_CB_OK;
+out:
+	nftnl_rule_free(r);
+	return MNL_CB_OK;
+}
+
+static bool nft_chain_rules_loaded(struct nft_handle *h, struct nftnl_chain *c)
+{
+	struct nft_chain_state *st = nft_chain_state_get_c(h, c, false);
+
+	return st && st->rules_loaded;
+}
+
+/* Fetch the rules of all chains in table @t with a single dump, rules are
+ * sorted into their chains by name as they arrive. Rules of chains fetched
+ * before are dropped from the dump. If at most one chain is still missing
+ * its rules, dump just that one.
+ */
+static int nft_rule_table_update(struct nft_handle *h,
+				 const struct builtin_table *t)
+{
+	struct nftnl_chain_list *list = h->cache->table[t->type].chains;
+	struct nftnl_rule_table_list_cb_data d = {
+		.h	= h,
+		.table	= t->name,
+		.list	= list,
+	};
+	unsigned int pending = 0;
+	struct nftnl_chain_list_iter *iter;
+	struct nft_chain_state *st;
+	char buf[16536];
+	struct nlmsghdr *nlh;
+	struct nftnl_rule *rule;
+	struct nftnl_chain *c;
+	int ret;
+
+	if (!list)
+		return 0;
+
+	iter = nftnl_chain_list_iter_create(list);
+	if (!iter)
+		return -1;
+
+	c = nftnl_chain_list_iter_next(iter);
+	while (c) {
+		if (!nft_chain_rules_loaded(h, c))
+			pending++;
+		c = nftnl_chain_list_iter_next(iter);
+	}
+	nftnl_chain_list_iter_destroy(iter);
+
+	if (pending < 2)
+		return nftnl_chain_list_foreach(list, nft_rule_list_update, h);
+
+	iter = nftnl_chain_list_iter_create(list);
+	if (!iter)
+		return -1;
+
+	c = nftnl_chain_list_iter_next(iter);
+	while (c) {
+		st = nft_chain_state_get_c(h, c, true);
+		if (st && !st->rules_loaded) {
+			nft_rule_index_free(st);
+			st->fetch_pos = nftnl_rule_lookup_byindex(c,
+							st->head_rules);
+		}
+		c = nftnl_chain_list_iter_next(iter);
+	}
+	nftnl_chain_list_iter_destroy(iter);
+
+	rule = nftnl_rule_alloc();
+	if (!rule)
+		return -1;
+
+	nftnl_rule_set_str(rule, NFTNL_RULE_TABLE, t->name);
+
+	nlh = nftnl_rule_nlmsg_build_hdr(buf, NFT_MSG_GETRULE, h->family,
+					NLM_F_DUMP, h->seq);
+	nftnl_rule_nlmsg_build_payload(nlh, rule);
+
+	ret = mnl_talk(h, nlh, nftnl_rule_table_list_cb, &d);
+	if (ret < 0 && errno == EINTR)
+		assert(nft_restart(h) >= 0);
+
+	nftnl_rule_free(rule);
+
+	iter = nftnl_chain_list_iter_create(list);
+	if (iter) {
+		c = nftnl_chain_list_iter_next(iter);
+		while (c) {
+			st = nft_chain_state_get_c(h, c, false);
+			if (st && !st->rules_loaded) {
+				st->rules_loaded = true;
+				st->head_rules = 0;
+				st->fetch_pos = NULL;
+				nft_chain_rules_fetched(h, c);
+			}
+			c = nftnl_chain_list_iter_next(iter);
+		}
+		nftnl_chain_list_iter_destroy(iter);
+	}
+
+	h->cache_stats.rule_dumps++;
+	h->cache_stats.rule_dumps_saved += pending - 1;
 
 	return 0;
 }
@@ -429,24 +1232,194 @@ static int fetch_rule_cache(struct nft_handle *h,
 
 		if (chain) {
 			c = nftnl_chain_list_lookup_byname(list, chain);
+			if (!c)
+				return 0;
 			return nft_rule_list_update(c, h);
 		}
-		return nftnl_chain_list_foreach(list, nft_rule_list_update, h);
+		return nft_rule_table_update(h, t);
 	}
 
 	for (i = 0; i < NFT_TABLE_MAX; i++) {
-		enum nft_table_type type = h->tables[i].type;
-
 		if (!h->tables[i].name)
 			continue;
 
-		if (nftnl_chain_list_foreach(h->cache->table[type].chains,
-					     nft_rule_list_update, h))
+		if (nft_rule_table_update(h, &h->tables[i]))
 			return -1;
 	}
 	return 0;
 }
 
+struct nft_table_fetch_cb_data {
+	const char		*table;
+	struct nftnl_chain_list	*list;
+};
+
+static int nft_table_fetch_chain_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct nft_table_fetch_cb_data *d = data;
+	struct nftnl_chain *c;
+
+	c = nftnl_chain_alloc();
+	if (c == NULL)
+		return MNL_CB_OK;
+
+	if (nftnl_chain_nlmsg_parse(nlh, c) < 0 ||
+	    strcmp(nftnl_chain_get_str(c, NFTNL_CHAIN_TABLE), d->table)) {
+		nftnl_chain_free(c);
+		return MNL_CB_OK;
+	}
+
+	nftnl_chain_list_add_tail(c, d->list);
+	return MNL_CB_OK;
+}
+
+static int nft_table_fetch_rule_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct nft_table_fetch_cb_data *d = data;
+	struct nftnl_chain *c = NULL;
+	struct nftnl_rule *r;
+	const char *chain;
+
+	r = nftnl_rule_alloc();
+	if (r == NULL)
+		return MNL_CB_OK;
+
+	if (nftnl_rule_nlmsg_parse(nlh, r) == 0) {
+		chain = nftnl_rule_get_str(r, NFTNL_RULE_CHAIN);
+		if (chain)
+			c = nftnl_chain_list_lookup_byname(d->list, chain);
+	}
+
+	if (c)
+		nftnl_chain_rule_add_tail(r, c);
+	else
+		nftnl_rule_free(r);
+	return MNL_CB_OK;
+}
+
+/* Fetch the chains and rules of @table into a list of their own, leaving
+ * the cache alone, to compare them with what is being restored. The sets
+ * of the table are fetched into the cache if missing, so that rules
+ * looking up anonymous sets can be decoded.
+ */
+struct nftnl_chain_list *nft_table_fetch(struct nft_handle *h,
+					 const char *table)
+{
+	struct nft_table_fetch_cb_data d = {
+		.table	= table,
+	};
+	const struct builtin_table *t;
+	struct nftnl_rule *rule;
+	struct nlmsghdr *nlh;
+	char buf[16536];
+	int ret;
+
+	t = nft_table_builtin_find(h, table);
+	if (!t)
+		return NULL;
+
+	d.list = nftnl_chain_list_alloc();
+	if (!d.list)
+		return NULL;
+
+	nlh = nftnl_chain_nlmsg_build_hdr(buf, NFT_MSG_GETCHAIN, h->family,
+					  NLM_F_DUMP, h->seq);
+	ret = mnl_talk(h, nlh, nft_table_fetch_chain_cb, &d);
+	if (ret < 0)
+		goto err;
+
+	rule = nftnl_rule_alloc();
+	if (!rule)
+		goto err;
+
+	nftnl_rule_set_str(rule, NFTNL_RULE_TABLE, table);
+	nlh = nftnl_rule_nlmsg_build_hdr(buf, NFT_MSG_GETRULE, h->family,
+					 NLM_F_DUMP, h->seq);
+	nftnl_rule_nlmsg_build_payload(nlh, rule);
+	nftnl_rule_free(rule);
+
+	ret = mnl_talk(h, nlh, nft_table_fetch_rule_cb, &d);
+	if (ret < 0)
+		goto err;
+
+	if (!h->cache->table[t->type].sets_loaded) {
+		if (fetch_set_cache(h, t, NULL) < 0)
+			goto err;
+		h->cache->table[t->type].sets_loaded = true;
+	}
+
+	return d.list;
+err:
+	nftnl_chain_list_free(d.list);
+	return NULL;
+}
+
+void nft_cache_print_stats(struct nft_handle *h)
+{
+	fprintf(stderr, "rule cache: %u dump(s), %u round trip(s) saved\n",
+		h->cache_stats.rule_dumps, h->cache_stats.rule_dumps_saved);
+	fprintf(stderr, "transaction retried %u time(s) after concurrent "
+		"ruleset update\n", h->cache_stats.restarts);
+}
+
+/* Check whether the cache already holds everything up to @level, either
+ * globally, for table @t or just for @chain in table @t.
+ */
+static bool nft_cache_has(struct nft_handle *h, enum nft_cache_level level,
+			  const struct builtin_table *t, const char *chain)
+{
+	struct nft_chain_state *st;
+
+	if (level <= h->cache_level)
+		return true;
+
+	if (!t)
+		return false;
+
+	if (level >= NFT_CL_SETS && !h->cache->table[t->type].sets_loaded)
+		return false;
+
+	if (level <= h->cache->table[t->type].level)
+		return true;
+
+	if (!chain || !h->cache->table[t->type].chains ||
+	    !nftnl_chain_list_lookup_byname(h->cache->table[t->type].chains,
+					    chain))
+		return false;
+
+	if (level < NFT_CL_RULES)
+		return true;
+
+	st = nft_chain_state_get(h, t->name, chain, false);
+	return st && st->rules_loaded;
+}
+
+static void
+__nft_build_table_cache(struct nft_handle *h, enum nft_cache_level level,
+			const struct builtin_table *t, const char *set,
+			const char *chain)
+{
+	if (h->cache_level < NFT_CL_TABLES)
+		fetch_table_cache(h);
+	if (level == NFT_CL_TABLES)
+		return;
+
+	if (!nft_cache_has(h, NFT_CL_CHAINS, t, chain))
+		fetch_chain_cache(h, t, chain);
+	if (level == NFT_CL_CHAINS)
+		return;
+
+	if (!h->cache->table[t->type].sets_loaded) {
+		fetch_set_cache(h, t, set);
+		if (!set)
+			h->cache->table[t->type].sets_loaded = true;
+	}
+	if (level == NFT_CL_SETS)
+		return;
+
+	fetch_rule_cache(h, t, chain);
+}
+
 static void
 __nft_build_cache(struct nft_handle *h, enum nft_cache_level level,
 		  const struct builtin_table *t, const char *set,
@@ -454,7 +1427,7 @@ __nft_build_cache(struct nft_handle *h, enum nft_cache_level level,
 {
 	uint32_t genid_start, genid_stop;
 
-	if (level <= h->cache_level)
+	if (nft_cache_has(h, level, t, chain))
 		return;
 retry:
 	mnl_genid_get(h, &genid_start);
@@ -462,6 +1435,11 @@ retry:
 	if (h->cache_level && genid_start != h->nft_genid)
 		flush_chain_cache(h, NULL);
 
+	if (t) {
+		__nft_build_table_cache(h, level, t, set, chain);
+		goto done;
+	}
+
 	switch (h->cache_level) {
 	case NFT_CL_NONE:
 		fetch_table_cache(h);
@@ -486,17 +1464,21 @@ retry:
 	case NFT_CL_RULES:
 		break;
 	}
-
+done:
 	mnl_genid_get(h, &genid_stop);
 	if (genid_start != genid_stop) {
 		flush_chain_cache(h, NULL);
 		goto retry;
 	}
 
-	if (!t && !chain)
+	if (!t) {
 		h->cache_level = level;
-	else if (h->cache_level < NFT_CL_TABLES)
-		h->cache_level = NFT_CL_TABLES;
+	} else {
+		if (!chain && level > h->cache->table[t->type].level)
+			h->cache->table[t->type].level = level;
+		if (h->cache_level < NFT_CL_TABLES)
+			h->cache_level = NFT_CL_TABLES;
+	}
 
 	h->nft_genid = genid_start;
 }
@@ -515,6 +1497,20 @@ void nft_build_cache(struct nft_handle *h, struct nftnl_chain *c)
 	__nft_build_cache(h, NFT_CL_RULES, t, NULL, chain);
 }
 
+/* Fill the rule cache of all chains in @table at once, so that looking at
+ * them one by one with nft_build_cache() does not fetch anything.
+ */
+void nft_build_table_cache(struct nft_handle *h, const char *table)
+{
+	const struct builtin_table *t;
+
+	t = nft_table_builtin_find(h, table);
+	if (!t)
+		return;
+
+	__nft_build_cache(h, NFT_CL_RULES, t, NULL, NULL);
+}
+
 void nft_fake_cache(struct nft_handle *h)
 {
 	int i;
@@ -552,6 +1548,11 @@ static int ____flush_rule_cache(struct nftnl_rule *r, void *data)
 
 static int __flush_rule_cache(struct nftnl_chain *c, void *data)
 {
+	struct nft_handle *h = data;
+
+	if (h)
+		nft_chain_state_set_empty(h, c);
+
 	return nftnl_rule_foreach(c, ____flush_rule_cache, NULL);
 }
 
@@ -560,15 +1561,17 @@ int flush_rule_cache(struct nft_handle *h, const char *table,
 {
 	const struct builtin_table *t;
 
-	if (c)
+	if (c) {
+		nft_chain_state_set_empty(h, c);
 		return __flush_rule_cache(c, NULL);
+	}
 
 	t = nft_table_builtin_find(h, table);
 	if (!t || !h->cache->table[t->type].chains)
 		return 0;
 
 	return nftnl_chain_list_foreach(h->cache->table[t->type].chains,
-					__flush_rule_cache, NULL);
+					__flush_rule_cache, h);
 }
 
 static int __flush_chain_cache(struct nftnl_chain *c, void *data)
@@ -597,12 +1600,21 @@ static int flush_cache(struct nft_handle *h, struct nft_cache *c,
 		table = nft_table_builtin_find(h, tablename);
 		if (!table)
 			return 0;
+		/* Table was flushed, nothing left to fetch. */
+		nft_chain_state_table_free(c->table[table->type].chain_state);
+		c->table[table->type].chain_state = NULL;
+		c->table[table->type].level = NFT_CL_RULES;
+		c->table[table->type].sets_loaded = true;
 		if (c->table[table->type].chains)
 			nftnl_chain_list_foreach(c->table[table->type].chains,
 						 __flush_chain_cache, NULL);
+		else
+			c->table[table->type].chains = nftnl_chain_list_alloc();
 		if (c->table[table->type].sets)
 			nftnl_set_list_foreach(c->table[table->type].sets,
 					       __flush_set_cache, NULL);
+		else
+			c->table[table->type].sets = nftnl_set_list_alloc();
 		return 0;
 	}
 
@@ -610,6 +1622,11 @@ static int flush_cache(struct nft_handle *h, struct nft_cache *c,
 		if (h->tables[i].name == NULL)
 			continue;
 
+		nft_chain_state_table_free(c->table[i].chain_state);
+		c->table[i].chain_state = NULL;
+		c->table[i].level = NFT_CL_NONE;
+		c->table[i].sets_loaded = false;
+
 		if (!c->table[i].chains)
 			continue;
 
@@ -634,15 +1651,19 @@ void flush_chain_cache(struct nft_handle *h, const char *tablename)
 		h->cache_level = NFT_CL_NONE;
 }
 
+/* Called when the ruleset changed under a pending transaction. Rather than
+ * refetching everything at the previous cache level, start over with an
+ * empty cache: nft_refresh_transaction() then only fetches the tables and
+ * chains the transaction refers to, and everything else is fetched on
+ * demand.
+ */
 void nft_rebuild_cache(struct nft_handle *h)
 {
-	enum nft_cache_level level = h->cache_level;
-
 	if (h->cache_level)
 		__nft_flush_cache(h);
 
 	h->cache_level = NFT_CL_NONE;
-	__nft_build_cache(h, level, NULL, NULL, NULL);
+	mnl_genid_get(h, &h->nft_genid);
 }
 
 void nft_release_cache(struct nft_handle *h)
@@ -2,15 +2,38 @@
 #define _NFT_CACHE_H_
 
 struct nft_handle;
+struct nftnl_chain;
+struct nftnl_rule;
 
+void mnl_genid_get(struct nft_handle *h, uint32_t *genid);
 void nft_fake_cache(struct nft_handle *h);
 void nft_build_cache(struct nft_handle *h, struct nftnl_chain *c);
+void nft_build_table_cache(struct nft_handle *h, const char *table);
 void nft_rebuild_cache(struct nft_handle *h);
 void nft_release_cache(struct nft_handle *h);
+void nft_cache_print_stats(struct nft_handle *h);
 void flush_chain_cache(struct nft_handle *h, const char *tablename);
 int flush_rule_cache(struct nft_handle *h, const char *table,
 		     struct nftnl_chain *c);
 
+struct nftnl_rule *
+nft_rule_index_lookup(struct nft_handle *h, struct nftnl_chain *c,
+		      struct nftnl_rule *needle, void *data, bool *complete);
+void nft_rule_index_del(struct nft_handle *h, struct nftnl_rule *r);
+void nft_cache_rule_add(struct nft_handle *h, struct nftnl_chain *c,
+			struct nftnl_rule *r, bool head);
+void nft_cache_merged_add(struct nft_handle *h, struct nftnl_chain *c,
+			  struct nftnl_rule *r);
+struct nftnl_rule *nft_cache_merged_find(struct nft_handle *h,
+					 struct nftnl_rule *r);
+void nft_cache_merged_del(struct nft_handle *h, struct nftnl_rule *r);
+void nft_cache_chain_new(struct nft_handle *h, struct nftnl_chain *c);
+void nft_cache_chain_del(struct nft_handle *h, const char *table,
+			 const char *chain);
+uint32_t nft_rule_fingerprint(struct nftnl_rule *r);
+struct nftnl_chain_list *nft_table_fetch(struct nft_handle *h,
+					 const char *table);
+
 struct nftnl_chain_list *
 nft_chain_list_get(struct nft_handle *h, const char *table, const char *chain);
 struct nftnl_set_list *
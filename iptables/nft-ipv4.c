@@ -60,6 +60,11 @@ static int nft_ipv4_add(struct nft_handle *h, struct nftnl_rule *r, void *data)
 			 &cs->fw.ip.dst.s_addr, &cs->fw.ip.dmsk.s_addr,
 			 sizeof(struct in_addr), op);
 	}
+	if (cs->saddrs || cs->daddrs) {
+		ret = add_addr_list(h, r, cs->saddrs, cs->daddrs);
+		if (ret < 0)
+			return ret;
+	}
 	if (cs->fw.ip.flags & IPT_F_FRAG) {
 		add_payload(r, offsetof(struct iphdr, frag_off), 2,
 			    NFT_PAYLOAD_NETWORK_HEADER);
@@ -88,7 +93,7 @@ static int nft_ipv4_add(struct nft_handle *h, struct nftnl_rule *r, void *data)
 	if (add_counters(r, cs->counters.pcnt, cs->counters.bcnt) < 0)
 		return -1;
 
-	return add_action(r, cs, !!(cs->fw.ip.flags & IPT_F_GOTO));
+	return add_action(h, r, cs, !!(cs->fw.ip.flags & IPT_F_GOTO));
 }
 
 static bool nft_ipv4_is_same(const void *data_a,
@@ -108,6 +113,11 @@ static bool nft_ipv4_is_same(const void *data_a,
 		return false;
 	}
 
+	if (!nft_addr_lists_equal(a, b, sizeof(struct in_addr))) {
+		DEBUGP("different src/dst lists\n");
+		return false;
+	}
+
 	return is_same_interfaces(a->fw.ip.iniface, a->fw.ip.outiface,
 				  a->fw.ip.iniface_mask, a->fw.ip.outiface_mask,
 				  b->fw.ip.iniface, b->fw.ip.outiface,
@@ -273,7 +283,10 @@ static void nft_ipv4_print_rule(struct nft_handle *h, struct nftnl_rule *r,
 	print_fragment(cs.fw.ip.flags, cs.fw.ip.invflags, format);
 	print_ifaces(cs.fw.ip.iniface, cs.fw.ip.outiface, cs.fw.ip.invflags,
 		     format);
-	print_ipv4_addresses(&cs.fw, format);
+	if (cs.saddrs || cs.daddrs)
+		nft_print_addr_lists(&cs, AF_INET, format);
+	else
+		print_ipv4_addresses(&cs.fw, format);
 
 	if (format & FMT_NOTABLE)
 		fputs("  ", stdout);
@@ -289,6 +302,7 @@ static void nft_ipv4_print_rule(struct nft_handle *h, struct nftnl_rule *r,
 		fputc('\n', stdout);
 
 	xtables_rule_matches_free(&cs.matches);
+	nft_addr_lists_free(&cs);
 }
 
 static void save_ipv4_addr(char letter, const struct in_addr *addr,
@@ -305,10 +319,16 @@ static void nft_ipv4_save_rule(const void *data, unsigned int format)
 {
 	const struct iptables_command_state *cs = data;
 
-	save_ipv4_addr('s', &cs->fw.ip.src, cs->fw.ip.smsk.s_addr,
-		       cs->fw.ip.invflags & IPT_INV_SRCIP);
-	save_ipv4_addr('d', &cs->fw.ip.dst, cs->fw.ip.dmsk.s_addr,
-		       cs->fw.ip.invflags & IPT_INV_DSTIP);
+	if (cs->saddrs)
+		nft_save_addr_list('s', cs->saddrs, AF_INET);
+	else
+		save_ipv4_addr('s', &cs->fw.ip.src, cs->fw.ip.smsk.s_addr,
+			       cs->fw.ip.invflags & IPT_INV_SRCIP);
+	if (cs->daddrs)
+		nft_save_addr_list('d', cs->daddrs, AF_INET);
+	else
+		save_ipv4_addr('d', &cs->fw.ip.dst, cs->fw.ip.dmsk.s_addr,
+			       cs->fw.ip.invflags & IPT_INV_DSTIP);
 
 	save_rule_details(cs, cs->fw.ip.invflags, cs->fw.ip.proto,
 			  cs->fw.ip.iniface, cs->fw.ip.iniface_mask,
@@ -63,6 +63,11 @@ static int nft_ipv6_add(struct nft_handle *h, struct nftnl_rule *r, void *data)
 			 &cs->fw6.ipv6.dst, &cs->fw6.ipv6.dmsk,
 			 sizeof(struct in6_addr), op);
 	}
+	if (cs->saddrs || cs->daddrs) {
+		ret = add_addr_list(h, r, cs->saddrs, cs->daddrs);
+		if (ret < 0)
+			return ret;
+	}
 	add_compat(r, cs->fw6.ipv6.proto, cs->fw6.ipv6.invflags & XT_INV_PROTO);
 
 	for (matchp = cs->matches; matchp; matchp = matchp->next) {
@@ -77,7 +82,7 @@ static int nft_ipv6_add(struct nft_handle *h, struct nftnl_rule *r, void *data)
 	if (add_counters(r, cs->counters.pcnt, cs->counters.bcnt) < 0)
 		return -1;
 
-	return add_action(r, cs, !!(cs->fw6.ipv6.flags & IP6T_F_GOTO));
+	return add_action(h, r, cs, !!(cs->fw6.ipv6.flags & IP6T_F_GOTO));
 }
 
 static bool nft_ipv6_is_same(const void *data_a,
@@ -97,6 +102,11 @@ static bool nft_ipv6_is_same(const void *data_a,
 		return false;
 	}
 
+	if (!nft_addr_lists_equal(a, b, sizeof(struct in6_addr))) {
+		DEBUGP("different src/dst lists\n");
+		return false;
+	}
+
 	return is_same_interfaces(a->fw6.ipv6.iniface, a->fw6.ipv6.outiface,
 				  a->fw6.ipv6.iniface_mask,
 				  a->fw6.ipv6.outiface_mask,
@@ -204,7 +214,10 @@ static void nft_ipv6_print_rule(struct nft_handle *h, struct nftnl_rule *r,
 	}
 	print_ifaces(cs.fw6.ipv6.iniface, cs.fw6.ipv6.outiface,
 		     cs.fw6.ipv6.invflags, format);
-	print_ipv6_addresses(&cs.fw6, format);
+	if (cs.saddrs || cs.daddrs)
+		nft_print_addr_lists(&cs, AF_INET6, format);
+	else
+		print_ipv6_addresses(&cs.fw6, format);
 
 	if (format & FMT_NOTABLE)
 		fputs("  ", stdout);
@@ -218,6 +231,7 @@ static void nft_ipv6_print_rule(struct nft_handle *h, struct nftnl_rule *r,
 		fputc('\n', stdout);
 
 	xtables_rule_matches_free(&cs.matches);
+	nft_addr_lists_free(&cs);
 }
 
 static void save_ipv6_addr(char letter, const struct in6_addr *addr,
@@ -244,10 +258,16 @@ static void nft_ipv6_save_rule(const void *data, unsigned int format)
 {
 	const struct iptables_command_state *cs = data;
 
-	save_ipv6_addr('s', &cs->fw6.ipv6.src, &cs->fw6.ipv6.smsk,
-		       cs->fw6.ipv6.invflags & IP6T_INV_SRCIP);
-	save_ipv6_addr('d', &cs->fw6.ipv6.dst, &cs->fw6.ipv6.dmsk,
-		       cs->fw6.ipv6.invflags & IP6T_INV_DSTIP);
+	if (cs->saddrs)
+		nft_save_addr_list('s', cs->saddrs, AF_INET6);
+	else
+		save_ipv6_addr('s', &cs->fw6.ipv6.src, &cs->fw6.ipv6.smsk,
+			       cs->fw6.ipv6.invflags & IP6T_INV_SRCIP);
+	if (cs->daddrs)
+		nft_save_addr_list('d', cs->daddrs, AF_INET6);
+	else
+		save_ipv6_addr('d', &cs->fw6.ipv6.dst, &cs->fw6.ipv6.dmsk,
+			       cs->fw6.ipv6.invflags & IP6T_INV_DSTIP);
 
 	save_rule_details(cs, cs->fw6.ipv6.invflags, cs->fw6.ipv6.proto,
 			  cs->fw6.ipv6.iniface, cs->fw6.ipv6.iniface_mask,
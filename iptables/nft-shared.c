@@ -17,19 +17,32 @@
 #include <netdb.h>
 #include <errno.h>
 #include <inttypes.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
 
 #include <xtables.h>
 
+#include <linux/netfilter/nf_conntrack_common.h>
 #include <linux/netfilter/nf_tables.h>
 #include <linux/netfilter/xt_comment.h>
+#include <linux/netfilter/xt_CONNMARK.h>
+#include <linux/netfilter/xt_conntrack.h>
 #include <linux/netfilter/xt_limit.h>
+#include <linux/netfilter/xt_MARK.h>
+#include <linux/netfilter/xt_multiport.h>
+#include <linux/netfilter/xt_set.h>
+#include <linux/netfilter/xt_tcpudp.h>
 
 #include <libmnl/libmnl.h>
 #include <libnftnl/rule.h>
 #include <libnftnl/expr.h>
+#include <libnftnl/set.h>
 
 #include "nft-shared.h"
 #include "nft-bridge.h"
+#include "nft-cache.h"
 #include "xshared.h"
 #include "nft.h"
 
@@ -52,6 +65,23 @@ void add_meta(struct nftnl_rule *r, uint32_t key)
 	nftnl_rule_add_expr(r, expr);
 }
 
+/* @dir is the conntrack tuple direction, -1 for keys without one. */
+void add_ct(struct nftnl_rule *r, uint32_t key, int dir)
+{
+	struct nftnl_expr *expr;
+
+	expr = nftnl_expr_alloc("ct");
+	if (expr == NULL)
+		return;
+
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_CT_KEY, key);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_CT_DREG, NFT_REG_1);
+	if (dir >= 0)
+		nftnl_expr_set_u8(expr, NFTNL_EXPR_CT_DIR, dir);
+
+	nftnl_rule_add_expr(r, expr);
+}
+
 void add_payload(struct nftnl_rule *r, int offset, int len, uint32_t base)
 {
 	struct nftnl_expr *expr;
@@ -86,6 +116,23 @@ void add_bitwise_u16(struct nftnl_rule *r, uint16_t mask, uint16_t xor)
 	nftnl_rule_add_expr(r, expr);
 }
 
+void add_bitwise_u32(struct nftnl_rule *r, uint32_t mask, uint32_t xor)
+{
+	struct nftnl_expr *expr;
+
+	expr = nftnl_expr_alloc("bitwise");
+	if (expr == NULL)
+		return;
+
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_BITWISE_SREG, NFT_REG_1);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_BITWISE_DREG, NFT_REG_1);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_BITWISE_LEN, sizeof(uint32_t));
+	nftnl_expr_set(expr, NFTNL_EXPR_BITWISE_MASK, &mask, sizeof(uint32_t));
+	nftnl_expr_set(expr, NFTNL_EXPR_BITWISE_XOR, &xor, sizeof(uint32_t));
+
+	nftnl_rule_add_expr(r, expr);
+}
+
 void add_bitwise(struct nftnl_rule *r, uint8_t *mask, size_t len)
 {
 	struct nftnl_expr *expr;
@@ -104,6 +151,23 @@ void add_bitwise(struct nftnl_rule *r, uint8_t *mask, size_t len)
 	nftnl_rule_add_expr(r, expr);
 }
 
+void add_byteorder(struct nftnl_rule *r, uint32_t op, size_t len, size_t size)
+{
+	struct nftnl_expr *expr;
+
+	expr = nftnl_expr_alloc("byteorder");
+	if (expr == NULL)
+		return;
+
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_BYTEORDER_SREG, NFT_REG_1);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_BYTEORDER_DREG, NFT_REG_1);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_BYTEORDER_OP, op);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_BYTEORDER_LEN, len);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_BYTEORDER_SIZE, size);
+
+	nftnl_rule_add_expr(r, expr);
+}
+
 void add_cmp_ptr(struct nftnl_rule *r, uint32_t op, void *data, size_t len)
 {
 	struct nftnl_expr *expr;
@@ -134,6 +198,23 @@ void add_cmp_u32(struct nftnl_rule *r, uint32_t val, uint32_t op)
 	add_cmp_ptr(r, op, &val, sizeof(val));
 }
 
+void add_range(struct nftnl_rule *r, uint32_t op, void *from, void *to,
+	       size_t len)
+{
+	struct nftnl_expr *expr;
+
+	expr = nftnl_expr_alloc("range");
+	if (expr == NULL)
+		return;
+
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_RANGE_SREG, NFT_REG_1);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_RANGE_OP, op);
+	nftnl_expr_set(expr, NFTNL_EXPR_RANGE_FROM_DATA, from, len);
+	nftnl_expr_set(expr, NFTNL_EXPR_RANGE_TO_DATA, to, len);
+
+	nftnl_rule_add_expr(r, expr);
+}
+
 void add_iniface(struct nftnl_rule *r, char *iface, uint32_t op)
 {
 	int iface_len;
@@ -394,11 +475,25 @@ void get_cmp_data(struct nftnl_expr *e, void *data, size_t dlen, bool *inv)
 		*inv = false;
 }
 
-static void nft_meta_set_to_target(struct nft_xt_ctx *ctx)
+static void nft_alloc_target(struct xtables_target *target)
 {
-	struct xtables_target *target;
 	struct xt_entry_target *t;
 	unsigned int size;
+
+	size = XT_ALIGN(sizeof(struct xt_entry_target)) + target->size;
+
+	t = xtables_calloc(1, size);
+	t->u.target_size = size;
+	t->u.user.revision = target->revision;
+	strcpy(t->u.user.name, target->name);
+
+	target->t = t;
+	xs_init_target(target);
+}
+
+static void nft_meta_set_to_target(struct nft_xt_ctx *ctx)
+{
+	struct xtables_target *target;
 	const char *targname;
 
 	switch (ctx->meta.key) {
@@ -415,31 +510,156 @@ static void nft_meta_set_to_target(struct nft_xt_ctx *ctx)
 	if (target == NULL)
 		return;
 
-	size = XT_ALIGN(sizeof(struct xt_entry_target)) + target->size;
+	nft_alloc_target(target);
 
-	t = xtables_calloc(1, size);
-	t->u.target_size = size;
-	t->u.user.revision = target->revision;
-	strcpy(t->u.user.name, targname);
+	ctx->h->ops->parse_target(target, ctx->cs);
+}
 
-	target->t = t;
+static void nft_mark_target(struct nft_xt_ctx *ctx, uint32_t mark,
+			    uint32_t mask)
+{
+	struct xtables_target *target;
+	struct xt_mark_tginfo2 *info;
+
+	target = xtables_find_target("MARK", XTF_TRY_LOAD);
+	if (target == NULL || target->revision != 2)
+		return;
+
+	nft_alloc_target(target);
+	info = (void *)target->t->data;
+	info->mark = mark;
+	info->mask = mask;
 
 	ctx->h->ops->parse_target(target, ctx->cs);
 }
 
-static void nft_parse_meta(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
+static void nft_connmark_target(struct nft_xt_ctx *ctx, uint8_t mode,
+				uint32_t ctmark, uint32_t ctmask,
+				uint32_t nfmask)
+{
+	struct xtables_target *target;
+	struct xt_connmark_tginfo1 *info;
+
+	target = xtables_find_target("CONNMARK", XTF_TRY_LOAD);
+	if (target == NULL ||
+	    (target->revision != 1 && target->revision != 2))
+		return;
+
+	/* revision 2 adds shift fields in front of the mode, the init
+	 * function sets them to no shift
+	 */
+	nft_alloc_target(target);
+	info = (void *)target->t->data;
+	info->ctmark = ctmark;
+	info->ctmask = ctmask;
+	info->nfmask = nfmask;
+	if (target->revision == 1)
+		info->mode = mode;
+	else
+		((struct xt_connmark_tginfo2 *)info)->mode = mode;
+
+	ctx->h->ops->parse_target(target, ctx->cs);
+}
+
+/* Register @sreg holds the packet or conntrack mark as loaded, possibly
+ * passed through the bitwise in ctx->bitwise.
+ */
+static bool nft_xt_ctx_loads_mark(const struct nft_xt_ctx *ctx,
+				  uint32_t sreg, bool ct)
+{
+	if (ctx->reg != sreg)
+		return false;
+	if (ct)
+		return ctx->flags & NFT_XT_CTX_CT &&
+		       ctx->ct.key == NFT_CT_MARK;
+	return ctx->flags & NFT_XT_CTX_META && ctx->meta.key == NFT_META_MARK;
+}
+
+static bool nft_xt_ctx_imm_u32(const struct nft_xt_ctx *ctx, uint32_t sreg)
+{
+	return ctx->flags & NFT_XT_CTX_IMMEDIATE &&
+	       ctx->immediate.reg == sreg &&
+	       ctx->immediate.len == sizeof(uint32_t);
+}
+
+/* Mask of a bitwise without xor, all ones if there is none. */
+static bool nft_xt_ctx_and_mask(const struct nft_xt_ctx *ctx, uint32_t *mask)
+{
+	*mask = UINT32_MAX;
+	if (!(ctx->flags & NFT_XT_CTX_BITWISE))
+		return true;
+	if (ctx->bitwise.xor[0])
+		return false;
+	*mask = ctx->bitwise.mask[0];
+	return true;
+}
+
+/* Packet mark set by the MARK target or CONNMARK --restore-mark, see
+ * add_nft_mark_target() and add_nft_connmark_target().
+ */
+static void nft_parse_meta_set_mark(struct nft_xt_ctx *ctx, uint32_t sreg)
+{
+	uint32_t mask;
+
+	if (nft_xt_ctx_imm_u32(ctx, sreg))
+		nft_mark_target(ctx, ctx->immediate.data[0], UINT32_MAX);
+	else if (nft_xt_ctx_loads_mark(ctx, sreg, false) &&
+		 (ctx->flags & NFT_XT_CTX_BITWISE))
+		nft_mark_target(ctx, ctx->bitwise.xor[0],
+				~ctx->bitwise.mask[0]);
+	else if (nft_xt_ctx_loads_mark(ctx, sreg, true) &&
+		 nft_xt_ctx_and_mask(ctx, &mask))
+		nft_connmark_target(ctx, XT_CONNMARK_RESTORE, 0,
+				    mask, UINT32_MAX);
+	else
+		ctx->unsupported = true;
+}
+
+/* Conntrack mark set by CONNMARK --set-xmark or --save-mark. */
+static void nft_parse_ct_set_mark(struct nft_xt_ctx *ctx, uint32_t sreg)
 {
-	ctx->meta.key = nftnl_expr_get_u32(e, NFTNL_EXPR_META_KEY);
+	uint32_t mask;
+
+	if (nft_xt_ctx_imm_u32(ctx, sreg))
+		nft_connmark_target(ctx, XT_CONNMARK_SET,
+				    ctx->immediate.data[0], UINT32_MAX,
+				    UINT32_MAX);
+	else if (nft_xt_ctx_loads_mark(ctx, sreg, true) &&
+		 (ctx->flags & NFT_XT_CTX_BITWISE))
+		nft_connmark_target(ctx, XT_CONNMARK_SET,
+				    ctx->bitwise.xor[0],
+				    ~ctx->bitwise.mask[0], UINT32_MAX);
+	else if (nft_xt_ctx_loads_mark(ctx, sreg, false) &&
+		 nft_xt_ctx_and_mask(ctx, &mask))
+		nft_connmark_target(ctx, XT_CONNMARK_SAVE, 0,
+				    UINT32_MAX, mask);
+	else
+		ctx->unsupported = true;
+}
 
-	if (nftnl_expr_is_set(e, NFTNL_EXPR_META_SREG) &&
-	    (ctx->flags & NFT_XT_CTX_IMMEDIATE) &&
-	     nftnl_expr_get_u32(e, NFTNL_EXPR_META_SREG) == ctx->immediate.reg) {
-		ctx->flags &= ~NFT_XT_CTX_IMMEDIATE;
-		nft_meta_set_to_target(ctx);
+static void nft_parse_meta(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
+{
+	uint32_t key = nftnl_expr_get_u32(e, NFTNL_EXPR_META_KEY);
+	uint32_t sreg;
+
+	if (nftnl_expr_is_set(e, NFTNL_EXPR_META_SREG)) {
+		sreg = nftnl_expr_get_u32(e, NFTNL_EXPR_META_SREG);
+
+		if (key == NFT_META_MARK) {
+			nft_parse_meta_set_mark(ctx, sreg);
+		} else if ((ctx->flags & NFT_XT_CTX_IMMEDIATE) &&
+			   sreg == ctx->immediate.reg) {
+			ctx->meta.key = key;
+			nft_meta_set_to_target(ctx);
+		}
+		ctx->flags &= ~(NFT_XT_CTX_IMMEDIATE | NFT_XT_CTX_META |
+				NFT_XT_CTX_CT | NFT_XT_CTX_BITWISE);
 		return;
 	}
 
+	ctx->meta.key = key;
 	ctx->reg = nftnl_expr_get_u32(e, NFTNL_EXPR_META_DREG);
+	ctx->flags &= ~(NFT_XT_CTX_CT | NFT_XT_CTX_BITWISE);
 	ctx->flags |= NFT_XT_CTX_META;
 }
 
@@ -474,104 +694,56 @@ static void nft_parse_bitwise(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
 	ctx->flags |= NFT_XT_CTX_BITWISE;
 }
 
-static void nft_parse_cmp(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
+static void nft_parse_ct(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
 {
-	void *data = ctx->cs;
-	uint32_t reg;
+	uint32_t key = nftnl_expr_get_u32(e, NFTNL_EXPR_CT_KEY);
 
-	reg = nftnl_expr_get_u32(e, NFTNL_EXPR_CMP_SREG);
-	if (ctx->reg && reg != ctx->reg)
+	if (nftnl_expr_is_set(e, NFTNL_EXPR_CT_SREG)) {
+		if (key == NFT_CT_MARK)
+			nft_parse_ct_set_mark(ctx,
+				nftnl_expr_get_u32(e, NFTNL_EXPR_CT_SREG));
+		else
+			ctx->unsupported = true;
+		ctx->flags &= ~(NFT_XT_CTX_IMMEDIATE | NFT_XT_CTX_META |
+				NFT_XT_CTX_CT | NFT_XT_CTX_BITWISE);
 		return;
-
-	if (ctx->flags & NFT_XT_CTX_META) {
-		ctx->h->ops->parse_meta(ctx, e, data);
-		ctx->flags &= ~NFT_XT_CTX_META;
-	}
-	/* bitwise context is interpreted from payload */
-	if (ctx->flags & NFT_XT_CTX_PAYLOAD) {
-		ctx->h->ops->parse_payload(ctx, e, data);
-		ctx->flags &= ~NFT_XT_CTX_PAYLOAD;
 	}
-}
 
-static void nft_parse_counter(struct nftnl_expr *e, struct xt_counters *counters)
-{
-	counters->pcnt = nftnl_expr_get_u64(e, NFTNL_EXPR_CTR_PACKETS);
-	counters->bcnt = nftnl_expr_get_u64(e, NFTNL_EXPR_CTR_BYTES);
+	ctx->reg = nftnl_expr_get_u32(e, NFTNL_EXPR_CT_DREG);
+	ctx->ct.key = key;
+	ctx->ct.dir = IP_CT_DIR_ORIGINAL;
+	if (nftnl_expr_is_set(e, NFTNL_EXPR_CT_DIR))
+		ctx->ct.dir = nftnl_expr_get_u8(e, NFTNL_EXPR_CT_DIR);
+	ctx->flags &= ~(NFT_XT_CTX_META | NFT_XT_CTX_BITWISE |
+			NFT_XT_CTX_BYTEORDER);
+	ctx->flags |= NFT_XT_CTX_CT;
 }
 
-static void nft_parse_immediate(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
+static void nft_parse_byteorder(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
 {
-	const char *chain = nftnl_expr_get_str(e, NFTNL_EXPR_IMM_CHAIN);
-	const char *jumpto = NULL;
-	bool nft_goto = false;
-	void *data = ctx->cs;
-	int verdict;
-
-	if (nftnl_expr_is_set(e, NFTNL_EXPR_IMM_DATA)) {
-		const void *imm_data;
-		uint32_t len;
-
-		imm_data = nftnl_expr_get_data(e, NFTNL_EXPR_IMM_DATA, &len);
-
-		if (len > sizeof(ctx->immediate.data))
-			return;
+	uint32_t reg;
 
-		memcpy(ctx->immediate.data, imm_data, len);
-		ctx->immediate.len = len;
-		ctx->immediate.reg = nftnl_expr_get_u32(e, NFTNL_EXPR_IMM_DREG);
-		ctx->flags |= NFT_XT_CTX_IMMEDIATE;
+	reg = nftnl_expr_get_u32(e, NFTNL_EXPR_BYTEORDER_SREG);
+	if (ctx->reg && reg != ctx->reg)
 		return;
-	}
-
-	verdict = nftnl_expr_get_u32(e, NFTNL_EXPR_IMM_VERDICT);
-	/* Standard target? */
-	switch(verdict) {
-	case NF_ACCEPT:
-		jumpto = "ACCEPT";
-		break;
-	case NF_DROP:
-		jumpto = "DROP";
-		break;
-	case NFT_RETURN:
-		jumpto = "RETURN";
-		break;;
-	case NFT_GOTO:
-		nft_goto = true;
-		/* fall through */
-	case NFT_JUMP:
-		jumpto = chain;
-		break;
-	}
 
-	ctx->h->ops->parse_immediate(jumpto, nft_goto, data);
+	/* only the conntrack match converts, see nft_parse_ct_conntrack() */
+	if (nftnl_expr_get_u32(e, NFTNL_EXPR_BYTEORDER_OP) == NFT_BYTEORDER_HTON &&
+	    nftnl_expr_get_u32(e, NFTNL_EXPR_BYTEORDER_SIZE) == sizeof(uint32_t))
+		ctx->flags |= NFT_XT_CTX_BYTEORDER;
+	else
+		ctx->unsupported = true;
 }
 
-static void nft_parse_limit(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
+static struct xtables_match *nft_create_match(struct nft_xt_ctx *ctx,
+					      const char *name)
 {
-	__u32 burst = nftnl_expr_get_u32(e, NFTNL_EXPR_LIMIT_BURST);
-	__u64 unit = nftnl_expr_get_u64(e, NFTNL_EXPR_LIMIT_UNIT);
-	__u64 rate = nftnl_expr_get_u64(e, NFTNL_EXPR_LIMIT_RATE);
-	struct xtables_rule_match **matches;
 	struct xtables_match *match;
-	struct xt_rateinfo *rinfo;
 	size_t size;
 
-	switch (ctx->h->family) {
-	case NFPROTO_IPV4:
-	case NFPROTO_IPV6:
-	case NFPROTO_BRIDGE:
-		matches = &ctx->cs->matches;
-		break;
-	default:
-		fprintf(stderr, "BUG: nft_parse_limit() unknown family %d\n",
-			ctx->h->family);
-		exit(EXIT_FAILURE);
-	}
-
-	match = xtables_find_match("limit", XTF_TRY_LOAD, matches);
+	match = xtables_find_match(name, XTF_TRY_LOAD, &ctx->cs->matches);
 	if (match == NULL)
-		return;
+		return NULL;
 
 	size = XT_ALIGN(sizeof(struct xt_entry_match)) + match->size;
 	match->m = xtables_calloc(1, size);
@@ -580,75 +752,1458 @@ static void nft_parse_limit(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
 	match->m->u.user.revision = match->revision;
 	xs_init_match(match);
 
-	rinfo = (void *)match->m->data;
-	rinfo->avg = XT_LIMIT_SCALE * unit / rate;
-	rinfo->burst = burst;
-
 	if (ctx->h->ops->parse_match != NULL)
 		ctx->h->ops->parse_match(match, ctx->cs);
-}
 
-static void nft_parse_lookup(struct nft_xt_ctx *ctx, struct nft_handle *h,
-			     struct nftnl_expr *e)
-{
-	if (ctx->h->ops->parse_lookup)
-		ctx->h->ops->parse_lookup(ctx, e, NULL);
+	return match;
 }
 
-void nft_rule_to_iptables_command_state(struct nft_handle *h,
-					const struct nftnl_rule *r,
-					struct iptables_command_state *cs)
+/* Packet or conntrack mark match, see add_nft_mark(). */
+static void nft_parse_mark_cmp(struct nft_xt_ctx *ctx, struct nftnl_expr *e,
+			       bool ct)
 {
-	struct nftnl_expr_iter *iter;
-	struct nftnl_expr *expr;
-	struct nft_xt_ctx ctx = {
-		.cs = cs,
-		.h = h,
-		.table = nftnl_rule_get_str(r, NFTNL_RULE_TABLE),
-	};
+	struct xt_mark_mtinfo1 *info;
+	struct xtables_match *match;
+	uint32_t op, len, mask;
+	const void *data;
 
-	iter = nftnl_expr_iter_create(r);
-	if (iter == NULL)
+	op = nftnl_expr_get_u32(e, NFTNL_EXPR_CMP_OP);
+	data = nftnl_expr_get(e, NFTNL_EXPR_CMP_DATA, &len);
+	if ((op != NFT_CMP_EQ && op != NFT_CMP_NEQ) ||
+	    len != sizeof(uint32_t) || !nft_xt_ctx_and_mask(ctx, &mask)) {
+		ctx->unsupported = true;
 		return;
+	}
 
-	ctx.iter = iter;
-	expr = nftnl_expr_iter_next(iter);
-	while (expr != NULL) {
-		const char *name =
-			nftnl_expr_get_str(expr, NFTNL_EXPR_NAME);
+	match = nft_create_match(ctx, ct ? "connmark" : "mark");
+	if (match == NULL || match->m->u.user.revision != 1) {
+		ctx->unsupported = true;
+		return;
+	}
 
-		if (strcmp(name, "counter") == 0)
-			nft_parse_counter(expr, &ctx.cs->counters);
-		else if (strcmp(name, "payload") == 0)
-			nft_parse_payload(&ctx, expr);
-		else if (strcmp(name, "meta") == 0)
-			nft_parse_meta(&ctx, expr);
-		else if (strcmp(name, "bitwise") == 0)
-			nft_parse_bitwise(&ctx, expr);
-		else if (strcmp(name, "cmp") == 0)
-			nft_parse_cmp(&ctx, expr);
-		else if (strcmp(name, "immediate") == 0)
-			nft_parse_immediate(&ctx, expr);
-		else if (strcmp(name, "match") == 0)
-			nft_parse_match(&ctx, expr);
-		else if (strcmp(name, "target") == 0)
-			nft_parse_target(&ctx, expr);
-		else if (strcmp(name, "limit") == 0)
-			nft_parse_limit(&ctx, expr);
-		else if (strcmp(name, "lookup") == 0)
-			nft_parse_lookup(&ctx, h, expr);
+	/* xt_connmark_mtinfo1 is laid out the same */
+	info = (void *)match->m->data;
+	memcpy(&info->mark, data, sizeof(info->mark));
+	info->mask = mask;
+	info->invert = op == NFT_CMP_NEQ;
+}
 
-		expr = nftnl_expr_iter_next(iter);
+/* Layer 4 protocol of the rule, 0 if none or inverted. */
+static uint8_t nft_xt_ctx_l4proto(const struct nft_xt_ctx *ctx)
+{
+	switch (ctx->h->family) {
+	case NFPROTO_IPV4:
+		if (ctx->cs->fw.ip.invflags & XT_INV_PROTO)
+			return 0;
+		return ctx->cs->fw.ip.proto;
+	case NFPROTO_IPV6:
+		if (ctx->cs->fw6.ipv6.invflags & XT_INV_PROTO)
+			return 0;
+		return ctx->cs->fw6.ipv6.proto;
 	}
+	return 0;
+}
 
-	nftnl_expr_iter_destroy(iter);
-
-	if (nftnl_rule_is_set(r, NFTNL_RULE_USERDATA)) {
-		const void *data;
-		uint32_t len, size;
-		const char *comment;
+static bool nft_xt_ctx_th_port(const struct nft_xt_ctx *ctx)
+{
+	return ctx->payload.base == NFT_PAYLOAD_TRANSPORT_HEADER &&
+	       ctx->payload.len == sizeof(uint16_t) &&
+	       (ctx->payload.offset == NFT_TH_SPORT_OFFSET ||
+		ctx->payload.offset == NFT_TH_DPORT_OFFSET);
+}
 
-		data = nftnl_rule_get_data(r, NFTNL_RULE_USERDATA, &len);
+/* Port match on the transport header, as generated from the tcp and udp
+ * matches. Consecutive source and destination port expressions go into the
+ * same match, as they were added from the same one: a match following right
+ * after another is not translated, see nft_rule_ends_in_port().
+ */
+static void nft_parse_th_port(struct nft_xt_ctx *ctx, uint16_t from,
+			      uint16_t to, bool inv)
+{
+	bool src = ctx->payload.offset == NFT_TH_SPORT_OFFSET;
+	struct xtables_match *match;
+	uint8_t proto, *invflags;
+	const char *name;
+	uint16_t *pts;
+
+	proto = nft_xt_ctx_l4proto(ctx);
+	switch (proto) {
+	case IPPROTO_TCP:
+		name = "tcp";
+		break;
+	case IPPROTO_UDP:
+		name = "udp";
+		break;
+	default:
+		/* not from a tcp or udp match, which take -p */
+		ctx->unsupported = true;
+		return;
+	}
+
+	match = ctx->tcpudp.match;
+	if (match == NULL || ctx->payload.offset <= ctx->tcpudp.offset) {
+		match = nft_create_match(ctx, name);
+		if (match == NULL) {
+			ctx->unsupported = true;
+			return;
+		}
+	}
+	ctx->tcpudp.match = match;
+	ctx->tcpudp.offset = ctx->payload.offset;
+
+	if (proto == IPPROTO_TCP) {
+		struct xt_tcp *tcp = (void *)match->m->data;
+
+		pts = src ? tcp->spts : tcp->dpts;
+		invflags = &tcp->invflags;
+		if (inv)
+			*invflags |= src ? XT_TCP_INV_SRCPT : XT_TCP_INV_DSTPT;
+	} else {
+		struct xt_udp *udp = (void *)match->m->data;
+
+		pts = src ? udp->spts : udp->dpts;
+		invflags = &udp->invflags;
+		if (inv)
+			*invflags |= src ? XT_UDP_INV_SRCPT : XT_UDP_INV_DSTPT;
+	}
+
+	pts[0] = ntohs(from);
+	pts[1] = ntohs(to);
+}
+
+/* The conntrack match revisions share their leading fields. Revision 1 has
+ * 8 bit state and status masks, up to revision 2 ports are single and in
+ * network byte order.
+ */
+void nft_conntrack_to_v3(struct xt_conntrack_mtinfo3 *info,
+			 const struct xt_entry_match *m)
+{
+	const struct xt_conntrack_mtinfo1 *v1 = (const void *)m->data;
+
+	memset(info, 0, sizeof(*info));
+
+	switch (m->u.user.revision) {
+	case 1:
+		memcpy(info, v1, offsetof(struct xt_conntrack_mtinfo1,
+					  state_mask));
+		info->state_mask = v1->state_mask;
+		info->status_mask = v1->status_mask;
+		break;
+	case 2:
+		memcpy(info, m->data, sizeof(struct xt_conntrack_mtinfo2));
+		break;
+	default:
+		memcpy(info, m->data, sizeof(*info));
+		return;
+	}
+
+	info->origsrc_port = info->origsrc_port_high = ntohs(info->origsrc_port);
+	info->origdst_port = info->origdst_port_high = ntohs(info->origdst_port);
+	info->replsrc_port = info->replsrc_port_high = ntohs(info->replsrc_port);
+	info->repldst_port = info->repldst_port_high = ntohs(info->repldst_port);
+}
+
+bool nft_conntrack_from_v3(struct xt_entry_match *m,
+			   const struct xt_conntrack_mtinfo3 *info)
+{
+	struct xt_conntrack_mtinfo1 *v1 = (void *)m->data;
+	struct xt_conntrack_mtinfo2 *v2 = (void *)m->data;
+
+	switch (m->u.user.revision) {
+	case 1:
+		if (info->state_mask > UINT8_MAX ||
+		    info->status_mask > UINT8_MAX)
+			return false;
+		break;
+	case 2:
+		break;
+	case 3:
+		memcpy(m->data, info, sizeof(*info));
+		return true;
+	default:
+		return false;
+	}
+
+	if (info->origsrc_port != info->origsrc_port_high ||
+	    info->origdst_port != info->origdst_port_high ||
+	    info->replsrc_port != info->replsrc_port_high ||
+	    info->repldst_port != info->repldst_port_high)
+		return false;
+
+	memcpy(v2, info, offsetof(struct xt_conntrack_mtinfo2, state_mask));
+	v2->origsrc_port = htons(info->origsrc_port);
+	v2->origdst_port = htons(info->origdst_port);
+	v2->replsrc_port = htons(info->replsrc_port);
+	v2->repldst_port = htons(info->repldst_port);
+
+	if (m->u.user.revision == 1) {
+		v1->state_mask = info->state_mask;
+		v1->status_mask = info->status_mask;
+	} else {
+		v2->state_mask = info->state_mask;
+		v2->status_mask = info->status_mask;
+	}
+	return true;
+}
+
+/* Conntrack match criterion a ct expression stems from, see
+ * add_nft_conntrack().
+ */
+static uint16_t nft_xt_ctx_conntrack_flag(const struct nft_xt_ctx *ctx)
+{
+	bool orig = ctx->ct.dir == IP_CT_DIR_ORIGINAL;
+
+	switch (ctx->ct.key) {
+	case NFT_CT_STATE:
+		return XT_CONNTRACK_STATE;
+	case NFT_CT_PROTOCOL:
+		return orig ? XT_CONNTRACK_PROTO : 0;
+	case NFT_CT_SRC:
+		return orig ? XT_CONNTRACK_ORIGSRC : XT_CONNTRACK_REPLSRC;
+	case NFT_CT_DST:
+		return orig ? XT_CONNTRACK_ORIGDST : XT_CONNTRACK_REPLDST;
+	case NFT_CT_STATUS:
+		return XT_CONNTRACK_STATUS;
+	case NFT_CT_EXPIRATION:
+		return XT_CONNTRACK_EXPIRES;
+	case NFT_CT_PROTO_SRC:
+		return orig ? XT_CONNTRACK_ORIGSRC_PORT :
+			      XT_CONNTRACK_REPLSRC_PORT;
+	case NFT_CT_PROTO_DST:
+		return orig ? XT_CONNTRACK_ORIGDST_PORT :
+			      XT_CONNTRACK_REPLDST_PORT;
+	case NFT_CT_DIRECTION:
+		return XT_CONNTRACK_DIRECTION;
+	}
+	return 0;
+}
+
+static bool nft_ct_state_to_xt(uint32_t mask, uint16_t *state_mask)
+{
+	if (mask & ~(XT_CONNTRACK_STATE_INVALID |
+		     XT_CONNTRACK_STATE_BIT(IP_CT_ESTABLISHED) |
+		     XT_CONNTRACK_STATE_BIT(IP_CT_RELATED) |
+		     XT_CONNTRACK_STATE_BIT(IP_CT_NEW) |
+		     NFT_CT_STATE_UNTRACKED_BIT))
+		return false;
+
+	*state_mask = mask & ~NFT_CT_STATE_UNTRACKED_BIT;
+	if (mask & NFT_CT_STATE_UNTRACKED_BIT)
+		*state_mask |= XT_CONNTRACK_STATE_UNTRACKED;
+	return true;
+}
+
+static bool nft_parse_ct_addr(const struct nft_xt_ctx *ctx,
+			      union nf_inet_addr *addr,
+			      union nf_inet_addr *mask,
+			      const void *data, uint32_t len)
+{
+	switch (ctx->h->family) {
+	case NFPROTO_IPV4:
+		if (len != sizeof(struct in_addr))
+			return false;
+		break;
+	case NFPROTO_IPV6:
+		if (len != sizeof(struct in6_addr))
+			return false;
+		break;
+	default:
+		return false;
+	}
+
+	memcpy(addr, data, len);
+	if (ctx->flags & NFT_XT_CTX_BITWISE)
+		memcpy(mask, ctx->bitwise.mask, len);
+	else
+		memset(mask, 0xff, len);
+	return true;
+}
+
+static void nft_parse_ct_port(uint16_t *port, uint16_t *port_high,
+			      const void *from, const void *to)
+{
+	*port = ntohs(*(const uint16_t *)from);
+	*port_high = ntohs(*(const uint16_t *)to);
+}
+
+/* Criteria of one conntrack match are added in ascending order of their
+ * flags, a criterion not following the previous one starts a new match.
+ */
+static void nft_parse_ct_conntrack(struct nft_xt_ctx *ctx, const void *from,
+				   const void *to, uint32_t len, bool inv,
+				   bool range)
+{
+	struct xt_conntrack_mtinfo3 info;
+	struct xtables_match *match;
+	uint32_t val, min, max;
+	bool ok = false;
+	uint16_t flag;
+
+	flag = nft_xt_ctx_conntrack_flag(ctx);
+	if (!flag) {
+		ctx->unsupported = true;
+		return;
+	}
+
+	match = ctx->conntrack.match;
+	if (match) {
+		nft_conntrack_to_v3(&info, match->m);
+		if (info.match_flags & XT_CONNTRACK_STATE_ALIAS ||
+		    flag <= ctx->conntrack.flag)
+			match = NULL;
+	}
+	if (!match)
+		memset(&info, 0, sizeof(info));
+
+	switch (flag) {
+	case XT_CONNTRACK_STATE:
+		/* -m state has a zero xor, -m conntrack --ctstate the mask */
+		if (range || len != sizeof(val) ||
+		    !(ctx->flags & NFT_XT_CTX_BITWISE))
+			break;
+		memcpy(&val, from, sizeof(val));
+		if (val != ctx->bitwise.xor[0] ||
+		    (val && val != ctx->bitwise.mask[0]))
+			break;
+		ok = nft_ct_state_to_xt(ctx->bitwise.mask[0],
+					&info.state_mask);
+		if (!val)
+			info.match_flags |= XT_CONNTRACK_STATE_ALIAS;
+		inv = !inv;
+		break;
+	case XT_CONNTRACK_PROTO:
+		if (range || len != sizeof(uint8_t))
+			break;
+		info.l4proto = *(const uint8_t *)from;
+		ok = true;
+		break;
+	case XT_CONNTRACK_ORIGSRC:
+		ok = !range && nft_parse_ct_addr(ctx, &info.origsrc_addr,
+						 &info.origsrc_mask, from, len);
+		break;
+	case XT_CONNTRACK_ORIGDST:
+		ok = !range && nft_parse_ct_addr(ctx, &info.origdst_addr,
+						 &info.origdst_mask, from, len);
+		break;
+	case XT_CONNTRACK_REPLSRC:
+		ok = !range && nft_parse_ct_addr(ctx, &info.replsrc_addr,
+						 &info.replsrc_mask, from, len);
+		break;
+	case XT_CONNTRACK_REPLDST:
+		ok = !range && nft_parse_ct_addr(ctx, &info.repldst_addr,
+						 &info.repldst_mask, from, len);
+		break;
+	case XT_CONNTRACK_STATUS:
+		if (range || len != sizeof(val) ||
+		    !(ctx->flags & NFT_XT_CTX_BITWISE))
+			break;
+		memcpy(&val, from, sizeof(val));
+		if (val || ctx->bitwise.xor[0] ||
+		    ctx->bitwise.mask[0] > UINT16_MAX)
+			break;
+		info.status_mask = ctx->bitwise.mask[0];
+		inv = !inv;
+		ok = true;
+		break;
+	case XT_CONNTRACK_EXPIRES:
+		/* milliseconds in network byte order, whole seconds */
+		if (!range || len != sizeof(uint32_t) ||
+		    !(ctx->flags & NFT_XT_CTX_BYTEORDER))
+			break;
+		min = ntohl(*(const uint32_t *)from);
+		max = ntohl(*(const uint32_t *)to);
+		if (min % 1000 || max % 1000 != 999)
+			break;
+		info.expires_min = min / 1000;
+		info.expires_max = max / 1000;
+		ok = true;
+		break;
+	case XT_CONNTRACK_ORIGSRC_PORT:
+	case XT_CONNTRACK_ORIGDST_PORT:
+	case XT_CONNTRACK_REPLSRC_PORT:
+	case XT_CONNTRACK_REPLDST_PORT:
+		if (len != sizeof(uint16_t))
+			break;
+		if (flag == XT_CONNTRACK_ORIGSRC_PORT)
+			nft_parse_ct_port(&info.origsrc_port,
+					  &info.origsrc_port_high, from, to);
+		else if (flag == XT_CONNTRACK_ORIGDST_PORT)
+			nft_parse_ct_port(&info.origdst_port,
+					  &info.origdst_port_high, from, to);
+		else if (flag == XT_CONNTRACK_REPLSRC_PORT)
+			nft_parse_ct_port(&info.replsrc_port,
+					  &info.replsrc_port_high, from, to);
+		else
+			nft_parse_ct_port(&info.repldst_port,
+					  &info.repldst_port_high, from, to);
+		ok = true;
+		break;
+	case XT_CONNTRACK_DIRECTION:
+		if (range || inv || len != sizeof(uint8_t))
+			break;
+		inv = *(const uint8_t *)from == IP_CT_DIR_REPLY;
+		ok = true;
+		break;
+	}
+
+	if (!ok) {
+		ctx->unsupported = true;
+		return;
+	}
+
+	info.match_flags |= flag;
+	if (inv)
+		info.invert_flags |= flag;
+
+	if (match == NULL) {
+		match = nft_create_match(ctx, "conntrack");
+		if (match == NULL) {
+			ctx->unsupported = true;
+			return;
+		}
+	}
+
+	if (!nft_conntrack_from_v3(match->m, &info)) {
+		ctx->unsupported = true;
+		return;
+	}
+
+	ctx->conntrack.match = match;
+	ctx->conntrack.flag = flag;
+}
+
+static void nft_parse_ct_cmp(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
+{
+	uint32_t op, len;
+	const void *data;
+
+	if (ctx->ct.key == NFT_CT_MARK) {
+		nft_parse_mark_cmp(ctx, e, true);
+		ctx->conntrack.match = NULL;
+		return;
+	}
+
+	op = nftnl_expr_get_u32(e, NFTNL_EXPR_CMP_OP);
+	if (op != NFT_CMP_EQ && op != NFT_CMP_NEQ) {
+		ctx->unsupported = true;
+		return;
+	}
+
+	data = nftnl_expr_get(e, NFTNL_EXPR_CMP_DATA, &len);
+	nft_parse_ct_conntrack(ctx, data, data, len, op == NFT_CMP_NEQ, false);
+}
+
+static void nft_parse_ct_range(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
+{
+	const void *from, *to;
+	uint32_t len, to_len;
+
+	from = nftnl_expr_get(e, NFTNL_EXPR_RANGE_FROM_DATA, &len);
+	to = nftnl_expr_get(e, NFTNL_EXPR_RANGE_TO_DATA, &to_len);
+	if (len != to_len) {
+		ctx->unsupported = true;
+		return;
+	}
+
+	nft_parse_ct_conntrack(ctx, from, to, len,
+			       nftnl_expr_get_u32(e, NFTNL_EXPR_RANGE_OP) ==
+			       NFT_RANGE_NEQ, true);
+}
+
+static void nft_parse_cmp(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
+{
+	void *data = ctx->cs;
+	uint32_t reg;
+
+	reg = nftnl_expr_get_u32(e, NFTNL_EXPR_CMP_SREG);
+	if (ctx->reg && reg != ctx->reg)
+		return;
+
+	if (ctx->flags & NFT_XT_CTX_CT) {
+		nft_parse_ct_cmp(ctx, e);
+		ctx->flags &= ~(NFT_XT_CTX_CT | NFT_XT_CTX_BITWISE |
+				NFT_XT_CTX_BYTEORDER);
+		return;
+	}
+	if (ctx->flags & NFT_XT_CTX_META) {
+		if (ctx->meta.key == NFT_META_MARK)
+			nft_parse_mark_cmp(ctx, e, false);
+		else
+			ctx->h->ops->parse_meta(ctx, e, data);
+		ctx->flags &= ~(NFT_XT_CTX_META | NFT_XT_CTX_BITWISE);
+	}
+	/* bitwise context is interpreted from payload */
+	if (ctx->flags & NFT_XT_CTX_PAYLOAD) {
+		if (ctx->payload.base == NFT_PAYLOAD_TRANSPORT_HEADER) {
+			uint16_t port;
+			bool inv;
+
+			if (nft_xt_ctx_th_port(ctx)) {
+				get_cmp_data(e, &port, sizeof(port), &inv);
+				nft_parse_th_port(ctx, port, port, inv);
+			} else {
+				ctx->unsupported = true;
+			}
+		} else {
+			ctx->h->ops->parse_payload(ctx, e, data);
+		}
+		ctx->flags &= ~NFT_XT_CTX_PAYLOAD;
+	}
+}
+
+static void nft_parse_range(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
+{
+	uint16_t from, to;
+	uint32_t reg, len;
+	const void *data;
+	bool inv;
+
+	reg = nftnl_expr_get_u32(e, NFTNL_EXPR_RANGE_SREG);
+	if (ctx->reg && reg != ctx->reg)
+		return;
+
+	if (ctx->flags & NFT_XT_CTX_CT) {
+		nft_parse_ct_range(ctx, e);
+		ctx->flags &= ~(NFT_XT_CTX_CT | NFT_XT_CTX_BITWISE |
+				NFT_XT_CTX_BYTEORDER);
+		return;
+	}
+	/* port ranges are the only ones on the packet */
+	if (!(ctx->flags & NFT_XT_CTX_PAYLOAD) || !nft_xt_ctx_th_port(ctx)) {
+		ctx->unsupported = true;
+		return;
+	}
+	ctx->flags &= ~NFT_XT_CTX_PAYLOAD;
+
+	data = nftnl_expr_get(e, NFTNL_EXPR_RANGE_FROM_DATA, &len);
+	if (len != sizeof(from)) {
+		ctx->unsupported = true;
+		return;
+	}
+	memcpy(&from, data, sizeof(from));
+
+	data = nftnl_expr_get(e, NFTNL_EXPR_RANGE_TO_DATA, &len);
+	if (len != sizeof(to)) {
+		ctx->unsupported = true;
+		return;
+	}
+	memcpy(&to, data, sizeof(to));
+
+	inv = nftnl_expr_get_u32(e, NFTNL_EXPR_RANGE_OP) == NFT_RANGE_NEQ;
+	nft_parse_th_port(ctx, from, to, inv);
+}
+
+static void nft_parse_counter(struct nftnl_expr *e, struct xt_counters *counters)
+{
+	counters->pcnt = nftnl_expr_get_u64(e, NFTNL_EXPR_CTR_PACKETS);
+	counters->bcnt = nftnl_expr_get_u64(e, NFTNL_EXPR_CTR_BYTES);
+}
+
+static void nft_parse_immediate(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
+{
+	const char *chain = nftnl_expr_get_str(e, NFTNL_EXPR_IMM_CHAIN);
+	const char *jumpto = NULL;
+	bool nft_goto = false;
+	void *data = ctx->cs;
+	int verdict;
+
+	if (nftnl_expr_is_set(e, NFTNL_EXPR_IMM_DATA)) {
+		const void *imm_data;
+		uint32_t len;
+
+		imm_data = nftnl_expr_get_data(e, NFTNL_EXPR_IMM_DATA, &len);
+
+		if (len > sizeof(ctx->immediate.data))
+			return;
+
+		memcpy(ctx->immediate.data, imm_data, len);
+		ctx->immediate.len = len;
+		ctx->immediate.reg = nftnl_expr_get_u32(e, NFTNL_EXPR_IMM_DREG);
+		ctx->flags |= NFT_XT_CTX_IMMEDIATE;
+		return;
+	}
+
+	verdict = nftnl_expr_get_u32(e, NFTNL_EXPR_IMM_VERDICT);
+	/* Standard target? */
+	switch(verdict) {
+	case NF_ACCEPT:
+		jumpto = "ACCEPT";
+		break;
+	case NF_DROP:
+		jumpto = "DROP";
+		break;
+	case NFT_RETURN:
+		jumpto = "RETURN";
+		break;;
+	case NFT_GOTO:
+		nft_goto = true;
+		/* fall through */
+	case NFT_JUMP:
+		jumpto = chain;
+		break;
+	}
+
+	ctx->h->ops->parse_immediate(jumpto, nft_goto, data);
+}
+
+static void nft_parse_limit(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
+{
+	__u32 burst = nftnl_expr_get_u32(e, NFTNL_EXPR_LIMIT_BURST);
+	__u64 unit = nftnl_expr_get_u64(e, NFTNL_EXPR_LIMIT_UNIT);
+	__u64 rate = nftnl_expr_get_u64(e, NFTNL_EXPR_LIMIT_RATE);
+	struct xtables_rule_match **matches;
+	struct xtables_match *match;
+	struct xt_rateinfo *rinfo;
+	size_t size;
+
+	switch (ctx->h->family) {
+	case NFPROTO_IPV4:
+	case NFPROTO_IPV6:
+	case NFPROTO_BRIDGE:
+		matches = &ctx->cs->matches;
+		break;
+	default:
+		fprintf(stderr, "BUG: nft_parse_limit() unknown family %d\n",
+			ctx->h->family);
+		exit(EXIT_FAILURE);
+	}
+
+	match = xtables_find_match("limit", XTF_TRY_LOAD, matches);
+	if (match == NULL)
+		return;
+
+	size = XT_ALIGN(sizeof(struct xt_entry_match)) + match->size;
+	match->m = xtables_calloc(1, size);
+	match->m->u.match_size = size;
+	strcpy(match->m->u.user.name, match->name);
+	match->m->u.user.revision = match->revision;
+	xs_init_match(match);
+
+	rinfo = (void *)match->m->data;
+	rinfo->avg = XT_LIMIT_SCALE * unit / rate;
+	rinfo->burst = burst;
+
+	if (ctx->h->ops->parse_match != NULL)
+		ctx->h->ops->parse_match(match, ctx->cs);
+}
+
+struct nftnl_set *set_from_lookup_expr(struct nft_xt_ctx *ctx,
+				       const struct nftnl_expr *e)
+{
+	const char *set_name = nftnl_expr_get_str(e, NFTNL_EXPR_LOOKUP_SET);
+	struct nftnl_set_list *slist;
+	struct nftnl_set *s;
+
+	/* Anonymous set added in this transaction, not named by the kernel
+	 * yet, e.g. when printing a rule being added in verbose mode.
+	 */
+	if (nftnl_expr_is_set(e, NFTNL_EXPR_LOOKUP_SET_ID)) {
+		s = nft_set_batch_lookup_byid(ctx->h,
+			nftnl_expr_get_u32(e, NFTNL_EXPR_LOOKUP_SET_ID));
+		if (s)
+			return s;
+	}
+
+	slist = nft_set_list_get(ctx->h, ctx->table, set_name);
+	if (slist)
+		return nftnl_set_list_lookup_byname(slist, set_name);
+
+	return NULL;
+}
+
+static int nft_port_cmp(const void *a, const void *b)
+{
+	return *(const uint16_t *)a - *(const uint16_t *)b;
+}
+
+/* Port list lookup on the transport header, as generated from the
+ * multiport match. Set elements come in no particular order, the ports
+ * are sorted which is how the multiport match was given.
+ */
+static bool nft_parse_th_lookup(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
+{
+	struct nftnl_set_elems_iter *iter;
+	uint16_t ports[XT_MULTI_PORTS];
+	struct xt_multiport_v1 *mp;
+	struct xtables_match *match;
+	struct nftnl_set_elem *elem;
+	unsigned int count = 0;
+	struct nftnl_set *s;
+	const void *data;
+	uint32_t len;
+	bool inv;
+
+	s = set_from_lookup_expr(ctx, e);
+	if (!s)
+		return false;
+
+	iter = nftnl_set_elems_iter_create(s);
+	if (!iter)
+		return false;
+
+	while ((elem = nftnl_set_elems_iter_next(iter))) {
+		data = nftnl_set_elem_get(elem, NFTNL_SET_ELEM_KEY, &len);
+		if (!data || len != sizeof(uint16_t) ||
+		    count == XT_MULTI_PORTS) {
+			nftnl_set_elems_iter_destroy(iter);
+			return false;
+		}
+		ports[count++] = ntohs(*(const uint16_t *)data);
+	}
+	nftnl_set_elems_iter_destroy(iter);
+
+	if (!count)
+		return false;
+
+	inv = nftnl_expr_get_u32(e, NFTNL_EXPR_LOOKUP_FLAGS) & NFT_LOOKUP_F_INV;
+
+	match = nft_create_match(ctx, "multiport");
+	if (match == NULL)
+		return false;
+
+	qsort(ports, count, sizeof(ports[0]), nft_port_cmp);
+
+	/* revision 0 and 1 share the leading fields */
+	mp = (void *)match->m->data;
+	mp->flags = ctx->payload.offset == NFT_TH_SPORT_OFFSET ?
+		    XT_MULTIPORT_SOURCE : XT_MULTIPORT_DESTINATION;
+	mp->count = count;
+	memcpy(mp->ports, ports, count * sizeof(ports[0]));
+	if (match->revision == 1)
+		mp->invert = inv;
+	return true;
+}
+
+/* Increment @addr, false if it wraps around. */
+bool nft_addr_inc(uint8_t *addr, unsigned int len)
+{
+	while (len--) {
+		if (++addr[len])
+			return true;
+	}
+	return false;
+}
+
+static unsigned int nft_mask_to_prefix(const uint8_t *mask, unsigned int len)
+{
+	unsigned int i, bits = 0;
+	uint8_t byte;
+
+	for (i = 0; i < len && mask[i] == 0xff; i++)
+		bits += 8;
+	for (byte = i < len ? mask[i] : 0; byte & 0x80; byte <<= 1)
+		bits++;
+
+	return bits;
+}
+
+static void nft_prefix_to_mask(uint8_t *mask, unsigned int bits,
+			       unsigned int len)
+{
+	unsigned int i;
+
+	for (i = 0; i < len; i++, bits -= bits < 8 ? bits : 8)
+		mask[i] = bits >= 8 ? 0xff : (0xff00 >> bits) & 0xff;
+}
+
+/* Only prefix masks turn into address ranges. */
+bool nft_addr_list_ok(const struct addr_mask *am, unsigned int len)
+{
+	const uint8_t *mask = (const uint8_t *)am->mask.v4;
+	uint8_t tmp[16];
+	unsigned int i;
+
+	for (i = 0; i < am->naddrs; i++, mask += len) {
+		nft_prefix_to_mask(tmp, nft_mask_to_prefix(mask, len), len);
+		if (memcmp(tmp, mask, len))
+			return false;
+	}
+	return true;
+}
+
+static int nft_addr_range_cmp(const void *a, const void *b)
+{
+	return memcmp(((const struct nft_addr_range *)a)->from,
+		      ((const struct nft_addr_range *)b)->from, 16);
+}
+
+/* Sorted, disjoint and non-adjacent ranges covering the addresses of @am,
+ * which is the form an interval set wants them in. This is also how two
+ * lists are compared, rules keep the ranges only.
+ */
+unsigned int nft_addr_list_ranges(const struct addr_mask *am, unsigned int len,
+				  struct nft_addr_range **ranges)
+{
+	const uint8_t *addr = (const uint8_t *)am->addr.v4;
+	const uint8_t *mask = (const uint8_t *)am->mask.v4;
+	struct nft_addr_range *r;
+	unsigned int i, j, n = 0;
+	uint8_t next[16];
+
+	r = xtables_calloc(am->naddrs ? am->naddrs : 1, sizeof(*r));
+	for (i = 0; i < am->naddrs; i++) {
+		for (j = 0; j < len; j++) {
+			r[i].from[j] = addr[i * len + j] & mask[i * len + j];
+			r[i].to[j] = addr[i * len + j] | ~mask[i * len + j];
+		}
+	}
+	qsort(r, am->naddrs, sizeof(*r), nft_addr_range_cmp);
+
+	for (i = 0; i < am->naddrs; i++) {
+		if (n) {
+			memcpy(next, r[n - 1].to, len);
+			if (!nft_addr_inc(next, len) ||
+			    memcmp(r[i].from, next, len) <= 0) {
+				if (memcmp(r[i].to, r[n - 1].to, len) > 0)
+					memcpy(r[n - 1].to, r[i].to, len);
+				continue;
+			}
+		}
+		r[n++] = r[i];
+	}
+
+	*ranges = r;
+	return n;
+}
+
+/* Whether a set of the addresses of @am holds ranges, not single addresses. */
+bool nft_addr_list_interval(const struct addr_mask *am, unsigned int len)
+{
+	struct nft_addr_range *r;
+	unsigned int i, n;
+	bool ret = false;
+
+	n = nft_addr_list_ranges(am, len, &r);
+	for (i = 0; i < n && !ret; i++)
+		ret = memcmp(r[i].from, r[i].to, len) != 0;
+	free(r);
+
+	return ret;
+}
+
+static bool nft_addr_list_equal(const struct addr_mask *a,
+				const struct addr_mask *b, unsigned int len)
+{
+	struct nft_addr_range *ra, *rb;
+	unsigned int na, nb;
+	bool ret;
+
+	if (!a || !b)
+		return a == b;
+
+	na = nft_addr_list_ranges(a, len, &ra);
+	nb = nft_addr_list_ranges(b, len, &rb);
+	ret = na == nb && !memcmp(ra, rb, na * sizeof(*ra));
+	free(ra);
+	free(rb);
+
+	return ret;
+}
+
+bool nft_addr_lists_equal(const struct iptables_command_state *a,
+			  const struct iptables_command_state *b,
+			  unsigned int len)
+{
+	return nft_addr_list_equal(a->saddrs, b->saddrs, len) &&
+	       nft_addr_list_equal(a->daddrs, b->daddrs, len);
+}
+
+static void nft_addr_list_free(const struct addr_mask *am)
+{
+	if (!am)
+		return;
+
+	free(am->addr.v4);
+	free(am->mask.v4);
+	free((void *)am);
+}
+
+/* Lists decoded from a rule, see nft_parse_addr_lookup(). */
+void nft_addr_lists_free(struct iptables_command_state *cs)
+{
+	nft_addr_list_free(cs->saddrs);
+	nft_addr_list_free(cs->daddrs);
+	cs->saddrs = cs->daddrs = NULL;
+}
+
+/* Comma separated list for -S, or for the -L address columns. */
+static char *nft_addr_list_to_string(const struct addr_mask *am, int family,
+			      unsigned int format, bool save)
+{
+	char *buf = NULL, item[BUFSIZ];
+	const char *addr, *mask;
+	size_t size = 0, len;
+	unsigned int i;
+
+	for (i = 0; i < am->naddrs; i++) {
+		if (family == AF_INET) {
+			addr = format & FMT_NUMERIC || save ?
+			       xtables_ipaddr_to_numeric(&am->addr.v4[i]) :
+			       xtables_ipaddr_to_anyname(&am->addr.v4[i]);
+			mask = xtables_ipmask_to_numeric(&am->mask.v4[i]);
+			if (save && mask[0] == '\0')
+				mask = "/32";
+		} else {
+			addr = format & FMT_NUMERIC || save ?
+			       xtables_ip6addr_to_numeric(&am->addr.v6[i]) :
+			       xtables_ip6addr_to_anyname(&am->addr.v6[i]);
+			mask = xtables_ip6mask_to_numeric(&am->mask.v6[i]);
+			if (save && mask[0] == '\0')
+				mask = "/128";
+		}
+
+		len = snprintf(item, sizeof(item), "%s%s%s",
+			       i ? "," : "", addr, mask);
+		buf = xtables_realloc(buf, size + len + 1);
+		memcpy(buf + size, item, len + 1);
+		size += len;
+	}
+
+	return buf;
+}
+
+void nft_save_addr_list(char letter, const struct addr_mask *am, int family)
+{
+	char *buf = nft_addr_list_to_string(am, family, 0, true);
+
+	printf("-%c %s ", letter, buf);
+	free(buf);
+}
+
+static char *nft_addr_column(const struct addr_mask *list, void *addr,
+			     void *mask, int family, unsigned int format)
+{
+	struct addr_mask am = {
+		.addr.v4	= addr,
+		.mask.v4	= mask,
+		.naddrs		= 1,
+	};
+	static const uint8_t any[16];
+
+	if (list)
+		return nft_addr_list_to_string(list, family, format, false);
+	if (!(format & FMT_NUMERIC) &&
+	    !memcmp(mask, any, family == AF_INET ? sizeof(struct in_addr) :
+						   sizeof(struct in6_addr)))
+		return strdup("anywhere");
+	return nft_addr_list_to_string(&am, family, format, false);
+}
+
+/* Address columns of -L for a rule with -s or -d lists, see
+ * print_ipv4_addresses(). Lists are never inverted.
+ */
+void nft_print_addr_lists(struct iptables_command_state *cs, int family,
+			  unsigned int format)
+{
+	char *src, *dst;
+
+	if (family == AF_INET) {
+		src = nft_addr_column(cs->saddrs, &cs->fw.ip.src,
+				      &cs->fw.ip.smsk, family, format);
+		dst = nft_addr_column(cs->daddrs, &cs->fw.ip.dst,
+				      &cs->fw.ip.dmsk, family, format);
+	} else {
+		src = nft_addr_column(cs->saddrs, &cs->fw6.ipv6.src,
+				      &cs->fw6.ipv6.smsk, family, format);
+		dst = nft_addr_column(cs->daddrs, &cs->fw6.ipv6.dst,
+				      &cs->fw6.ipv6.dmsk, family, format);
+	}
+
+	printf(FMT(" %-19s ", " %s "), src);
+	printf(FMT(" %-19s ", "-> %s"), dst);
+	free(src);
+	free(dst);
+}
+
+/* Source or destination address of the rule family: returns the ipset
+ * direction flag, or -1 if the payload is not an address.
+ */
+static int nft_payload_addr(int family, uint32_t base, uint32_t offset,
+			    uint32_t len)
+{
+	if (base != NFT_PAYLOAD_NETWORK_HEADER)
+		return -1;
+
+	switch (family) {
+	case NFPROTO_IPV4:
+		if (len != sizeof(struct in_addr))
+			return -1;
+		if (offset == offsetof(struct iphdr, saddr))
+			return IPSET_DIM_ONE_SRC;
+		if (offset == offsetof(struct iphdr, daddr))
+			return 0;
+		break;
+	case NFPROTO_IPV6:
+		if (len != sizeof(struct in6_addr))
+			return -1;
+		if (offset == offsetof(struct ip6_hdr, ip6_src))
+			return IPSET_DIM_ONE_SRC;
+		if (offset == offsetof(struct ip6_hdr, ip6_dst))
+			return 0;
+		break;
+	}
+	return -1;
+}
+
+/* Key of a set lookup or update on an address, as generated from the set
+ * match and SET target or from address lists.
+ */
+static int nft_xt_ctx_ipset_key(const struct nft_xt_ctx *ctx)
+{
+	if (!(ctx->flags & NFT_XT_CTX_PAYLOAD))
+		return -1;
+
+	return nft_payload_addr(ctx->h->family, ctx->payload.base,
+				ctx->payload.offset, ctx->payload.len);
+}
+
+static void nft_addr_dec(uint8_t *addr, unsigned int len)
+{
+	while (len--) {
+		if (addr[len]--)
+			break;
+	}
+}
+
+static void nft_addr_list_add(struct addr_mask *am, const uint8_t *addr,
+			      unsigned int bits, unsigned int len)
+{
+	am->addr.v4 = xtables_realloc(am->addr.v4, (am->naddrs + 1) * len);
+	am->mask.v4 = xtables_realloc(am->mask.v4, (am->naddrs + 1) * len);
+	memcpy((uint8_t *)am->addr.v4 + am->naddrs * len, addr, len);
+	nft_prefix_to_mask((uint8_t *)am->mask.v4 + am->naddrs * len,
+			   bits, len);
+	am->naddrs++;
+}
+
+/* Split ranges into the fewest prefixes covering them. */
+static struct addr_mask *nft_addr_ranges_to_list(struct nft_addr_range *r,
+						 unsigned int n,
+						 unsigned int len)
+{
+	uint8_t cur[16], end[16], mask[16];
+	struct addr_mask *am;
+	unsigned int i, j, bits;
+	bool fits;
+
+	am = xtables_calloc(1, sizeof(*am));
+	for (i = 0; i < n; i++) {
+		memcpy(cur, r[i].from, len);
+		for (;;) {
+			for (bits = 0; bits <= len * 8; bits++) {
+				nft_prefix_to_mask(mask, bits, len);
+				fits = true;
+				for (j = 0; j < len; j++) {
+					if (cur[j] & ~mask[j])
+						fits = false;
+					end[j] = cur[j] | ~mask[j];
+				}
+				if (fits && memcmp(end, r[i].to, len) <= 0)
+					break;
+			}
+			nft_addr_list_add(am, cur, bits, len);
+
+			if (!memcmp(end, r[i].to, len))
+				break;
+			memcpy(cur, end, len);
+			nft_addr_inc(cur, len);
+		}
+	}
+	return am;
+}
+
+/* Ranges of one field of a concatenation, each of them is paired with every
+ * range of the other field.
+ */
+static unsigned int nft_addr_ranges_uniq(struct nft_addr_range *r,
+					 unsigned int n)
+{
+	unsigned int i, m = 0;
+
+	qsort(r, n, sizeof(*r), nft_addr_range_cmp);
+	for (i = 0; i < n; i++) {
+		if (!m || memcmp(&r[m - 1], &r[i], sizeof(*r)))
+			r[m++] = r[i];
+	}
+	return m;
+}
+
+struct nft_addr_elem {
+	uint8_t		key[16];
+	bool		end;
+};
+
+static int nft_addr_elem_cmp(const void *a, const void *b)
+{
+	const struct nft_addr_elem *ea = a, *eb = b;
+	int ret = memcmp(ea->key, eb->key, sizeof(ea->key));
+
+	return ret ? ret : eb->end - ea->end;
+}
+
+/* An interval set of single addresses holds start and end elements, the end
+ * being the first address after the range. There is none for a range up to
+ * the last address.
+ */
+static unsigned int nft_addr_elems_to_ranges(struct nft_addr_elem *el,
+					     unsigned int n, unsigned int len,
+					     struct nft_addr_range *r)
+{
+	unsigned int i, m = 0;
+	bool open = false;
+
+	qsort(el, n, sizeof(*el), nft_addr_elem_cmp);
+	for (i = 0; i < n; i++) {
+		if (el[i].end && open) {
+			memcpy(r[m].to, el[i].key, len);
+			nft_addr_dec(r[m].to, len);
+			m++;
+			open = false;
+		} else if (!el[i].end && !open) {
+			memset(&r[m], 0, sizeof(r[m]));
+			memcpy(r[m].from, el[i].key, len);
+			open = true;
+		}
+	}
+	if (open)
+		memset(r[m++].to, 0xff, len);
+
+	return m;
+}
+
+/* Lookup of the source or destination address, or of both concatenated, in
+ * an anonymous set, as generated from -s and -d lists by add_addr_list().
+ */
+static bool nft_parse_addr_lookup(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
+{
+	unsigned int n = 0, ns, nd, len = ctx->h->family == NFPROTO_IPV4 ?
+				sizeof(struct in_addr) : sizeof(struct in6_addr);
+	struct iptables_command_state *cs = ctx->cs;
+	struct nft_addr_range *sr = NULL, *dr = NULL;
+	struct nftnl_set_elems_iter *iter;
+	struct nft_addr_elem *el = NULL;
+	struct nftnl_set_elem *elem;
+	const uint8_t *key, *end;
+	bool concat, interval;
+	struct nftnl_set *s;
+	bool ret = false;
+	uint32_t klen;
+	int dir;
+
+	dir = nft_xt_ctx_ipset_key(ctx);
+	if (dir < 0 || nftnl_expr_get_u32(e, NFTNL_EXPR_LOOKUP_FLAGS))
+		return false;
+
+	s = set_from_lookup_expr(ctx, e);
+	if (!s)
+		return false;
+
+	concat = nftnl_set_get_u32(s, NFTNL_SET_KEY_LEN) == 2 * len;
+	if (concat &&
+	    (dir != 0 || !(ctx->flags & NFT_XT_CTX_PREV_PAYLOAD) ||
+	     nft_payload_addr(ctx->h->family, ctx->prev_payload.base,
+			      ctx->prev_payload.offset,
+			      ctx->prev_payload.len) != IPSET_DIM_ONE_SRC))
+		return false;
+	if (!concat && nftnl_set_get_u32(s, NFTNL_SET_KEY_LEN) != len)
+		return false;
+	interval = nftnl_set_get_u32(s, NFTNL_SET_FLAGS) & NFT_SET_INTERVAL;
+
+	iter = nftnl_set_elems_iter_create(s);
+	if (!iter)
+		return false;
+
+	while ((elem = nftnl_set_elems_iter_next(iter))) {
+		key = nftnl_set_elem_get(elem, NFTNL_SET_ELEM_KEY, &klen);
+		if (!key || klen != (concat ? 2 * len : len))
+			break;
+
+		/* one element per range pair, start and end of both */
+		end = key;
+		if (interval && concat) {
+			end = nftnl_set_elem_get(elem, NFTNL_SET_ELEM_KEY_END,
+						 &klen);
+			if (!end || klen != 2 * len)
+				break;
+		}
+
+		sr = xtables_realloc(sr, (n + 1) * sizeof(*sr));
+		dr = xtables_realloc(dr, (n + 1) * sizeof(*dr));
+		el = xtables_realloc(el, (n + 1) * sizeof(*el));
+		memset(&sr[n], 0, sizeof(*sr));
+		memset(&dr[n], 0, sizeof(*dr));
+		memset(&el[n], 0, sizeof(*el));
+
+		memcpy(sr[n].from, key, len);
+		memcpy(sr[n].to, end, len);
+		if (concat) {
+			memcpy(dr[n].from, key + len, len);
+			memcpy(dr[n].to, end + len, len);
+		}
+		memcpy(el[n].key, key, len);
+		el[n].end = nftnl_set_elem_get_u32(elem, NFTNL_SET_ELEM_FLAGS) &
+			    NFT_SET_ELEM_INTERVAL_END;
+		n++;
+	}
+	nftnl_set_elems_iter_destroy(iter);
+
+	if (elem || !n)
+		goto out;
+
+	if (interval && !concat)
+		n = nft_addr_elems_to_ranges(el, n, len, sr);
+
+	ns = nft_addr_ranges_uniq(sr, n);
+	if (concat) {
+		nd = nft_addr_ranges_uniq(dr, n);
+		if (ns * nd != n)
+			goto out;
+		cs->saddrs = nft_addr_ranges_to_list(sr, ns, len);
+		cs->daddrs = nft_addr_ranges_to_list(dr, nd, len);
+	} else if (dir == IPSET_DIM_ONE_SRC) {
+		cs->saddrs = nft_addr_ranges_to_list(sr, ns, len);
+	} else {
+		cs->daddrs = nft_addr_ranges_to_list(sr, ns, len);
+	}
+	ret = true;
+out:
+	free(sr);
+	free(dr);
+	free(el);
+	return ret;
+}
+
+/* The set match and SET target refer to kernel ipsets by index, this is
+ * the getsockopt() interface libxt_set resolves set names with.
+ */
+static bool nft_ipset_sockopt(unsigned int op, struct ip_set_req_get_set *req)
+{
+	struct ip_set_req_version req_version = { .op = IP_SET_OP_VERSION };
+	socklen_t size = sizeof(req_version);
+	bool ret = false;
+	int fd;
+
+	fd = socket(AF_INET, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
+	if (fd < 0)
+		return false;
+
+	if (getsockopt(fd, SOL_IP, SO_IP_SET, &req_version, &size) == 0) {
+		req->op = op;
+		req->version = req_version.version;
+		size = sizeof(*req);
+		ret = getsockopt(fd, SOL_IP, SO_IP_SET, req, &size) == 0 &&
+		      size == sizeof(*req);
+	}
+	close(fd);
+
+	return ret;
+}
+
+bool nft_ipset_get_name(uint16_t index, char *name)
+{
+	struct ip_set_req_get_set req = {
+		.set.index = index,
+	};
+
+	if (!nft_ipset_sockopt(IP_SET_OP_GET_BYINDEX, &req) ||
+	    req.set.name[0] == '\0')
+		return false;
+
+	memcpy(name, req.set.name, IPSET_MAXNAMELEN);
+	name[IPSET_MAXNAMELEN - 1] = '\0';
+	return true;
+}
+
+bool nft_ipset_get_index(const char *name, uint16_t *index)
+{
+	struct ip_set_req_get_set req = {};
+
+	strncpy(req.set.name, name, IPSET_MAXNAMELEN - 1);
+	if (!nft_ipset_sockopt(IP_SET_OP_GET_BYNAME, &req) ||
+	    req.set.index == IPSET_INVALID_ID)
+		return false;
+
+	*index = req.set.index;
+	return true;
+}
+
+static bool nft_set_name_anonymous(const char *name)
+{
+	return !strncmp(name, "__set", strlen("__set"));
+}
+
+/* Lookup in a named set, as generated from the set match, see
+ * add_nft_set_match(). The set is named after the ipset.
+ */
+static bool nft_parse_ipset_lookup(struct nft_xt_ctx *ctx,
+				   struct nftnl_expr *e, int key)
+{
+	const char *name = nftnl_expr_get_str(e, NFTNL_EXPR_LOOKUP_SET);
+	struct xtables_match *match;
+	struct xt_set_info *info;
+	uint16_t index;
+
+	if (!nft_ipset_get_index(name, &index))
+		return false;
+
+	match = nft_create_match(ctx, "set");
+	if (match == NULL)
+		return false;
+
+	/* all revisions but 0 start with the set info */
+	info = (void *)match->m->data;
+	info->index = index;
+	info->dim = IPSET_DIM_ONE;
+	info->flags = key;
+	if (nftnl_expr_get_u32(e, NFTNL_EXPR_LOOKUP_FLAGS) & NFT_LOOKUP_F_INV)
+		info->flags |= IPSET_INV_MATCH;
+	return true;
+}
+
+static void nft_parse_dynset(struct nft_xt_ctx *ctx, struct nftnl_expr *e)
+{
+	const char *name = nftnl_expr_get_str(e, NFTNL_EXPR_DYNSET_SET_NAME);
+	struct xtables_target *target;
+	struct xt_set_info *info;
+	uint16_t index;
+	int key;
+
+	key = nft_xt_ctx_ipset_key(ctx);
+	ctx->flags &= ~NFT_XT_CTX_PAYLOAD;
+
+	if (key < 0 || nft_set_name_anonymous(name) ||
+	    nftnl_expr_is_set(e, NFTNL_EXPR_DYNSET_TIMEOUT) ||
+	    nftnl_expr_get_u32(e, NFTNL_EXPR_DYNSET_OP) != NFT_DYNSET_OP_ADD ||
+	    !nft_ipset_get_index(name, &index)) {
+		ctx->unsupported = true;
+		return;
+	}
+
+	target = xtables_find_target("SET", XTF_TRY_LOAD);
+	if (target == NULL || target->revision < 1) {
+		ctx->unsupported = true;
+		return;
+	}
+
+	/* revisions 1 to 3 start with the add and del set infos, the init
+	 * callback sets up the unused ones.
+	 */
+	nft_alloc_target(target);
+	info = (void *)target->t->data;
+	info->index = index;
+	info->dim = IPSET_DIM_ONE;
+	info->flags = key;
+
+	ctx->h->ops->parse_target(target, ctx->cs);
+}
+
+static void nft_parse_lookup(struct nft_xt_ctx *ctx, struct nft_handle *h,
+			     struct nftnl_expr *e)
+{
+	const char *name = nftnl_expr_get_str(e, NFTNL_EXPR_LOOKUP_SET);
+	int key;
+
+	if ((ctx->flags & NFT_XT_CTX_PAYLOAD) && nft_xt_ctx_th_port(ctx)) {
+		if (!nft_parse_th_lookup(ctx, e))
+			ctx->unsupported = true;
+		ctx->flags &= ~NFT_XT_CTX_PAYLOAD;
+		return;
+	}
+
+	if (nft_set_name_anonymous(name) && nft_parse_addr_lookup(ctx, e)) {
+		ctx->flags &= ~(NFT_XT_CTX_PAYLOAD | NFT_XT_CTX_PREV_PAYLOAD);
+		return;
+	}
+
+	key = nft_xt_ctx_ipset_key(ctx);
+	if (key >= 0 && !nft_set_name_anonymous(name)) {
+		if (!nft_parse_ipset_lookup(ctx, e, key))
+			ctx->unsupported = true;
+		ctx->flags &= ~NFT_XT_CTX_PAYLOAD;
+		return;
+	}
+
+	if (ctx->h->ops->parse_lookup)
+		ctx->h->ops->parse_lookup(ctx, e, NULL);
+	else
+		ctx->unsupported = true;
+}
+
+/* False if part of the rule could not be mapped to iptables, see
+ * nft_is_rule_compatible().
+ */
+bool nft_rule_to_iptables_command_state(struct nft_handle *h,
+					const struct nftnl_rule *r,
+					struct iptables_command_state *cs)
+{
+	struct nftnl_expr_iter *iter;
+	struct nftnl_expr *expr;
+	struct nft_xt_ctx ctx = {
+		.cs = cs,
+		.h = h,
+		.table = nftnl_rule_get_str(r, NFTNL_RULE_TABLE),
+	};
+
+	iter = nftnl_expr_iter_create(r);
+	if (iter == NULL)
+		return false;
+
+	ctx.iter = iter;
+	expr = nftnl_expr_iter_next(iter);
+	while (expr != NULL) {
+		const char *name =
+			nftnl_expr_get_str(expr, NFTNL_EXPR_NAME);
+
+		/* port expressions of one tcp/udp match are consecutive */
+		if (strcmp(name, "payload") && strcmp(name, "cmp") &&
+		    strcmp(name, "range") && strcmp(name, "counter"))
+			ctx.tcpudp.match = NULL;
+		/* and so are the ct expressions of one conntrack match */
+		if (strcmp(name, "ct") && strcmp(name, "bitwise") &&
+		    strcmp(name, "byteorder") && strcmp(name, "cmp") &&
+		    strcmp(name, "range") && strcmp(name, "counter"))
+			ctx.conntrack.match = NULL;
+
+		if (strcmp(name, "counter") == 0)
+			nft_parse_counter(expr, &ctx.cs->counters);
+		else if (strcmp(name, "payload") == 0)
+			nft_parse_payload(&ctx, expr);
+		else if (strcmp(name, "meta") == 0)
+			nft_parse_meta(&ctx, expr);
+		else if (strcmp(name, "bitwise") == 0)
+			nft_parse_bitwise(&ctx, expr);
+		else if (strcmp(name, "cmp") == 0)
+			nft_parse_cmp(&ctx, expr);
+		else if (strcmp(name, "immediate") == 0)
+			nft_parse_immediate(&ctx, expr);
+		else if (strcmp(name, "match") == 0)
+			nft_parse_match(&ctx, expr);
+		else if (strcmp(name, "target") == 0)
+			nft_parse_target(&ctx, expr);
+		else if (strcmp(name, "limit") == 0)
+			nft_parse_limit(&ctx, expr);
+		else if (strcmp(name, "lookup") == 0)
+			nft_parse_lookup(&ctx, h, expr);
+		else if (strcmp(name, "dynset") == 0)
+			nft_parse_dynset(&ctx, expr);
+		else if (strcmp(name, "range") == 0)
+			nft_parse_range(&ctx, expr);
+		else if (strcmp(name, "ct") == 0)
+			nft_parse_ct(&ctx, expr);
+		else if (strcmp(name, "byteorder") == 0)
+			nft_parse_byteorder(&ctx, expr);
+
+		expr = nftnl_expr_iter_next(iter);
+	}
+
+	nftnl_expr_iter_destroy(iter);
+
+	if (nftnl_rule_is_set(r, NFTNL_RULE_USERDATA)) {
+		const void *data;
+		uint32_t len, size;
+		const char *comment;
+
+		data = nftnl_rule_get_data(r, NFTNL_RULE_USERDATA, &len);
 		comment = get_comment(data, len);
 		if (comment) {
 			struct xtables_match *match;
@@ -657,7 +2212,7 @@ void nft_rule_to_iptables_command_state(struct nft_handle *h,
 			match = xtables_find_match("comment", XTF_TRY_LOAD,
 						   &cs->matches);
 			if (match == NULL)
-				return;
+				return false;
 
 			size = XT_ALIGN(sizeof(struct xt_entry_match))
 				+ match->size;
@@ -680,7 +2235,7 @@ void nft_rule_to_iptables_command_state(struct nft_handle *h,
 
 		cs->target = xtables_find_target(cs->jumpto, XTF_TRY_LOAD);
 		if (!cs->target)
-			return;
+			return false;
 
 		size = XT_ALIGN(sizeof(struct xt_entry_target)) + cs->target->size;
 		t = xtables_calloc(1, size);
@@ -691,11 +2246,14 @@ void nft_rule_to_iptables_command_state(struct nft_handle *h,
 	} else {
 		cs->jumpto = "";
 	}
+
+	return !ctx.unsupported;
 }
 
 void nft_clear_iptables_command_state(struct iptables_command_state *cs)
 {
 	xtables_rule_matches_free(&cs->matches);
+	nft_addr_lists_free(cs);
 	if (cs->target) {
 		free(cs->target->t);
 		cs->target->t = NULL;
@@ -37,6 +37,7 @@
 struct xtables_args;
 struct nft_handle;
 struct xt_xlate;
+struct xt_conntrack_mtinfo3;
 
 enum {
 	NFT_XT_CTX_PAYLOAD	= (1 << 0),
@@ -44,6 +45,8 @@ enum {
 	NFT_XT_CTX_BITWISE	= (1 << 2),
 	NFT_XT_CTX_IMMEDIATE	= (1 << 3),
 	NFT_XT_CTX_PREV_PAYLOAD	= (1 << 4),
+	NFT_XT_CTX_CT		= (1 << 5),
+	NFT_XT_CTX_BYTEORDER	= (1 << 6),
 };
 
 struct nft_xt_ctx {
@@ -62,6 +65,10 @@ struct nft_xt_ctx {
 	struct {
 		uint32_t key;
 	} meta;
+	struct {
+		uint32_t key;
+		uint8_t dir;
+	} ct;
 	struct {
 		uint32_t data[4];
 		uint32_t len, reg;
@@ -70,8 +77,29 @@ struct nft_xt_ctx {
 		uint32_t mask[4];
 		uint32_t xor[4];
 	} bitwise;
+	struct {
+		/* tcp or udp match port expressions are decoded into */
+		struct xtables_match *match;
+		uint32_t offset;
+	} tcpudp;
+	struct {
+		/* conntrack match ct expressions are decoded into */
+		struct xtables_match *match;
+		uint16_t flag;
+	} conntrack;
+	/* a native expression found no match or target to map to */
+	bool unsupported;
 };
 
+/* Port offsets in the transport header, same for TCP and UDP. */
+#define NFT_TH_SPORT_OFFSET	0
+#define NFT_TH_DPORT_OFFSET	2
+
+/* ct state bit of untracked packets, the conntrack match has its SNAT and
+ * DNAT pseudo states in this place.
+ */
+#define NFT_CT_STATE_UNTRACKED_BIT	(1 << 6)
+
 struct nft_family_ops {
 	int (*add)(struct nft_handle *h, struct nftnl_rule *r, void *data);
 	bool (*is_same)(const void *data_a,
@@ -106,7 +134,7 @@ struct nft_family_ops {
 			   struct xtables_args *args);
 	void (*parse_match)(struct xtables_match *m, void *data);
 	void (*parse_target)(struct xtables_target *t, void *data);
-	void (*rule_to_cs)(struct nft_handle *h, const struct nftnl_rule *r,
+	bool (*rule_to_cs)(struct nft_handle *h, const struct nftnl_rule *r,
 			   struct iptables_command_state *cs);
 	void (*clear_cs)(struct iptables_command_state *cs);
 	bool (*rule_find)(struct nft_handle *h, struct nftnl_rule *r,
@@ -115,13 +143,18 @@ struct nft_family_ops {
 };
 
 void add_meta(struct nftnl_rule *r, uint32_t key);
+void add_ct(struct nftnl_rule *r, uint32_t key, int dir);
 void add_payload(struct nftnl_rule *r, int offset, int len, uint32_t base);
 void add_bitwise(struct nftnl_rule *r, uint8_t *mask, size_t len);
 void add_bitwise_u16(struct nftnl_rule *r, uint16_t mask, uint16_t xor);
+void add_bitwise_u32(struct nftnl_rule *r, uint32_t mask, uint32_t xor);
+void add_byteorder(struct nftnl_rule *r, uint32_t op, size_t len, size_t size);
 void add_cmp_ptr(struct nftnl_rule *r, uint32_t op, void *data, size_t len);
 void add_cmp_u8(struct nftnl_rule *r, uint8_t val, uint32_t op);
 void add_cmp_u16(struct nftnl_rule *r, uint16_t val, uint32_t op);
 void add_cmp_u32(struct nftnl_rule *r, uint32_t val, uint32_t op);
+void add_range(struct nftnl_rule *r, uint32_t op, void *from, void *to,
+	       size_t len);
 void add_iniface(struct nftnl_rule *r, char *iface, uint32_t op);
 void add_outiface(struct nftnl_rule *r, char *iface, uint32_t op);
 void add_addr(struct nftnl_rule *r, int offset,
@@ -143,7 +176,15 @@ int parse_meta(struct nftnl_expr *e, uint8_t key, char *iniface,
 		unsigned char *outiface_mask, uint8_t *invflags);
 void print_proto(uint16_t proto, int invert);
 void get_cmp_data(struct nftnl_expr *e, void *data, size_t dlen, bool *inv);
-void nft_rule_to_iptables_command_state(struct nft_handle *h,
+struct nftnl_set *set_from_lookup_expr(struct nft_xt_ctx *ctx,
+				       const struct nftnl_expr *e);
+void nft_conntrack_to_v3(struct xt_conntrack_mtinfo3 *info,
+			 const struct xt_entry_match *m);
+bool nft_conntrack_from_v3(struct xt_entry_match *m,
+			   const struct xt_conntrack_mtinfo3 *info);
+bool nft_ipset_get_name(uint16_t index, char *name);
+bool nft_ipset_get_index(const char *name, uint16_t *index);
+bool nft_rule_to_iptables_command_state(struct nft_handle *h,
 					const struct nftnl_rule *r,
 					struct iptables_command_state *cs);
 void nft_clear_iptables_command_state(struct iptables_command_state *cs);
@@ -191,6 +232,25 @@ struct addr_mask {
 	} mask;
 };
 
+/* Address range in network byte order, 4 or 16 bytes used. */
+struct nft_addr_range {
+	uint8_t		from[16];
+	uint8_t		to[16];
+};
+
+bool nft_addr_inc(uint8_t *addr, unsigned int len);
+bool nft_addr_list_ok(const struct addr_mask *am, unsigned int len);
+unsigned int nft_addr_list_ranges(const struct addr_mask *am, unsigned int len,
+				  struct nft_addr_range **ranges);
+bool nft_addr_list_interval(const struct addr_mask *am, unsigned int len);
+bool nft_addr_lists_equal(const struct iptables_command_state *a,
+			  const struct iptables_command_state *b,
+			  unsigned int len);
+void nft_addr_lists_free(struct iptables_command_state *cs);
+void nft_save_addr_list(char letter, const struct addr_mask *am, int family);
+void nft_print_addr_lists(struct iptables_command_state *cs, int family,
+			  unsigned int format);
+
 struct xtables_args {
 	int		family;
 	uint16_t	proto;
@@ -9,10 +9,12 @@
  * This code has been sponsored by Sophos Astaro <http://www.sophos.com>
  */
 
+#define _GNU_SOURCE
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <stdbool.h>
 #include <errno.h>
 #include <netdb.h>	/* getprotobynumber */
@@ -38,7 +40,15 @@
 #include <linux/netfilter/nf_tables.h>
 #include <linux/netfilter/nf_tables_compat.h>
 
+#include <linux/netfilter/nf_conntrack_common.h>
+#include <linux/netfilter/xt_comment.h>
+#include <linux/netfilter/xt_CONNMARK.h>
+#include <linux/netfilter/xt_conntrack.h>
 #include <linux/netfilter/xt_limit.h>
+#include <linux/netfilter/xt_MARK.h>
+#include <linux/netfilter/xt_multiport.h>
+#include <linux/netfilter/xt_set.h>
+#include <linux/netfilter/xt_tcpudp.h>
 
 #include <libmnl/libmnl.h>
 #include <libnftnl/gen.h>
@@ -134,26 +144,86 @@ static void mnl_batch_reset(struct nftnl_batch *batch)
 	nftnl_batch_free(batch);
 }
 
+#define NFT_ARENA_CHUNK_SIZE	(64 * 1024)
+
+struct nft_arena_chunk {
+	struct nft_arena_chunk	*next;
+	size_t			size;
+	size_t			used;
+	char			data[] __attribute__((aligned(sizeof(void *))));
+};
+
+/* Return zeroed memory that lives until nft_arena_release(). */
+static void *nft_arena_alloc(struct nft_arena *a, size_t size)
+{
+	struct nft_arena_chunk *chunk = a->chunks;
+	size_t chunk_size;
+	void *ptr;
+
+	size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	if (chunk == NULL || chunk->size - chunk->used < size) {
+		chunk_size = NFT_ARENA_CHUNK_SIZE;
+		if (size > chunk_size)
+			chunk_size = size;
+
+		chunk = malloc(sizeof(*chunk) + chunk_size);
+		if (chunk == NULL)
+			return NULL;
+
+		chunk->size = chunk_size;
+		chunk->used = 0;
+		chunk->next = a->chunks;
+		a->chunks = chunk;
+		a->chunk_allocs++;
+	}
+
+	ptr = chunk->data + chunk->used;
+	chunk->used += size;
+	memset(ptr, 0, size);
+
+	a->allocs++;
+	a->used += size;
+	if (a->used > a->high_water)
+		a->high_water = a->used;
+
+	return ptr;
+}
+
+static void nft_arena_release(struct nft_arena *a)
+{
+	struct nft_arena_chunk *chunk, *next;
+
+	for (chunk = a->chunks; chunk; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	a->chunks = NULL;
+	a->used = 0;
+}
+
 struct mnl_err {
 	struct list_head	head;
 	int			err;
 	uint32_t		seqnum;
 };
 
-static void mnl_err_list_node_add(struct list_head *err_list, int error,
+static void mnl_err_list_node_add(struct nft_handle *h, int error,
 				  int seqnum)
 {
-	struct mnl_err *err = malloc(sizeof(struct mnl_err));
+	struct mnl_err *err = nft_arena_alloc(&h->arena, sizeof(struct mnl_err));
+
+	if (err == NULL)
+		return;
 
 	err->seqnum = seqnum;
 	err->err = error;
-	list_add_tail(&err->head, err_list);
+	list_add_tail(&err->head, &h->err_list);
 }
 
 static void mnl_err_list_free(struct mnl_err *err)
 {
 	list_del(&err->head);
-	free(err);
 }
 
 static void mnl_set_sndbuffer(struct nft_handle *h)
@@ -171,9 +241,12 @@ static void mnl_set_sndbuffer(struct nft_handle *h)
 	h->nlsndbuffsiz = newbuffsiz;
 }
 
+/* Without NETLINK_CAP_ACK, each error message echoes the full request. */
+#define NFT_NLMSG_ERRSIZE(h) ((h)->nlcapack ? getpagesize() / 4 : getpagesize())
+
 static void mnl_set_rcvbuffer(struct nft_handle *h, int numcmds)
 {
-	int newbuffsiz = getpagesize() * numcmds;
+	int newbuffsiz = NFT_NLMSG_ERRSIZE(h) * numcmds;
 
 	if (newbuffsiz <= h->nlrcvbuffsiz)
 		return;
@@ -192,13 +265,19 @@ static ssize_t mnl_nft_socket_sendmsg(struct nft_handle *h, int numcmds)
 		.nl_family = AF_NETLINK
 	};
 	uint32_t iov_len = nftnl_batch_iovec_len(h->batch);
-	struct iovec iov[iov_len];
 	struct msghdr msg = {
 		.msg_name	= (struct sockaddr *) &snl,
 		.msg_namelen	= sizeof(snl),
-		.msg_iov	= iov,
 		.msg_iovlen	= iov_len,
 	};
+	struct iovec *iov;
+
+	/* One iovec per batch page, too many for the stack on huge batches. */
+	iov = nft_arena_alloc(&h->arena, iov_len * sizeof(struct iovec));
+	if (iov == NULL)
+		return -1;
+
+	msg.msg_iov = iov;
 
 	mnl_set_sndbuffer(h);
 	mnl_set_rcvbuffer(h, numcmds);
@@ -207,52 +286,95 @@ static ssize_t mnl_nft_socket_sendmsg(struct nft_handle *h, int numcmds)
 	return sendmsg(mnl_socket_get_fd(h->nl), &msg, 0);
 }
 
+/* Number of acknowledgments read per recvmmsg() call. */
+#define NFT_ACK_RING_SIZE	16
+
+struct mnl_ack_ring {
+	struct sockaddr_nl	addr[NFT_ACK_RING_SIZE];
+	struct iovec		iov[NFT_ACK_RING_SIZE];
+	struct mmsghdr		msgs[NFT_ACK_RING_SIZE];
+	char			buf[];
+};
+
+#define mnl_ack_ring_buf(ring, i) \
+	((ring)->buf + (i) * MNL_SOCKET_BUFFER_SIZE)
+
+static void mnl_ack_ring_reset(struct mnl_ack_ring *ring)
+{
+	int i;
+
+	for (i = 0; i < NFT_ACK_RING_SIZE; i++) {
+		ring->iov[i].iov_base = mnl_ack_ring_buf(ring, i);
+		ring->iov[i].iov_len = MNL_SOCKET_BUFFER_SIZE;
+		ring->msgs[i].msg_hdr = (struct msghdr) {
+			.msg_name	= &ring->addr[i],
+			.msg_namelen	= sizeof(struct sockaddr_nl),
+			.msg_iov	= &ring->iov[i],
+			.msg_iovlen	= 1,
+		};
+		ring->msgs[i].msg_len = 0;
+	}
+}
+
 static int mnl_batch_talk(struct nft_handle *h, int numcmds)
 {
 	const struct mnl_socket *nl = h->nl;
 	int ret, fd = mnl_socket_get_fd(nl), portid = mnl_socket_get_portid(nl);
-	char rcv_buf[MNL_SOCKET_BUFFER_SIZE];
-	fd_set readfds;
-	struct timeval tv = {
-		.tv_sec		= 0,
-		.tv_usec	= 0
-	};
-	int err = 0;
+	struct mnl_ack_ring *ring;
+	int i, err = 0, saved_errno = 0;
 
 	ret = mnl_nft_socket_sendmsg(h, numcmds);
 	if (ret == -1)
 		return -1;
 
-	FD_ZERO(&readfds);
-	FD_SET(fd, &readfds);
-
-	/* receive and digest all the acknowledgments from the kernel. */
-	ret = select(fd+1, &readfds, NULL, NULL, &tv);
-	if (ret == -1)
+	ring = nft_arena_alloc(&h->arena, sizeof(*ring) +
+			       NFT_ACK_RING_SIZE * MNL_SOCKET_BUFFER_SIZE);
+	if (ring == NULL)
 		return -1;
 
-	while (ret > 0 && FD_ISSET(fd, &readfds)) {
-		struct nlmsghdr *nlh = (struct nlmsghdr *)rcv_buf;
-
-		ret = mnl_socket_recvfrom(nl, rcv_buf, sizeof(rcv_buf));
-		if (ret == -1)
-			return -1;
+	/* The kernel processes the batch from within sendmsg(), so all the
+	 * acknowledgments are already queued at this point. Receive and
+	 * digest them in bulk until the socket is empty.
+	 */
+	do {
+		mnl_ack_ring_reset(ring);
 
-		ret = mnl_cb_run(rcv_buf, ret, 0, portid, NULL, NULL);
-		/* Continue on error, make sure we get all acknowledgments */
+		ret = recvmmsg(fd, ring->msgs, NFT_ACK_RING_SIZE,
+			       MSG_DONTWAIT, NULL);
 		if (ret == -1) {
-			mnl_err_list_node_add(&h->err_list, errno,
-					      nlh->nlmsg_seq);
-			err = -1;
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
 		}
 
-		ret = select(fd+1, &readfds, NULL, NULL, &tv);
-		if (ret == -1)
-			return -1;
+		for (i = 0; i < ret; i++) {
+			char *buf = mnl_ack_ring_buf(ring, i);
+			struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+			struct msghdr *msg = &ring->msgs[i].msg_hdr;
 
-		FD_ZERO(&readfds);
-		FD_SET(fd, &readfds);
-	}
+			if (msg->msg_flags & MSG_TRUNC) {
+				errno = ENOSPC;
+				return -1;
+			}
+			if (ring->addr[i].nl_pid != 0)
+				continue;
+
+			/* Continue on error, make sure we get all
+			 * acknowledgments.
+			 */
+			if (mnl_cb_run(buf, ring->msgs[i].msg_len, 0,
+				       portid, NULL, NULL) == -1) {
+				saved_errno = errno;
+				mnl_err_list_node_add(h, errno,
+						      nlh->nlmsg_seq);
+				err = -1;
+			}
+		}
+	} while (ret == -1 || ret == NFT_ACK_RING_SIZE);
+
+	errno = saved_errno;
 	return err;
 }
 
@@ -284,6 +406,7 @@ struct obj_update {
 	enum obj_update_type	type:8;
 	uint8_t			skip:1;
 	uint8_t			implicit:1;
+	uint8_t			diff:1;		/* changed by nft_diff() */
 	unsigned int		seq;
 	union {
 		struct nftnl_table	*table;
@@ -297,6 +420,42 @@ struct obj_update {
 	} error;
 };
 
+/* Record that sequence number @seq was sent for object @n, so kernel errors
+ * can be attributed with a direct lookup. If several objects share a
+ * sequence number, the first one wins.
+ */
+static void nft_action_seq_add(struct nft_handle *h, uint32_t seq,
+			       struct obj_update *n)
+{
+	struct obj_update **obj_seq;
+	uint32_t size;
+
+	if (seq >= h->obj_seq_size) {
+		size = h->obj_seq_size ? h->obj_seq_size : h->obj_list_num + 2;
+		while (size <= seq)
+			size *= 2;
+
+		obj_seq = realloc(h->obj_seq, size * sizeof(*obj_seq));
+		if (obj_seq == NULL)
+			xtables_error(OTHER_PROBLEM, "Can't allocate memory");
+
+		memset(obj_seq + h->obj_seq_size, 0,
+		       (size - h->obj_seq_size) * sizeof(*obj_seq));
+		h->obj_seq = obj_seq;
+		h->obj_seq_size = size;
+	}
+
+	if (!h->obj_seq[seq])
+		h->obj_seq[seq] = n;
+}
+
+static void nft_action_seq_reset(struct nft_handle *h)
+{
+	free(h->obj_seq);
+	h->obj_seq = NULL;
+	h->obj_seq_size = 0;
+}
+
 static int mnl_append_error(const struct nft_handle *h,
 			    const struct obj_update *o,
 			    const struct mnl_err *err,
@@ -371,7 +530,7 @@ static struct obj_update *batch_add(struct nft_handle *h, enum obj_update_type t
 {
 	struct obj_update *obj;
 
-	obj = calloc(1, sizeof(struct obj_update));
+	obj = nft_arena_alloc(&h->arena, sizeof(struct obj_update));
 	if (obj == NULL)
 		return NULL;
 
@@ -398,6 +557,21 @@ batch_set_add(struct nft_handle *h, enum obj_update_type type,
 	return batch_add(h, type, s);
 }
 
+/* Look up an anonymous set added in this transaction by its set ID. */
+struct nftnl_set *nft_set_batch_lookup_byid(struct nft_handle *h,
+					    uint32_t set_id)
+{
+	struct obj_update *n;
+
+	list_for_each_entry(n, &h->obj_list, head) {
+		if (n->type != NFT_COMPAT_SET_ADD)
+			continue;
+		if (nftnl_set_get_u32(n->set, NFTNL_SET_ID) == set_id)
+			return n->set;
+	}
+	return NULL;
+}
+
 static int batch_chain_add(struct nft_handle *h, enum obj_update_type type,
 			   struct nftnl_chain *c)
 {
@@ -771,6 +945,22 @@ static bool nft_chain_builtin(struct nftnl_chain *c)
 	return nftnl_chain_get(c, NFTNL_CHAIN_HOOKNUM) != NULL;
 }
 
+/* From linux/netlink.h */
+#ifndef NETLINK_CAP_ACK
+#define NETLINK_CAP_ACK	10
+#endif
+
+/* Errors are matched by sequence number only, don't let the kernel copy
+ * the failing request into the error message.
+ */
+static void mnl_set_cap_ack(struct nft_handle *h)
+{
+	int one = 1;
+
+	h->nlcapack = mnl_socket_setsockopt(h->nl, NETLINK_CAP_ACK,
+					    &one, sizeof(one)) == 0;
+}
+
 int nft_restart(struct nft_handle *h)
 {
 	mnl_socket_close(h->nl);
@@ -785,6 +975,7 @@ int nft_restart(struct nft_handle *h)
 	h->portid = mnl_socket_get_portid(h->nl);
 	h->nlsndbuffsiz = 0;
 	h->nlrcvbuffsiz = 0;
+	mnl_set_cap_ack(h);
 
 	return 0;
 }
@@ -807,9 +998,11 @@ int nft_init(struct nft_handle *h, int family, const struct builtin_table *t)
 		xtables_error(PARAMETER_PROBLEM, "Unknown family");
 
 	h->portid = mnl_socket_get_portid(h->nl);
+	mnl_set_cap_ack(h);
 	h->tables = t;
 	h->cache = &h->__cache[0];
 	h->family = family;
+	h->native_sets = getenv("XTABLES_NATIVE_SETS") != NULL;
 
 	INIT_LIST_HEAD(&h->obj_list);
 	INIT_LIST_HEAD(&h->err_list);
@@ -817,10 +1010,20 @@ int nft_init(struct nft_handle *h, int family, const struct builtin_table *t)
 	return 0;
 }
 
+void nft_print_stats(struct nft_handle *h)
+{
+	nft_cache_print_stats(h);
+	fprintf(stderr, "transaction arena: %u allocation(s) in %u chunk(s), "
+		"%zu bytes high-water mark\n", h->arena.allocs,
+		h->arena.chunk_allocs, h->arena.high_water);
+}
+
 void nft_fini(struct nft_handle *h)
 {
 	flush_chain_cache(h, NULL);
 	mnl_socket_close(h->nl);
+	nft_action_seq_reset(h);
+	nft_arena_release(&h->arena);
 }
 
 static void nft_chain_print_debug(struct nftnl_chain *c, struct nlmsghdr *nlh)
@@ -951,11 +1154,13 @@ static int add_nft_limit(struct nftnl_rule *r, struct xt_entry_match *m)
 	return 0;
 }
 
+/* IDs of sets added in a transaction, for lookups to refer to them */
+static uint32_t nft_set_id;
+
 static struct nftnl_set *add_anon_set(struct nft_handle *h, const char *table,
 				      uint32_t flags, uint32_t key_type,
 				      uint32_t key_len, uint32_t size)
 {
-	static uint32_t set_id = 0;
 	struct nftnl_set *s;
 
 	s = nftnl_set_alloc();
@@ -965,7 +1170,7 @@ static struct nftnl_set *add_anon_set(struct nft_handle *h, const char *table,
 	nftnl_set_set_u32(s, NFTNL_SET_FAMILY, h->family);
 	nftnl_set_set_str(s, NFTNL_SET_TABLE, table);
 	nftnl_set_set_str(s, NFTNL_SET_NAME, "__set%d");
-	nftnl_set_set_u32(s, NFTNL_SET_ID, ++set_id);
+	nftnl_set_set_u32(s, NFTNL_SET_ID, ++nft_set_id);
 	nftnl_set_set_u32(s, NFTNL_SET_FLAGS,
 			  NFT_SET_ANONYMOUS | NFT_SET_CONSTANT | flags);
 	nftnl_set_set_u32(s, NFTNL_SET_KEY_TYPE, key_type);
@@ -1010,8 +1215,14 @@ gen_lookup(uint32_t sreg, const char *set_name, uint32_t set_id, uint32_t flags)
 #define CONCAT_TYPE_BITS	6
 
 /* from nftables:include/datatype.h, enum datatypes */
+#define NFT_DATATYPE_INTEGER	4
 #define NFT_DATATYPE_IPADDR	7
+#define NFT_DATATYPE_IP6ADDR	8
 #define NFT_DATATYPE_ETHERADDR	9
+#define NFT_DATATYPE_INET_PROTOCOL	12
+#define NFT_DATATYPE_INET_SERVICE	13
+#define NFT_DATATYPE_MARK	19
+#define NFT_DATATYPE_IFNAME	41
 
 static int __add_nft_among(struct nft_handle *h, const char *table,
 			   struct nftnl_rule *r, struct nft_among_pair *pairs,
@@ -1116,1861 +1327,5344 @@ static int add_nft_among(struct nft_handle *h,
 	return 0;
 }
 
-int add_match(struct nft_handle *h,
-	      struct nftnl_rule *r, struct xt_entry_match *m)
+static bool nft_addr_ranges_interval(const struct nft_addr_range *r,
+				     unsigned int n, unsigned int len)
 {
-	struct nftnl_expr *expr;
-	int ret;
+	unsigned int i;
 
-	if (!strcmp(m->u.user.name, "limit"))
-		return add_nft_limit(r, m);
-	else if (!strcmp(m->u.user.name, "among"))
-		return add_nft_among(h, r, m);
+	for (i = 0; i < n; i++) {
+		if (memcmp(r[i].from, r[i].to, len))
+			return true;
+	}
+	return false;
+}
 
-	expr = nftnl_expr_alloc("match");
-	if (expr == NULL)
+static int add_addr_list_elem(struct nftnl_set *s, const void *key,
+			      const void *key_end, uint32_t len, uint32_t flags)
+{
+	struct nftnl_set_elem *elem = nftnl_set_elem_alloc();
+
+	if (!elem)
 		return -ENOMEM;
+	nftnl_set_elem_set(elem, NFTNL_SET_ELEM_KEY, key, len);
+	if (key_end)
+		nftnl_set_elem_set(elem, NFTNL_SET_ELEM_KEY_END, key_end, len);
+	if (flags)
+		nftnl_set_elem_set_u32(elem, NFTNL_SET_ELEM_FLAGS, flags);
+	nftnl_set_elem_add(s, elem);
+	return 0;
+}
 
-	ret = __add_match(expr, m);
-	nftnl_rule_add_expr(r, expr);
+/* Elements of a set on a single address. An interval set holds the start of
+ * each range and the first address after it, if any.
+ */
+static int add_addr_list_ranges(struct nftnl_set *s,
+				const struct nft_addr_range *r,
+				unsigned int n, unsigned int len, bool interval)
+{
+	uint8_t end[16];
+	unsigned int i;
 
-	return ret;
+	for (i = 0; i < n; i++) {
+		if (add_addr_list_elem(s, r[i].from, NULL, len, 0) < 0)
+			return -ENOMEM;
+		memcpy(end, r[i].to, len);
+		if (interval && nft_addr_inc(end, len) &&
+		    add_addr_list_elem(s, end, NULL, len,
+				       NFT_SET_ELEM_INTERVAL_END) < 0)
+			return -ENOMEM;
+	}
+	return 0;
 }
 
-static int __add_target(struct nftnl_expr *e, struct xt_entry_target *t)
+/* Elements of a set on source and destination address concatenated, one per
+ * pair of ranges. Intervals of concatenations need a kernel with the pipapo
+ * set backend, Linux 5.6 or later.
+ */
+static int add_addr_list_pairs(struct nftnl_set *s,
+			       const struct nft_addr_range *sr, unsigned int ns,
+			       const struct nft_addr_range *dr, unsigned int nd,
+			       unsigned int len, bool interval)
 {
-	void *info;
+	uint8_t key[32], key_end[32];
+	unsigned int i, j;
+
+	for (i = 0; i < ns; i++) {
+		for (j = 0; j < nd; j++) {
+			memcpy(key, sr[i].from, len);
+			memcpy(key + len, dr[j].from, len);
+			memcpy(key_end, sr[i].to, len);
+			memcpy(key_end + len, dr[j].to, len);
+			if (add_addr_list_elem(s, key,
+					       interval ? key_end : NULL,
+					       2 * len, 0) < 0)
+				return -ENOMEM;
+		}
+	}
+	return 0;
+}
 
-	nftnl_expr_set(e, NFTNL_EXPR_TG_NAME, t->u.user.name,
-			  strlen(t->u.user.name));
-	nftnl_expr_set_u32(e, NFTNL_EXPR_TG_REV, t->u.user.revision);
+static int __add_addr_list(struct nft_handle *h, struct nftnl_rule *r,
+			   struct nft_addr_range *sr, unsigned int ns,
+			   struct nft_addr_range *dr, unsigned int nd)
+{
+	const char *table = nftnl_rule_get(r, NFTNL_RULE_TABLE);
+	uint32_t len, type, key_len, size, flags = 0, set_id = 0;
+	uint32_t saddr, daddr;
+	struct nftnl_expr *e;
+	struct nftnl_set *s;
+	bool interval;
 
-	info = calloc(1, t->u.target_size);
-	if (info == NULL)
-		return -ENOMEM;
+	if (h->family == NFPROTO_IPV4) {
+		len = sizeof(struct in_addr);
+		type = NFT_DATATYPE_IPADDR;
+		saddr = offsetof(struct iphdr, saddr);
+		daddr = offsetof(struct iphdr, daddr);
+	} else {
+		len = sizeof(struct in6_addr);
+		type = NFT_DATATYPE_IP6ADDR;
+		saddr = offsetof(struct ip6_hdr, ip6_src);
+		daddr = offsetof(struct ip6_hdr, ip6_dst);
+	}
 
-	memcpy(info, t->data, t->u.target_size - sizeof(*t));
-	nftnl_expr_set(e, NFTNL_EXPR_TG_INFO, info, t->u.target_size - sizeof(*t));
+	interval = nft_addr_ranges_interval(sr, ns, len) ||
+		   nft_addr_ranges_interval(dr, nd, len);
+	if (interval)
+		flags = NFT_SET_INTERVAL;
 
-	return 0;
-}
+	/* Set contents are not part of the rule, no set for a lookup. */
+	if (h->rule_needle)
+		goto add_lookup;
 
-static int add_meta_nftrace(struct nftnl_rule *r)
-{
-	struct nftnl_expr *expr;
+	if (ns && nd) {
+		type = type << CONCAT_TYPE_BITS | type;
+		key_len = 2 * len;
+		size = ns * nd;
+	} else {
+		key_len = len;
+		size = (ns + nd) * (interval ? 2 : 1);
+	}
 
-	expr = nftnl_expr_alloc("immediate");
-	if (expr == NULL)
+	s = add_anon_set(h, table, flags, type, key_len, size);
+	if (!s)
 		return -ENOMEM;
+	set_id = nftnl_set_get_u32(s, NFTNL_SET_ID);
 
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_DREG, NFT_REG32_01);
-	nftnl_expr_set_u8(expr, NFTNL_EXPR_IMM_DATA, 1);
-	nftnl_rule_add_expr(r, expr);
+	if (ns && nd) {
+		if (interval) {
+			uint8_t field_len[2] = { len, len };
 
-	expr = nftnl_expr_alloc("meta");
-	if (expr == NULL)
+			nftnl_set_set_data(s, NFTNL_SET_DESC_CONCAT,
+					   field_len, sizeof(field_len));
+		}
+		if (add_addr_list_pairs(s, sr, ns, dr, nd, len, interval) < 0)
+			return -ENOMEM;
+	} else {
+		if (add_addr_list_ranges(s, ns ? sr : dr, ns + nd, len,
+					 interval) < 0)
+			return -ENOMEM;
+	}
+add_lookup:
+	if (ns) {
+		e = gen_payload(NFT_PAYLOAD_NETWORK_HEADER, saddr, len,
+				NFT_REG_1);
+		if (!e)
+			return -ENOMEM;
+		nftnl_rule_add_expr(r, e);
+	}
+	if (nd) {
+		e = gen_payload(NFT_PAYLOAD_NETWORK_HEADER, daddr, len,
+				ns ? NFT_REG32_00 + len / sizeof(uint32_t) :
+				     NFT_REG_1);
+		if (!e)
+			return -ENOMEM;
+		nftnl_rule_add_expr(r, e);
+	}
+
+	e = gen_lookup(NFT_REG_1, "__set%d", set_id, 0);
+	if (!e)
 		return -ENOMEM;
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_KEY, NFT_META_NFTRACE);
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_SREG, NFT_REG32_01);
+	nftnl_rule_add_expr(r, e);
 
-	nftnl_rule_add_expr(r, expr);
 	return 0;
 }
 
-int add_target(struct nftnl_rule *r, struct xt_entry_target *t)
+/* Match on lists of source and/or destination addresses with a single
+ * lookup, in a set on both addresses concatenated if there are two lists.
+ */
+int add_addr_list(struct nft_handle *h, struct nftnl_rule *r,
+		  const struct addr_mask *s, const struct addr_mask *d)
 {
-	struct nftnl_expr *expr;
+	unsigned int ns = 0, nd = 0, len = h->family == NFPROTO_IPV4 ?
+			  sizeof(struct in_addr) : sizeof(struct in6_addr);
+	struct nft_addr_range *sr = NULL, *dr = NULL;
 	int ret;
 
-	if (strcmp(t->u.user.name, "TRACE") == 0)
-		return add_meta_nftrace(r);
-
-	expr = nftnl_expr_alloc("target");
-	if (expr == NULL)
-		return -ENOMEM;
+	if (s)
+		ns = nft_addr_list_ranges(s, len, &sr);
+	if (d)
+		nd = nft_addr_list_ranges(d, len, &dr);
 
-	ret = __add_target(expr, t);
-	nftnl_rule_add_expr(r, expr);
+	ret = __add_addr_list(h, r, sr, ns, dr, nd);
 
+	free(sr);
+	free(dr);
 	return ret;
 }
 
-int add_jumpto(struct nftnl_rule *r, const char *name, int verdict)
+/* Port matches are only translated for iptables and ip6tables. The port
+ * expressions load from the transport header whatever the protocol, so the
+ * rule must be given the one the match checks for (-p) and not inverted,
+ * else the match is kept. Returns that protocol, 0 if there is none.
+ */
+static uint8_t nft_native_ports(struct nft_handle *h,
+				const struct nftnl_rule *r)
 {
-	struct nftnl_expr *expr;
-
-	expr = nftnl_expr_alloc("immediate");
-	if (expr == NULL)
-		return -ENOMEM;
+	if (h->family != NFPROTO_IPV4 && h->family != NFPROTO_IPV6)
+		return 0;
 
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_DREG, NFT_REG_VERDICT);
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_VERDICT, verdict);
-	nftnl_expr_set_str(expr, NFTNL_EXPR_IMM_CHAIN, (char *)name);
-	nftnl_rule_add_expr(r, expr);
+	if (!nftnl_rule_is_set(r, NFTNL_RULE_COMPAT_PROTO) ||
+	    nftnl_rule_get_u32(r, NFTNL_RULE_COMPAT_FLAGS) &
+	    NFT_RULE_COMPAT_F_INV)
+		return 0;
 
-	return 0;
+	return nftnl_rule_get_u32(r, NFTNL_RULE_COMPAT_PROTO);
 }
 
-int add_verdict(struct nftnl_rule *r, int verdict)
+/* Whether @r ends in the port expressions of a translated tcp or udp match.
+ * The ones of a match following right after would be decoded into the same
+ * match, so that one is kept.
+ */
+static bool nft_rule_ends_in_port(struct nftnl_rule *r)
 {
-	struct nftnl_expr *expr;
+	struct nftnl_expr *e, *prev = NULL, *last = NULL;
+	struct nftnl_expr_iter *iter;
 
-	expr = nftnl_expr_alloc("immediate");
-	if (expr == NULL)
-		return -ENOMEM;
+	iter = nftnl_expr_iter_create(r);
+	if (!iter)
+		return true;
+	while ((e = nftnl_expr_iter_next(iter))) {
+		prev = last;
+		last = e;
+	}
+	nftnl_expr_iter_destroy(iter);
 
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_DREG, NFT_REG_VERDICT);
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_VERDICT, verdict);
-	nftnl_rule_add_expr(r, expr);
+	if (!prev ||
+	    strcmp(nftnl_expr_get_str(prev, NFTNL_EXPR_NAME), "payload") ||
+	    nftnl_expr_get_u32(prev, NFTNL_EXPR_PAYLOAD_BASE) !=
+	    NFT_PAYLOAD_TRANSPORT_HEADER)
+		return false;
 
-	return 0;
+	return !strcmp(nftnl_expr_get_str(last, NFTNL_EXPR_NAME), "cmp") ||
+	       !strcmp(nftnl_expr_get_str(last, NFTNL_EXPR_NAME), "range");
 }
 
-int add_action(struct nftnl_rule *r, struct iptables_command_state *cs,
-	       bool goto_set)
+static bool nft_port_any(const uint16_t *pts, bool inv)
 {
-       int ret = 0;
-
-       /* If no target at all, add nothing (default to continue) */
-       if (cs->target != NULL) {
-	       /* Standard target? */
-	       if (strcmp(cs->jumpto, XTC_LABEL_ACCEPT) == 0)
-		       ret = add_verdict(r, NF_ACCEPT);
-	       else if (strcmp(cs->jumpto, XTC_LABEL_DROP) == 0)
-		       ret = add_verdict(r, NF_DROP);
-	       else if (strcmp(cs->jumpto, XTC_LABEL_RETURN) == 0)
-		       ret = add_verdict(r, NFT_RETURN);
-	       else
-		       ret = add_target(r, cs->target->t);
-       } else if (strlen(cs->jumpto) > 0) {
-	       /* Not standard, then it's a go / jump to chain */
-	       if (goto_set)
-		       ret = add_jumpto(r, cs->jumpto, NFT_GOTO);
-	       else
-		       ret = add_jumpto(r, cs->jumpto, NFT_JUMP);
-       }
-       return ret;
+	return pts[0] == 0 && pts[1] == UINT16_MAX && !inv;
 }
 
-static void nft_rule_print_debug(struct nftnl_rule *r, struct nlmsghdr *nlh)
+static void add_nft_port(struct nftnl_rule *r, int offset,
+			 const uint16_t *pts, bool inv)
 {
-#ifdef NLDEBUG
-	char tmp[1024];
+	uint16_t from = htons(pts[0]), to = htons(pts[1]);
 
-	nftnl_rule_snprintf(tmp, sizeof(tmp), r, 0, 0);
-	printf("DEBUG: rule: %s\n", tmp);
-	mnl_nlmsg_fprintf(stdout, nlh, nlh->nlmsg_len, sizeof(struct nfgenmsg));
-#endif
+	if (nft_port_any(pts, inv))
+		return;
+
+	add_payload(r, offset, sizeof(uint16_t), NFT_PAYLOAD_TRANSPORT_HEADER);
+	if (pts[0] == pts[1])
+		add_cmp_u16(r, from, inv ? NFT_CMP_NEQ : NFT_CMP_EQ);
+	else
+		add_range(r, inv ? NFT_RANGE_NEQ : NFT_RANGE_EQ,
+			  &from, &to, sizeof(from));
 }
 
-int add_counters(struct nftnl_rule *r, uint64_t packets, uint64_t bytes)
+/* Only port matching is translated, a match without ports is kept as is so
+ * it is listed as given.
+ */
+static bool nft_tcp_native(struct nft_handle *h, struct nftnl_rule *r,
+			   struct xt_entry_match *m)
 {
-	struct nftnl_expr *expr;
+	const struct xt_tcp *tcp = (const void *)m->data;
 
-	expr = nftnl_expr_alloc("counter");
-	if (expr == NULL)
-		return -ENOMEM;
+	if (nft_native_ports(h, r) != IPPROTO_TCP ||
+	    nft_rule_ends_in_port(r) || tcp->option || tcp->flg_mask ||
+	    tcp->invflags & ~(XT_TCP_INV_SRCPT | XT_TCP_INV_DSTPT))
+		return false;
 
-	nftnl_expr_set_u64(expr, NFTNL_EXPR_CTR_PACKETS, packets);
-	nftnl_expr_set_u64(expr, NFTNL_EXPR_CTR_BYTES, bytes);
+	return !nft_port_any(tcp->spts, tcp->invflags & XT_TCP_INV_SRCPT) ||
+	       !nft_port_any(tcp->dpts, tcp->invflags & XT_TCP_INV_DSTPT);
+}
 
-	nftnl_rule_add_expr(r, expr);
+static int add_nft_tcp(struct nftnl_rule *r, struct xt_entry_match *m)
+{
+	const struct xt_tcp *tcp = (const void *)m->data;
 
+	add_nft_port(r, NFT_TH_SPORT_OFFSET, tcp->spts,
+		     tcp->invflags & XT_TCP_INV_SRCPT);
+	add_nft_port(r, NFT_TH_DPORT_OFFSET, tcp->dpts,
+		     tcp->invflags & XT_TCP_INV_DSTPT);
 	return 0;
 }
 
-enum udata_type {
-	UDATA_TYPE_COMMENT,
-	UDATA_TYPE_EBTABLES_POLICY,
-	__UDATA_TYPE_MAX,
-};
-#define UDATA_TYPE_MAX (__UDATA_TYPE_MAX - 1)
+static bool nft_udp_native(struct nft_handle *h, struct nftnl_rule *r,
+			   struct xt_entry_match *m)
+{
+	const struct xt_udp *udp = (const void *)m->data;
 
-static int parse_udata_cb(const struct nftnl_udata *attr, void *data)
+	if (nft_native_ports(h, r) != IPPROTO_UDP ||
+	    nft_rule_ends_in_port(r) ||
+	    udp->invflags & ~(XT_UDP_INV_SRCPT | XT_UDP_INV_DSTPT))
+		return false;
+
+	return !nft_port_any(udp->spts, udp->invflags & XT_UDP_INV_SRCPT) ||
+	       !nft_port_any(udp->dpts, udp->invflags & XT_UDP_INV_DSTPT);
+}
+
+static int add_nft_udp(struct nftnl_rule *r, struct xt_entry_match *m)
 {
-	unsigned char *value = nftnl_udata_get(attr);
-	uint8_t type = nftnl_udata_type(attr);
-	uint8_t len = nftnl_udata_len(attr);
-	const struct nftnl_udata **tb = data;
+	const struct xt_udp *udp = (const void *)m->data;
 
-	switch (type) {
-	case UDATA_TYPE_COMMENT:
-		if (value[len - 1] != '\0')
-			return -1;
-		break;
-	case UDATA_TYPE_EBTABLES_POLICY:
+	add_nft_port(r, NFT_TH_SPORT_OFFSET, udp->spts,
+		     udp->invflags & XT_UDP_INV_SRCPT);
+	add_nft_port(r, NFT_TH_DPORT_OFFSET, udp->dpts,
+		     udp->invflags & XT_UDP_INV_DSTPT);
+	return 0;
+}
+
+/* Source or destination port lists become a lookup in an anonymous set.
+ * Set elements are listed in no particular order and sorted when parsed
+ * back, so only lists given in ascending order are translated. Port ranges
+ * and matching either port are left to the multiport match.
+ */
+static bool nft_multiport_native(struct nft_handle *h, struct nftnl_rule *r,
+				 struct xt_entry_match *m)
+{
+	/* revision 0 and 1 share the leading fields */
+	const struct xt_multiport_v1 *mp = (const void *)m->data;
+	unsigned int i;
+
+	switch (nft_native_ports(h, r)) {
+	case IPPROTO_TCP:
+	case IPPROTO_UDP:
+	case IPPROTO_UDPLITE:
+	case IPPROTO_SCTP:
+	case IPPROTO_DCCP:
 		break;
 	default:
-		return 0;
+		return false;
 	}
-	tb[type] = attr;
-	return 0;
+
+	if (m->u.user.revision > 1)
+		return false;
+
+	if (mp->flags != XT_MULTIPORT_SOURCE &&
+	    mp->flags != XT_MULTIPORT_DESTINATION)
+		return false;
+
+	if (!mp->count || mp->count > XT_MULTI_PORTS)
+		return false;
+
+	for (i = 0; i < mp->count; i++) {
+		if (m->u.user.revision == 1 && mp->pflags[i])
+			return false;
+		if (i && mp->ports[i] <= mp->ports[i - 1])
+			return false;
+	}
+	return true;
 }
 
-char *get_comment(const void *data, uint32_t data_len)
+static int add_nft_multiport(struct nft_handle *h, struct nftnl_rule *r,
+			     struct xt_entry_match *m)
 {
-	const struct nftnl_udata *tb[UDATA_TYPE_MAX + 1] = {};
+	const struct xt_multiport_v1 *mp = (const void *)m->data;
+	const char *table = nftnl_rule_get(r, NFTNL_RULE_TABLE);
+	bool inv = m->u.user.revision == 1 && mp->invert;
+	struct nftnl_expr *e;
+	struct nftnl_set *s;
+	uint32_t set_id = 0;
+	int i;
 
-	if (nftnl_udata_parse(data, data_len, parse_udata_cb, tb) < 0)
-		return NULL;
+	/* Set contents are not part of the rule, no set for a lookup. */
+	if (h->rule_needle)
+		goto add_lookup;
 
-	if (!tb[UDATA_TYPE_COMMENT])
-		return NULL;
+	s = add_anon_set(h, table, 0, NFT_DATATYPE_INET_SERVICE,
+			 sizeof(uint16_t), mp->count);
+	if (!s)
+		return -ENOMEM;
+	set_id = nftnl_set_get_u32(s, NFTNL_SET_ID);
 
-	return nftnl_udata_get(tb[UDATA_TYPE_COMMENT]);
+	for (i = 0; i < mp->count; i++) {
+		struct nftnl_set_elem *elem = nftnl_set_elem_alloc();
+		uint16_t port = htons(mp->ports[i]);
+
+		if (!elem)
+			return -ENOMEM;
+		nftnl_set_elem_set(elem, NFTNL_SET_ELEM_KEY,
+				   &port, sizeof(port));
+		nftnl_set_elem_add(s, elem);
+	}
+add_lookup:
+	e = gen_payload(NFT_PAYLOAD_TRANSPORT_HEADER,
+			mp->flags == XT_MULTIPORT_SOURCE ?
+			NFT_TH_SPORT_OFFSET : NFT_TH_DPORT_OFFSET,
+			sizeof(uint16_t), NFT_REG_1);
+	if (!e)
+		return -ENOMEM;
+	nftnl_rule_add_expr(r, e);
+
+	e = gen_lookup(NFT_REG_1, "__set%d", set_id,
+		       inv ? NFT_LOOKUP_F_INV : 0);
+	if (!e)
+		return -ENOMEM;
+	nftnl_rule_add_expr(r, e);
+
+	return 0;
 }
 
-void add_compat(struct nftnl_rule *r, uint32_t proto, bool inv)
+/* Conntrack match criteria are ANDed, but packets without a conntrack entry
+ * (invalid and untracked ones) are only checked against the state: the
+ * match then succeeds if the state did, whereas any other ct expression
+ * breaks. So a state letting such packets through is only translated when
+ * it is the sole criterion. The SNAT and DNAT pseudo states have no ct state
+ * equivalent and expiry is matched in milliseconds, which limits its range.
+ */
+#define NFT_CONNTRACK_FLAGS	((XT_CONNTRACK_STATE_ALIAS << 1) - 1)
+#define NFT_CONNTRACK_STATES	(XT_CONNTRACK_STATE_INVALID | \
+				 XT_CONNTRACK_STATE_BIT(IP_CT_ESTABLISHED) | \
+				 XT_CONNTRACK_STATE_BIT(IP_CT_RELATED) | \
+				 XT_CONNTRACK_STATE_BIT(IP_CT_NEW) | \
+				 XT_CONNTRACK_STATE_UNTRACKED)
+#define NFT_CONNTRACK_EXPIRES_MAX	((UINT32_MAX - 999) / 1000)
+
+static bool nft_ct_addr_masked(const union nf_inet_addr *addr,
+			       const union nf_inet_addr *mask)
 {
-	nftnl_rule_set_u32(r, NFTNL_RULE_COMPAT_PROTO, proto);
-	nftnl_rule_set_u32(r, NFTNL_RULE_COMPAT_FLAGS,
-			      inv ? NFT_RULE_COMPAT_F_INV : 0);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(addr->all); i++) {
+		if (addr->all[i] & ~mask->all[i])
+			return false;
+	}
+	return true;
 }
 
-static struct nftnl_rule *
-nft_rule_new(struct nft_handle *h, const char *chain, const char *table,
-	     void *data)
+static bool nft_conntrack_native(struct nft_handle *h,
+				 struct xt_entry_match *m)
 {
-	struct nftnl_rule *r;
+	struct xt_conntrack_mtinfo3 info;
+	uint16_t flags;
 
-	r = nftnl_rule_alloc();
-	if (r == NULL)
-		return NULL;
+	if (h->family != NFPROTO_IPV4 && h->family != NFPROTO_IPV6)
+		return false;
+	if (m->u.user.revision < 1 || m->u.user.revision > 3)
+		return false;
 
-	nftnl_rule_set_u32(r, NFTNL_RULE_FAMILY, h->family);
-	nftnl_rule_set_str(r, NFTNL_RULE_TABLE, table);
-	nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, chain);
+	nft_conntrack_to_v3(&info, m);
+	flags = info.match_flags;
 
-	if (h->ops->add(h, r, data) < 0)
-		goto err;
+	if (!flags || flags & ~NFT_CONNTRACK_FLAGS ||
+	    info.invert_flags & ~flags)
+		return false;
 
-	return r;
-err:
-	nftnl_rule_free(r);
-	return NULL;
+	if (flags & XT_CONNTRACK_STATE) {
+		if (!info.state_mask ||
+		    info.state_mask & ~NFT_CONNTRACK_STATES)
+			return false;
+		if (flags & ~(XT_CONNTRACK_STATE | XT_CONNTRACK_STATE_ALIAS) &&
+		    (info.invert_flags & XT_CONNTRACK_STATE ||
+		     info.state_mask & (XT_CONNTRACK_STATE_INVALID |
+					XT_CONNTRACK_STATE_UNTRACKED)))
+			return false;
+	}
+	if (flags & XT_CONNTRACK_STATE_ALIAS &&
+	    flags != (XT_CONNTRACK_STATE | XT_CONNTRACK_STATE_ALIAS))
+		return false;
+
+	if (flags & XT_CONNTRACK_PROTO && info.l4proto > UINT8_MAX)
+		return false;
+
+	if ((flags & XT_CONNTRACK_ORIGSRC &&
+	     !nft_ct_addr_masked(&info.origsrc_addr, &info.origsrc_mask)) ||
+	    (flags & XT_CONNTRACK_ORIGDST &&
+	     !nft_ct_addr_masked(&info.origdst_addr, &info.origdst_mask)) ||
+	    (flags & XT_CONNTRACK_REPLSRC &&
+	     !nft_ct_addr_masked(&info.replsrc_addr, &info.replsrc_mask)) ||
+	    (flags & XT_CONNTRACK_REPLDST &&
+	     !nft_ct_addr_masked(&info.repldst_addr, &info.repldst_mask)))
+		return false;
+
+	if (flags & XT_CONNTRACK_EXPIRES &&
+	    (info.expires_min > info.expires_max ||
+	     info.expires_max > NFT_CONNTRACK_EXPIRES_MAX))
+		return false;
+
+	return info.origsrc_port <= info.origsrc_port_high &&
+	       info.origdst_port <= info.origdst_port_high &&
+	       info.replsrc_port <= info.replsrc_port_high &&
+	       info.repldst_port <= info.repldst_port_high;
 }
 
-static struct nftnl_chain *
-nft_chain_find(struct nft_handle *h, const char *table, const char *chain);
+static uint32_t nft_ct_state_mask(uint16_t state_mask)
+{
+	uint32_t mask = state_mask & ~XT_CONNTRACK_STATE_UNTRACKED;
 
-int
-nft_rule_append(struct nft_handle *h, const char *chain, const char *table,
-		void *data, struct nftnl_rule *ref, bool verbose)
+	if (state_mask & XT_CONNTRACK_STATE_UNTRACKED)
+		mask |= NFT_CT_STATE_UNTRACKED_BIT;
+	return mask;
+}
+
+static void add_nft_ct_addr(struct nftnl_rule *r, uint32_t key, int dir,
+			    const union nf_inet_addr *addr,
+			    const union nf_inet_addr *mask,
+			    size_t len, bool inv)
 {
-	struct nftnl_chain *c;
-	struct nftnl_rule *r;
-	int type;
+	const uint8_t *m = (const uint8_t *)mask;
+	int i;
 
-	nft_xt_builtin_init(h, table);
+	add_ct(r, key, dir);
 
-	/* Since ebtables user-defined chain policies are implemented as last
-	 * rule in nftables, rule cache is required here to treat them right. */
-	if (h->family == NFPROTO_BRIDGE) {
-		c = nft_chain_find(h, table, chain);
-		if (c && !nft_chain_builtin(c))
-			nft_build_cache(h, c);
+	for (i = 0; i < len; i++) {
+		if (m[i] != 0xff)
+			break;
 	}
 
-	nft_fn = nft_rule_append;
-
-	r = nft_rule_new(h, chain, table, data);
-	if (r == NULL)
-		return 0;
+	if (i != len)
+		add_bitwise(r, (uint8_t *)mask, len);
 
-	if (ref) {
-		nftnl_rule_set_u64(r, NFTNL_RULE_HANDLE,
-				   nftnl_rule_get_u64(ref, NFTNL_RULE_HANDLE));
-		type = NFT_COMPAT_RULE_REPLACE;
-	} else
-		type = NFT_COMPAT_RULE_APPEND;
+	add_cmp_ptr(r, inv ? NFT_CMP_NEQ : NFT_CMP_EQ, (void *)addr, len);
+}
 
-	if (batch_rule_add(h, type, r) == NULL) {
-		nftnl_rule_free(r);
-		return 0;
-	}
+static void add_nft_ct_port(struct nftnl_rule *r, uint32_t key, int dir,
+			    uint16_t low, uint16_t high, bool inv)
+{
+	uint16_t from = htons(low), to = htons(high);
 
-	if (verbose)
-		h->ops->print_rule(h, r, 0, FMT_PRINT_RULE);
+	add_ct(r, key, dir);
+	if (low == high)
+		add_cmp_u16(r, from, inv ? NFT_CMP_NEQ : NFT_CMP_EQ);
+	else
+		add_range(r, inv ? NFT_RANGE_NEQ : NFT_RANGE_EQ,
+			  &from, &to, sizeof(from));
+}
 
-	if (ref) {
-		nftnl_chain_rule_insert_at(r, ref);
-		nftnl_chain_rule_del(r);
-	} else {
-		c = nft_chain_find(h, table, chain);
-		if (!c) {
-			errno = ENOENT;
-			return 0;
-		}
-		nftnl_chain_rule_add_tail(r, c);
+/* Criteria are added in ascending order of their flags, which is how the
+ * ct expressions of one match are told apart from those of the next one.
+ */
+static int add_nft_conntrack(struct nft_handle *h, struct nftnl_rule *r,
+			     struct xt_entry_match *m)
+{
+	struct xt_conntrack_mtinfo3 info;
+	uint32_t mask, xor, from, to;
+	uint16_t flags, inv;
+	size_t len;
+
+	nft_conntrack_to_v3(&info, m);
+	flags = info.match_flags;
+	inv = info.invert_flags;
+	len = h->family == NFPROTO_IPV4 ? sizeof(struct in_addr) :
+					  sizeof(struct in6_addr);
+
+	if (flags & XT_CONNTRACK_STATE) {
+		/* the xor tells -m state from -m conntrack --ctstate */
+		mask = nft_ct_state_mask(info.state_mask);
+		xor = flags & XT_CONNTRACK_STATE_ALIAS ? 0 : mask;
+		add_ct(r, NFT_CT_STATE, -1);
+		add_bitwise_u32(r, mask, xor);
+		add_cmp_u32(r, xor, inv & XT_CONNTRACK_STATE ?
+				    NFT_CMP_EQ : NFT_CMP_NEQ);
+	}
+	if (flags & XT_CONNTRACK_PROTO) {
+		add_ct(r, NFT_CT_PROTOCOL, IP_CT_DIR_ORIGINAL);
+		add_cmp_u8(r, info.l4proto, inv & XT_CONNTRACK_PROTO ?
+					    NFT_CMP_NEQ : NFT_CMP_EQ);
+	}
+	if (flags & XT_CONNTRACK_ORIGSRC)
+		add_nft_ct_addr(r, NFT_CT_SRC, IP_CT_DIR_ORIGINAL,
+				&info.origsrc_addr, &info.origsrc_mask, len,
+				inv & XT_CONNTRACK_ORIGSRC);
+	if (flags & XT_CONNTRACK_ORIGDST)
+		add_nft_ct_addr(r, NFT_CT_DST, IP_CT_DIR_ORIGINAL,
+				&info.origdst_addr, &info.origdst_mask, len,
+				inv & XT_CONNTRACK_ORIGDST);
+	if (flags & XT_CONNTRACK_REPLSRC)
+		add_nft_ct_addr(r, NFT_CT_SRC, IP_CT_DIR_REPLY,
+				&info.replsrc_addr, &info.replsrc_mask, len,
+				inv & XT_CONNTRACK_REPLSRC);
+	if (flags & XT_CONNTRACK_REPLDST)
+		add_nft_ct_addr(r, NFT_CT_DST, IP_CT_DIR_REPLY,
+				&info.repldst_addr, &info.repldst_mask, len,
+				inv & XT_CONNTRACK_REPLDST);
+	if (flags & XT_CONNTRACK_STATUS) {
+		add_ct(r, NFT_CT_STATUS, -1);
+		add_bitwise_u32(r, info.status_mask, 0);
+		add_cmp_u32(r, 0, inv & XT_CONNTRACK_STATUS ?
+				  NFT_CMP_EQ : NFT_CMP_NEQ);
 	}
+	if (flags & XT_CONNTRACK_EXPIRES) {
+		/* milliseconds in host byte order, range compares bytes */
+		from = htonl(info.expires_min * 1000);
+		to = htonl(info.expires_max * 1000 + 999);
+		add_ct(r, NFT_CT_EXPIRATION, -1);
+		add_byteorder(r, NFT_BYTEORDER_HTON, sizeof(uint32_t),
+			      sizeof(uint32_t));
+		add_range(r, inv & XT_CONNTRACK_EXPIRES ?
+			     NFT_RANGE_NEQ : NFT_RANGE_EQ,
+			  &from, &to, sizeof(from));
+	}
+	if (flags & XT_CONNTRACK_ORIGSRC_PORT)
+		add_nft_ct_port(r, NFT_CT_PROTO_SRC, IP_CT_DIR_ORIGINAL,
+				info.origsrc_port, info.origsrc_port_high,
+				inv & XT_CONNTRACK_ORIGSRC_PORT);
+	if (flags & XT_CONNTRACK_ORIGDST_PORT)
+		add_nft_ct_port(r, NFT_CT_PROTO_DST, IP_CT_DIR_ORIGINAL,
+				info.origdst_port, info.origdst_port_high,
+				inv & XT_CONNTRACK_ORIGDST_PORT);
+	if (flags & XT_CONNTRACK_REPLSRC_PORT)
+		add_nft_ct_port(r, NFT_CT_PROTO_SRC, IP_CT_DIR_REPLY,
+				info.replsrc_port, info.replsrc_port_high,
+				inv & XT_CONNTRACK_REPLSRC_PORT);
+	if (flags & XT_CONNTRACK_REPLDST_PORT)
+		add_nft_ct_port(r, NFT_CT_PROTO_DST, IP_CT_DIR_REPLY,
+				info.repldst_port, info.repldst_port_high,
+				inv & XT_CONNTRACK_REPLDST_PORT);
+	if (flags & XT_CONNTRACK_DIRECTION) {
+		add_ct(r, NFT_CT_DIRECTION, -1);
+		add_cmp_u8(r, inv & XT_CONNTRACK_DIRECTION ?
+			      IP_CT_DIR_REPLY : IP_CT_DIR_ORIGINAL,
+			   NFT_CMP_EQ);
+	}
+	return 0;
+}
 
-	return 1;
+/* Mark and connmark matches compare (mark & mask) with the value, the
+ * latter fails without a conntrack entry whether inverted or not, which
+ * is what a ct expression does.
+ */
+static bool nft_mark_native(const struct xt_entry_match *m)
+{
+	/* xt_connmark_mtinfo1 is laid out the same */
+	const struct xt_mark_mtinfo1 *info = (const void *)m->data;
+
+	return m->u.user.revision == 1 && info->invert <= 1;
 }
 
-void
-nft_rule_print_save(struct nft_handle *h, const struct nftnl_rule *r,
-		    enum nft_rule_print type, unsigned int format)
+static int add_nft_mark(struct nftnl_rule *r, struct xt_entry_match *m,
+			bool ct)
 {
-	const char *chain = nftnl_rule_get_str(r, NFTNL_RULE_CHAIN);
-	struct iptables_command_state cs = {};
-	struct nft_family_ops *ops = h->ops;
+	const struct xt_mark_mtinfo1 *info = (const void *)m->data;
 
-	ops->rule_to_cs(h, r, &cs);
+	if (ct)
+		add_ct(r, NFT_CT_MARK, -1);
+	else
+		add_meta(r, NFT_META_MARK);
+	if (info->mask != UINT32_MAX)
+		add_bitwise_u32(r, info->mask, 0);
+	add_cmp_u32(r, info->mark, info->invert ? NFT_CMP_NEQ : NFT_CMP_EQ);
+	return 0;
+}
 
-	if (!(format & (FMT_NOCOUNTS | FMT_C_COUNTS)) && ops->save_counters)
-		ops->save_counters(&cs);
+/* With XTABLES_NATIVE_SETS, the set match and SET target use the nf_tables
+ * set named after the ipset in the rule's table instead of calling into
+ * ipset. The set is created on first use and seeded with the members of the
+ * ipset, later on it is maintained with nft. Rules still refer to ipsets by
+ * index, so the ipset has to stay around for the name.
+ */
+static bool nft_ipset_native(const struct nft_handle *h,
+			     const struct xt_set_info *info)
+{
+	return h->native_sets &&
+	       (h->family == NFPROTO_IPV4 || h->family == NFPROTO_IPV6) &&
+	       info->index != IPSET_INVALID_ID && info->dim == IPSET_DIM_ONE;
+}
 
-	/* print chain name */
-	switch(type) {
-	case NFT_RULE_APPEND:
-		printf("-A %s ", chain);
+static bool nft_set_match_native(const struct nft_handle *h,
+				 const struct xt_entry_match *m)
+{
+	const struct xt_set_info_match_v3 *v3 = (const void *)m->data;
+	const struct xt_set_info_match_v4 *v4 = (const void *)m->data;
+	const struct xt_set_info *info = (const void *)m->data;
+
+	switch (m->u.user.revision) {
+	case 1:
+	case 2:
 		break;
-	case NFT_RULE_DEL:
-		printf("-D %s ", chain);
+	case 3:
+		if (v3->flags || v3->packets.op || v3->bytes.op)
+			return false;
+		break;
+	case 4:
+		if (v4->flags || v4->packets.op || v4->bytes.op)
+			return false;
 		break;
+	default:
+		return false;
 	}
 
-	if (ops->save_rule)
-		ops->save_rule(&cs, format);
-
-	if (ops->clear_cs)
-		ops->clear_cs(&cs);
+	return nft_ipset_native(h, info) &&
+	       !(info->flags & ~(IPSET_INV_MATCH | IPSET_DIM_ONE_SRC));
 }
 
-static bool nft_rule_is_policy_rule(struct nftnl_rule *r)
+static bool nft_set_target_native(const struct nft_handle *h,
+				  const struct xt_entry_target *t)
 {
-	const struct nftnl_udata *tb[UDATA_TYPE_MAX + 1] = {};
-	const void *data;
-	uint32_t len;
-
-	if (!nftnl_rule_is_set(r, NFTNL_RULE_USERDATA))
-		return false;
-
-	data = nftnl_rule_get_data(r, NFTNL_RULE_USERDATA, &len);
-	if (nftnl_udata_parse(data, len, parse_udata_cb, tb) < 0)
-		return NULL;
+	const struct xt_set_info_target_v2 *v2 = (const void *)t->data;
+	const struct xt_set_info_target_v3 *v3 = (const void *)t->data;
+	const struct xt_set_info_target_v1 *info = (const void *)t->data;
 
-	if (!tb[UDATA_TYPE_EBTABLES_POLICY] ||
-	    nftnl_udata_get_u32(tb[UDATA_TYPE_EBTABLES_POLICY]) != 1)
+	switch (t->u.user.revision) {
+	case 1:
+		break;
+	case 2:
+		if (v2->flags || v2->timeout != UINT32_MAX)
+			return false;
+		break;
+	case 3:
+		if (v3->map_set.index != IPSET_INVALID_ID ||
+		    v3->flags || v3->timeout != UINT32_MAX)
+			return false;
+		break;
+	default:
 		return false;
+	}
 
-	return true;
+	return nft_ipset_native(h, &info->add_set) &&
+	       !(info->add_set.flags & ~IPSET_DIM_ONE_SRC) &&
+	       info->del_set.index == IPSET_INVALID_ID;
 }
 
-static struct nftnl_rule *nft_chain_last_rule(struct nftnl_chain *c)
+static uint32_t nft_ipset_key_len(const struct nft_handle *h)
 {
-	struct nftnl_rule *r = NULL, *last;
-	struct nftnl_rule_iter *iter;
-
-	iter = nftnl_rule_iter_create(c);
-	if (!iter)
-		return NULL;
+	return h->family == NFPROTO_IPV4 ? sizeof(struct in_addr) :
+					   sizeof(struct in6_addr);
+}
 
-	do {
-		last = r;
-		r = nftnl_rule_iter_next(iter);
-	} while (r);
-	nftnl_rule_iter_destroy(iter);
+static void add_nft_ipset_key(struct nft_handle *h, struct nftnl_rule *r,
+			      const struct xt_set_info *info)
+{
+	bool src = info->flags & IPSET_DIM_ONE_SRC;
 
-	return last;
+	if (h->family == NFPROTO_IPV4)
+		add_payload(r, src ? offsetof(struct iphdr, saddr) :
+				     offsetof(struct iphdr, daddr),
+			    sizeof(struct in_addr), NFT_PAYLOAD_NETWORK_HEADER);
+	else
+		add_payload(r, src ? offsetof(struct ip6_hdr, ip6_src) :
+				     offsetof(struct ip6_hdr, ip6_dst),
+			    sizeof(struct in6_addr), NFT_PAYLOAD_NETWORK_HEADER);
 }
 
-void nft_bridge_chain_postprocess(struct nft_handle *h,
-				  struct nftnl_chain *c)
+struct nft_ipset_import {
+	struct nftnl_set	*s;
+	uint32_t		len;
+	bool			typed;
+	bool			unsupported;
+};
+
+static void nft_ipset_import_elem(struct nft_ipset_import *imp,
+				  const struct nlattr *data)
 {
-	struct nftnl_rule *last = nft_chain_last_rule(c);
-	struct nftnl_expr_iter *iter;
-	struct nftnl_expr *expr;
-	int verdict;
+	const struct nlattr *attr, *ip;
+	struct nftnl_set_elem *elem;
+	const void *addr = NULL;
+
+	mnl_attr_for_each_nested(attr, data) {
+		switch (mnl_attr_get_type(attr)) {
+		case IPSET_ATTR_IP:
+			mnl_attr_for_each_nested(ip, attr) {
+				if (mnl_attr_get_payload_len(ip) == imp->len)
+					addr = mnl_attr_get_payload(ip);
+			}
+			break;
+		case IPSET_ATTR_CIDR:
+			/* no intervals, the set is updated from the packet
+			 * path by the SET target
+			 */
+			if (mnl_attr_get_u8(attr) != imp->len * 8)
+				imp->unsupported = true;
+			break;
+		}
+	}
 
-	if (!last || !nft_rule_is_policy_rule(last))
+	if (!addr) {
+		imp->unsupported = true;
 		return;
+	}
 
-	iter = nftnl_expr_iter_create(last);
-	if (!iter)
+	elem = nftnl_set_elem_alloc();
+	if (!elem) {
+		imp->unsupported = true;
 		return;
+	}
+	nftnl_set_elem_set(elem, NFTNL_SET_ELEM_KEY, addr, imp->len);
+	nftnl_set_elem_add(imp->s, elem);
+}
 
-	expr = nftnl_expr_iter_next(iter);
-	if (!expr ||
-	    strcmp("counter", nftnl_expr_get_str(expr, NFTNL_EXPR_NAME)))
-		goto out_iter;
-
-	expr = nftnl_expr_iter_next(iter);
-	if (!expr ||
-	    strcmp("immediate", nftnl_expr_get_str(expr, NFTNL_EXPR_NAME)) ||
-	    !nftnl_expr_is_set(expr, NFTNL_EXPR_IMM_VERDICT))
-		goto out_iter;
-
-	verdict = nftnl_expr_get_u32(expr, NFTNL_EXPR_IMM_VERDICT);
-	switch (verdict) {
-	case NF_ACCEPT:
-	case NF_DROP:
-		break;
-	default:
-		goto out_iter;
+/* Always OK, the rest of the dump has to be read anyway. */
+static int nft_ipset_import_cb(const struct nlmsghdr *nlh, void *data)
+{
+	struct nft_ipset_import *imp = data;
+	const struct nlattr *attr, *nest;
+	const char *type;
+
+	mnl_attr_for_each(attr, nlh, sizeof(struct nfgenmsg)) {
+		switch (mnl_attr_get_type(attr)) {
+		case IPSET_ATTR_TYPENAME:
+			type = mnl_attr_get_str(attr);
+			if (strcmp(type, "hash:ip") && strcmp(type, "hash:net"))
+				imp->unsupported = true;
+			imp->typed = true;
+			break;
+		case IPSET_ATTR_DATA:
+			mnl_attr_for_each_nested(nest, attr) {
+				if (mnl_attr_get_type(nest) ==
+				    IPSET_ATTR_NETMASK &&
+				    mnl_attr_get_u8(nest) != imp->len * 8)
+					imp->unsupported = true;
+			}
+			break;
+		case IPSET_ATTR_ADT:
+			if (!imp->typed) {
+				imp->unsupported = true;
+				break;
+			}
+			mnl_attr_for_each_nested(nest, attr) {
+				if (imp->unsupported)
+					break;
+				nft_ipset_import_elem(imp, nest);
+			}
+			break;
+		}
 	}
-
-	nftnl_chain_set_u32(c, NFTNL_CHAIN_POLICY, verdict);
-	if (batch_rule_add(h, NFT_COMPAT_RULE_DELETE, last) == NULL)
-		fprintf(stderr, "Failed to delete old policy rule\n");
-	nftnl_chain_rule_del(last);
-out_iter:
-	nftnl_expr_iter_destroy(iter);
+	return MNL_CB_OK;
 }
-static const char *policy_name[NF_ACCEPT+1] = {
-	[NF_DROP] = "DROP",
-	[NF_ACCEPT] = "ACCEPT",
-};
 
-int nft_chain_save(struct nft_handle *h, struct nftnl_chain_list *list)
+/* Copy the members of an ipset of single addresses into @imp->s. */
+static int nft_ipset_import(struct nft_handle *h, const char *name,
+			    struct nft_ipset_import *imp)
 {
-	struct nft_family_ops *ops = h->ops;
-	struct nftnl_chain_list_iter *iter;
-	struct nftnl_chain *c;
-
-	iter = nftnl_chain_list_iter_create(list);
-	if (iter == NULL)
-		return 0;
-
-	c = nftnl_chain_list_iter_next(iter);
-	while (c != NULL) {
-		const char *policy = NULL;
-
-		if (nft_chain_builtin(c)) {
-			uint32_t pol = NF_ACCEPT;
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	struct nfgenmsg *nfg;
 
-			if (nftnl_chain_get(c, NFTNL_CHAIN_POLICY))
-				pol = nftnl_chain_get_u32(c, NFTNL_CHAIN_POLICY);
-			policy = policy_name[pol];
-		} else if (h->family == NFPROTO_BRIDGE) {
-			if (nftnl_chain_is_set(c, NFTNL_CHAIN_POLICY)) {
-				uint32_t pol;
+	nlh = mnl_nlmsg_put_header(buf);
+	nlh->nlmsg_type = (NFNL_SUBSYS_IPSET << 8) | IPSET_CMD_LIST;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	nlh->nlmsg_seq = h->seq;
 
-				pol = nftnl_chain_get_u32(c, NFTNL_CHAIN_POLICY);
-				policy = policy_name[pol];
-			} else {
-				policy = "RETURN";
-			}
-		}
+	nfg = mnl_nlmsg_put_extra_header(nlh, sizeof(*nfg));
+	nfg->nfgen_family = h->family;
+	nfg->version = NFNETLINK_V0;
+	nfg->res_id = 0;
 
-		if (ops->save_chain)
-			ops->save_chain(c, policy);
+	mnl_attr_put_u8(nlh, IPSET_ATTR_PROTOCOL, IPSET_PROTOCOL);
+	mnl_attr_put_strz(nlh, IPSET_ATTR_SETNAME, name);
 
-		c = nftnl_chain_list_iter_next(iter);
-	}
+	if (mnl_talk(h, nlh, nft_ipset_import_cb, imp) < 0)
+		return -1;
 
-	nftnl_chain_list_iter_destroy(iter);
+	return imp->typed && !imp->unsupported ? 0 : -1;
+}
 
-	return 1;
+static int nft_set_exists_cb(const struct nlmsghdr *nlh, void *data)
+{
+	*(bool *)data = true;
+	return MNL_CB_OK;
 }
 
-static int nft_chain_save_rules(struct nft_handle *h,
-				struct nftnl_chain *c, unsigned int format)
+static bool nft_set_exists(struct nft_handle *h, const char *table,
+			   const char *name)
 {
-	struct nftnl_rule_iter *iter;
-	struct nftnl_rule *r;
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	struct nftnl_set *s;
+	bool found = false;
 
-	iter = nftnl_rule_iter_create(c);
-	if (iter == NULL)
-		return 1;
+	s = nftnl_set_alloc();
+	if (!s)
+		return false;
 
-	r = nftnl_rule_iter_next(iter);
-	while (r != NULL) {
-		nft_rule_print_save(h, r, NFT_RULE_APPEND, format);
-		r = nftnl_rule_iter_next(iter);
-	}
+	nlh = nftnl_set_nlmsg_build_hdr(buf, NFT_MSG_GETSET, h->family,
+					NLM_F_ACK, h->seq);
+	nftnl_set_set_str(s, NFTNL_SET_TABLE, table);
+	nftnl_set_set_str(s, NFTNL_SET_NAME, name);
+	nftnl_set_nlmsg_build_payload(nlh, s);
+	nftnl_set_free(s);
 
-	nftnl_rule_iter_destroy(iter);
-	return 0;
+	mnl_talk(h, nlh, nft_set_exists_cb, &found);
+
+	return found;
 }
 
-int nft_rule_save(struct nft_handle *h, const char *table, unsigned int format)
+/* Find or create the set backing ipset @name in @table. @set_id is set for
+ * a set added in this transaction, the kernel resolves others by name.
+ * Returns -1 if the ipset can't be mirrored by an nf_tables set.
+ */
+static int nft_ipset_set_get(struct nft_handle *h, const char *table,
+			     const char *name, uint32_t *set_id)
 {
-	struct nftnl_chain_list_iter *iter;
-	struct nftnl_chain_list *list;
-	struct nftnl_chain *c;
-	int ret = 0;
+	struct nft_ipset_import imp = {
+		.len	= nft_ipset_key_len(h),
+	};
+	struct obj_update *n;
 
-	list = nft_chain_list_get(h, table, NULL);
-	if (!list)
+	*set_id = 0;
+
+	list_for_each_entry(n, &h->obj_list, head) {
+		if (n->type != NFT_COMPAT_SET_ADD ||
+		    strcmp(nftnl_set_get_str(n->set, NFTNL_SET_TABLE), table) ||
+		    strcmp(nftnl_set_get_str(n->set, NFTNL_SET_NAME), name))
+			continue;
+
+		*set_id = nftnl_set_get_u32(n->set, NFTNL_SET_ID);
 		return 0;
+	}
 
-	iter = nftnl_chain_list_iter_create(list);
-	if (!iter)
+	if (nft_set_exists(h, table, name))
 		return 0;
 
-	c = nftnl_chain_list_iter_next(iter);
-	while (c) {
-		nft_build_cache(h, c);
-		ret = nft_chain_save_rules(h, c, format);
-		if (ret != 0)
-			break;
+	imp.s = nftnl_set_alloc();
+	if (!imp.s)
+		return -1;
 
-		c = nftnl_chain_list_iter_next(iter);
+	nftnl_set_set_u32(imp.s, NFTNL_SET_FAMILY, h->family);
+	nftnl_set_set_str(imp.s, NFTNL_SET_TABLE, table);
+	nftnl_set_set_str(imp.s, NFTNL_SET_NAME, name);
+	nftnl_set_set_u32(imp.s, NFTNL_SET_ID, ++nft_set_id);
+	nftnl_set_set_u32(imp.s, NFTNL_SET_FLAGS, NFT_SET_EVAL);
+	nftnl_set_set_u32(imp.s, NFTNL_SET_KEY_TYPE,
+			  h->family == NFPROTO_IPV4 ? NFT_DATATYPE_IPADDR :
+						      NFT_DATATYPE_IP6ADDR);
+	nftnl_set_set_u32(imp.s, NFTNL_SET_KEY_LEN, imp.len);
+
+	if (nft_ipset_import(h, name, &imp) < 0 ||
+	    !batch_set_add(h, NFT_COMPAT_SET_ADD, imp.s)) {
+		nftnl_set_free(imp.s);
+		return -1;
 	}
 
-	nftnl_chain_list_iter_destroy(iter);
-
-	/* the core expects 1 for success and 0 for error */
-	return ret == 0 ? 1 : 0;
+	*set_id = nftnl_set_get_u32(imp.s, NFTNL_SET_ID);
+	return 0;
 }
 
-static void
-__nft_rule_flush(struct nft_handle *h, const char *table,
-		 const char *chain, bool verbose, bool implicit)
+/* Returns 1 to fall back to the set match. */
+static int add_nft_set_match(struct nft_handle *h, struct nftnl_rule *r,
+			     struct xt_entry_match *m)
 {
-	struct obj_update *obj;
-	struct nftnl_rule *r;
+	const char *table = nftnl_rule_get_str(r, NFTNL_RULE_TABLE);
+	const struct xt_set_info *info = (const void *)m->data;
+	char name[IPSET_MAXNAMELEN];
+	struct nftnl_expr *e;
+	uint32_t set_id = 0;
 
-	if (verbose && chain)
-		fprintf(stdout, "Flushing chain `%s'\n", chain);
+	if (!nft_ipset_get_name(info->index, name))
+		return 1;
 
-	r = nftnl_rule_alloc();
-	if (r == NULL)
-		return;
+	/* Set contents are not part of the rule, no set for a lookup. */
+	if (!h->rule_needle && nft_ipset_set_get(h, table, name, &set_id) < 0)
+		return 1;
 
-	nftnl_rule_set_str(r, NFTNL_RULE_TABLE, table);
-	if (chain)
-		nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, chain);
+	add_nft_ipset_key(h, r, info);
 
-	obj = batch_rule_add(h, NFT_COMPAT_RULE_FLUSH, r);
-	if (!obj) {
-		nftnl_rule_free(r);
-		return;
-	}
+	e = gen_lookup(NFT_REG_1, name, set_id,
+		       info->flags & IPSET_INV_MATCH ? NFT_LOOKUP_F_INV : 0);
+	if (!e)
+		return -ENOMEM;
+	nftnl_rule_add_expr(r, e);
 
-	obj->implicit = implicit;
+	return 0;
 }
 
-int nft_rule_flush(struct nft_handle *h, const char *chain, const char *table,
-		   bool verbose)
+int add_match(struct nft_handle *h,
+	      struct nftnl_rule *r, struct xt_entry_match *m)
 {
-	struct nftnl_chain_list_iter *iter;
-	struct nftnl_chain_list *list;
-	struct nftnl_chain *c = NULL;
-	int ret = 0;
-
-	nft_xt_builtin_init(h, table);
-
-	nft_fn = nft_rule_flush;
-
-	if (chain || verbose) {
-		list = nft_chain_list_get(h, table, chain);
-		if (list == NULL) {
-			ret = 1;
-			goto err;
-		}
-	}
-
-	if (chain) {
-		c = nftnl_chain_list_lookup_byname(list, chain);
-		if (!c) {
-			errno = ENOENT;
-			return 0;
-		}
-	}
+	struct nftnl_expr *expr;
+	int ret;
 
-	if (chain || !verbose) {
-		__nft_rule_flush(h, table, chain, verbose, false);
-		flush_rule_cache(h, table, c);
-		return 1;
+	if (!strcmp(m->u.user.name, "limit"))
+		return add_nft_limit(r, m);
+	else if (!strcmp(m->u.user.name, "among"))
+		return add_nft_among(h, r, m);
+	else if (!strcmp(m->u.user.name, "tcp") && nft_tcp_native(h, r, m))
+		return add_nft_tcp(r, m);
+	else if (!strcmp(m->u.user.name, "udp") && nft_udp_native(h, r, m))
+		return add_nft_udp(r, m);
+	else if (!strcmp(m->u.user.name, "multiport") &&
+		 nft_multiport_native(h, r, m))
+		return add_nft_multiport(h, r, m);
+	else if (!strcmp(m->u.user.name, "conntrack") &&
+		 nft_conntrack_native(h, m))
+		return add_nft_conntrack(h, r, m);
+	else if (!strcmp(m->u.user.name, "mark") && nft_mark_native(m))
+		return add_nft_mark(r, m, false);
+	else if (!strcmp(m->u.user.name, "connmark") && nft_mark_native(m))
+		return add_nft_mark(r, m, true);
+	else if (!strcmp(m->u.user.name, "set") && nft_set_match_native(h, m)) {
+		ret = add_nft_set_match(h, r, m);
+		if (ret <= 0)
+			return ret;
 	}
 
-	iter = nftnl_chain_list_iter_create(list);
-	if (iter == NULL) {
-		ret = 1;
-		goto err;
-	}
+	expr = nftnl_expr_alloc("match");
+	if (expr == NULL)
+		return -ENOMEM;
 
-	c = nftnl_chain_list_iter_next(iter);
-	while (c != NULL) {
-		chain = nftnl_chain_get_str(c, NFTNL_CHAIN_NAME);
+	ret = __add_match(expr, m);
+	nftnl_rule_add_expr(r, expr);
 
-		__nft_rule_flush(h, table, chain, verbose, false);
-		flush_rule_cache(h, table, c);
-		c = nftnl_chain_list_iter_next(iter);
-	}
-	nftnl_chain_list_iter_destroy(iter);
-err:
-	/* the core expects 1 for success and 0 for error */
-	return ret == 0 ? 1 : 0;
+	return ret;
 }
 
-int nft_chain_user_add(struct nft_handle *h, const char *chain, const char *table)
+static int __add_target(struct nftnl_expr *e, struct xt_entry_target *t)
 {
-	struct nftnl_chain_list *list;
-	struct nftnl_chain *c;
-	int ret;
+	void *info;
 
-	nft_fn = nft_chain_user_add;
+	nftnl_expr_set(e, NFTNL_EXPR_TG_NAME, t->u.user.name,
+			  strlen(t->u.user.name));
+	nftnl_expr_set_u32(e, NFTNL_EXPR_TG_REV, t->u.user.revision);
 
-	nft_xt_builtin_init(h, table);
+	info = calloc(1, t->u.target_size);
+	if (info == NULL)
+		return -ENOMEM;
 
-	if (nft_chain_exists(h, table, chain)) {
-		errno = EEXIST;
-		return 0;
-	}
+	memcpy(info, t->data, t->u.target_size - sizeof(*t));
+	nftnl_expr_set(e, NFTNL_EXPR_TG_INFO, info, t->u.target_size - sizeof(*t));
 
-	c = nftnl_chain_alloc();
-	if (c == NULL)
-		return 0;
+	return 0;
+}
 
-	nftnl_chain_set_str(c, NFTNL_CHAIN_TABLE, table);
-	nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, chain);
-	if (h->family == NFPROTO_BRIDGE)
-		nftnl_chain_set_u32(c, NFTNL_CHAIN_POLICY, NF_ACCEPT);
+static int add_meta_nftrace(struct nftnl_rule *r)
+{
+	struct nftnl_expr *expr;
 
-	ret = batch_chain_add(h, NFT_COMPAT_CHAIN_USER_ADD, c);
+	expr = nftnl_expr_alloc("immediate");
+	if (expr == NULL)
+		return -ENOMEM;
 
-	list = nft_chain_list_get(h, table, chain);
-	if (list)
-		nftnl_chain_list_add(c, list);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_DREG, NFT_REG32_01);
+	nftnl_expr_set_u8(expr, NFTNL_EXPR_IMM_DATA, 1);
+	nftnl_rule_add_expr(r, expr);
 
-	/* the core expects 1 for success and 0 for error */
-	return ret == 0 ? 1 : 0;
+	expr = nftnl_expr_alloc("meta");
+	if (expr == NULL)
+		return -ENOMEM;
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_KEY, NFT_META_NFTRACE);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_SREG, NFT_REG32_01);
+
+	nftnl_rule_add_expr(r, expr);
+	return 0;
 }
 
-int nft_chain_restore(struct nft_handle *h, const char *chain, const char *table)
+static int add_nft_mark_imm(struct nftnl_rule *r, uint32_t mark)
 {
-	struct nftnl_chain_list *list;
-	struct nftnl_chain *c;
-	bool created = false;
-	int ret;
-
-	c = nft_chain_find(h, table, chain);
-	if (c) {
-		/* Apparently -n still flushes existing user defined
-		 * chains that are redefined.
-		 */
-		if (h->noflush)
-			__nft_rule_flush(h, table, chain, false, true);
-	} else {
-		c = nftnl_chain_alloc();
-		if (!c)
-			return -1;
-
-		nftnl_chain_set_str(c, NFTNL_CHAIN_TABLE, table);
-		nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, chain);
-		created = true;
-	}
-
-	if (h->family == NFPROTO_BRIDGE)
-		nftnl_chain_set_u32(c, NFTNL_CHAIN_POLICY, NF_ACCEPT);
-
-	if (!created)
-		return 0;
-
-	ret = batch_chain_add(h, NFT_COMPAT_CHAIN_USER_ADD, c);
+	struct nftnl_expr *expr;
 
-	list = nft_chain_list_get(h, table, chain);
-	if (list)
-		nftnl_chain_list_add(c, list);
+	expr = nftnl_expr_alloc("immediate");
+	if (expr == NULL)
+		return -ENOMEM;
 
-	return ret;
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_DREG, NFT_REG_1);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_DATA, mark);
+	nftnl_rule_add_expr(r, expr);
+	return 0;
 }
 
-/* From linux/netlink.h */
-#ifndef NLM_F_NONREC
-#define NLM_F_NONREC	0x100	/* Do not delete recursively    */
-#endif
-
-struct chain_user_del_data {
-	struct nft_handle	*handle;
-	bool			verbose;
-	int			builtin_err;
-};
-
-static int __nft_chain_user_del(struct nftnl_chain *c, void *data)
+static int add_nft_mark_set(struct nftnl_rule *r, bool ct)
 {
-	struct chain_user_del_data *d = data;
-	struct nft_handle *h = d->handle;
-	int ret;
-
-	/* don't delete built-in chain */
-	if (nft_chain_builtin(c))
-		return d->builtin_err;
-
-	if (d->verbose)
-		fprintf(stdout, "Deleting chain `%s'\n",
-			nftnl_chain_get_str(c, NFTNL_CHAIN_NAME));
-
-	/* This triggers required policy rule deletion. */
-	if (h->family == NFPROTO_BRIDGE)
-		nft_build_cache(h, c);
+	struct nftnl_expr *expr;
 
-	/* XXX This triggers a fast lookup from the kernel. */
-	nftnl_chain_unset(c, NFTNL_CHAIN_HANDLE);
-	ret = batch_chain_add(h, NFT_COMPAT_CHAIN_USER_DEL, c);
-	if (ret)
-		return -1;
+	expr = nftnl_expr_alloc(ct ? "ct" : "meta");
+	if (expr == NULL)
+		return -ENOMEM;
 
-	nftnl_chain_list_del(c);
+	if (ct) {
+		nftnl_expr_set_u32(expr, NFTNL_EXPR_CT_KEY, NFT_CT_MARK);
+		nftnl_expr_set_u32(expr, NFTNL_EXPR_CT_SREG, NFT_REG_1);
+	} else {
+		nftnl_expr_set_u32(expr, NFTNL_EXPR_META_KEY, NFT_META_MARK);
+		nftnl_expr_set_u32(expr, NFTNL_EXPR_META_SREG, NFT_REG_1);
+	}
+	nftnl_rule_add_expr(r, expr);
 	return 0;
 }
 
-int nft_chain_user_del(struct nft_handle *h, const char *chain,
-		       const char *table, bool verbose)
+/* MARK sets (mark & ~mask) ^ value, a bitwise on the current mark unless
+ * all bits are replaced.
+ */
+static int add_nft_mark_target(struct nftnl_rule *r,
+			       struct xt_entry_target *t)
 {
-	struct chain_user_del_data d = {
-		.handle = h,
-		.verbose = verbose,
-	};
-	struct nftnl_chain_list *list;
-	struct nftnl_chain *c;
-	int ret = 0;
-
-	nft_fn = nft_chain_user_del;
-
-	list = nft_chain_list_get(h, table, chain);
-	if (list == NULL)
-		return 0;
+	const struct xt_mark_tginfo2 *info = (const void *)t->data;
 
-	if (chain) {
-		c = nftnl_chain_list_lookup_byname(list, chain);
-		if (!c) {
-			errno = ENOENT;
-			return 0;
-		}
-		d.builtin_err = -2;
-		ret = __nft_chain_user_del(c, &d);
-		if (ret == -2)
-			errno = EINVAL;
-		goto out;
+	if (info->mask == UINT32_MAX) {
+		if (add_nft_mark_imm(r, info->mark) < 0)
+			return -ENOMEM;
+	} else {
+		add_meta(r, NFT_META_MARK);
+		add_bitwise_u32(r, ~info->mask, info->mark);
 	}
-
-	ret = nftnl_chain_list_foreach(list, __nft_chain_user_del, &d);
-out:
-	/* the core expects 1 for success and 0 for error */
-	return ret == 0 ? 1 : 0;
+	return add_nft_mark_set(r, false);
 }
 
-static struct nftnl_chain *
-nft_chain_find(struct nft_handle *h, const char *table, const char *chain)
+static uint8_t nft_connmark_target_mode(const struct xt_entry_target *t)
 {
-	struct nftnl_chain_list *list;
-
-	list = nft_chain_list_get(h, table, chain);
-	if (list == NULL)
-		return NULL;
+	const struct xt_connmark_tginfo1 *info1 = (const void *)t->data;
+	const struct xt_connmark_tginfo2 *info2 = (const void *)t->data;
 
-	return nftnl_chain_list_lookup_byname(list, chain);
+	return t->u.user.revision == 1 ? info1->mode : info2->mode;
 }
 
-bool nft_chain_exists(struct nft_handle *h,
-		      const char *table, const char *chain)
+/* CONNMARK --save-mark and --restore-mark combine both marks, which is only
+ * possible if the one set is replaced entirely: there is no bitwise
+ * operation between two registers.
+ */
+static bool nft_connmark_target_native(const struct xt_entry_target *t)
 {
-	const struct builtin_table *t = nft_table_builtin_find(h, table);
+	/* revision 2 shares the leading fields */
+	const struct xt_connmark_tginfo1 *info = (const void *)t->data;
+	const struct xt_connmark_tginfo2 *info2 = (const void *)t->data;
 
-	/* xtables does not support custom tables */
-	if (!t)
+	switch (t->u.user.revision) {
+	case 1:
+		break;
+	case 2:
+		if (info2->shift_dir || info2->shift_bits)
+			return false;
+		break;
+	default:
 		return false;
+	}
 
-	if (nft_chain_builtin_find(t, chain))
-		return true;
-
-	return !!nft_chain_find(h, table, chain);
+	switch (nft_connmark_target_mode(t)) {
+	case XT_CONNMARK_SET:
+		return info->nfmask == UINT32_MAX;
+	case XT_CONNMARK_SAVE:
+		return info->ctmark == 0 && info->ctmask == UINT32_MAX;
+	case XT_CONNMARK_RESTORE:
+		return info->ctmark == 0 && info->nfmask == UINT32_MAX;
+	}
+	return false;
 }
 
-int nft_chain_user_rename(struct nft_handle *h,const char *chain,
-			  const char *table, const char *newname)
+static int add_nft_connmark_target(struct nftnl_rule *r,
+				   struct xt_entry_target *t)
 {
-	struct nftnl_chain *c;
-	uint64_t handle;
-	int ret;
-
-	nft_fn = nft_chain_user_rename;
+	const struct xt_connmark_tginfo1 *info = (const void *)t->data;
 
-	if (nft_chain_exists(h, table, newname)) {
-		errno = EEXIST;
-		return 0;
+	switch (nft_connmark_target_mode(t)) {
+	case XT_CONNMARK_SET:
+		if (info->ctmask == UINT32_MAX) {
+			if (add_nft_mark_imm(r, info->ctmark) < 0)
+				return -ENOMEM;
+		} else {
+			add_ct(r, NFT_CT_MARK, -1);
+			add_bitwise_u32(r, ~info->ctmask, info->ctmark);
+		}
+		return add_nft_mark_set(r, true);
+	case XT_CONNMARK_SAVE:
+		add_meta(r, NFT_META_MARK);
+		if (info->nfmask != UINT32_MAX)
+			add_bitwise_u32(r, info->nfmask, 0);
+		return add_nft_mark_set(r, true);
+	default:
+		add_ct(r, NFT_CT_MARK, -1);
+		if (info->ctmask != UINT32_MAX)
+			add_bitwise_u32(r, info->ctmask, 0);
+		return add_nft_mark_set(r, false);
 	}
+}
 
-	nft_xt_builtin_init(h, table);
-
-	/* Config load changed errno. Ensure genuine info for our callers. */
-	errno = 0;
+/* Returns 1 to fall back to the SET target, see add_nft_set_match(). */
+static int add_nft_set_target(struct nft_handle *h, struct nftnl_rule *r,
+			      struct xt_entry_target *t)
+{
+	const char *table = nftnl_rule_get_str(r, NFTNL_RULE_TABLE);
+	const struct xt_set_info_target_v1 *info = (const void *)t->data;
+	char name[IPSET_MAXNAMELEN];
+	struct nftnl_expr *e;
+	uint32_t set_id = 0;
 
-	/* Find the old chain to be renamed */
-	c = nft_chain_find(h, table, chain);
-	if (c == NULL) {
-		errno = ENOENT;
-		return 0;
-	}
-	handle = nftnl_chain_get_u64(c, NFTNL_CHAIN_HANDLE);
+	if (!nft_ipset_get_name(info->add_set.index, name))
+		return 1;
 
-	/* Now prepare the new name for the chain */
-	c = nftnl_chain_alloc();
-	if (c == NULL)
-		return 0;
+	if (!h->rule_needle && nft_ipset_set_get(h, table, name, &set_id) < 0)
+		return 1;
 
-	nftnl_chain_set_str(c, NFTNL_CHAIN_TABLE, table);
-	nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, newname);
-	nftnl_chain_set_u64(c, NFTNL_CHAIN_HANDLE, handle);
+	add_nft_ipset_key(h, r, &info->add_set);
 
-	ret = batch_chain_add(h, NFT_COMPAT_CHAIN_RENAME, c);
+	e = nftnl_expr_alloc("dynset");
+	if (!e)
+		return -ENOMEM;
+	nftnl_expr_set_u32(e, NFTNL_EXPR_DYNSET_SREG_KEY, NFT_REG_1);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_DYNSET_OP, NFT_DYNSET_OP_ADD);
+	nftnl_expr_set_str(e, NFTNL_EXPR_DYNSET_SET_NAME, name);
+	nftnl_expr_set_u32(e, NFTNL_EXPR_DYNSET_SET_ID, set_id);
+	nftnl_rule_add_expr(r, e);
 
-	/* the core expects 1 for success and 0 for error */
-	return ret == 0 ? 1 : 0;
+	return 0;
 }
 
-bool nft_table_find(struct nft_handle *h, const char *tablename)
+int add_target(struct nft_handle *h, struct nftnl_rule *r,
+	       struct xt_entry_target *t)
 {
-	struct nftnl_table_list_iter *iter;
-	struct nftnl_table_list *list;
-	struct nftnl_table *t;
-	bool ret = false;
-
-	list = nftnl_table_list_get(h);
-	if (list == NULL)
-		goto err;
-
-	iter = nftnl_table_list_iter_create(list);
-	if (iter == NULL)
-		goto err;
-
-	t = nftnl_table_list_iter_next(iter);
-	while (t != NULL) {
-		const char *this_tablename =
-			nftnl_table_get(t, NFTNL_TABLE_NAME);
-
-		if (strcmp(tablename, this_tablename) == 0) {
-			ret = true;
-			break;
-		}
+	struct nftnl_expr *expr;
+	int ret;
 
-		t = nftnl_table_list_iter_next(iter);
+	if (strcmp(t->u.user.name, "TRACE") == 0)
+		return add_meta_nftrace(r);
+	else if (strcmp(t->u.user.name, "MARK") == 0 &&
+		 t->u.user.revision == 2)
+		return add_nft_mark_target(r, t);
+	else if (strcmp(t->u.user.name, "CONNMARK") == 0 &&
+		 nft_connmark_target_native(t))
+		return add_nft_connmark_target(r, t);
+	else if (strcmp(t->u.user.name, "SET") == 0 &&
+		 nft_set_target_native(h, t)) {
+		ret = add_nft_set_target(h, r, t);
+		if (ret <= 0)
+			return ret;
 	}
 
-	nftnl_table_list_iter_destroy(iter);
+	expr = nftnl_expr_alloc("target");
+	if (expr == NULL)
+		return -ENOMEM;
+
+	ret = __add_target(expr, t);
+	nftnl_rule_add_expr(r, expr);
 
-err:
 	return ret;
 }
 
-int nft_for_each_table(struct nft_handle *h,
-		       int (*func)(struct nft_handle *h, const char *tablename, void *data),
-		       void *data)
+int add_jumpto(struct nftnl_rule *r, const char *name, int verdict)
 {
-	struct nftnl_table_list *list;
-	struct nftnl_table_list_iter *iter;
-	struct nftnl_table *t;
-
-	list = nftnl_table_list_get(h);
-	if (list == NULL)
-		return -1;
-
-	iter = nftnl_table_list_iter_create(list);
-	if (iter == NULL)
-		return -1;
-
-	t = nftnl_table_list_iter_next(iter);
-	while (t != NULL) {
-		const char *tablename =
-			nftnl_table_get(t, NFTNL_TABLE_NAME);
+	struct nftnl_expr *expr;
 
-		func(h, tablename, data);
+	expr = nftnl_expr_alloc("immediate");
+	if (expr == NULL)
+		return -ENOMEM;
 
-		t = nftnl_table_list_iter_next(iter);
-	}
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_DREG, NFT_REG_VERDICT);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_VERDICT, verdict);
+	nftnl_expr_set_str(expr, NFTNL_EXPR_IMM_CHAIN, (char *)name);
+	nftnl_rule_add_expr(r, expr);
 
-	nftnl_table_list_iter_destroy(iter);
 	return 0;
 }
 
-static int __nft_table_flush(struct nft_handle *h, const char *table, bool exists)
+int add_verdict(struct nftnl_rule *r, int verdict)
 {
-	const struct builtin_table *_t;
-	struct obj_update *obj;
-	struct nftnl_table *t;
+	struct nftnl_expr *expr;
 
-	t = nftnl_table_alloc();
-	if (t == NULL)
-		return -1;
+	expr = nftnl_expr_alloc("immediate");
+	if (expr == NULL)
+		return -ENOMEM;
 
-	nftnl_table_set_str(t, NFTNL_TABLE_NAME, table);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_DREG, NFT_REG_VERDICT);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_VERDICT, verdict);
+	nftnl_rule_add_expr(r, expr);
 
-	obj = batch_table_add(h, NFT_COMPAT_TABLE_FLUSH, t);
-	if (!obj) {
-		nftnl_table_free(t);
-		return -1;
-	}
+	return 0;
+}
 
-	if (!exists)
-		obj->skip = 1;
+int add_action(struct nft_handle *h, struct nftnl_rule *r,
+	       struct iptables_command_state *cs, bool goto_set)
+{
+       int ret = 0;
 
-	_t = nft_table_builtin_find(h, table);
-	assert(_t);
-	h->cache->table[_t->type].initialized = false;
+       /* If no target at all, add nothing (default to continue) */
+       if (cs->target != NULL) {
+	       /* Standard target? */
+	       if (strcmp(cs->jumpto, XTC_LABEL_ACCEPT) == 0)
+		       ret = add_verdict(r, NF_ACCEPT);
+	       else if (strcmp(cs->jumpto, XTC_LABEL_DROP) == 0)
+		       ret = add_verdict(r, NF_DROP);
+	       else if (strcmp(cs->jumpto, XTC_LABEL_RETURN) == 0)
+		       ret = add_verdict(r, NFT_RETURN);
+	       else
+		       ret = add_target(h, r, cs->target->t);
+       } else if (strlen(cs->jumpto) > 0) {
+	       /* Not standard, then it's a go / jump to chain */
+	       if (goto_set)
+		       ret = add_jumpto(r, cs->jumpto, NFT_GOTO);
+	       else
+		       ret = add_jumpto(r, cs->jumpto, NFT_JUMP);
+       }
+       return ret;
+}
 
-	flush_chain_cache(h, table);
+static void nft_rule_print_debug(struct nftnl_rule *r, struct nlmsghdr *nlh)
+{
+#ifdef NLDEBUG
+	char tmp[1024];
 
-	return 0;
+	nftnl_rule_snprintf(tmp, sizeof(tmp), r, 0, 0);
+	printf("DEBUG: rule: %s\n", tmp);
+	mnl_nlmsg_fprintf(stdout, nlh, nlh->nlmsg_len, sizeof(struct nfgenmsg));
+#endif
 }
 
-int nft_table_flush(struct nft_handle *h, const char *table)
+int add_counters(struct nftnl_rule *r, uint64_t packets, uint64_t bytes)
 {
-	struct nftnl_table_list_iter *iter;
-	struct nftnl_table_list *list;
-	struct nftnl_table *t;
-	bool exists = false;
-	int ret = 0;
+	struct nftnl_expr *expr;
 
-	nft_fn = nft_table_flush;
+	expr = nftnl_expr_alloc("counter");
+	if (expr == NULL)
+		return -ENOMEM;
 
-	list = nftnl_table_list_get(h);
-	if (list == NULL) {
-		ret = -1;
-		goto err_out;
-	}
+	nftnl_expr_set_u64(expr, NFTNL_EXPR_CTR_PACKETS, packets);
+	nftnl_expr_set_u64(expr, NFTNL_EXPR_CTR_BYTES, bytes);
 
-	iter = nftnl_table_list_iter_create(list);
-	if (iter == NULL) {
-		ret = -1;
-		goto err_table_list;
-	}
+	nftnl_rule_add_expr(r, expr);
 
-	t = nftnl_table_list_iter_next(iter);
-	while (t != NULL) {
-		const char *table_name =
-			nftnl_table_get_str(t, NFTNL_TABLE_NAME);
+	return 0;
+}
 
-		if (strcmp(table_name, table) == 0) {
-			exists = true;
-			break;
-		}
+enum udata_type {
+	UDATA_TYPE_COMMENT,
+	UDATA_TYPE_EBTABLES_POLICY,
+	UDATA_TYPE_OPTIMIZED,
+	__UDATA_TYPE_MAX,
+};
+#define UDATA_TYPE_MAX (__UDATA_TYPE_MAX - 1)
 
-		t = nftnl_table_list_iter_next(iter);
-	}
+static int parse_udata_cb(const struct nftnl_udata *attr, void *data)
+{
+	unsigned char *value = nftnl_udata_get(attr);
+	uint8_t type = nftnl_udata_type(attr);
+	uint8_t len = nftnl_udata_len(attr);
+	const struct nftnl_udata **tb = data;
 
-	ret = __nft_table_flush(h, table, exists);
-	nftnl_table_list_iter_destroy(iter);
-err_table_list:
-err_out:
-	/* the core expects 1 for success and 0 for error */
-	return ret == 0 ? 1 : 0;
+	switch (type) {
+	case UDATA_TYPE_COMMENT:
+		if (value[len - 1] != '\0')
+			return -1;
+		break;
+	case UDATA_TYPE_EBTABLES_POLICY:
+	case UDATA_TYPE_OPTIMIZED:
+		break;
+	default:
+		return 0;
+	}
+	tb[type] = attr;
+	return 0;
 }
 
-void nft_table_new(struct nft_handle *h, const char *table)
+char *get_comment(const void *data, uint32_t data_len)
 {
-	nft_xt_builtin_init(h, table);
-}
+	const struct nftnl_udata *tb[UDATA_TYPE_MAX + 1] = {};
 
-static int __nft_rule_del(struct nft_handle *h, struct nftnl_rule *r)
-{
-	struct obj_update *obj;
+	if (nftnl_udata_parse(data, data_len, parse_udata_cb, tb) < 0)
+		return NULL;
 
-	nftnl_rule_list_del(r);
+	if (!tb[UDATA_TYPE_COMMENT])
+		return NULL;
 
-	if (!nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE))
-		nftnl_rule_set_u32(r, NFTNL_RULE_ID, ++h->rule_id);
+	return nftnl_udata_get(tb[UDATA_TYPE_COMMENT]);
+}
 
-	obj = batch_rule_add(h, NFT_COMPAT_RULE_DELETE, r);
-	if (!obj) {
-		nftnl_rule_free(r);
-		return -1;
-	}
-	return 1;
+void add_compat(struct nftnl_rule *r, uint32_t proto, bool inv)
+{
+	nftnl_rule_set_u32(r, NFTNL_RULE_COMPAT_PROTO, proto);
+	nftnl_rule_set_u32(r, NFTNL_RULE_COMPAT_FLAGS,
+			      inv ? NFT_RULE_COMPAT_F_INV : 0);
 }
 
 static struct nftnl_rule *
-nft_rule_find(struct nft_handle *h, struct nftnl_chain *c, void *data, int rulenum)
+nft_rule_new(struct nft_handle *h, const char *chain, const char *table,
+	     void *data)
 {
 	struct nftnl_rule *r;
-	struct nftnl_rule_iter *iter;
-	bool found = false;
-
-	nft_build_cache(h, c);
-
-	if (rulenum >= 0)
-		/* Delete by rule number case */
-		return nftnl_rule_lookup_byindex(c, rulenum);
 
-	iter = nftnl_rule_iter_create(c);
-	if (iter == NULL)
-		return 0;
+	r = nftnl_rule_alloc();
+	if (r == NULL)
+		return NULL;
 
-	r = nftnl_rule_iter_next(iter);
-	while (r != NULL) {
-		found = h->ops->rule_find(h, r, data);
-		if (found)
-			break;
-		r = nftnl_rule_iter_next(iter);
-	}
+	nftnl_rule_set_u32(r, NFTNL_RULE_FAMILY, h->family);
+	nftnl_rule_set_str(r, NFTNL_RULE_TABLE, table);
+	nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, chain);
 
-	nftnl_rule_iter_destroy(iter);
+	if (h->ops->add(h, r, data) < 0)
+		goto err;
 
-	return found ? r : NULL;
+	return r;
+err:
+	nftnl_rule_free(r);
+	return NULL;
 }
 
-int nft_rule_check(struct nft_handle *h, const char *chain,
-		   const char *table, void *data, bool verbose)
+static struct nftnl_chain *
+nft_chain_find(struct nft_handle *h, const char *table, const char *chain);
+
+int
+nft_rule_append(struct nft_handle *h, const char *chain, const char *table,
+		void *data, struct nftnl_rule *ref, bool verbose)
 {
 	struct nftnl_chain *c;
 	struct nftnl_rule *r;
+	int type;
 
-	nft_fn = nft_rule_check;
+	nft_xt_builtin_init(h, table);
 
-	c = nft_chain_find(h, table, chain);
-	if (!c)
-		goto fail_enoent;
+	/* Since ebtables user-defined chain policies are implemented as last
+	 * rule in nftables, rule cache is required here to treat them right. */
+	if (h->family == NFPROTO_BRIDGE) {
+		c = nft_chain_find(h, table, chain);
+		if (c && !nft_chain_builtin(c))
+			nft_build_cache(h, c);
+	}
 
-	r = nft_rule_find(h, c, data, -1);
+	nft_fn = nft_rule_append;
+
+	r = nft_rule_new(h, chain, table, data);
 	if (r == NULL)
-		goto fail_enoent;
+		return 0;
+
+	if (ref) {
+		nftnl_rule_set_u64(r, NFTNL_RULE_HANDLE,
+				   nftnl_rule_get_u64(ref, NFTNL_RULE_HANDLE));
+		type = NFT_COMPAT_RULE_REPLACE;
+	} else
+		type = NFT_COMPAT_RULE_APPEND;
+
+	if (batch_rule_add(h, type, r) == NULL) {
+		nftnl_rule_free(r);
+		return 0;
+	}
 
 	if (verbose)
 		h->ops->print_rule(h, r, 0, FMT_PRINT_RULE);
 
+	if (ref) {
+		nftnl_chain_rule_insert_at(r, ref);
+		nftnl_chain_rule_del(r);
+	} else {
+		c = nft_chain_find(h, table, chain);
+		if (!c) {
+			errno = ENOENT;
+			return 0;
+		}
+		nftnl_chain_rule_add_tail(r, c);
+		nft_cache_rule_add(h, c, r, false);
+	}
+
 	return 1;
-fail_enoent:
-	errno = ENOENT;
-	return 0;
 }
 
-int nft_rule_delete(struct nft_handle *h, const char *chain,
-		    const char *table, void *data, bool verbose)
+void
+nft_rule_print_save(struct nft_handle *h, const struct nftnl_rule *r,
+		    enum nft_rule_print type, unsigned int format)
 {
-	int ret = 0;
-	struct nftnl_chain *c;
-	struct nftnl_rule *r;
+	const char *chain = nftnl_rule_get_str(r, NFTNL_RULE_CHAIN);
+	struct iptables_command_state cs = {};
+	struct nft_family_ops *ops = h->ops;
 
-	nft_fn = nft_rule_delete;
+	ops->rule_to_cs(h, r, &cs);
 
-	c = nft_chain_find(h, table, chain);
-	if (!c) {
+	if (!(format & (FMT_NOCOUNTS | FMT_C_COUNTS)) && ops->save_counters)
+		ops->save_counters(&cs);
+
+	/* print chain name */
+	switch(type) {
+	case NFT_RULE_APPEND:
+		printf("-A %s ", chain);
+		break;
+	case NFT_RULE_DEL:
+		printf("-D %s ", chain);
+		break;
+	}
+
+	if (ops->save_rule)
+		ops->save_rule(&cs, format);
+
+	if (ops->clear_cs)
+		ops->clear_cs(&cs);
+}
+
+static bool nft_rule_is_policy_rule(struct nftnl_rule *r)
+{
+	const struct nftnl_udata *tb[UDATA_TYPE_MAX + 1] = {};
+	const void *data;
+	uint32_t len;
+
+	if (!nftnl_rule_is_set(r, NFTNL_RULE_USERDATA))
+		return false;
+
+	data = nftnl_rule_get_data(r, NFTNL_RULE_USERDATA, &len);
+	if (nftnl_udata_parse(data, len, parse_udata_cb, tb) < 0)
+		return NULL;
+
+	if (!tb[UDATA_TYPE_EBTABLES_POLICY] ||
+	    nftnl_udata_get_u32(tb[UDATA_TYPE_EBTABLES_POLICY]) != 1)
+		return false;
+
+	return true;
+}
+
+/* Merged by iptables-nft-restore --optimize, see nft_optimize(). */
+static bool nft_rule_is_optimized(struct nftnl_rule *r)
+{
+	const struct nftnl_udata *tb[UDATA_TYPE_MAX + 1] = {};
+	const void *data;
+	uint32_t len;
+
+	if (!nftnl_rule_is_set(r, NFTNL_RULE_USERDATA))
+		return false;
+
+	data = nftnl_rule_get_data(r, NFTNL_RULE_USERDATA, &len);
+	if (nftnl_udata_parse(data, len, parse_udata_cb, tb) < 0)
+		return false;
+
+	return tb[UDATA_TYPE_OPTIMIZED] != NULL;
+}
+
+static struct nftnl_rule *nft_chain_last_rule(struct nftnl_chain *c)
+{
+	struct nftnl_rule *r = NULL, *last;
+	struct nftnl_rule_iter *iter;
+
+	iter = nftnl_rule_iter_create(c);
+	if (!iter)
+		return NULL;
+
+	do {
+		last = r;
+		r = nftnl_rule_iter_next(iter);
+	} while (r);
+	nftnl_rule_iter_destroy(iter);
+
+	return last;
+}
+
+void nft_bridge_chain_postprocess(struct nft_handle *h,
+				  struct nftnl_chain *c)
+{
+	struct nftnl_rule *last = nft_chain_last_rule(c);
+	struct nftnl_expr_iter *iter;
+	struct nftnl_expr *expr;
+	int verdict;
+
+	if (!last || !nft_rule_is_policy_rule(last))
+		return;
+
+	iter = nftnl_expr_iter_create(last);
+	if (!iter)
+		return;
+
+	expr = nftnl_expr_iter_next(iter);
+	if (!expr ||
+	    strcmp("counter", nftnl_expr_get_str(expr, NFTNL_EXPR_NAME)))
+		goto out_iter;
+
+	expr = nftnl_expr_iter_next(iter);
+	if (!expr ||
+	    strcmp("immediate", nftnl_expr_get_str(expr, NFTNL_EXPR_NAME)) ||
+	    !nftnl_expr_is_set(expr, NFTNL_EXPR_IMM_VERDICT))
+		goto out_iter;
+
+	verdict = nftnl_expr_get_u32(expr, NFTNL_EXPR_IMM_VERDICT);
+	switch (verdict) {
+	case NF_ACCEPT:
+	case NF_DROP:
+		break;
+	default:
+		goto out_iter;
+	}
+
+	nftnl_chain_set_u32(c, NFTNL_CHAIN_POLICY, verdict);
+	if (batch_rule_add(h, NFT_COMPAT_RULE_DELETE, last) == NULL)
+		fprintf(stderr, "Failed to delete old policy rule\n");
+	nftnl_chain_rule_del(last);
+out_iter:
+	nftnl_expr_iter_destroy(iter);
+}
+static const char *policy_name[NF_ACCEPT+1] = {
+	[NF_DROP] = "DROP",
+	[NF_ACCEPT] = "ACCEPT",
+};
+
+int nft_chain_save(struct nft_handle *h, struct nftnl_chain_list *list)
+{
+	struct nft_family_ops *ops = h->ops;
+	struct nftnl_chain_list_iter *iter;
+	struct nftnl_chain *c;
+
+	iter = nftnl_chain_list_iter_create(list);
+	if (iter == NULL)
+		return 0;
+
+	c = nftnl_chain_list_iter_next(iter);
+	while (c != NULL) {
+		const char *policy = NULL;
+
+		if (nft_chain_builtin(c)) {
+			uint32_t pol = NF_ACCEPT;
+
+			if (nftnl_chain_get(c, NFTNL_CHAIN_POLICY))
+				pol = nftnl_chain_get_u32(c, NFTNL_CHAIN_POLICY);
+			policy = policy_name[pol];
+		} else if (h->family == NFPROTO_BRIDGE) {
+			if (nftnl_chain_is_set(c, NFTNL_CHAIN_POLICY)) {
+				uint32_t pol;
+
+				pol = nftnl_chain_get_u32(c, NFTNL_CHAIN_POLICY);
+				policy = policy_name[pol];
+			} else {
+				policy = "RETURN";
+			}
+		}
+
+		if (ops->save_chain)
+			ops->save_chain(c, policy);
+
+		c = nftnl_chain_list_iter_next(iter);
+	}
+
+	nftnl_chain_list_iter_destroy(iter);
+
+	return 1;
+}
+
+static int nft_rule_count(struct nft_handle *h, struct nftnl_chain *c);
+
+/* Extensions print rules straight to stdout, which rules out formatting
+ * them in threads. Large tables are instead split in ranges of chains which
+ * forked workers format into temporary files, copied out in chain order so
+ * the output is the same as when formatted in place. Callers fill the rule
+ * cache of the table beforehand, workers don't talk to the kernel.
+ */
+#define NFT_SAVE_JOBS_MAX	16
+#define NFT_SAVE_JOBS_MIN_RULES	10000
+
+struct nft_save_job {
+	unsigned int	first;
+	unsigned int	last;
+	FILE		*out;
+	pid_t		pid;
+};
+
+typedef int (*nft_chain_format_cb)(struct nft_handle *h,
+				   struct nftnl_chain *c, void *data);
+
+static unsigned int nft_save_jobs(unsigned int rules)
+{
+	const char *env = getenv("XTABLES_SAVE_JOBS");
+	long n;
+
+	if (env)
+		n = strtol(env, NULL, 10);
+	else if (rules < NFT_SAVE_JOBS_MIN_RULES)
+		return 1;
+	else
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		return 1;
+
+	return n > NFT_SAVE_JOBS_MAX ? NFT_SAVE_JOBS_MAX : n;
+}
+
+static int nft_chain_format_range(struct nft_handle *h,
+				  struct nftnl_chain **chains,
+				  unsigned int first, unsigned int last,
+				  nft_chain_format_cb cb, void *data)
+{
+	int ret = 0;
+
+	while (!ret && first < last)
+		ret = cb(h, chains[first++], data);
+
+	return ret;
+}
+
+static int nft_save_job_finish(struct nft_save_job *job)
+{
+	char buf[BUFSIZ];
+	int status, ret = 0;
+	size_t len;
+
+	if (waitpid(job->pid, &status, 0) < 0 ||
+	    !WIFEXITED(status) || WEXITSTATUS(status))
+		ret = -1;
+
+	rewind(job->out);
+	while ((len = fread(buf, 1, sizeof(buf), job->out)) > 0)
+		fwrite(buf, 1, len, stdout);
+
+	return ret;
+}
+
+static int nft_chain_list_format(struct nft_handle *h,
+				 struct nftnl_chain_list *list,
+				 nft_chain_format_cb cb, void *data)
+{
+	struct nft_save_job job[NFT_SAVE_JOBS_MAX];
+	unsigned int i, j, n = 0, size = 0, njobs, *count = NULL;
+	struct nftnl_chain_list_iter *iter;
+	struct nftnl_chain **chains = NULL;
+	uint64_t rules = 0, sum = 0;
+	struct nftnl_chain *c;
+	int ret = 0;
+
+	iter = nftnl_chain_list_iter_create(list);
+	if (!iter)
+		return -1;
+
+	while ((c = nftnl_chain_list_iter_next(iter))) {
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			chains = xtables_realloc(chains,
+						 size * sizeof(*chains));
+			count = xtables_realloc(count, size * sizeof(*count));
+		}
+		chains[n] = c;
+		count[n] = nft_rule_count(h, c);
+		rules += count[n++];
+	}
+	nftnl_chain_list_iter_destroy(iter);
+
+	njobs = nft_save_jobs(rules);
+	if (njobs > n)
+		njobs = n;
+	if (njobs <= 1) {
+		ret = nft_chain_format_range(h, chains, 0, n, cb, data);
+		goto out;
+	}
+
+	/* about the same number of rules for each */
+	for (i = 0, j = 0; j < njobs; j++) {
+		job[j].first = i;
+		while (i < n && (j == njobs - 1 || i == job[j].first ||
+				 sum + count[i] <= rules * (j + 1) / njobs))
+			sum += count[i++];
+		job[j].last = i;
+	}
+
+	fflush(stdout);
+	for (j = 0; j < njobs; j++) {
+		job[j].pid = -1;
+		job[j].out = NULL;
+		if (job[j].first == job[j].last)
+			continue;
+
+		job[j].out = tmpfile();
+		if (!job[j].out)
+			continue;
+
+		job[j].pid = fork();
+		if (job[j].pid == 0) {
+			if (dup2(fileno(job[j].out), STDOUT_FILENO) < 0)
+				_exit(EXIT_FAILURE);
+
+			ret = nft_chain_format_range(h, chains, job[j].first,
+						     job[j].last, cb, data);
+			fflush(stdout);
+			_exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+		}
+	}
+
+	for (j = 0; j < njobs; j++) {
+		/* no worker for it, format in place */
+		if (job[j].pid < 0 && !ret)
+			ret = nft_chain_format_range(h, chains, job[j].first,
+						     job[j].last, cb, data);
+		else if (job[j].pid > 0 && nft_save_job_finish(&job[j]) < 0)
+			ret = -1;
+
+		if (job[j].out)
+			fclose(job[j].out);
+	}
+out:
+	free(chains);
+	free(count);
+	return ret;
+}
+
+static int nft_chain_save_rules(struct nft_handle *h,
+				struct nftnl_chain *c, unsigned int format)
+{
+	struct nftnl_rule_iter *iter;
+	struct nftnl_rule *r;
+
+	iter = nftnl_rule_iter_create(c);
+	if (iter == NULL)
+		return 1;
+
+	r = nftnl_rule_iter_next(iter);
+	while (r != NULL) {
+		nft_rule_print_save(h, r, NFT_RULE_APPEND, format);
+		r = nftnl_rule_iter_next(iter);
+	}
+
+	nftnl_rule_iter_destroy(iter);
+	return 0;
+}
+
+static int nft_chain_save_rules_cb(struct nft_handle *h,
+				   struct nftnl_chain *c, void *data)
+{
+	return nft_chain_save_rules(h, c, *(unsigned int *)data);
+}
+
+int nft_rule_save(struct nft_handle *h, const char *table, unsigned int format)
+{
+	struct nftnl_chain_list *list;
+	int ret;
+
+	nft_build_table_cache(h, table);
+
+	list = nft_chain_list_get(h, table, NULL);
+	if (!list)
+		return 0;
+
+	ret = nft_chain_list_format(h, list, nft_chain_save_rules_cb, &format);
+
+	/* the core expects 1 for success and 0 for error */
+	return ret == 0 ? 1 : 0;
+}
+
+/* The comment of a rule, from userdata or an unparsed comment match. */
+static const char *nft_rule_comment(const struct nftnl_rule *r)
+{
+	const struct xt_comment_info *info;
+	struct nftnl_expr_iter *iter;
+	const char *comment = NULL;
+	struct nftnl_expr *e;
+	const void *data;
+	uint32_t len;
+
+	if (nftnl_rule_is_set(r, NFTNL_RULE_USERDATA)) {
+		data = nftnl_rule_get_data(r, NFTNL_RULE_USERDATA, &len);
+		comment = get_comment(data, len);
+		if (comment)
+			return comment;
+	}
+
+	iter = nftnl_expr_iter_create(r);
+	if (!iter)
+		return NULL;
+
+	while ((e = nftnl_expr_iter_next(iter))) {
+		if (strcmp(nftnl_expr_get_str(e, NFTNL_EXPR_NAME), "match") ||
+		    strcmp(nftnl_expr_get_str(e, NFTNL_EXPR_MT_NAME), "comment"))
+			continue;
+
+		info = nftnl_expr_get(e, NFTNL_EXPR_MT_INFO, &len);
+		if (len >= sizeof(*info))
+			comment = info->comment;
+		break;
+	}
+	nftnl_expr_iter_destroy(iter);
+
+	return comment;
+}
+
+/* Values of the first counter expression of @r, zero if there is none. */
+static void nft_rule_counters(const struct nftnl_rule *r,
+			      struct xt_counters *ctr)
+{
+	struct nftnl_expr_iter *iter;
+	struct nftnl_expr *e;
+
+	ctr->pcnt = ctr->bcnt = 0;
+
+	iter = nftnl_expr_iter_create(r);
+	if (!iter)
+		return;
+	while ((e = nftnl_expr_iter_next(iter))) {
+		if (strcmp(nftnl_expr_get_str(e, NFTNL_EXPR_NAME), "counter"))
+			continue;
+
+		ctr->pcnt = nftnl_expr_get_u64(e, NFTNL_EXPR_CTR_PACKETS);
+		ctr->bcnt = nftnl_expr_get_u64(e, NFTNL_EXPR_CTR_BYTES);
+		break;
+	}
+	nftnl_expr_iter_destroy(iter);
+}
+
+static void nft_rule_print_counters(const char *table, const char *chain,
+				    unsigned int num,
+				    const struct nftnl_rule *r)
+{
+	struct xt_counters ctr;
+	const char *comment;
+
+	nft_rule_counters(r, &ctr);
+	printf("%s %s %u %"PRIu64" %"PRIu64, table, chain, num,
+	       (uint64_t)ctr.pcnt, (uint64_t)ctr.bcnt);
+	comment = nft_rule_comment(r);
+	if (comment)
+		xtables_save_string(comment);
+	putchar('\n');
+}
+
+/* Print the counters of the chains and rules in @table, one per line:
+ *
+ *	table chain rulenum packets bytes [comment]
+ *
+ * with '-' as rule number for the policy of base chains. Nothing gets
+ * decoded and no extension is loaded, so this works for any table.
+ */
+int nft_rule_save_counters(struct nft_handle *h, const char *table)
+{
+	struct nftnl_chain_list_iter *iter;
+	struct nftnl_chain_list *list;
+	struct nftnl_rule_iter *riter;
+	struct nftnl_chain *c;
+	struct nftnl_rule *r;
+	const char *chain;
+	unsigned int num;
+
+	/* all rules with one dump, not one per chain */
+	nft_build_table_cache(h, table);
+
+	list = nft_chain_list_get(h, table, NULL);
+	if (!list)
+		return 0;
+
+	iter = nftnl_chain_list_iter_create(list);
+	if (!iter)
+		return 0;
+
+	c = nftnl_chain_list_iter_next(iter);
+	while (c) {
+		chain = nftnl_chain_get_str(c, NFTNL_CHAIN_NAME);
+		if (nftnl_chain_is_set(c, NFTNL_CHAIN_HOOKNUM))
+			printf("%s %s - %"PRIu64" %"PRIu64"\n", table, chain,
+			       nftnl_chain_get_u64(c, NFTNL_CHAIN_PACKETS),
+			       nftnl_chain_get_u64(c, NFTNL_CHAIN_BYTES));
+
+		riter = nftnl_rule_iter_create(c);
+		if (riter) {
+			num = 0;
+			while ((r = nftnl_rule_iter_next(riter)))
+				nft_rule_print_counters(table, chain, ++num, r);
+			nftnl_rule_iter_destroy(riter);
+		}
+
+		c = nftnl_chain_list_iter_next(iter);
+	}
+
+	nftnl_chain_list_iter_destroy(iter);
+
+	return 1;
+}
+
+/* Binary snapshots hold the netlink messages adding the tables saved,
+ * their chains, sets and rules, see xt_snapshot_write_hdr(). Restoring one
+ * parses them back and replays them in a single transaction, no rule goes
+ * through the command line parser or extensions.
+ */
+static void nft_snapshot_put(FILE *f, const struct nlmsghdr *nlh)
+{
+	xt_snapshot_write(f, NFNL_MSG_TYPE(nlh->nlmsg_type), nlh,
+			  nlh->nlmsg_len);
+}
+
+static void nft_snapshot_put_set(struct nft_handle *h, FILE *f, char *buf,
+				 struct nftnl_set *s)
+{
+	struct nftnl_set_elems_iter *iter;
+	struct nlmsghdr *nlh;
+
+	nlh = nftnl_nlmsg_build_hdr(buf, NFT_MSG_NEWSET, h->family, 0, 0);
+	nftnl_set_nlmsg_build_payload(nlh, s);
+	nft_snapshot_put(f, nlh);
+
+	iter = nftnl_set_elems_iter_create(s);
+	if (!iter)
+		return;
+
+	while (nftnl_set_elems_iter_cur(iter)) {
+		nlh = nftnl_nlmsg_build_hdr(buf, NFT_MSG_NEWSETELEM,
+					    h->family, 0, 0);
+		if (nftnl_set_elems_nlmsg_build_payload_iter(nlh, iter) <= 0)
+			break;
+		nft_snapshot_put(f, nlh);
+	}
+	nftnl_set_elems_iter_destroy(iter);
+}
+
+static int nft_snapshot_put_table(struct nft_handle *h, FILE *f, char *buf,
+				  const char *table)
+{
+	struct nftnl_chain_list_iter *iter;
+	struct nftnl_set_list_iter *siter;
+	struct nftnl_chain_list *chains;
+	struct nftnl_rule_iter *riter;
+	struct nftnl_set_list *sets;
+	struct nlmsghdr *nlh;
+	struct nftnl_chain *c;
+	struct nftnl_table *t;
+	struct nftnl_rule *r, *merged, *last;
+	struct nftnl_set *s;
+
+	nft_build_table_cache(h, table);
+
+	chains = nft_chain_list_get(h, table, NULL);
+	if (!chains)
+		return -1;
+
+	t = nftnl_table_alloc();
+	if (!t)
+		return -1;
+	nftnl_table_set_str(t, NFTNL_TABLE_NAME, table);
+	nlh = nftnl_table_nlmsg_build_hdr(buf, NFT_MSG_NEWTABLE, h->family,
+					  0, 0);
+	nftnl_table_nlmsg_build_payload(nlh, t);
+	nftnl_table_free(t);
+	nft_snapshot_put(f, nlh);
+
+	/* chains first, rules and verdict maps jump to them */
+	iter = nftnl_chain_list_iter_create(chains);
+	if (!iter)
+		return -1;
+	while ((c = nftnl_chain_list_iter_next(iter))) {
+		nft_build_cache(h, c);
+		nlh = nftnl_chain_nlmsg_build_hdr(buf, NFT_MSG_NEWCHAIN,
+						  h->family, 0, 0);
+		nftnl_chain_nlmsg_build_payload(nlh, c);
+		nft_snapshot_put(f, nlh);
+	}
+	nftnl_chain_list_iter_destroy(iter);
+
+	sets = nft_set_list_get(h, table, NULL);
+	if (sets) {
+		siter = nftnl_set_list_iter_create(sets);
+		if (!siter)
+			return -1;
+		while ((s = nftnl_set_list_iter_next(siter)))
+			nft_snapshot_put_set(h, f, buf, s);
+		nftnl_set_list_iter_destroy(siter);
+	}
+
+	iter = nftnl_chain_list_iter_create(chains);
+	if (!iter)
+		return -1;
+	while ((c = nftnl_chain_list_iter_next(iter))) {
+		riter = nftnl_rule_iter_create(c);
+		if (!riter)
+			break;
+		last = NULL;
+		while ((r = nftnl_rule_iter_next(riter))) {
+			/* the rules a merged rule stands for go as one */
+			merged = nft_cache_merged_find(h, r);
+			if (merged && merged == last)
+				continue;
+			last = merged;
+			if (merged)
+				r = merged;
+
+			nlh = nftnl_rule_nlmsg_build_hdr(buf, NFT_MSG_NEWRULE,
+							 h->family, 0, 0);
+			nftnl_rule_nlmsg_build_payload(nlh, r);
+			nft_snapshot_put(f, nlh);
+		}
+		nftnl_rule_iter_destroy(riter);
+	}
+	nftnl_chain_list_iter_destroy(iter);
+
+	return 0;
+}
+
+int nft_snapshot_save(struct nft_handle *h, FILE *f, const char *table)
+{
+	const char *name;
+	char *buf;
+	int i, ret = 0;
+
+	buf = xtables_malloc(NFT_NLMSG_MAXSIZE);
+	xt_snapshot_write_hdr(f, XT_SNAPSHOT_NFT, h->family);
+
+	for (i = 0; i < NFT_TABLE_MAX; i++) {
+		name = h->tables[i].name;
+		if (!name || (table && strcmp(name, table)) ||
+		    !nft_table_find(h, name))
+			continue;
+
+		ret = nft_snapshot_put_table(h, f, buf, name);
+		if (ret < 0)
+			break;
+	}
+	free(buf);
+
+	/* the core expects 1 for success and 0 for error */
+	return ret == 0 ? 1 : 0;
+}
+
+struct nft_snapshot_set {
+	char		name[NFT_SET_MAXNAMELEN];
+	uint32_t	set_id;
+};
+
+/* Anonymous sets are renamed on restore, lookups refer to the new ones by
+ * their transaction ID.
+ */
+static void nft_snapshot_rule_fixup(struct nftnl_rule *r,
+				    const struct nft_snapshot_set *sets,
+				    unsigned int nsets, bool counters)
+{
+	struct nftnl_expr_iter *iter;
+	struct nftnl_expr *e;
+	const char *name;
+	unsigned int i;
+
+	nftnl_rule_unset(r, NFTNL_RULE_HANDLE);
+	nftnl_rule_unset(r, NFTNL_RULE_POSITION);
+
+	iter = nftnl_expr_iter_create(r);
+	if (!iter)
+		return;
+
+	while ((e = nftnl_expr_iter_next(iter))) {
+		name = nftnl_expr_get_str(e, NFTNL_EXPR_NAME);
+
+		if (!strcmp(name, "counter") && !counters) {
+			nftnl_expr_set_u64(e, NFTNL_EXPR_CTR_PACKETS, 0);
+			nftnl_expr_set_u64(e, NFTNL_EXPR_CTR_BYTES, 0);
+		} else if (!strcmp(name, "lookup")) {
+			for (i = 0; i < nsets; i++) {
+				if (strcmp(nftnl_expr_get_str(e,
+						NFTNL_EXPR_LOOKUP_SET),
+					   sets[i].name))
+					continue;
+				nftnl_expr_set_str(e, NFTNL_EXPR_LOOKUP_SET,
+						   "__set%d");
+				nftnl_expr_set_u32(e, NFTNL_EXPR_LOOKUP_SET_ID,
+						   sets[i].set_id);
+				break;
+			}
+		}
+	}
+	nftnl_expr_iter_destroy(iter);
+}
+
+static const char *nft_snapshot_table_name(struct nft_handle *h,
+					   const struct nlmsghdr *nlh)
+{
+	static char name[NFT_TABLE_MAXNAMELEN];
+	struct nftnl_table *t;
+
+	t = nftnl_table_alloc();
+	if (!t || nftnl_table_nlmsg_parse(nlh, t) < 0)
+		xtables_error(PARAMETER_PROBLEM, "Snapshot is corrupt");
+
+	snprintf(name, sizeof(name), "%s",
+		 nftnl_table_get_str(t, NFTNL_TABLE_NAME));
+	nftnl_table_free(t);
+
+	if (!nft_table_builtin_find(h, name))
+		xtables_error(PARAMETER_PROBLEM,
+			      "Snapshot holds unknown table `%s'", name);
+	return name;
+}
+
+/* Replace the tables in the snapshot, or only @table, by their content. */
+int nft_snapshot_restore(struct nft_handle *h, FILE *f, const char *table,
+			 bool counters, bool test)
+{
+	struct nft_snapshot_set *sets = NULL;
+	struct nftnl_chain_list *chains;
+	struct nftnl_set *s = NULL;
+	unsigned int nsets = 0;
+	struct nlmsghdr *nlh;
+	struct nftnl_chain *c;
+	struct nftnl_table *t;
+	struct nftnl_rule *r;
+	const char *name;
+	bool skip = true;
+	uint32_t type, len;
+	int ret;
+
+	xt_snapshot_read_hdr(f, XT_SNAPSHOT_NFT, h->family);
+
+	/* rules are owned by their chains, which aren't cached */
+	chains = nftnl_chain_list_alloc();
+	if (!chains)
+		return 0;
+
+	nft_fake_cache(h);
+
+	while ((nlh = xt_snapshot_read(f, &type, &len, NFT_NLMSG_MAXSIZE))) {
+		if (len < sizeof(*nlh) || nlh->nlmsg_len != len)
+			xtables_error(PARAMETER_PROBLEM, "Snapshot is corrupt");
+
+		if (type == NFT_MSG_NEWTABLE) {
+			name = nft_snapshot_table_name(h, nlh);
+			skip = table && strcmp(table, name);
+			/* anonymous set names are only unique per table */
+			nsets = 0;
+			if (!skip) {
+				nft_table_flush(h, name);
+				t = nftnl_table_alloc();
+				nftnl_table_set_str(t, NFTNL_TABLE_NAME, name);
+				batch_table_add(h, NFT_COMPAT_TABLE_ADD, t);
+			}
+		}
+		if (skip || type == NFT_MSG_NEWTABLE) {
+			free(nlh);
+			continue;
+		}
+
+		switch (type) {
+		case NFT_MSG_NEWCHAIN:
+			c = nftnl_chain_alloc();
+			if (!c || nftnl_chain_nlmsg_parse(nlh, c) < 0)
+				goto corrupt;
+			nftnl_chain_unset(c, NFTNL_CHAIN_HANDLE);
+			nftnl_chain_unset(c, NFTNL_CHAIN_USE);
+			if (!counters) {
+				nftnl_chain_unset(c, NFTNL_CHAIN_PACKETS);
+				nftnl_chain_unset(c, NFTNL_CHAIN_BYTES);
+			}
+			nftnl_chain_list_add_tail(c, chains);
+			batch_chain_add(h, nftnl_chain_is_set(c, NFTNL_CHAIN_HOOKNUM) ?
+					   NFT_COMPAT_CHAIN_ADD :
+					   NFT_COMPAT_CHAIN_USER_ADD, c);
+			break;
+		case NFT_MSG_NEWSET:
+			s = nftnl_set_alloc();
+			if (!s || nftnl_set_nlmsg_parse(nlh, s) < 0)
+				goto corrupt;
+			nftnl_set_unset(s, NFTNL_SET_HANDLE);
+			nftnl_set_set_u32(s, NFTNL_SET_ID, ++nft_set_id);
+			if (nftnl_set_get_u32(s, NFTNL_SET_FLAGS) &
+			    NFT_SET_ANONYMOUS) {
+				sets = xtables_realloc(sets, (nsets + 1) *
+						       sizeof(*sets));
+				snprintf(sets[nsets].name,
+					 sizeof(sets[nsets].name), "%s",
+					 nftnl_set_get_str(s, NFTNL_SET_NAME));
+				sets[nsets++].set_id = nft_set_id;
+				nftnl_set_set_str(s, NFTNL_SET_NAME, "__set%d");
+			}
+			batch_set_add(h, NFT_COMPAT_SET_ADD, s);
+			break;
+		case NFT_MSG_NEWSETELEM:
+			if (!s || nftnl_set_elems_nlmsg_parse(nlh, s) < 0)
+				goto corrupt;
+			break;
+		case NFT_MSG_NEWRULE:
+			r = nftnl_rule_alloc();
+			if (!r || nftnl_rule_nlmsg_parse(nlh, r) < 0)
+				goto corrupt;
+			c = nftnl_chain_list_lookup_byname(chains,
+					nftnl_rule_get_str(r, NFTNL_RULE_CHAIN));
+			if (!c)
+				goto corrupt;
+			nft_snapshot_rule_fixup(r, sets, nsets, counters);
+			nftnl_chain_rule_add_tail(r, c);
+			batch_rule_add(h, NFT_COMPAT_RULE_APPEND, r);
+			break;
+		default:
+			goto corrupt;
+		}
+		free(nlh);
+	}
+
+	ret = test ? nft_abort(h) : nft_commit(h);
+
+	nftnl_chain_list_free(chains);
+	free(sets);
+
+	return ret;
+corrupt:
+	xtables_error(PARAMETER_PROBLEM, "Snapshot is corrupt");
+}
+
+static void
+__nft_rule_flush(struct nft_handle *h, const char *table,
+		 const char *chain, bool verbose, bool implicit)
+{
+	struct obj_update *obj;
+	struct nftnl_rule *r;
+
+	if (verbose && chain)
+		fprintf(stdout, "Flushing chain `%s'\n", chain);
+
+	r = nftnl_rule_alloc();
+	if (r == NULL)
+		return;
+
+	nftnl_rule_set_str(r, NFTNL_RULE_TABLE, table);
+	if (chain)
+		nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, chain);
+
+	obj = batch_rule_add(h, NFT_COMPAT_RULE_FLUSH, r);
+	if (!obj) {
+		nftnl_rule_free(r);
+		return;
+	}
+
+	obj->implicit = implicit;
+}
+
+int nft_rule_flush(struct nft_handle *h, const char *chain, const char *table,
+		   bool verbose)
+{
+	struct nftnl_chain_list_iter *iter;
+	struct nftnl_chain_list *list;
+	struct nftnl_chain *c = NULL;
+	int ret = 0;
+
+	nft_xt_builtin_init(h, table);
+
+	nft_fn = nft_rule_flush;
+
+	if (chain || verbose) {
+		list = nft_chain_list_get(h, table, chain);
+		if (list == NULL) {
+			ret = 1;
+			goto err;
+		}
+	}
+
+	if (chain) {
+		c = nftnl_chain_list_lookup_byname(list, chain);
+		if (!c) {
+			errno = ENOENT;
+			return 0;
+		}
+	}
+
+	if (chain || !verbose) {
+		__nft_rule_flush(h, table, chain, verbose, false);
+		flush_rule_cache(h, table, c);
+		return 1;
+	}
+
+	iter = nftnl_chain_list_iter_create(list);
+	if (iter == NULL) {
+		ret = 1;
+		goto err;
+	}
+
+	c = nftnl_chain_list_iter_next(iter);
+	while (c != NULL) {
+		chain = nftnl_chain_get_str(c, NFTNL_CHAIN_NAME);
+
+		__nft_rule_flush(h, table, chain, verbose, false);
+		flush_rule_cache(h, table, c);
+		c = nftnl_chain_list_iter_next(iter);
+	}
+	nftnl_chain_list_iter_destroy(iter);
+err:
+	/* the core expects 1 for success and 0 for error */
+	return ret == 0 ? 1 : 0;
+}
+
+int nft_chain_user_add(struct nft_handle *h, const char *chain, const char *table)
+{
+	struct nftnl_chain_list *list;
+	struct nftnl_chain *c;
+	int ret;
+
+	nft_fn = nft_chain_user_add;
+
+	nft_xt_builtin_init(h, table);
+
+	if (nft_chain_exists(h, table, chain)) {
+		errno = EEXIST;
+		return 0;
+	}
+
+	c = nftnl_chain_alloc();
+	if (c == NULL)
+		return 0;
+
+	nftnl_chain_set_str(c, NFTNL_CHAIN_TABLE, table);
+	nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, chain);
+	if (h->family == NFPROTO_BRIDGE)
+		nftnl_chain_set_u32(c, NFTNL_CHAIN_POLICY, NF_ACCEPT);
+
+	ret = batch_chain_add(h, NFT_COMPAT_CHAIN_USER_ADD, c);
+
+	list = nft_chain_list_get(h, table, chain);
+	if (list) {
+		nftnl_chain_list_add(c, list);
+		nft_cache_chain_new(h, c);
+	}
+
+	/* the core expects 1 for success and 0 for error */
+	return ret == 0 ? 1 : 0;
+}
+
+int nft_chain_restore(struct nft_handle *h, const char *chain, const char *table)
+{
+	struct nftnl_chain_list *list;
+	struct nftnl_chain *c;
+	bool created = false;
+	int ret;
+
+	c = nft_chain_find(h, table, chain);
+	if (c) {
+		/* Apparently -n still flushes existing user defined
+		 * chains that are redefined.
+		 */
+		if (h->noflush) {
+			__nft_rule_flush(h, table, chain, false, true);
+			flush_rule_cache(h, table, c);
+		}
+	} else {
+		c = nftnl_chain_alloc();
+		if (!c)
+			return -1;
+
+		nftnl_chain_set_str(c, NFTNL_CHAIN_TABLE, table);
+		nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, chain);
+		created = true;
+	}
+
+	if (h->family == NFPROTO_BRIDGE)
+		nftnl_chain_set_u32(c, NFTNL_CHAIN_POLICY, NF_ACCEPT);
+
+	if (!created)
+		return 0;
+
+	ret = batch_chain_add(h, NFT_COMPAT_CHAIN_USER_ADD, c);
+
+	list = nft_chain_list_get(h, table, chain);
+	if (list) {
+		nftnl_chain_list_add(c, list);
+		nft_cache_chain_new(h, c);
+	}
+
+	return ret;
+}
+
+/* From linux/netlink.h */
+#ifndef NLM_F_NONREC
+#define NLM_F_NONREC	0x100	/* Do not delete recursively    */
+#endif
+
+struct chain_user_del_data {
+	struct nft_handle	*handle;
+	bool			verbose;
+	int			builtin_err;
+};
+
+static int __nft_chain_user_del(struct nftnl_chain *c, void *data)
+{
+	struct chain_user_del_data *d = data;
+	struct nft_handle *h = d->handle;
+	int ret;
+
+	/* don't delete built-in chain */
+	if (nft_chain_builtin(c))
+		return d->builtin_err;
+
+	if (d->verbose)
+		fprintf(stdout, "Deleting chain `%s'\n",
+			nftnl_chain_get_str(c, NFTNL_CHAIN_NAME));
+
+	/* This triggers required policy rule deletion. */
+	if (h->family == NFPROTO_BRIDGE)
+		nft_build_cache(h, c);
+
+	/* XXX This triggers a fast lookup from the kernel. */
+	nftnl_chain_unset(c, NFTNL_CHAIN_HANDLE);
+	ret = batch_chain_add(h, NFT_COMPAT_CHAIN_USER_DEL, c);
+	if (ret)
+		return -1;
+
+	nft_cache_chain_del(h, nftnl_chain_get_str(c, NFTNL_CHAIN_TABLE),
+			    nftnl_chain_get_str(c, NFTNL_CHAIN_NAME));
+	nftnl_chain_list_del(c);
+	return 0;
+}
+
+int nft_chain_user_del(struct nft_handle *h, const char *chain,
+		       const char *table, bool verbose)
+{
+	struct chain_user_del_data d = {
+		.handle = h,
+		.verbose = verbose,
+	};
+	struct nftnl_chain_list *list;
+	struct nftnl_chain *c;
+	int ret = 0;
+
+	nft_fn = nft_chain_user_del;
+
+	list = nft_chain_list_get(h, table, chain);
+	if (list == NULL)
+		return 0;
+
+	if (chain) {
+		c = nftnl_chain_list_lookup_byname(list, chain);
+		if (!c) {
+			errno = ENOENT;
+			return 0;
+		}
+		d.builtin_err = -2;
+		ret = __nft_chain_user_del(c, &d);
+		if (ret == -2)
+			errno = EINVAL;
+		goto out;
+	}
+
+	ret = nftnl_chain_list_foreach(list, __nft_chain_user_del, &d);
+out:
+	/* the core expects 1 for success and 0 for error */
+	return ret == 0 ? 1 : 0;
+}
+
+static struct nftnl_chain *
+nft_chain_find(struct nft_handle *h, const char *table, const char *chain)
+{
+	struct nftnl_chain_list *list;
+
+	list = nft_chain_list_get(h, table, chain);
+	if (list == NULL)
+		return NULL;
+
+	return nftnl_chain_list_lookup_byname(list, chain);
+}
+
+bool nft_chain_exists(struct nft_handle *h,
+		      const char *table, const char *chain)
+{
+	const struct builtin_table *t = nft_table_builtin_find(h, table);
+
+	/* xtables does not support custom tables */
+	if (!t)
+		return false;
+
+	if (nft_chain_builtin_find(t, chain))
+		return true;
+
+	return !!nft_chain_find(h, table, chain);
+}
+
+int nft_chain_user_rename(struct nft_handle *h,const char *chain,
+			  const char *table, const char *newname)
+{
+	struct nftnl_chain *c;
+	uint64_t handle;
+	int ret;
+
+	nft_fn = nft_chain_user_rename;
+
+	if (nft_chain_exists(h, table, newname)) {
+		errno = EEXIST;
+		return 0;
+	}
+
+	nft_xt_builtin_init(h, table);
+
+	/* Config load changed errno. Ensure genuine info for our callers. */
+	errno = 0;
+
+	/* Find the old chain to be renamed */
+	c = nft_chain_find(h, table, chain);
+	if (c == NULL) {
+		errno = ENOENT;
+		return 0;
+	}
+	handle = nftnl_chain_get_u64(c, NFTNL_CHAIN_HANDLE);
+
+	/* Now prepare the new name for the chain */
+	c = nftnl_chain_alloc();
+	if (c == NULL)
+		return 0;
+
+	nftnl_chain_set_str(c, NFTNL_CHAIN_TABLE, table);
+	nftnl_chain_set_str(c, NFTNL_CHAIN_NAME, newname);
+	nftnl_chain_set_u64(c, NFTNL_CHAIN_HANDLE, handle);
+
+	ret = batch_chain_add(h, NFT_COMPAT_CHAIN_RENAME, c);
+
+	/* the core expects 1 for success and 0 for error */
+	return ret == 0 ? 1 : 0;
+}
+
+bool nft_table_find(struct nft_handle *h, const char *tablename)
+{
+	struct nftnl_table_list_iter *iter;
+	struct nftnl_table_list *list;
+	struct nftnl_table *t;
+	bool ret = false;
+
+	list = nftnl_table_list_get(h);
+	if (list == NULL)
+		goto err;
+
+	iter = nftnl_table_list_iter_create(list);
+	if (iter == NULL)
+		goto err;
+
+	t = nftnl_table_list_iter_next(iter);
+	while (t != NULL) {
+		const char *this_tablename =
+			nftnl_table_get(t, NFTNL_TABLE_NAME);
+
+		if (strcmp(tablename, this_tablename) == 0) {
+			ret = true;
+			break;
+		}
+
+		t = nftnl_table_list_iter_next(iter);
+	}
+
+	nftnl_table_list_iter_destroy(iter);
+
+err:
+	return ret;
+}
+
+int nft_for_each_table(struct nft_handle *h,
+		       int (*func)(struct nft_handle *h, const char *tablename, void *data),
+		       void *data)
+{
+	struct nftnl_table_list *list;
+	struct nftnl_table_list_iter *iter;
+	struct nftnl_table *t;
+
+	list = nftnl_table_list_get(h);
+	if (list == NULL)
+		return -1;
+
+	iter = nftnl_table_list_iter_create(list);
+	if (iter == NULL)
+		return -1;
+
+	t = nftnl_table_list_iter_next(iter);
+	while (t != NULL) {
+		const char *tablename =
+			nftnl_table_get(t, NFTNL_TABLE_NAME);
+
+		func(h, tablename, data);
+
+		t = nftnl_table_list_iter_next(iter);
+	}
+
+	nftnl_table_list_iter_destroy(iter);
+	return 0;
+}
+
+static int __nft_table_flush(struct nft_handle *h, const char *table, bool exists)
+{
+	const struct builtin_table *_t;
+	struct obj_update *obj;
+	struct nftnl_table *t;
+
+	t = nftnl_table_alloc();
+	if (t == NULL)
+		return -1;
+
+	nftnl_table_set_str(t, NFTNL_TABLE_NAME, table);
+
+	obj = batch_table_add(h, NFT_COMPAT_TABLE_FLUSH, t);
+	if (!obj) {
+		nftnl_table_free(t);
+		return -1;
+	}
+
+	if (!exists)
+		obj->skip = 1;
+
+	_t = nft_table_builtin_find(h, table);
+	assert(_t);
+	h->cache->table[_t->type].initialized = false;
+
+	flush_chain_cache(h, table);
+
+	return 0;
+}
+
+int nft_table_flush(struct nft_handle *h, const char *table)
+{
+	struct nftnl_table_list_iter *iter;
+	struct nftnl_table_list *list;
+	struct nftnl_table *t;
+	bool exists = false;
+	int ret = 0;
+
+	nft_fn = nft_table_flush;
+
+	list = nftnl_table_list_get(h);
+	if (list == NULL) {
+		ret = -1;
+		goto err_out;
+	}
+
+	iter = nftnl_table_list_iter_create(list);
+	if (iter == NULL) {
+		ret = -1;
+		goto err_table_list;
+	}
+
+	t = nftnl_table_list_iter_next(iter);
+	while (t != NULL) {
+		const char *table_name =
+			nftnl_table_get_str(t, NFTNL_TABLE_NAME);
+
+		if (strcmp(table_name, table) == 0) {
+			exists = true;
+			break;
+		}
+
+		t = nftnl_table_list_iter_next(iter);
+	}
+
+	ret = __nft_table_flush(h, table, exists);
+	nftnl_table_list_iter_destroy(iter);
+err_table_list:
+err_out:
+	/* the core expects 1 for success and 0 for error */
+	return ret == 0 ? 1 : 0;
+}
+
+void nft_table_new(struct nft_handle *h, const char *table)
+{
+	nft_xt_builtin_init(h, table);
+}
+
+enum nft_opt_split_op {
+	NFT_OPT_SPLIT_DELETE,
+	NFT_OPT_SPLIT_REPLACE,
+	NFT_OPT_SPLIT_INSERT,
+	NFT_OPT_SPLIT_ZERO,
+};
+
+static int nft_opt_split(struct nft_handle *h, struct nftnl_rule *part,
+			 struct nftnl_rule *new, enum nft_opt_split_op op);
+static int nft_opt_split_new(struct nft_handle *h, struct nftnl_rule *part,
+			     void *data, enum nft_opt_split_op op,
+			     bool verbose);
+
+static int __nft_rule_del(struct nft_handle *h, struct nftnl_rule *r)
+{
+	struct obj_update *obj;
+
+	/* one of the rules a merged rule stands for */
+	if (nft_cache_merged_find(h, r))
+		return nft_opt_split(h, r, NULL, NFT_OPT_SPLIT_DELETE) < 0 ?
+		       -1 : 1;
+
+	nft_rule_index_del(h, r);
+	nftnl_rule_list_del(r);
+
+	if (!nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE))
+		nftnl_rule_set_u32(r, NFTNL_RULE_ID, ++h->rule_id);
+
+	obj = batch_rule_add(h, NFT_COMPAT_RULE_DELETE, r);
+	if (!obj) {
+		nftnl_rule_free(r);
+		return -1;
+	}
+	return 1;
+}
+
+static struct nftnl_rule *
+nft_rule_find(struct nft_handle *h, struct nftnl_chain *c, void *data, int rulenum)
+{
+	struct nftnl_rule *r, *needle;
+	struct nftnl_rule_iter *iter;
+	bool found = false, complete;
+
+	nft_build_cache(h, c);
+
+	if (rulenum >= 0)
+		/* Delete by rule number case */
+		return nftnl_rule_lookup_byindex(c, rulenum);
+
+	/* Building the rule from @data for bridge may have side effects on
+	 * the batch (anonymous sets for among match), so bridge always takes
+	 * the slow path.
+	 */
+	if (h->family != NFPROTO_BRIDGE) {
+		h->rule_needle = true;
+		needle = nft_rule_new(h, nftnl_chain_get_str(c, NFTNL_CHAIN_NAME),
+				      nftnl_chain_get_str(c, NFTNL_CHAIN_TABLE),
+				      data);
+		h->rule_needle = false;
+		if (needle) {
+			r = nft_rule_index_lookup(h, c, needle, data,
+						  &complete);
+			nftnl_rule_free(needle);
+			if (r || complete)
+				return r;
+		}
+	}
+
+	/* Semantically equal rules may still be encoded differently, e.g.
+	 * if added by another tool or an older version, so fall back to a
+	 * full scan on a miss if the chain holds such rules.
+	 */
+	iter = nftnl_rule_iter_create(c);
+	if (iter == NULL)
+		return 0;
+
+	r = nftnl_rule_iter_next(iter);
+	while (r != NULL) {
+		found = h->ops->rule_find(h, r, data);
+		if (found)
+			break;
+		r = nftnl_rule_iter_next(iter);
+	}
+
+	nftnl_rule_iter_destroy(iter);
+
+	return found ? r : NULL;
+}
+
+int nft_rule_check(struct nft_handle *h, const char *chain,
+		   const char *table, void *data, bool verbose)
+{
+	struct nftnl_chain *c;
+	struct nftnl_rule *r;
+
+	nft_fn = nft_rule_check;
+
+	c = nft_chain_find(h, table, chain);
+	if (!c)
+		goto fail_enoent;
+
+	r = nft_rule_find(h, c, data, -1);
+	if (r == NULL)
+		goto fail_enoent;
+
+	if (verbose)
+		h->ops->print_rule(h, r, 0, FMT_PRINT_RULE);
+
+	return 1;
+fail_enoent:
+	errno = ENOENT;
+	return 0;
+}
+
+int nft_rule_delete(struct nft_handle *h, const char *chain,
+		    const char *table, void *data, bool verbose)
+{
+	int ret = 0;
+	struct nftnl_chain *c;
+	struct nftnl_rule *r;
+
+	nft_fn = nft_rule_delete;
+
+	c = nft_chain_find(h, table, chain);
+	if (!c) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	r = nft_rule_find(h, c, data, -1);
+	if (r != NULL) {
+		ret =__nft_rule_del(h, r);
+		if (ret < 0)
+			errno = ENOMEM;
+		if (verbose)
+			h->ops->print_rule(h, r, 0, FMT_PRINT_RULE);
+	} else
+		errno = ENOENT;
+
+	return ret;
+}
+
+static struct nftnl_rule *
+nft_rule_add(struct nft_handle *h, const char *chain,
+	     const char *table, struct iptables_command_state *cs,
+	     struct nftnl_rule *ref, bool verbose)
+{
+	struct nftnl_rule *r;
+	uint64_t ref_id;
+
+	r = nft_rule_new(h, chain, table, cs);
+	if (r == NULL)
+		return NULL;
+
+	if (ref) {
+		ref_id = nftnl_rule_get_u64(ref, NFTNL_RULE_HANDLE);
+		if (ref_id > 0) {
+			nftnl_rule_set_u64(r, NFTNL_RULE_POSITION, ref_id);
+			DEBUGP("adding after rule handle %"PRIu64"\n", ref_id);
+		} else {
+			ref_id = nftnl_rule_get_u32(ref, NFTNL_RULE_ID);
+			if (!ref_id) {
+				ref_id = ++h->rule_id;
+				nftnl_rule_set_u32(ref, NFTNL_RULE_ID, ref_id);
+			}
+			nftnl_rule_set_u32(r, NFTNL_RULE_POSITION_ID, ref_id);
+			DEBUGP("adding after rule ID %"PRIu64"\n", ref_id);
+		}
+	}
+
+	if (!batch_rule_add(h, NFT_COMPAT_RULE_INSERT, r)) {
+		nftnl_rule_free(r);
+		return NULL;
+	}
+
+	if (verbose)
+		h->ops->print_rule(h, r, 0, FMT_PRINT_RULE);
+
+	return r;
+}
+
+int nft_rule_insert(struct nft_handle *h, const char *chain,
+		    const char *table, void *data, int rulenum, bool verbose)
+{
+	struct nftnl_rule *r = NULL, *new_rule;
+	struct nftnl_chain *c;
+
+	nft_xt_builtin_init(h, table);
+
+	nft_fn = nft_rule_insert;
+
+	c = nft_chain_find(h, table, chain);
+	if (!c) {
+		errno = ENOENT;
+		goto err;
+	}
+
+	if (rulenum > 0) {
+		r = nft_rule_find(h, c, data, rulenum);
+		if (r == NULL) {
+			/* special case: iptables allows to insert into
+			 * rule_count + 1 position.
+			 */
+			r = nft_rule_find(h, c, data, rulenum - 1);
+			if (r != NULL)
+				return nft_rule_append(h, chain, table, data,
+						       NULL, verbose);
+
+			errno = E2BIG;
+			goto err;
+		}
+		if (nft_cache_merged_find(h, r))
+			return nft_opt_split_new(h, r, data,
+						 NFT_OPT_SPLIT_INSERT, verbose);
+	}
+
+	new_rule = nft_rule_add(h, chain, table, data, r, verbose);
+	if (!new_rule)
+		goto err;
+
+	if (r)
+		nftnl_chain_rule_insert_at(new_rule, r);
+	else
+		nftnl_chain_rule_add(new_rule, c);
+	nft_cache_rule_add(h, c, new_rule, !r);
+
+	return 1;
+err:
+	return 0;
+}
+
+int nft_rule_delete_num(struct nft_handle *h, const char *chain,
+			const char *table, int rulenum, bool verbose)
+{
+	int ret = 0;
+	struct nftnl_chain *c;
+	struct nftnl_rule *r;
+
+	nft_fn = nft_rule_delete_num;
+
+	c = nft_chain_find(h, table, chain);
+	if (!c) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	r = nft_rule_find(h, c, NULL, rulenum);
+	if (r != NULL) {
+		DEBUGP("deleting rule by number %d\n", rulenum);
+		ret = __nft_rule_del(h, r);
+		if (ret < 0)
+			errno = ENOMEM;
+	} else
+		errno = E2BIG;
+
+	return ret;
+}
+
+int nft_rule_replace(struct nft_handle *h, const char *chain,
+		     const char *table, void *data, int rulenum, bool verbose)
+{
+	int ret = 0;
+	struct nftnl_chain *c;
+	struct nftnl_rule *r;
+
+	nft_fn = nft_rule_replace;
+
+	c = nft_chain_find(h, table, chain);
+	if (!c) {
+		errno = ENOENT;
+		return 0;
+	}
+
+	r = nft_rule_find(h, c, data, rulenum);
+	if (r != NULL) {
+		DEBUGP("replacing rule with handle=%llu\n",
+			(unsigned long long)
+			nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE));
+
+		if (nft_cache_merged_find(h, r))
+			ret = nft_opt_split_new(h, r, data,
+						NFT_OPT_SPLIT_REPLACE, verbose);
+		else
+			ret = nft_rule_append(h, chain, table, data, r,
+					      verbose);
+	} else
+		errno = E2BIG;
+
+	return ret;
+}
+
+static int
+__nft_rule_list(struct nft_handle *h, struct nftnl_chain *c,
+		int rulenum, unsigned int format,
+		void (*cb)(struct nft_handle *h, struct nftnl_rule *r,
+			   unsigned int num, unsigned int format))
+{
+	struct nftnl_rule_iter *iter;
+	struct nftnl_rule *r;
+	int rule_ctr = 0;
+
+	if (rulenum > 0) {
+		r = nftnl_rule_lookup_byindex(c, rulenum - 1);
+		if (!r)
+			/* iptables-legacy returns 0 when listing for
+			 * valid chain but invalid rule number
+			 */
+			return 1;
+		cb(h, r, rulenum, format);
+		return 1;
+	}
+
+	iter = nftnl_rule_iter_create(c);
+	if (iter == NULL)
+		return 0;
+
+	r = nftnl_rule_iter_next(iter);
+	while (r != NULL) {
+		cb(h, r, ++rule_ctr, format);
+		r = nftnl_rule_iter_next(iter);
+	}
+
+	nftnl_rule_iter_destroy(iter);
+	return 1;
+}
+
+static int nft_rule_count(struct nft_handle *h, struct nftnl_chain *c)
+{
+	struct nftnl_rule_iter *iter;
+	struct nftnl_rule *r;
+	int rule_ctr = 0;
+
+	iter = nftnl_rule_iter_create(c);
+	if (iter == NULL)
+		return 0;
+
+	r = nftnl_rule_iter_next(iter);
+	while (r != NULL) {
+		rule_ctr++;
+		r = nftnl_rule_iter_next(iter);
+	}
+
+	nftnl_rule_iter_destroy(iter);
+	return rule_ctr;
+}
+
+static void __nft_print_header(struct nft_handle *h,
+			       struct nftnl_chain *c, unsigned int format)
+{
+	const char *chain_name = nftnl_chain_get_str(c, NFTNL_CHAIN_NAME);
+	bool basechain = !!nftnl_chain_get(c, NFTNL_CHAIN_HOOKNUM);
+	uint32_t refs = nftnl_chain_get_u32(c, NFTNL_CHAIN_USE);
+	uint32_t entries = nft_rule_count(h, c);
+	struct xt_counters ctrs = {
+		.pcnt = nftnl_chain_get_u64(c, NFTNL_CHAIN_PACKETS),
+		.bcnt = nftnl_chain_get_u64(c, NFTNL_CHAIN_BYTES),
+	};
+	const char *pname = NULL;
+
+	if (nftnl_chain_is_set(c, NFTNL_CHAIN_POLICY))
+		pname = policy_name[nftnl_chain_get_u32(c, NFTNL_CHAIN_POLICY)];
+
+	h->ops->print_header(format, chain_name, pname,
+			&ctrs, basechain, refs - entries, entries);
+}
+
+int nft_rule_list(struct nft_handle *h, const char *chain, const char *table,
+		  int rulenum, unsigned int format)
+{
+	const struct nft_family_ops *ops = h->ops;
+	struct nftnl_chain_list *list;
+	struct nftnl_chain_list_iter *iter;
+	struct nftnl_chain *c;
+	bool found = false;
+
+	nft_xt_builtin_init(h, table);
+	nft_assert_table_compatible(h, table, chain);
+
+	list = nft_chain_list_get(h, table, chain);
+	if (!list)
+		return 0;
+
+	if (chain) {
+		c = nftnl_chain_list_lookup_byname(list, chain);
+		if (!c)
+			return 0;
+
+		if (!rulenum) {
+			if (ops->print_table_header)
+				ops->print_table_header(table);
+			__nft_print_header(h, c, format);
+		}
+		__nft_rule_list(h, c, rulenum, format, ops->print_rule);
+		return 1;
+	}
+
+	iter = nftnl_chain_list_iter_create(list);
+	if (iter == NULL)
+		return 0;
+
+	if (ops->print_table_header)
+		ops->print_table_header(table);
+
+	c = nftnl_chain_list_iter_next(iter);
+	while (c != NULL) {
+		if (found)
+			printf("\n");
+
+		__nft_print_header(h, c, format);
+		__nft_rule_list(h, c, rulenum, format, ops->print_rule);
+
+		found = true;
+		c = nftnl_chain_list_iter_next(iter);
+	}
+	nftnl_chain_list_iter_destroy(iter);
+	return 1;
+}
+
+static void
+list_save(struct nft_handle *h, struct nftnl_rule *r,
+	  unsigned int num, unsigned int format)
+{
+	nft_rule_print_save(h, r, NFT_RULE_APPEND, format);
+}
+
+static int __nftnl_rule_list_chain_save(struct nftnl_chain *c, void *data)
+{
+	const char *chain_name = nftnl_chain_get_str(c, NFTNL_CHAIN_NAME);
+	uint32_t policy = nftnl_chain_get_u32(c, NFTNL_CHAIN_POLICY);
+	int *counters = data;
+
+	if (!nft_chain_builtin(c)) {
+		printf("-N %s\n", chain_name);
+		return 0;
+	}
+
+	/* this is a base chain */
+
+	printf("-P %s %s", chain_name, policy_name[policy]);
+	if (*counters)
+		printf(" -c %"PRIu64" %"PRIu64,
+		       nftnl_chain_get_u64(c, NFTNL_CHAIN_PACKETS),
+		       nftnl_chain_get_u64(c, NFTNL_CHAIN_BYTES));
+	printf("\n");
+	return 0;
+}
+
+static int
+nftnl_rule_list_chain_save(struct nft_handle *h, const char *chain,
+			   struct nftnl_chain_list *list, int counters)
+{
+	struct nftnl_chain *c;
+
+	if (chain) {
+		c = nftnl_chain_list_lookup_byname(list, chain);
+		if (!c)
+			return 0;
+
+		__nftnl_rule_list_chain_save(c, &counters);
+		return 1;
+	}
+
+	nftnl_chain_list_foreach(list, __nftnl_rule_list_chain_save, &counters);
+	return 1;
+}
+
+static int nft_rule_list_save_cb(struct nft_handle *h,
+				 struct nftnl_chain *c, void *data)
+{
+	return !__nft_rule_list(h, c, 0, *(unsigned int *)data, list_save);
+}
+
+int nft_rule_list_save(struct nft_handle *h, const char *chain,
+		       const char *table, int rulenum, int counters)
+{
+	struct nftnl_chain_list *list;
+	unsigned int format = 0;
+	struct nftnl_chain *c;
+
+	nft_xt_builtin_init(h, table);
+	nft_assert_table_compatible(h, table, chain);
+
+	list = nft_chain_list_get(h, table, chain);
+	if (!list)
+		return 0;
+
+	/* Dump policies and custom chains first */
+	if (!rulenum)
+		nftnl_rule_list_chain_save(h, chain, list, counters);
+
+	if (counters < 0)
+		format = FMT_C_COUNTS;
+	else if (counters == 0)
+		format = FMT_NOCOUNTS;
+
+	if (chain) {
+		c = nftnl_chain_list_lookup_byname(list, chain);
+		if (!c)
+			return 0;
+
+		return __nft_rule_list(h, c, rulenum, format, list_save);
+	}
+
+	/* Now dump out rules in this table */
+	return !nft_chain_list_format(h, list, nft_rule_list_save_cb, &format);
+}
+
+/* Have the kernel reset rule counters in place, instead of replacing the
+ * rules by copies with zeroed counters. Given a handle, only this rule is
+ * reset, else all rules in @chain or, if NULL, in @table. Needs Linux >= 6.2,
+ * older kernels reject the message type and callers fall back to replacing.
+ *
+ * The reset takes effect right away, not as part of the batch, so it is not
+ * used from iptables-restore where a later failure must leave the counters
+ * alone. Rules queued in the batch are not known to the kernel yet and still
+ * need replacing.
+ */
+static int nft_rule_reset(struct nft_handle *h, const char *table,
+			  const char *chain, uint64_t handle)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct nlmsghdr *nlh;
+	struct nftnl_rule *r;
+
+	r = nftnl_rule_alloc();
+	if (!r)
+		return -1;
+
+	nftnl_rule_set_str(r, NFTNL_RULE_TABLE, table);
+	if (chain)
+		nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, chain);
+	if (handle)
+		nftnl_rule_set_u64(r, NFTNL_RULE_HANDLE, handle);
+
+	nlh = nftnl_rule_nlmsg_build_hdr(buf, NFT_MSG_GETRULE_RESET, h->family,
+					 handle ? NLM_F_ACK : NLM_F_DUMP,
+					 h->seq);
+	nftnl_rule_nlmsg_build_payload(nlh, r);
+	nftnl_rule_free(r);
+
+	return mnl_talk(h, nlh, NULL, NULL);
+}
+
+int nft_rule_zero_counters(struct nft_handle *h, const char *chain,
+			   const char *table, int rulenum)
+{
+	struct iptables_command_state cs = {};
+	struct nftnl_chain *c;
+	struct nftnl_rule *r;
+	int ret = 0;
+
+	nft_fn = nft_rule_delete;
+
+	c = nft_chain_find(h, table, chain);
+	if (!c)
+		return 0;
+
+	r = nft_rule_find(h, c, NULL, rulenum);
+	if (r == NULL) {
 		errno = ENOENT;
+		ret = 1;
+		goto error;
+	}
+
+	if (!h->restore && nftnl_rule_is_set(r, NFTNL_RULE_HANDLE) &&
+	    !nft_rule_reset(h, table, chain,
+			    nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE)))
+		return 1;
+
+	if (nft_cache_merged_find(h, r))
+		return nft_opt_split(h, r, NULL, NFT_OPT_SPLIT_ZERO) < 0 ? 0 : 1;
+
+	nft_rule_to_iptables_command_state(h, r, &cs);
+
+	cs.counters.pcnt = cs.counters.bcnt = 0;
+
+	ret =  nft_rule_append(h, chain, table, &cs, r, false);
+
+error:
+	return ret;
+}
+
+static void nft_compat_table_batch_add(struct nft_handle *h, uint16_t type,
+				       uint16_t flags, uint32_t seq,
+				       struct nftnl_table *table)
+{
+	struct nlmsghdr *nlh;
+
+	nlh = nftnl_table_nlmsg_build_hdr(nftnl_batch_buffer(h->batch),
+					type, h->family, flags, seq);
+	nftnl_table_nlmsg_build_payload(nlh, table);
+}
+
+static void nft_compat_set_batch_add(struct nft_handle *h, uint16_t type,
+				     uint16_t flags, uint32_t seq,
+				     struct nftnl_set *set)
+{
+	struct nlmsghdr *nlh;
+
+	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(h->batch),
+					type, h->family, flags, seq);
+	nftnl_set_nlmsg_build_payload(nlh, set);
+}
+
+static void nft_compat_setelem_batch_add(struct nft_handle *h, uint16_t type,
+					 uint16_t flags, uint32_t *seq,
+					 struct nftnl_set *set)
+{
+	struct nftnl_set_elems_iter *iter;
+	struct nlmsghdr *nlh;
+
+	iter = nftnl_set_elems_iter_create(set);
+	if (!iter)
+		return;
+
+	while (nftnl_set_elems_iter_cur(iter)) {
+		(*seq)++;
+		mnl_nft_batch_continue(h->batch);
+		nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(h->batch),
+					    type, h->family, flags, *seq);
+		if (nftnl_set_elems_nlmsg_build_payload_iter(nlh, iter) <= 0)
+			break;
+	}
+	nftnl_set_elems_iter_destroy(iter);
+}
+
+static void nft_compat_chain_batch_add(struct nft_handle *h, uint16_t type,
+				       uint16_t flags, uint32_t seq,
+				       struct nftnl_chain *chain)
+{
+	struct nlmsghdr *nlh;
+
+	nlh = nftnl_chain_nlmsg_build_hdr(nftnl_batch_buffer(h->batch),
+					type, h->family, flags, seq);
+	nftnl_chain_nlmsg_build_payload(nlh, chain);
+	nft_chain_print_debug(chain, nlh);
+}
+
+static void nft_compat_rule_batch_add(struct nft_handle *h, uint16_t type,
+				      uint16_t flags, uint32_t seq,
+				      struct nftnl_rule *rule)
+{
+	struct nlmsghdr *nlh;
+
+	nlh = nftnl_rule_nlmsg_build_hdr(nftnl_batch_buffer(h->batch),
+				       type, h->family, flags, seq);
+	nftnl_rule_nlmsg_build_payload(nlh, rule);
+	nft_rule_print_debug(rule, nlh);
+}
+
+static void batch_obj_del(struct nft_handle *h, struct obj_update *o)
+{
+	switch (o->type) {
+	case NFT_COMPAT_TABLE_ADD:
+	case NFT_COMPAT_TABLE_FLUSH:
+		nftnl_table_free(o->table);
+		break;
+	case NFT_COMPAT_CHAIN_ZERO:
+	case NFT_COMPAT_CHAIN_USER_ADD:
+	case NFT_COMPAT_CHAIN_ADD:
+		break;
+	case NFT_COMPAT_CHAIN_USER_DEL:
+	case NFT_COMPAT_CHAIN_USER_FLUSH:
+	case NFT_COMPAT_CHAIN_UPDATE:
+	case NFT_COMPAT_CHAIN_RENAME:
+		nftnl_chain_free(o->chain);
+		break;
+	case NFT_COMPAT_RULE_APPEND:
+	case NFT_COMPAT_RULE_INSERT:
+	case NFT_COMPAT_RULE_REPLACE:
+	case NFT_COMPAT_RULE_DELETE:
+		break;
+	case NFT_COMPAT_RULE_FLUSH:
+		nftnl_rule_free(o->rule);
+		break;
+	case NFT_COMPAT_SET_ADD:
+		nftnl_set_free(o->set);
+		break;
+	}
+	h->obj_list_num--;
+	list_del(&o->head);
+}
+
+static void nft_refresh_transaction(struct nft_handle *h)
+{
+	const char *tablename, *chainname;
+	const struct nftnl_chain *c;
+	struct obj_update *n, *tmp;
+	bool exists;
+
+	h->error.lineno = 0;
+
+	list_for_each_entry_safe(n, tmp, &h->obj_list, head) {
+		if (n->implicit) {
+			batch_obj_del(h, n);
+			continue;
+		}
+
+		switch (n->type) {
+		case NFT_COMPAT_TABLE_FLUSH:
+			tablename = nftnl_table_get_str(n->table, NFTNL_TABLE_NAME);
+			if (!tablename)
+				continue;
+			exists = nft_table_find(h, tablename);
+			if (exists)
+				n->skip = 0;
+			else
+				n->skip = 1;
+			break;
+		case NFT_COMPAT_CHAIN_USER_ADD:
+			tablename = nftnl_chain_get_str(n->chain, NFTNL_CHAIN_TABLE);
+			if (!tablename)
+				continue;
+
+			chainname = nftnl_chain_get_str(n->chain, NFTNL_CHAIN_NAME);
+			if (!chainname)
+				continue;
+
+			if (!h->noflush)
+				break;
+
+			c = nft_chain_find(h, tablename, chainname);
+			if (c) {
+				/* -restore -n flushes existing rules from redefined user-chain */
+				__nft_rule_flush(h, tablename,
+						 chainname, false, true);
+				n->skip = 1;
+			} else if (!c) {
+				n->skip = 0;
+			}
+			break;
+		case NFT_COMPAT_TABLE_ADD:
+		case NFT_COMPAT_CHAIN_ADD:
+		case NFT_COMPAT_CHAIN_ZERO:
+		case NFT_COMPAT_CHAIN_USER_DEL:
+		case NFT_COMPAT_CHAIN_USER_FLUSH:
+		case NFT_COMPAT_CHAIN_UPDATE:
+		case NFT_COMPAT_CHAIN_RENAME:
+		case NFT_COMPAT_RULE_APPEND:
+		case NFT_COMPAT_RULE_INSERT:
+		case NFT_COMPAT_RULE_REPLACE:
+		case NFT_COMPAT_RULE_DELETE:
+		case NFT_COMPAT_RULE_FLUSH:
+		case NFT_COMPAT_SET_ADD:
+			break;
+		}
+	}
+}
+
+static void nft_diff(struct nft_handle *h);
+
+static int nft_action(struct nft_handle *h, int action)
+{
+	struct obj_update *n, *tmp;
+	struct mnl_err *err, *ne;
+	unsigned int buflen, i, len;
+	bool show_errors = true;
+	char errmsg[1024];
+	uint32_t seq, first_seq;
+	int ret = 0;
+
+retry:
+	seq = 1;
+	h->batch = mnl_batch_init();
+	nft_action_seq_reset(h);
+
+	mnl_batch_begin(h->batch, h->nft_genid, seq++);
+	h->nft_genid++;
+
+	list_for_each_entry(n, &h->obj_list, head) {
+
+		if (n->skip)
+			continue;
+
+		n->seq = seq++;
+		first_seq = n->seq;
+		switch (n->type) {
+		case NFT_COMPAT_TABLE_ADD:
+			nft_compat_table_batch_add(h, NFT_MSG_NEWTABLE,
+						   NLM_F_CREATE, n->seq,
+						   n->table);
+			break;
+		case NFT_COMPAT_TABLE_FLUSH:
+			nft_compat_table_batch_add(h, NFT_MSG_DELTABLE,
+						   0,
+						   n->seq, n->table);
+			break;
+		case NFT_COMPAT_CHAIN_ADD:
+		case NFT_COMPAT_CHAIN_ZERO:
+			nft_compat_chain_batch_add(h, NFT_MSG_NEWCHAIN,
+						   NLM_F_CREATE, n->seq,
+						   n->chain);
+			break;
+		case NFT_COMPAT_CHAIN_USER_ADD:
+			nft_compat_chain_batch_add(h, NFT_MSG_NEWCHAIN,
+						   NLM_F_EXCL, n->seq,
+						   n->chain);
+			break;
+		case NFT_COMPAT_CHAIN_USER_DEL:
+			nft_compat_chain_batch_add(h, NFT_MSG_DELCHAIN,
+						   NLM_F_NONREC, n->seq,
+						   n->chain);
+			break;
+		case NFT_COMPAT_CHAIN_USER_FLUSH:
+			nft_compat_chain_batch_add(h, NFT_MSG_DELCHAIN,
+						   0, n->seq,
+						   n->chain);
+			break;
+		case NFT_COMPAT_CHAIN_UPDATE:
+			nft_compat_chain_batch_add(h, NFT_MSG_NEWCHAIN,
+						   h->restore ?
+						     NLM_F_CREATE : 0,
+						   n->seq, n->chain);
+			break;
+		case NFT_COMPAT_CHAIN_RENAME:
+			nft_compat_chain_batch_add(h, NFT_MSG_NEWCHAIN, 0,
+						   n->seq, n->chain);
+			break;
+		case NFT_COMPAT_RULE_APPEND:
+			nft_compat_rule_batch_add(h, NFT_MSG_NEWRULE,
+						  NLM_F_CREATE | NLM_F_APPEND,
+						  n->seq, n->rule);
+			break;
+		case NFT_COMPAT_RULE_INSERT:
+			nft_compat_rule_batch_add(h, NFT_MSG_NEWRULE,
+						  NLM_F_CREATE, n->seq,
+						  n->rule);
+			break;
+		case NFT_COMPAT_RULE_REPLACE:
+			nft_compat_rule_batch_add(h, NFT_MSG_NEWRULE,
+						  NLM_F_CREATE | NLM_F_REPLACE,
+						  n->seq, n->rule);
+			break;
+		case NFT_COMPAT_RULE_DELETE:
+		case NFT_COMPAT_RULE_FLUSH:
+			nft_compat_rule_batch_add(h, NFT_MSG_DELRULE, 0,
+						  n->seq, n->rule);
+			break;
+		case NFT_COMPAT_SET_ADD:
+			nft_compat_set_batch_add(h, NFT_MSG_NEWSET,
+						 NLM_F_CREATE, n->seq, n->set);
+			nft_compat_setelem_batch_add(h, NFT_MSG_NEWSETELEM,
+						     NLM_F_CREATE, &n->seq, n->set);
+			seq = n->seq;
+			break;
+		}
+
+		for (i = first_seq; i <= n->seq; i++)
+			nft_action_seq_add(h, i, n);
+
+		mnl_nft_batch_continue(h->batch);
+	}
+
+	switch (action) {
+	case NFT_COMPAT_COMMIT:
+		mnl_batch_end(h->batch, seq++);
+		break;
+	case NFT_COMPAT_ABORT:
+		break;
+	}
+
+	errno = 0;
+	ret = mnl_batch_talk(h, seq);
+	if (ret && errno == ERESTART) {
+		h->cache_stats.restarts++;
+		nft_rebuild_cache(h);
+
+		nft_refresh_transaction(h);
+		if (action == NFT_COMPAT_COMMIT && h->diff)
+			nft_diff(h);
+
+		list_for_each_entry_safe(err, ne, &h->err_list, head)
+			mnl_err_list_free(err);
+
+		mnl_batch_reset(h->batch);
+		goto retry;
+	}
+
+	i = 0;
+	buflen = sizeof(errmsg);
+
+	list_for_each_entry_safe(err, ne, &h->err_list, head) {
+		n = NULL;
+		if (err->seqnum < h->obj_seq_size)
+			n = h->obj_seq[err->seqnum];
+
+		if (n && show_errors) {
+			if (n->error.lineno == 0)
+				show_errors = false;
+			len = mnl_append_error(h, n, err, errmsg + i, buflen);
+			if (len > 0 && len <= buflen) {
+				buflen -= len;
+				i += len;
+			}
+		}
+		mnl_err_list_free(err);
+	}
+	nft_action_seq_reset(h);
+
+	list_for_each_entry_safe(n, tmp, &h->obj_list, head)
+		batch_obj_del(h, n);
+	nft_arena_release(&h->arena);
+
+	nft_release_cache(h);
+	mnl_batch_reset(h->batch);
+
+	if (i)
+		xtables_error(RESOURCE_PROBLEM, "%s", errmsg);
+
+	return ret == 0 ? 1 : 0;
+}
+
+static int ebt_add_policy_rule(struct nftnl_chain *c, void *data)
+{
+	uint32_t policy = nftnl_chain_get_u32(c, NFTNL_CHAIN_POLICY);
+	struct iptables_command_state cs = {
+		.eb.bitmask = EBT_NOPROTO,
+	};
+	struct nftnl_udata_buf *udata;
+	struct nft_handle *h = data;
+	struct nftnl_rule *r;
+	const char *pname;
+
+	if (nftnl_chain_get(c, NFTNL_CHAIN_HOOKNUM))
+		return 0; /* ignore base chains */
+
+	if (!nftnl_chain_is_set(c, NFTNL_CHAIN_POLICY))
+		return 0;
+
+	nftnl_chain_unset(c, NFTNL_CHAIN_POLICY);
+
+	switch (policy) {
+	case NFT_RETURN:
+		return 0; /* return policy is default for nft chains */
+	case NF_ACCEPT:
+		pname = "ACCEPT";
+		break;
+	case NF_DROP:
+		pname = "DROP";
+		break;
+	default:
+		return -1;
+	}
+
+	command_jump(&cs, pname);
+
+	r = nft_rule_new(h, nftnl_chain_get_str(c, NFTNL_CHAIN_NAME),
+			 nftnl_chain_get_str(c, NFTNL_CHAIN_TABLE), &cs);
+	if (!r)
+		return -1;
+
+	udata = nftnl_udata_buf_alloc(NFT_USERDATA_MAXLEN);
+	if (!udata)
+		return -1;
+
+	if (!nftnl_udata_put_u32(udata, UDATA_TYPE_EBTABLES_POLICY, 1))
+		return -1;
+
+	nftnl_rule_set_data(r, NFTNL_RULE_USERDATA,
+			    nftnl_udata_buf_data(udata),
+			    nftnl_udata_buf_len(udata));
+	nftnl_udata_buf_free(udata);
+
+	if (!batch_rule_add(h, NFT_COMPAT_RULE_APPEND, r)) {
+		nftnl_rule_free(r);
+		return -1;
+	}
+
+	return 0;
+}
+
+int ebt_set_user_chain_policy(struct nft_handle *h, const char *table,
+			      const char *chain, const char *policy)
+{
+	struct nftnl_chain *c = nft_chain_find(h, table, chain);
+	int pval;
+
+	if (!c)
+		return 0;
+
+	if (!strcmp(policy, "DROP"))
+		pval = NF_DROP;
+	else if (!strcmp(policy, "ACCEPT"))
+		pval = NF_ACCEPT;
+	else if (!strcmp(policy, "RETURN"))
+		pval = NFT_RETURN;
+	else
 		return 0;
+
+	nft_build_cache(h, c);
+
+	nftnl_chain_set_u32(c, NFTNL_CHAIN_POLICY, pval);
+	return 1;
+}
+
+static void nft_bridge_commit_prepare(struct nft_handle *h)
+{
+	const struct builtin_table *t;
+	struct nftnl_chain_list *list;
+	int i;
+
+	for (i = 0; i < NFT_TABLE_MAX; i++) {
+		t = &h->tables[i];
+
+		if (!t->name)
+			continue;
+
+		list = h->cache->table[t->type].chains;
+		if (!list)
+			continue;
+
+		nftnl_chain_list_foreach(list, ebt_add_policy_rule, h);
+	}
+}
+
+/* iptables-nft-restore --optimize merges runs of appended rules which only
+ * differ in the values some fields are compared to into a single rule, that
+ * looks up these fields in an anonymous set. If the rules also differ in
+ * their verdict, e.g. go to different chains, the verdict is taken from a
+ * map as well. The keys of merged rules are all different, so a packet
+ * matches at most one of them and only the way it is evaluated changes.
+ * Rules keeping state, e.g. with -m limit, and rules whose target may let
+ * the packet continue are left alone. So are jumps: the called chain may
+ * change what a key is loaded from, e.g. with -j MARK, and the packet may
+ * match the next rule on return.
+ */
+struct nft_opt_rule {
+	struct obj_update	*obj;
+	struct nftnl_expr	**expr;
+	unsigned int		nexpr;
+};
+
+#define NFT_OPT_KEYS_MAX	8
+
+struct nft_opt_key {
+	unsigned int		pos;	/* of the cmp, the load is right before */
+	uint32_t		offset;	/* in the set key */
+	uint32_t		len;
+	uint32_t		type;
+};
+
+struct nft_opt_group {
+	struct nft_opt_key	key[NFT_OPT_KEYS_MAX];
+	unsigned int		nkeys;
+	uint32_t		key_len;
+};
+
+struct nft_opt_elem {
+	uint8_t			key[NFT_DATA_VALUE_MAXLEN];
+	unsigned int		idx;
+};
+
+struct nft_opt_stats {
+	unsigned int		rules;
+	unsigned int		merged;
+};
+
+static bool nft_opt_expr_is(const struct nftnl_expr *e, const char *name)
+{
+	return !strcmp(nftnl_expr_get_str(e, NFTNL_EXPR_NAME), name);
+}
+
+/* Attributes are flagged in a 32-bit word, whatever the expression type. */
+#define NFT_OPT_EXPR_ATTR_MAX	32
+
+static bool nft_opt_expr_equal(const struct nftnl_expr *a,
+			       const struct nftnl_expr *b)
+{
+	const void *da, *db;
+	uint32_t la, lb;
+	uint16_t attr;
+
+	if (strcmp(nftnl_expr_get_str(a, NFTNL_EXPR_NAME),
+		   nftnl_expr_get_str(b, NFTNL_EXPR_NAME)))
+		return false;
+
+	for (attr = NFTNL_EXPR_BASE; attr < NFT_OPT_EXPR_ATTR_MAX; attr++) {
+		if (nftnl_expr_is_set(a, attr) != nftnl_expr_is_set(b, attr))
+			return false;
+		if (!nftnl_expr_is_set(a, attr))
+			continue;
+
+		da = nftnl_expr_get(a, attr, &la);
+		db = nftnl_expr_get(b, attr, &lb);
+		if (la != lb || memcmp(da, db, la))
+			return false;
+	}
+	return true;
+}
+
+static struct nftnl_expr *nft_opt_expr_clone(const struct nftnl_expr *e)
+{
+	const char *name = nftnl_expr_get_str(e, NFTNL_EXPR_NAME);
+	struct nftnl_expr *c;
+	const void *data;
+	uint16_t attr;
+	uint32_t len;
+	void *info;
+
+	c = nftnl_expr_alloc(name);
+	if (!c)
+		return NULL;
+
+	for (attr = NFTNL_EXPR_BASE; attr < NFT_OPT_EXPR_ATTR_MAX; attr++) {
+		if (!nftnl_expr_is_set(e, attr))
+			continue;
+
+		data = nftnl_expr_get(e, attr, &len);
+		/* the expression takes ownership of the extension data,
+		 * so the clone gets a copy of its own
+		 */
+		if ((!strcmp(name, "match") && attr == NFTNL_EXPR_MT_INFO) ||
+		    (!strcmp(name, "target") && attr == NFTNL_EXPR_TG_INFO)) {
+			info = xtables_calloc(1, len);
+			memcpy(info, data, len);
+			data = info;
+		}
+		nftnl_expr_set(c, attr, data, len);
+	}
+	return c;
+}
+
+static bool nft_opt_verdict(const struct nftnl_expr *e)
+{
+	return nft_opt_expr_is(e, "immediate") &&
+	       nftnl_expr_get_u32(e, NFTNL_EXPR_IMM_DREG) == NFT_REG_VERDICT;
+}
+
+static bool nft_opt_load(const struct nftnl_expr *e)
+{
+	return nft_opt_expr_is(e, "payload") || nft_opt_expr_is(e, "meta") ||
+	       nft_opt_expr_is(e, "ct");
+}
+
+static bool nft_opt_comment(const struct nftnl_expr *e)
+{
+	return nft_opt_expr_is(e, "match") &&
+	       !strcmp(nftnl_expr_get_str(e, NFTNL_EXPR_MT_NAME), "comment");
+}
+
+static bool nft_opt_match_stateless(const struct nftnl_expr *e)
+{
+	static const char *stateful[] = {
+		"connlimit", "hashlimit", "limit", "nfacct", "quota",
+		"recent", "set", "statistic",
+	};
+	const char *name = nftnl_expr_get_str(e, NFTNL_EXPR_MT_NAME);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(stateful); i++) {
+		if (!strcmp(name, stateful[i]))
+			return false;
+	}
+	return true;
+}
+
+static bool nft_opt_target_terminal(const struct nftnl_expr *e)
+{
+	static const char *terminal[] = {
+		"DNAT", "MASQUERADE", "NETMAP", "REDIRECT", "REJECT", "SNAT",
+	};
+	const char *name = nftnl_expr_get_str(e, NFTNL_EXPR_TG_NAME);
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(terminal); i++) {
+		if (!strcmp(name, terminal[i]))
+			return true;
+	}
+	return false;
+}
+
+static struct nftnl_expr **nft_opt_expr_array(struct nftnl_rule *r,
+					      unsigned int *n)
+{
+	struct nftnl_expr **expr = NULL;
+	struct nftnl_expr_iter *iter;
+	struct nftnl_expr *e;
+
+	*n = 0;
+
+	iter = nftnl_expr_iter_create(r);
+	if (!iter)
+		return NULL;
+	while ((e = nftnl_expr_iter_next(iter))) {
+		expr = xtables_realloc(expr, (*n + 1) * sizeof(*expr));
+		expr[(*n)++] = e;
+	}
+	nftnl_expr_iter_destroy(iter);
+
+	return expr;
+}
+
+/* Fetch the expressions of an appended rule, false if it can't be merged. */
+static bool nft_opt_rule_load(struct obj_update *obj, struct nft_opt_rule *or)
+{
+	struct nftnl_expr *e;
+	bool last, ok = true;
+	unsigned int i;
+
+	or->obj = obj;
+	or->expr = nft_opt_expr_array(obj->rule, &or->nexpr);
+	if (!or->expr)
+		return false;
+
+	for (i = 0; ok && i < or->nexpr; i++) {
+		e = or->expr[i];
+		last = i == or->nexpr - 1;
+
+		if (nft_opt_expr_is(e, "payload"))
+			ok = !nftnl_expr_is_set(e, NFTNL_EXPR_PAYLOAD_SREG);
+		else if (nft_opt_expr_is(e, "meta"))
+			ok = nftnl_expr_is_set(e, NFTNL_EXPR_META_DREG);
+		else if (nft_opt_expr_is(e, "ct"))
+			ok = nftnl_expr_is_set(e, NFTNL_EXPR_CT_DREG);
+		else if (nft_opt_expr_is(e, "lookup"))
+			ok = !nftnl_expr_is_set(e, NFTNL_EXPR_LOOKUP_DREG);
+		else if (nft_opt_expr_is(e, "match"))
+			ok = nft_opt_match_stateless(e);
+		else if (nft_opt_expr_is(e, "immediate"))
+			ok = last && nft_opt_verdict(e) &&
+			     nftnl_expr_get_u32(e, NFTNL_EXPR_IMM_VERDICT) !=
+			     NFT_JUMP;
+		else if (nft_opt_expr_is(e, "target"))
+			ok = last && nft_opt_target_terminal(e);
+		else
+			ok = nft_opt_expr_is(e, "cmp") ||
+			     nft_opt_expr_is(e, "bitwise") ||
+			     nft_opt_expr_is(e, "byteorder") ||
+			     nft_opt_expr_is(e, "range") ||
+			     nft_opt_expr_is(e, "counter");
 	}
 
-	r = nft_rule_find(h, c, data, -1);
-	if (r != NULL) {
-		ret =__nft_rule_del(h, r);
-		if (ret < 0)
-			errno = ENOMEM;
-		if (verbose)
-			h->ops->print_rule(h, r, 0, FMT_PRINT_RULE);
-	} else
-		errno = ENOENT;
+	/* the rule must end in a verdict */
+	if (ok && or->nexpr)
+		ok = nft_opt_expr_is(or->expr[or->nexpr - 1], "immediate") ||
+		     nft_opt_expr_is(or->expr[or->nexpr - 1], "target");
 
-	return ret;
+	if (!ok || !or->nexpr) {
+		free(or->expr);
+		return false;
+	}
+	return true;
 }
 
-static struct nftnl_rule *
-nft_rule_add(struct nft_handle *h, const char *chain,
-	     const char *table, struct iptables_command_state *cs,
-	     struct nftnl_rule *ref, bool verbose)
+/* Length and type of the data a key is loaded with, 0 if the key can't be
+ * looked up. Loads shorter than a register word are padded with zeroes.
+ */
+static uint32_t nft_opt_load_len(struct nft_handle *h,
+				 const struct nftnl_expr *e, uint32_t *type)
 {
-	struct nftnl_rule *r;
-	uint64_t ref_id;
-
-	r = nft_rule_new(h, chain, table, cs);
-	if (r == NULL)
-		return NULL;
+	uint32_t base, offset, len;
+
+	*type = NFT_DATATYPE_INTEGER;
+
+	if (nft_opt_expr_is(e, "payload")) {
+		base = nftnl_expr_get_u32(e, NFTNL_EXPR_PAYLOAD_BASE);
+		offset = nftnl_expr_get_u32(e, NFTNL_EXPR_PAYLOAD_OFFSET);
+		len = nftnl_expr_get_u32(e, NFTNL_EXPR_PAYLOAD_LEN);
+
+		if (base == NFT_PAYLOAD_NETWORK_HEADER &&
+		    h->family == NFPROTO_IPV4 && len == sizeof(struct in_addr) &&
+		    (offset == offsetof(struct iphdr, saddr) ||
+		     offset == offsetof(struct iphdr, daddr)))
+			*type = NFT_DATATYPE_IPADDR;
+		else if (base == NFT_PAYLOAD_NETWORK_HEADER &&
+			 h->family == NFPROTO_IPV6 &&
+			 len == sizeof(struct in6_addr) &&
+			 (offset == offsetof(struct ip6_hdr, ip6_src) ||
+			  offset == offsetof(struct ip6_hdr, ip6_dst)))
+			*type = NFT_DATATYPE_IP6ADDR;
+		else if (base == NFT_PAYLOAD_TRANSPORT_HEADER &&
+			 len == sizeof(uint16_t) &&
+			 (offset == NFT_TH_SPORT_OFFSET ||
+			  offset == NFT_TH_DPORT_OFFSET))
+			*type = NFT_DATATYPE_INET_SERVICE;
+		return len;
+	}
 
-	if (ref) {
-		ref_id = nftnl_rule_get_u64(ref, NFTNL_RULE_HANDLE);
-		if (ref_id > 0) {
-			nftnl_rule_set_u64(r, NFTNL_RULE_POSITION, ref_id);
-			DEBUGP("adding after rule handle %"PRIu64"\n", ref_id);
-		} else {
-			ref_id = nftnl_rule_get_u32(ref, NFTNL_RULE_ID);
-			if (!ref_id) {
-				ref_id = ++h->rule_id;
-				nftnl_rule_set_u32(ref, NFTNL_RULE_ID, ref_id);
-			}
-			nftnl_rule_set_u32(r, NFTNL_RULE_POSITION_ID, ref_id);
-			DEBUGP("adding after rule ID %"PRIu64"\n", ref_id);
+	if (nft_opt_expr_is(e, "meta")) {
+		switch (nftnl_expr_get_u32(e, NFTNL_EXPR_META_KEY)) {
+		case NFT_META_IIFNAME:
+		case NFT_META_OIFNAME:
+			*type = NFT_DATATYPE_IFNAME;
+			return IFNAMSIZ;
+		case NFT_META_L4PROTO:
+			*type = NFT_DATATYPE_INET_PROTOCOL;
+			return sizeof(uint8_t);
+		case NFT_META_MARK:
+			*type = NFT_DATATYPE_MARK;
+			return sizeof(uint32_t);
 		}
+		return 0;
 	}
 
-	if (!batch_rule_add(h, NFT_COMPAT_RULE_INSERT, r)) {
-		nftnl_rule_free(r);
-		return NULL;
+	if (nft_opt_expr_is(e, "ct") &&
+	    nftnl_expr_get_u32(e, NFTNL_EXPR_CT_KEY) == NFT_CT_MARK) {
+		*type = NFT_DATATYPE_MARK;
+		return sizeof(uint32_t);
 	}
+	return 0;
+}
 
-	if (verbose)
-		h->ops->print_rule(h, r, 0, FMT_PRINT_RULE);
+static uint32_t nft_opt_load_dreg(const struct nftnl_expr *e)
+{
+	if (nft_opt_expr_is(e, "payload"))
+		return nftnl_expr_get_u32(e, NFTNL_EXPR_PAYLOAD_DREG);
+	if (nft_opt_expr_is(e, "meta"))
+		return nftnl_expr_get_u32(e, NFTNL_EXPR_META_DREG);
+	return nftnl_expr_get_u32(e, NFTNL_EXPR_CT_DREG);
+}
 
-	return r;
+static void nft_opt_load_set_dreg(struct nftnl_expr *e, uint32_t dreg)
+{
+	if (nft_opt_expr_is(e, "payload"))
+		nftnl_expr_set_u32(e, NFTNL_EXPR_PAYLOAD_DREG, dreg);
+	else if (nft_opt_expr_is(e, "meta"))
+		nftnl_expr_set_u32(e, NFTNL_EXPR_META_DREG, dreg);
+	else
+		nftnl_expr_set_u32(e, NFTNL_EXPR_CT_DREG, dreg);
 }
 
-int nft_rule_insert(struct nft_handle *h, const char *chain,
-		    const char *table, void *data, int rulenum, bool verbose)
+/* An equality test on loaded data, the load being the previous expression.
+ * Exact interface names are compared up to their terminating zero, which is
+ * the padding of the loaded name as well.
+ */
+static bool nft_opt_key_ok(struct nft_handle *h, const struct nft_opt_rule *or,
+			   unsigned int pos, struct nft_opt_key *key)
 {
-	struct nftnl_rule *r = NULL, *new_rule;
-	struct nftnl_chain *c;
+	const struct nftnl_expr *cmp = or->expr[pos], *load;
+	const uint8_t *data;
+	uint32_t len;
 
-	nft_xt_builtin_init(h, table);
+	if (!pos || !nft_opt_expr_is(cmp, "cmp") ||
+	    nftnl_expr_get_u32(cmp, NFTNL_EXPR_CMP_OP) != NFT_CMP_EQ)
+		return false;
 
-	nft_fn = nft_rule_insert;
+	load = or->expr[pos - 1];
+	if (!nft_opt_load(load))
+		return false;
+	if (nft_opt_load_dreg(load) !=
+	    nftnl_expr_get_u32(cmp, NFTNL_EXPR_CMP_SREG))
+		return false;
 
-	c = nft_chain_find(h, table, chain);
-	if (!c) {
-		errno = ENOENT;
-		goto err;
+	key->pos = pos;
+	key->len = nft_opt_load_len(h, load, &key->type);
+	if (!key->len)
+		return false;
+
+	data = nftnl_expr_get(cmp, NFTNL_EXPR_CMP_DATA, &len);
+	if (len == key->len)
+		return true;
+
+	return key->type == NFT_DATATYPE_IFNAME && len && len < key->len &&
+	       data[len - 1] == '\0';
+}
+
+static bool nft_opt_rule_attr_equal(const struct nftnl_rule *a,
+				    const struct nftnl_rule *b, uint16_t attr)
+{
+	if (nftnl_rule_is_set(a, attr) != nftnl_rule_is_set(b, attr))
+		return false;
+
+	return !nftnl_rule_is_set(a, attr) ||
+	       nftnl_rule_get_u32(a, attr) == nftnl_rule_get_u32(b, attr);
+}
+
+static bool nft_opt_same_chain(const struct obj_update *a,
+			       const struct obj_update *b)
+{
+	return !strcmp(nftnl_rule_get_str(a->rule, NFTNL_RULE_TABLE),
+		       nftnl_rule_get_str(b->rule, NFTNL_RULE_TABLE)) &&
+	       !strcmp(nftnl_rule_get_str(a->rule, NFTNL_RULE_CHAIN),
+		       nftnl_rule_get_str(b->rule, NFTNL_RULE_CHAIN));
+}
+
+static int nft_opt_key_find(const struct nft_opt_group *g, unsigned int pos)
+{
+	unsigned int i;
+
+	for (i = 0; i < g->nkeys; i++) {
+		if (g->key[i].pos == pos)
+			return i;
 	}
+	return -1;
+}
 
-	if (rulenum > 0) {
-		r = nft_rule_find(h, c, data, rulenum);
-		if (r == NULL) {
-			/* special case: iptables allows to insert into
-			 * rule_count + 1 position.
-			 */
-			r = nft_rule_find(h, c, data, rulenum - 1);
-			if (r != NULL)
-				return nft_rule_append(h, chain, table, data,
-						       NULL, verbose);
+/* Whether @b may be merged with @a. The keys are found on the first pair of
+ * rules, the others may only differ in these.
+ */
+static bool nft_opt_group_add(struct nft_handle *h, struct nft_opt_group *g,
+			      const struct nft_opt_rule *a,
+			      const struct nft_opt_rule *b, bool first)
+{
+	struct nft_opt_key ka, kb;
+	unsigned int pos;
+	int i;
 
-			errno = E2BIG;
-			goto err;
-		}
+	if (a->nexpr != b->nexpr ||
+	    !nft_opt_rule_attr_equal(a->obj->rule, b->obj->rule,
+				     NFTNL_RULE_COMPAT_PROTO) ||
+	    !nft_opt_rule_attr_equal(a->obj->rule, b->obj->rule,
+				     NFTNL_RULE_COMPAT_FLAGS))
+		return false;
+
+	if (first) {
+		g->nkeys = 0;
+		g->key_len = 0;
 	}
 
-	new_rule = nft_rule_add(h, chain, table, data, r, verbose);
-	if (!new_rule)
-		goto err;
+	for (pos = 0; pos < a->nexpr; pos++) {
+		if (nft_opt_expr_equal(a->expr[pos], b->expr[pos]))
+			continue;
+		if (pos == a->nexpr - 1 && nft_opt_verdict(a->expr[pos]) &&
+		    nft_opt_verdict(b->expr[pos]))
+			continue;
+		if (nft_opt_comment(a->expr[pos]) &&
+		    nft_opt_comment(b->expr[pos]))
+			continue;
 
-	if (r)
-		nftnl_chain_rule_insert_at(new_rule, r);
-	else
-		nftnl_chain_rule_add(new_rule, c);
+		if (!nft_opt_key_ok(h, a, pos, &ka) ||
+		    !nft_opt_key_ok(h, b, pos, &kb) || ka.len != kb.len)
+			return false;
 
-	return 1;
-err:
-	return 0;
+		i = nft_opt_key_find(g, pos);
+		if (i >= 0)
+			continue;
+		if (!first || g->nkeys == NFT_OPT_KEYS_MAX)
+			return false;
+
+		ka.offset = g->key_len;
+		g->key_len += (ka.len + NETLINK_ALIGN - 1) & ~(NETLINK_ALIGN - 1);
+		if (g->key_len > NFT_DATA_VALUE_MAXLEN)
+			return false;
+		g->key[g->nkeys++] = ka;
+	}
+	return g->nkeys > 0;
 }
 
-int nft_rule_delete_num(struct nft_handle *h, const char *chain,
-			const char *table, int rulenum, bool verbose)
+static void nft_opt_key_data(const struct nft_opt_group *g,
+			     const struct nft_opt_rule *or, uint8_t *key)
 {
-	int ret = 0;
-	struct nftnl_chain *c;
-	struct nftnl_rule *r;
-
-	nft_fn = nft_rule_delete_num;
+	const void *data;
+	unsigned int i;
+	uint32_t len;
 
-	c = nft_chain_find(h, table, chain);
-	if (!c) {
-		errno = ENOENT;
-		return 0;
+	memset(key, 0, NFT_DATA_VALUE_MAXLEN);
+	for (i = 0; i < g->nkeys; i++) {
+		data = nftnl_expr_get(or->expr[g->key[i].pos],
+				      NFTNL_EXPR_CMP_DATA, &len);
+		memcpy(key + g->key[i].offset, data, len);
 	}
+}
 
-	r = nft_rule_find(h, c, NULL, rulenum);
-	if (r != NULL) {
-		DEBUGP("deleting rule by number %d\n", rulenum);
-		ret = __nft_rule_del(h, r);
-		if (ret < 0)
-			errno = ENOMEM;
-	} else
-		errno = E2BIG;
+static int nft_opt_elem_cmp(const void *a, const void *b)
+{
+	const struct nft_opt_elem *ea = a, *eb = b;
+	int ret = memcmp(ea->key, eb->key, sizeof(ea->key));
 
-	return ret;
+	return ret ? ret : (int)ea->idx - (int)eb->idx;
 }
 
-int nft_rule_replace(struct nft_handle *h, const char *chain,
-		     const char *table, void *data, int rulenum, bool verbose)
+/* Number of leading rules with distinct keys: a set holds each key once, and
+ * of two rules on the same key only the first may decide on a packet.
+ */
+static unsigned int nft_opt_distinct(const struct nft_opt_group *g,
+				     const struct nft_opt_rule *rules,
+				     unsigned int n)
 {
-	int ret = 0;
-	struct nftnl_chain *c;
-	struct nftnl_rule *r;
+	struct nft_opt_elem *el;
+	unsigned int i, m = n;
 
-	nft_fn = nft_rule_replace;
+	el = xtables_calloc(n, sizeof(*el));
+	for (i = 0; i < n; i++) {
+		nft_opt_key_data(g, &rules[i], el[i].key);
+		el[i].idx = i;
+	}
+	qsort(el, n, sizeof(*el), nft_opt_elem_cmp);
 
-	c = nft_chain_find(h, table, chain);
-	if (!c) {
-		errno = ENOENT;
-		return 0;
+	for (i = 1; i < n; i++) {
+		if (!memcmp(el[i - 1].key, el[i].key, sizeof(el[i].key)) &&
+		    el[i].idx < m)
+			m = el[i].idx;
 	}
+	free(el);
 
-	r = nft_rule_find(h, c, data, rulenum);
-	if (r != NULL) {
-		DEBUGP("replacing rule with handle=%llu\n",
-			(unsigned long long)
-			nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE));
+	return m;
+}
 
-		ret = nft_rule_append(h, chain, table, data, r, verbose);
-	} else
-		errno = E2BIG;
+static struct nftnl_expr *nft_opt_lookup(struct nft_handle *h,
+					 const struct nft_opt_group *g,
+					 const struct nft_opt_rule *a,
+					 struct nftnl_rule *r, uint32_t set_id,
+					 bool vmap)
+{
+	struct nftnl_expr *e;
+	unsigned int i;
+	uint32_t dreg;
 
-	return ret;
+	for (i = 0; i < g->nkeys; i++) {
+		e = nft_opt_expr_clone(a->expr[g->key[i].pos - 1]);
+		if (!e)
+			return NULL;
+		dreg = i ? NFT_REG32_00 + g->key[i].offset / sizeof(uint32_t) :
+			   NFT_REG_1;
+		nft_opt_load_set_dreg(e, dreg);
+		nftnl_rule_add_expr(r, e);
+	}
+
+	e = gen_lookup(NFT_REG_1, "__set%d", set_id, 0);
+	if (e && vmap)
+		nftnl_expr_set_u32(e, NFTNL_EXPR_LOOKUP_DREG, NFT_REG_VERDICT);
+	return e;
 }
 
-static int
-__nft_rule_list(struct nft_handle *h, struct nftnl_chain *c,
-		int rulenum, unsigned int format,
-		void (*cb)(struct nft_handle *h, struct nftnl_rule *r,
-			   unsigned int num, unsigned int format))
+static struct nftnl_set *nft_opt_set(struct nft_handle *h,
+				     const struct nft_opt_group *g,
+				     const struct nft_opt_rule *rules,
+				     unsigned int n, bool vmap)
 {
-	struct nftnl_rule_iter *iter;
+	const struct nftnl_expr *verdict;
+	struct nftnl_set_elem *elem;
+	uint8_t key[NFT_DATA_VALUE_MAXLEN];
+	uint32_t type = 0;
+	struct obj_update *obj;
+	struct nftnl_set *s;
+	unsigned int i;
+
+	for (i = 0; i < g->nkeys; i++)
+		type = type << CONCAT_TYPE_BITS | g->key[i].type;
+
+	s = add_anon_set(h, nftnl_rule_get_str(rules[0].obj->rule,
+					       NFTNL_RULE_TABLE),
+			 vmap ? NFT_SET_MAP : 0, type, g->key_len, n);
+	if (!s)
+		return NULL;
+	if (vmap)
+		nftnl_set_set_u32(s, NFTNL_SET_DATA_TYPE, NFT_DATA_VERDICT);
+
+	/* the set goes before the rule looking it up */
+	obj = list_entry(h->obj_list.prev, struct obj_update, head);
+	list_move_tail(&obj->head, &rules[0].obj->head);
+
+	for (i = 0; i < n; i++) {
+		elem = nftnl_set_elem_alloc();
+		if (!elem)
+			return NULL;
+
+		nft_opt_key_data(g, &rules[i], key);
+		nftnl_set_elem_set(elem, NFTNL_SET_ELEM_KEY, key, g->key_len);
+		if (vmap) {
+			verdict = rules[i].expr[rules[i].nexpr - 1];
+			nftnl_set_elem_set_u32(elem, NFTNL_SET_ELEM_VERDICT,
+				nftnl_expr_get_u32(verdict,
+						   NFTNL_EXPR_IMM_VERDICT));
+			if (nftnl_expr_is_set(verdict, NFTNL_EXPR_IMM_CHAIN))
+				nftnl_set_elem_set_str(elem,
+					NFTNL_SET_ELEM_CHAIN,
+					nftnl_expr_get_str(verdict,
+							   NFTNL_EXPR_IMM_CHAIN));
+		}
+		nftnl_set_elem_add(s, elem);
+	}
+	return s;
+}
+
+static bool nft_opt_expr_shared(const struct nft_opt_rule *rules,
+				unsigned int n, unsigned int pos)
+{
+	unsigned int i;
+
+	for (i = 1; i < n; i++) {
+		if (!nft_opt_expr_equal(rules[0].expr[pos], rules[i].expr[pos]))
+			return false;
+	}
+	return true;
+}
+
+/* Replace the first @n rules of @rules by a single one, in the transaction
+ * and in the cache.
+ */
+static int nft_opt_merge(struct nft_handle *h, const struct nft_opt_group *g,
+			 struct nft_opt_rule *rules, unsigned int n)
+{
+	const struct nft_opt_rule *a = &rules[0];
+	const char *table = nftnl_rule_get_str(a->obj->rule, NFTNL_RULE_TABLE);
+	const char *chain = nftnl_rule_get_str(a->obj->rule, NFTNL_RULE_CHAIN);
+	unsigned int i, pos, last = g->key[g->nkeys - 1].pos;
+	struct nftnl_udata_buf *udata;
+	struct nftnl_chain *c;
+	struct nftnl_expr *e;
+	struct nftnl_set *s, *m = NULL;
 	struct nftnl_rule *r;
-	int rule_ctr = 0;
+	bool vmap;
 
-	if (rulenum > 0) {
-		r = nftnl_rule_lookup_byindex(c, rulenum - 1);
-		if (!r)
-			/* iptables-legacy returns 0 when listing for
-			 * valid chain but invalid rule number
-			 */
-			return 1;
-		cb(h, r, rulenum, format);
-		return 1;
+	vmap = !nft_opt_expr_shared(rules, n, a->nexpr - 1);
+
+	/* The keys are matched where the last one was, so that what follows,
+	 * e.g. the counter, only sees packets matching them. A verdict map
+	 * takes the place of the verdict and looks the keys up once more.
+	 */
+	s = nft_opt_set(h, g, rules, n, false);
+	if (!s)
+		return -ENOMEM;
+	if (vmap) {
+		m = nft_opt_set(h, g, rules, n, true);
+		if (!m)
+			return -ENOMEM;
 	}
 
-	iter = nftnl_rule_iter_create(c);
-	if (iter == NULL)
-		return 0;
+	r = nftnl_rule_alloc();
+	if (!r)
+		return -ENOMEM;
 
-	r = nftnl_rule_iter_next(iter);
-	while (r != NULL) {
-		cb(h, r, ++rule_ctr, format);
-		r = nftnl_rule_iter_next(iter);
+	nftnl_rule_set_u32(r, NFTNL_RULE_FAMILY, h->family);
+	nftnl_rule_set_str(r, NFTNL_RULE_TABLE, table);
+	nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, chain);
+	if (nftnl_rule_is_set(a->obj->rule, NFTNL_RULE_COMPAT_PROTO))
+		add_compat(r, nftnl_rule_get_u32(a->obj->rule,
+						 NFTNL_RULE_COMPAT_PROTO),
+			   nftnl_rule_get_u32(a->obj->rule,
+					      NFTNL_RULE_COMPAT_FLAGS));
+
+	for (pos = 0; pos < a->nexpr; pos++) {
+		e = NULL;
+		if (nft_opt_key_find(g, pos) >= 0 ||
+		    nft_opt_key_find(g, pos + 1) >= 0) {
+			if (pos == last)
+				e = nft_opt_lookup(h, g, a, r,
+						   nftnl_set_get_u32(s, NFTNL_SET_ID),
+						   false);
+			else
+				continue;
+		} else if (pos == a->nexpr - 1 && vmap) {
+			e = nft_opt_lookup(h, g, a, r,
+					   nftnl_set_get_u32(m, NFTNL_SET_ID),
+					   true);
+		} else if (nft_opt_comment(a->expr[pos]) &&
+			   !nft_opt_expr_shared(rules, n, pos)) {
+			continue;
+		} else {
+			e = nft_opt_expr_clone(a->expr[pos]);
+		}
+		if (!e) {
+			nftnl_rule_free(r);
+			return -ENOMEM;
+		}
+		nftnl_rule_add_expr(r, e);
 	}
 
-	nftnl_rule_iter_destroy(iter);
-	return 1;
-}
+	udata = nftnl_udata_buf_alloc(NFT_USERDATA_MAXLEN);
+	if (!udata || !nftnl_udata_put_u32(udata, UDATA_TYPE_OPTIMIZED, n)) {
+		nftnl_rule_free(r);
+		return -ENOMEM;
+	}
+	nftnl_rule_set_data(r, NFTNL_RULE_USERDATA,
+			    nftnl_udata_buf_data(udata),
+			    nftnl_udata_buf_len(udata));
+	nftnl_udata_buf_free(udata);
 
-static int nft_rule_count(struct nft_handle *h, struct nftnl_chain *c)
-{
-	struct nftnl_rule_iter *iter;
-	struct nftnl_rule *r;
-	int rule_ctr = 0;
+	printf("# %s %s: %u rules from line %u to %u merged into %s\n",
+	       table, chain, n, a->obj->error.lineno,
+	       rules[n - 1].obj->error.lineno,
+	       vmap ? "a verdict map" : "a set lookup");
 
-	iter = nftnl_rule_iter_create(c);
-	if (iter == NULL)
-		return 0;
+	c = nft_chain_find(h, table, chain);
+	if (c) {
+		nftnl_chain_rule_insert_at(r, a->obj->rule);
+		nft_cache_rule_add(h, c, r, false);
+	}
 
-	r = nftnl_rule_iter_next(iter);
-	while (r != NULL) {
-		rule_ctr++;
-		r = nftnl_rule_iter_next(iter);
+	for (i = 0; i < n; i++) {
+		nft_rule_index_del(h, rules[i].obj->rule);
+		nftnl_rule_list_del(rules[i].obj->rule);
+		nftnl_rule_free(rules[i].obj->rule);
+		if (i)
+			batch_obj_del(h, rules[i].obj);
 	}
+	rules[0].obj->rule = r;
 
-	nftnl_rule_iter_destroy(iter);
-	return rule_ctr;
+	return 0;
 }
 
-static void __nft_print_header(struct nft_handle *h,
-			       struct nftnl_chain *c, unsigned int format)
+static void nft_opt_run(struct nft_handle *h, struct nft_opt_rule *rules,
+			unsigned int nrules, struct nft_opt_stats *stats)
 {
-	const char *chain_name = nftnl_chain_get_str(c, NFTNL_CHAIN_NAME);
-	bool basechain = !!nftnl_chain_get(c, NFTNL_CHAIN_HOOKNUM);
-	uint32_t refs = nftnl_chain_get_u32(c, NFTNL_CHAIN_USE);
-	uint32_t entries = nft_rule_count(h, c);
-	struct xt_counters ctrs = {
-		.pcnt = nftnl_chain_get_u64(c, NFTNL_CHAIN_PACKETS),
-		.bcnt = nftnl_chain_get_u64(c, NFTNL_CHAIN_BYTES),
-	};
-	const char *pname = NULL;
+	struct nft_opt_group g;
+	unsigned int i = 0, j, n;
 
-	if (nftnl_chain_is_set(c, NFTNL_CHAIN_POLICY))
-		pname = policy_name[nftnl_chain_get_u32(c, NFTNL_CHAIN_POLICY)];
+	while (i + 1 < nrules) {
+		if (!nft_opt_group_add(h, &g, &rules[i], &rules[i + 1], true)) {
+			i++;
+			continue;
+		}
+		for (j = i + 2; j < nrules; j++) {
+			if (!nft_opt_group_add(h, &g, &rules[i], &rules[j],
+					       false))
+				break;
+		}
 
-	h->ops->print_header(format, chain_name, pname,
-			&ctrs, basechain, refs - entries, entries);
-}
+		n = nft_opt_distinct(&g, &rules[i], j - i);
+		if (n < 2) {
+			i++;
+			continue;
+		}
 
-int nft_rule_list(struct nft_handle *h, const char *chain, const char *table,
-		  int rulenum, unsigned int format)
-{
-	const struct nft_family_ops *ops = h->ops;
-	struct nftnl_chain_list *list;
-	struct nftnl_chain_list_iter *iter;
-	struct nftnl_chain *c;
-	bool found = false;
+		if (nft_opt_merge(h, &g, &rules[i], n) < 0)
+			xtables_error(OTHER_PROBLEM, "Can't allocate memory");
 
-	nft_xt_builtin_init(h, table);
-	nft_assert_table_compatible(h, table, chain);
+		stats->rules += n;
+		stats->merged++;
+		i += n;
+	}
 
-	list = nft_chain_list_get(h, table, chain);
-	if (!list)
-		return 0;
+	for (i = 0; i < nrules; i++)
+		free(rules[i].expr);
+}
 
-	if (chain) {
-		c = nftnl_chain_list_lookup_byname(list, chain);
-		if (!c)
-			return 0;
+static void nft_optimize(struct nft_handle *h)
+{
+	struct nft_opt_stats stats = {};
+	struct nft_opt_rule *rules = NULL;
+	unsigned int nrules = 0, size = 0;
+	struct obj_update *n, *tmp;
+	bool ok;
 
-		if (!rulenum) {
-			if (ops->print_table_header)
-				ops->print_table_header(table);
-			__nft_print_header(h, c, format);
+	list_for_each_entry_safe(n, tmp, &h->obj_list, head) {
+		ok = n->type == NFT_COMPAT_RULE_APPEND && !n->skip;
+		if (nrules && (!ok || !nft_opt_same_chain(rules[0].obj, n))) {
+			nft_opt_run(h, rules, nrules, &stats);
+			nrules = 0;
+		}
+		if (!ok)
+			continue;
+
+		if (nrules == size) {
+			size = size ? size * 2 : 64;
+			rules = xtables_realloc(rules, size * sizeof(*rules));
+		}
+		if (nft_opt_rule_load(n, &rules[nrules])) {
+			nrules++;
+		} else if (nrules) {
+			nft_opt_run(h, rules, nrules, &stats);
+			nrules = 0;
 		}
-		__nft_rule_list(h, c, rulenum, format, ops->print_rule);
-		return 1;
 	}
+	if (nrules)
+		nft_opt_run(h, rules, nrules, &stats);
+	free(rules);
 
-	iter = nftnl_chain_list_iter_create(list);
-	if (iter == NULL)
-		return 0;
+	if (stats.merged)
+		printf("# %u rules merged into %u\n",
+		       stats.rules, stats.merged);
+}
 
-	if (ops->print_table_header)
-		ops->print_table_header(table);
+/* A merged rule is listed as the rules it stands for, one per element of its
+ * set in key order, so that it can be saved, checked and deleted as if it
+ * had never been merged. These rules all carry the handle of the merged rule,
+ * which the cache keeps aside, and share its counters.
+ */
+static int recover_rule_compat(struct nftnl_rule *r);
+static int nft_expr_zero_counter(struct nftnl_expr *e, void *data);
 
-	c = nftnl_chain_list_iter_next(iter);
-	while (c != NULL) {
-		if (found)
-			printf("\n");
+struct nft_opt_part {
+	uint8_t			key[NFT_DATA_VALUE_MAXLEN];
+	uint32_t		verdict;
+	const char		*chain;
+};
 
-		__nft_print_header(h, c, format);
-		__nft_rule_list(h, c, rulenum, format, ops->print_rule);
+static int nft_opt_part_cmp(const void *a, const void *b)
+{
+	const struct nft_opt_part *pa = a, *pb = b;
 
-		found = true;
-		c = nftnl_chain_list_iter_next(iter);
-	}
-	nftnl_chain_list_iter_destroy(iter);
-	return 1;
+	return memcmp(pa->key, pb->key, sizeof(pa->key));
 }
 
-static void
-list_save(struct nft_handle *h, struct nftnl_rule *r,
-	  unsigned int num, unsigned int format)
+/* The elements of set @name sorted by key, NULL if there are none. */
+static struct nft_opt_part *nft_opt_parts(struct nftnl_set_list *sets,
+					  const char *name, uint32_t key_len,
+					  unsigned int *n)
 {
-	nft_rule_print_save(h, r, NFT_RULE_APPEND, format);
-}
+	struct nft_opt_part *parts = NULL, *p;
+	struct nftnl_set_elems_iter *iter;
+	struct nftnl_set_elem *elem;
+	unsigned int size = 0;
+	struct nftnl_set *s;
+	const void *data;
+	uint32_t len;
 
-static int __nftnl_rule_list_chain_save(struct nftnl_chain *c, void *data)
-{
-	const char *chain_name = nftnl_chain_get_str(c, NFTNL_CHAIN_NAME);
-	uint32_t policy = nftnl_chain_get_u32(c, NFTNL_CHAIN_POLICY);
-	int *counters = data;
+	*n = 0;
 
-	if (!nft_chain_builtin(c)) {
-		printf("-N %s\n", chain_name);
-		return 0;
-	}
+	s = nftnl_set_list_lookup_byname(sets, name);
+	if (!s || nftnl_set_get_u32(s, NFTNL_SET_KEY_LEN) != key_len)
+		return NULL;
 
-	/* this is a base chain */
+	iter = nftnl_set_elems_iter_create(s);
+	if (!iter)
+		return NULL;
 
-	printf("-P %s %s", chain_name, policy_name[policy]);
-	if (*counters)
-		printf(" -c %"PRIu64" %"PRIu64,
-		       nftnl_chain_get_u64(c, NFTNL_CHAIN_PACKETS),
-		       nftnl_chain_get_u64(c, NFTNL_CHAIN_BYTES));
-	printf("\n");
-	return 0;
+	while ((elem = nftnl_set_elems_iter_next(iter))) {
+		data = nftnl_set_elem_get(elem, NFTNL_SET_ELEM_KEY, &len);
+		if (!data || len != key_len) {
+			*n = 0;
+			break;
+		}
+		if (*n == size) {
+			size = size ? size * 2 : 64;
+			parts = xtables_realloc(parts, size * sizeof(*parts));
+		}
+		p = &parts[(*n)++];
+		memset(p, 0, sizeof(*p));
+		memcpy(p->key, data, len);
+		if (nftnl_set_elem_is_set(elem, NFTNL_SET_ELEM_VERDICT))
+			p->verdict = nftnl_set_elem_get_u32(elem,
+						NFTNL_SET_ELEM_VERDICT);
+		if (nftnl_set_elem_is_set(elem, NFTNL_SET_ELEM_CHAIN))
+			p->chain = nftnl_set_elem_get_str(elem,
+						NFTNL_SET_ELEM_CHAIN);
+	}
+	nftnl_set_elems_iter_destroy(iter);
+
+	if (!*n) {
+		free(parts);
+		return NULL;
+	}
+	qsort(parts, *n, sizeof(*parts), nft_opt_part_cmp);
+	return parts;
 }
 
-static int
-nftnl_rule_list_chain_save(struct nft_handle *h, const char *chain,
-			   struct nftnl_chain_list *list, int counters)
+/* The rule standing for element @p of merged rule @r, see nft_opt_merge()
+ * for how the keys at @lpos and the verdict map at @vpos are looked up.
+ */
+static struct nftnl_rule *nft_opt_part_rule(struct nft_handle *h,
+					    struct nftnl_rule *r,
+					    struct nftnl_expr **expr,
+					    unsigned int nexpr,
+					    const struct nft_opt_key *key,
+					    unsigned int nkeys,
+					    unsigned int lpos, unsigned int vpos,
+					    const struct nft_opt_part *p,
+					    const struct nft_opt_part *map,
+					    unsigned int nmap)
 {
-	struct nftnl_chain *c;
+	const struct nft_opt_part *v;
+	struct nftnl_expr *e;
+	struct nftnl_rule *part;
+	unsigned int pos, i;
+	const char *data;
+	uint32_t len;
 
-	if (chain) {
-		c = nftnl_chain_list_lookup_byname(list, chain);
-		if (!c)
-			return 0;
+	part = nftnl_rule_alloc();
+	if (!part)
+		return NULL;
 
-		__nftnl_rule_list_chain_save(c, &counters);
-		return 1;
-	}
+	nftnl_rule_set_u32(part, NFTNL_RULE_FAMILY, h->family);
+	nftnl_rule_set_str(part, NFTNL_RULE_TABLE,
+			   nftnl_rule_get_str(r, NFTNL_RULE_TABLE));
+	nftnl_rule_set_str(part, NFTNL_RULE_CHAIN,
+			   nftnl_rule_get_str(r, NFTNL_RULE_CHAIN));
+	nftnl_rule_set_u64(part, NFTNL_RULE_HANDLE,
+			   nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE));
+	if (nftnl_rule_is_set(r, NFTNL_RULE_COMPAT_PROTO))
+		add_compat(part, nftnl_rule_get_u32(r, NFTNL_RULE_COMPAT_PROTO),
+			   nftnl_rule_get_u32(r, NFTNL_RULE_COMPAT_FLAGS));
+
+	for (pos = 0; pos < nexpr; pos++) {
+		if ((pos >= lpos - nkeys && pos < lpos) ||
+		    (vpos && pos >= vpos - nkeys && pos < vpos))
+			continue;
 
-	nftnl_chain_list_foreach(list, __nftnl_rule_list_chain_save, &counters);
-	return 1;
+		if (pos == lpos) {
+			for (i = 0; i < nkeys; i++) {
+				e = nft_opt_expr_clone(expr[lpos - nkeys + i]);
+				if (!e)
+					goto err;
+				nft_opt_load_set_dreg(e, NFT_REG_1);
+				nftnl_rule_add_expr(part, e);
+
+				data = (const char *)p->key + key[i].offset;
+				len = key[i].len;
+				if (key[i].type == NFT_DATATYPE_IFNAME)
+					len = strnlen(data, len - 1) + 1;
+
+				e = nftnl_expr_alloc("cmp");
+				if (!e)
+					goto err;
+				nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_SREG,
+						   NFT_REG_1);
+				nftnl_expr_set_u32(e, NFTNL_EXPR_CMP_OP,
+						   NFT_CMP_EQ);
+				nftnl_expr_set(e, NFTNL_EXPR_CMP_DATA, data, len);
+				nftnl_rule_add_expr(part, e);
+			}
+			continue;
+		}
+
+		if (pos == vpos) {
+			v = bsearch(p, map, nmap, sizeof(*map),
+				    nft_opt_part_cmp);
+			if (!v)
+				goto err;
+			if (v->chain ? add_jumpto(part, v->chain, v->verdict) :
+				       add_verdict(part, v->verdict))
+				goto err;
+			continue;
+		}
+
+		e = nft_opt_expr_clone(expr[pos]);
+		if (!e)
+			goto err;
+		nftnl_rule_add_expr(part, e);
+	}
+	return part;
+err:
+	nftnl_rule_free(part);
+	return NULL;
 }
 
-int nft_rule_list_save(struct nft_handle *h, const char *chain,
-		       const char *table, int rulenum, int counters)
+/* Put the rules merged rule @r of chain @c stands for in its place. Rules
+ * which don't look like nft_opt_merge() made them are left alone, they
+ * can't be listed then.
+ */
+static int nft_opt_expand(struct nft_handle *h, struct nftnl_chain *c,
+			  struct nftnl_rule *r, struct nftnl_set_list *sets)
 {
-	struct nftnl_chain_list *list;
-	struct nftnl_chain_list_iter *iter;
-	unsigned int format = 0;
-	struct nftnl_chain *c;
-	int ret = 0;
+	unsigned int nexpr, nkeys = 0, lpos, vpos = 0, nparts = 0, nmap = 0, i;
+	struct nft_opt_part *parts = NULL, *map = NULL;
+	struct nft_opt_key key[NFT_OPT_KEYS_MAX];
+	struct nftnl_rule **rules = NULL;
+	struct nftnl_expr **expr, *e;
+	uint32_t key_len = 0, dreg;
+	int ret = -1;
 
-	nft_xt_builtin_init(h, table);
-	nft_assert_table_compatible(h, table, chain);
+	expr = nft_opt_expr_array(r, &nexpr);
+	if (!expr)
+		return -1;
 
-	list = nft_chain_list_get(h, table, chain);
-	if (!list)
-		return 0;
+	for (lpos = 0; lpos < nexpr; lpos++) {
+		e = expr[lpos];
+		if (nft_opt_expr_is(e, "lookup") &&
+		    !nftnl_expr_is_set(e, NFTNL_EXPR_LOOKUP_DREG))
+			break;
+	}
+	if (lpos == nexpr)
+		goto out;
 
-	/* Dump policies and custom chains first */
-	if (!rulenum)
-		nftnl_rule_list_chain_save(h, chain, list, counters);
+	e = expr[nexpr - 1];
+	if (nft_opt_expr_is(e, "lookup") &&
+	    nftnl_expr_is_set(e, NFTNL_EXPR_LOOKUP_DREG) &&
+	    nftnl_expr_get_u32(e, NFTNL_EXPR_LOOKUP_DREG) == NFT_REG_VERDICT)
+		vpos = nexpr - 1;
 
-	if (counters < 0)
-		format = FMT_C_COUNTS;
-	else if (counters == 0)
-		format = FMT_NOCOUNTS;
+	while (nkeys < lpos && nkeys < NFT_OPT_KEYS_MAX &&
+	       nft_opt_load(expr[lpos - nkeys - 1]))
+		nkeys++;
+	if (!nkeys || (vpos && vpos <= lpos + nkeys))
+		goto out;
+	for (i = 0; vpos && i < nkeys; i++) {
+		if (!nft_opt_load(expr[vpos - nkeys + i]))
+			goto out;
+	}
 
-	if (chain) {
-		c = nftnl_chain_list_lookup_byname(list, chain);
-		if (!c)
-			return 0;
+	for (i = 0; i < nkeys; i++) {
+		e = expr[lpos - nkeys + i];
+		dreg = i ? NFT_REG32_00 + key_len / sizeof(uint32_t) :
+			   NFT_REG_1;
+		key[i].offset = key_len;
+		key[i].len = nft_opt_load_len(h, e, &key[i].type);
+		if (!key[i].len || nft_opt_load_dreg(e) != dreg)
+			goto out;
+		key_len += (key[i].len + NETLINK_ALIGN - 1) &
+			   ~(NETLINK_ALIGN - 1);
+		if (key_len > NFT_DATA_VALUE_MAXLEN)
+			goto out;
+	}
 
-		return __nft_rule_list(h, c, rulenum, format, list_save);
+	parts = nft_opt_parts(sets, nftnl_expr_get_str(expr[lpos],
+						       NFTNL_EXPR_LOOKUP_SET),
+			      key_len, &nparts);
+	if (!parts)
+		goto out;
+	if (vpos) {
+		map = nft_opt_parts(sets,
+				    nftnl_expr_get_str(expr[vpos],
+						       NFTNL_EXPR_LOOKUP_SET),
+				    key_len, &nmap);
+		if (!map)
+			goto out;
 	}
 
-	/* Now dump out rules in this table */
-	iter = nftnl_chain_list_iter_create(list);
-	if (iter == NULL)
-		return 0;
+	rules = xtables_calloc(nparts, sizeof(*rules));
+	for (i = 0; i < nparts; i++) {
+		rules[i] = nft_opt_part_rule(h, r, expr, nexpr, key, nkeys,
+					     lpos, vpos, &parts[i], map, nmap);
+		if (!rules[i])
+			goto out;
+	}
 
-	c = nftnl_chain_list_iter_next(iter);
-	while (c != NULL) {
-		ret = __nft_rule_list(h, c, rulenum, format, list_save);
-		c = nftnl_chain_list_iter_next(iter);
+	for (i = 0; i < nparts; i++) {
+		nftnl_chain_rule_insert_at(rules[i], r);
+		rules[i] = NULL;
 	}
-	nftnl_chain_list_iter_destroy(iter);
+	nftnl_rule_list_del(r);
+	nft_cache_merged_add(h, c, r);
+	ret = 0;
+out:
+	if (rules) {
+		for (i = 0; i < nparts; i++) {
+			if (rules[i])
+				nftnl_rule_free(rules[i]);
+		}
+		free(rules);
+	}
+	free(map);
+	free(parts);
+	free(expr);
 	return ret;
 }
 
-int nft_rule_zero_counters(struct nft_handle *h, const char *chain,
-			   const char *table, int rulenum)
+void nft_opt_chain_postprocess(struct nft_handle *h, struct nftnl_chain *c,
+			       struct nftnl_set_list *sets)
 {
-	struct iptables_command_state cs = {};
-	struct nftnl_chain *c;
+	struct nftnl_rule **merged = NULL;
+	unsigned int n = 0, size = 0, i;
+	struct nftnl_rule_iter *iter;
 	struct nftnl_rule *r;
-	int ret = 0;
 
-	nft_fn = nft_rule_delete;
+	iter = nftnl_rule_iter_create(c);
+	if (!iter)
+		return;
+	while ((r = nftnl_rule_iter_next(iter))) {
+		if (!nft_rule_is_optimized(r))
+			continue;
+		if (n == size) {
+			size = size ? size * 2 : 16;
+			merged = xtables_realloc(merged,
+						 size * sizeof(*merged));
+		}
+		merged[n++] = r;
+	}
+	nftnl_rule_iter_destroy(iter);
+
+	for (i = 0; i < n; i++)
+		nft_opt_expand(h, c, merged[i], sets);
+	free(merged);
+}
+
+/* The kernel only knows the merged rule, the rules it stands for can't be
+ * changed one by one. Add the ones staying as plain rules in front of it and
+ * delete it instead: with @op DELETE, @part goes away, with REPLACE, @new
+ * takes its place and with INSERT, @new goes in front of it. ZERO keeps all
+ * of them, @part with zeroed counters.
+ */
+static int nft_opt_split(struct nft_handle *h, struct nftnl_rule *part,
+			 struct nftnl_rule *new, enum nft_opt_split_op op)
+{
+	uint64_t handle = nftnl_rule_get_u64(part, NFTNL_RULE_HANDLE);
+	const char *table = nftnl_rule_get_str(part, NFTNL_RULE_TABLE);
+	const char *chain = nftnl_rule_get_str(part, NFTNL_RULE_CHAIN);
+	struct nftnl_rule **parts = NULL, *r, *del = NULL;
+	unsigned int n = 0, size = 0, i;
+	struct nftnl_rule_iter *iter;
+	struct nftnl_chain *c;
+	int ret = -1;
 
 	c = nft_chain_find(h, table, chain);
 	if (!c)
-		return 0;
+		return -1;
 
-	r = nft_rule_find(h, c, NULL, rulenum);
-	if (r == NULL) {
-		errno = ENOENT;
-		ret = 1;
-		goto error;
+	iter = nftnl_rule_iter_create(c);
+	if (!iter)
+		return -1;
+	while ((r = nftnl_rule_iter_next(iter))) {
+		if (!nftnl_rule_is_set(r, NFTNL_RULE_HANDLE) ||
+		    nftnl_rule_get_u64(r, NFTNL_RULE_HANDLE) != handle)
+			continue;
+		if (n == size) {
+			size = size ? size * 2 : 16;
+			parts = xtables_realloc(parts, size * sizeof(*parts));
+		}
+		parts[n++] = r;
 	}
+	nftnl_rule_iter_destroy(iter);
 
-	nft_rule_to_iptables_command_state(h, r, &cs);
-
-	cs.counters.pcnt = cs.counters.bcnt = 0;
+	for (i = 0; i < n; i++) {
+		r = parts[i];
+		if (r == part && new) {
+			nftnl_rule_set_u64(new, NFTNL_RULE_POSITION, handle);
+			if (!batch_rule_add(h, NFT_COMPAT_RULE_INSERT, new))
+				goto out;
+			nftnl_chain_rule_insert_at(new, r);
+			nft_cache_rule_add(h, c, new, false);
+		}
+		if (r == part && (op == NFT_OPT_SPLIT_DELETE ||
+				  op == NFT_OPT_SPLIT_REPLACE)) {
+			nft_rule_index_del(h, r);
+			nftnl_rule_list_del(r);
+			if (op == NFT_OPT_SPLIT_DELETE)
+				del = r;
+			else
+				nftnl_rule_free(r);
+			continue;
+		}
+		if (r == part && op == NFT_OPT_SPLIT_ZERO)
+			nftnl_expr_foreach(r, nft_expr_zero_counter, NULL);
+
+		recover_rule_compat(r);
+		nftnl_rule_unset(r, NFTNL_RULE_HANDLE);
+		nftnl_rule_set_u64(r, NFTNL_RULE_POSITION, handle);
+		if (!batch_rule_add(h, NFT_COMPAT_RULE_INSERT, r))
+			goto out;
+	}
 
-	ret =  nft_rule_append(h, chain, table, &cs, r, false);
+	if (!del) {
+		del = nftnl_rule_alloc();
+		if (!del)
+			goto out;
+		nftnl_rule_set_str(del, NFTNL_RULE_TABLE, table);
+		nftnl_rule_set_str(del, NFTNL_RULE_CHAIN, chain);
+		nftnl_rule_set_u64(del, NFTNL_RULE_HANDLE, handle);
+	}
+	if (!batch_rule_add(h, NFT_COMPAT_RULE_DELETE, del))
+		goto out;
 
-error:
+	nft_cache_merged_del(h, del);
+	ret = 0;
+out:
+	free(parts);
 	return ret;
 }
 
-static void nft_compat_table_batch_add(struct nft_handle *h, uint16_t type,
-				       uint16_t flags, uint32_t seq,
-				       struct nftnl_table *table)
+static int nft_opt_split_new(struct nft_handle *h, struct nftnl_rule *part,
+			     void *data, enum nft_opt_split_op op,
+			     bool verbose)
 {
-	struct nlmsghdr *nlh;
+	struct nftnl_rule *r;
 
-	nlh = nftnl_table_nlmsg_build_hdr(nftnl_batch_buffer(h->batch),
-					type, h->family, flags, seq);
-	nftnl_table_nlmsg_build_payload(nlh, table);
-}
+	r = nft_rule_new(h, nftnl_rule_get_str(part, NFTNL_RULE_CHAIN),
+			 nftnl_rule_get_str(part, NFTNL_RULE_TABLE), data);
+	if (!r)
+		return 0;
 
-static void nft_compat_set_batch_add(struct nft_handle *h, uint16_t type,
-				     uint16_t flags, uint32_t seq,
-				     struct nftnl_set *set)
-{
-	struct nlmsghdr *nlh;
+	if (nft_opt_split(h, part, r, op) < 0) {
+		errno = ENOMEM;
+		return 0;
+	}
 
-	nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(h->batch),
-					type, h->family, flags, seq);
-	nftnl_set_nlmsg_build_payload(nlh, set);
-}
+	if (verbose)
+		h->ops->print_rule(h, r, 0, FMT_PRINT_RULE);
 
-static void nft_compat_setelem_batch_add(struct nft_handle *h, uint16_t type,
-					 uint16_t flags, uint32_t *seq,
-					 struct nftnl_set *set)
-{
-	struct nftnl_set_elems_iter *iter;
-	struct nlmsghdr *nlh;
+	return 1;
+}
 
-	iter = nftnl_set_elems_iter_create(set);
-	if (!iter)
-		return;
+/*
+ * restore --diff: rather than flushing the table and adding all of it
+ * anew, the chains being restored are compared with the ones in the kernel
+ * and only what differs is sent. Rules that did not change are left alone
+ * and keep their counters, unless --counters gives different ones, which
+ * has the rule replaced. This is only done for tables the transaction does
+ * nothing to but create chains and append rules, others are flushed as
+ * usual. If the transaction has to be retried, the comparison is redone
+ * against the updated ruleset.
+ */
+struct nft_diff_obj {
+	const void		*ptr;
+	struct obj_update	*obj;
+};
 
-	while (nftnl_set_elems_iter_cur(iter)) {
-		(*seq)++;
-		mnl_nft_batch_continue(h->batch);
-		nlh = nftnl_nlmsg_build_hdr(nftnl_batch_buffer(h->batch),
-					    type, h->family, flags, *seq);
-		if (nftnl_set_elems_nlmsg_build_payload_iter(nlh, iter) <= 0)
-			break;
-	}
-	nftnl_set_elems_iter_destroy(iter);
-}
+struct nft_diff_chain {
+	struct nft_handle	*h;
+	struct nftnl_rule	**old;
+	struct obj_update	**new;
+	uint32_t		*old_fp;
+	uint32_t		*new_fp;
+};
 
-static void nft_compat_chain_batch_add(struct nft_handle *h, uint16_t type,
-				       uint16_t flags, uint32_t seq,
-				       struct nftnl_chain *chain)
+static int nft_diff_obj_cmp(const void *a, const void *b)
 {
-	struct nlmsghdr *nlh;
+	const struct nft_diff_obj *x = a, *y = b;
 
-	nlh = nftnl_chain_nlmsg_build_hdr(nftnl_batch_buffer(h->batch),
-					type, h->family, flags, seq);
-	nftnl_chain_nlmsg_build_payload(nlh, chain);
-	nft_chain_print_debug(chain, nlh);
+	return x->ptr < y->ptr ? -1 : x->ptr > y->ptr;
 }
 
-static void nft_compat_rule_batch_add(struct nft_handle *h, uint16_t type,
-				      uint16_t flags, uint32_t seq,
-				      struct nftnl_rule *rule)
+static struct obj_update *nft_diff_obj_find(const struct nft_diff_obj *objs,
+					    unsigned int nobjs,
+					    const void *ptr)
 {
-	struct nlmsghdr *nlh;
+	struct nft_diff_obj key = { .ptr = ptr }, *o;
 
-	nlh = nftnl_rule_nlmsg_build_hdr(nftnl_batch_buffer(h->batch),
-				       type, h->family, flags, seq);
-	nftnl_rule_nlmsg_build_payload(nlh, rule);
-	nft_rule_print_debug(rule, nlh);
+	o = bsearch(&key, objs, nobjs, sizeof(*objs), nft_diff_obj_cmp);
+	return o ? o->obj : NULL;
 }
 
-static void batch_obj_del(struct nft_handle *h, struct obj_update *o)
+static const char *nft_obj_table(const struct obj_update *n)
 {
-	switch (o->type) {
+	switch (n->type) {
 	case NFT_COMPAT_TABLE_ADD:
 	case NFT_COMPAT_TABLE_FLUSH:
-		nftnl_table_free(o->table);
-		break;
-	case NFT_COMPAT_CHAIN_ZERO:
-	case NFT_COMPAT_CHAIN_USER_ADD:
+		return nftnl_table_get_str(n->table, NFTNL_TABLE_NAME);
 	case NFT_COMPAT_CHAIN_ADD:
-		break;
+	case NFT_COMPAT_CHAIN_USER_ADD:
 	case NFT_COMPAT_CHAIN_USER_DEL:
 	case NFT_COMPAT_CHAIN_USER_FLUSH:
 	case NFT_COMPAT_CHAIN_UPDATE:
 	case NFT_COMPAT_CHAIN_RENAME:
-		nftnl_chain_free(o->chain);
-		break;
+	case NFT_COMPAT_CHAIN_ZERO:
+		return nftnl_chain_get_str(n->chain, NFTNL_CHAIN_TABLE);
 	case NFT_COMPAT_RULE_APPEND:
 	case NFT_COMPAT_RULE_INSERT:
 	case NFT_COMPAT_RULE_REPLACE:
 	case NFT_COMPAT_RULE_DELETE:
-		break;
 	case NFT_COMPAT_RULE_FLUSH:
-		nftnl_rule_free(o->rule);
-		break;
+		return nftnl_rule_get_str(n->rule, NFTNL_RULE_TABLE);
 	case NFT_COMPAT_SET_ADD:
-		nftnl_set_free(o->set);
-		break;
+		return nftnl_set_get_str(n->set, NFTNL_SET_TABLE);
 	}
-	h->obj_list_num--;
-	list_del(&o->head);
-	free(o);
+	return NULL;
 }
 
-static void nft_refresh_transaction(struct nft_handle *h)
+static bool nft_diff_same(unsigned int old, unsigned int new, void *data)
 {
-	const char *tablename, *chainname;
-	const struct nftnl_chain *c;
-	struct obj_update *n, *tmp;
-	bool exists;
-
-	h->error.lineno = 0;
+	struct iptables_command_state cs = {};
+	struct nft_diff_chain *d = data;
+	struct nft_handle *h = d->h;
+	bool ret;
 
-	list_for_each_entry_safe(n, tmp, &h->obj_list, head) {
-		if (n->implicit) {
-			batch_obj_del(h, n);
-			continue;
-		}
+	if (d->old_fp[old] != d->new_fp[new])
+		return false;
 
-		switch (n->type) {
-		case NFT_COMPAT_TABLE_FLUSH:
-			tablename = nftnl_table_get_str(n->table, NFTNL_TABLE_NAME);
-			if (!tablename)
-				continue;
-			exists = nft_table_find(h, tablename);
-			if (exists)
-				n->skip = 0;
-			else
-				n->skip = 1;
-			break;
-		case NFT_COMPAT_CHAIN_USER_ADD:
-			tablename = nftnl_chain_get_str(n->chain, NFTNL_CHAIN_TABLE);
-			if (!tablename)
-				continue;
+	if (h->diff_counters) {
+		struct xt_counters a, b;
 
-			chainname = nftnl_chain_get_str(n->chain, NFTNL_CHAIN_NAME);
-			if (!chainname)
-				continue;
+		nft_rule_counters(d->old[old], &a);
+		nft_rule_counters(d->new[new]->rule, &b);
+		if (a.pcnt != b.pcnt || a.bcnt != b.bcnt)
+			return false;
+	}
 
-			if (!h->noflush)
-				break;
+	h->ops->rule_to_cs(h, d->new[new]->rule, &cs);
+	ret = h->ops->rule_find(h, d->old[old], &cs);
+	h->ops->clear_cs(&cs);
 
-			c = nft_chain_find(h, tablename, chainname);
-			if (c) {
-				/* -restore -n flushes existing rules from redefined user-chain */
-				__nft_rule_flush(h, tablename,
-						 chainname, false, true);
-				n->skip = 1;
-			} else if (!c) {
-				n->skip = 0;
-			}
-			break;
-		case NFT_COMPAT_TABLE_ADD:
-		case NFT_COMPAT_CHAIN_ADD:
-		case NFT_COMPAT_CHAIN_ZERO:
-		case NFT_COMPAT_CHAIN_USER_DEL:
-		case NFT_COMPAT_CHAIN_USER_FLUSH:
-		case NFT_COMPAT_CHAIN_UPDATE:
-		case NFT_COMPAT_CHAIN_RENAME:
-		case NFT_COMPAT_RULE_APPEND:
-		case NFT_COMPAT_RULE_INSERT:
-		case NFT_COMPAT_RULE_REPLACE:
-		case NFT_COMPAT_RULE_DELETE:
-		case NFT_COMPAT_RULE_FLUSH:
-		case NFT_COMPAT_SET_ADD:
-			break;
-		}
-	}
+	return ret;
 }
 
-static int nft_action(struct nft_handle *h, int action)
+static int nft_diff_rule_del(struct nft_handle *h, struct nftnl_rule *old)
 {
-	struct obj_update *n, *tmp;
-	struct mnl_err *err, *ne;
-	unsigned int buflen, i, len;
-	bool show_errors = true;
-	char errmsg[1024];
-	uint32_t seq;
-	int ret = 0;
-
-retry:
-	seq = 1;
-	h->batch = mnl_batch_init();
-
-	mnl_batch_begin(h->batch, h->nft_genid, seq++);
-	h->nft_genid++;
-
-	list_for_each_entry(n, &h->obj_list, head) {
-
-		if (n->skip)
-			continue;
+	struct obj_update *obj;
+	struct nftnl_rule *r;
 
-		n->seq = seq++;
-		switch (n->type) {
-		case NFT_COMPAT_TABLE_ADD:
-			nft_compat_table_batch_add(h, NFT_MSG_NEWTABLE,
-						   NLM_F_CREATE, n->seq,
-						   n->table);
-			break;
-		case NFT_COMPAT_TABLE_FLUSH:
-			nft_compat_table_batch_add(h, NFT_MSG_DELTABLE,
-						   0,
-						   n->seq, n->table);
-			break;
-		case NFT_COMPAT_CHAIN_ADD:
-		case NFT_COMPAT_CHAIN_ZERO:
-			nft_compat_chain_batch_add(h, NFT_MSG_NEWCHAIN,
-						   NLM_F_CREATE, n->seq,
-						   n->chain);
-			break;
-		case NFT_COMPAT_CHAIN_USER_ADD:
-			nft_compat_chain_batch_add(h, NFT_MSG_NEWCHAIN,
-						   NLM_F_EXCL, n->seq,
-						   n->chain);
-			break;
-		case NFT_COMPAT_CHAIN_USER_DEL:
-			nft_compat_chain_batch_add(h, NFT_MSG_DELCHAIN,
-						   NLM_F_NONREC, n->seq,
-						   n->chain);
-			break;
-		case NFT_COMPAT_CHAIN_USER_FLUSH:
-			nft_compat_chain_batch_add(h, NFT_MSG_DELCHAIN,
-						   0, n->seq,
-						   n->chain);
-			break;
-		case NFT_COMPAT_CHAIN_UPDATE:
-			nft_compat_chain_batch_add(h, NFT_MSG_NEWCHAIN,
-						   h->restore ?
-						     NLM_F_CREATE : 0,
-						   n->seq, n->chain);
-			break;
-		case NFT_COMPAT_CHAIN_RENAME:
-			nft_compat_chain_batch_add(h, NFT_MSG_NEWCHAIN, 0,
-						   n->seq, n->chain);
-			break;
-		case NFT_COMPAT_RULE_APPEND:
-			nft_compat_rule_batch_add(h, NFT_MSG_NEWRULE,
-						  NLM_F_CREATE | NLM_F_APPEND,
-						  n->seq, n->rule);
-			break;
-		case NFT_COMPAT_RULE_INSERT:
-			nft_compat_rule_batch_add(h, NFT_MSG_NEWRULE,
-						  NLM_F_CREATE, n->seq,
-						  n->rule);
-			break;
-		case NFT_COMPAT_RULE_REPLACE:
-			nft_compat_rule_batch_add(h, NFT_MSG_NEWRULE,
-						  NLM_F_CREATE | NLM_F_REPLACE,
-						  n->seq, n->rule);
-			break;
-		case NFT_COMPAT_RULE_DELETE:
-		case NFT_COMPAT_RULE_FLUSH:
-			nft_compat_rule_batch_add(h, NFT_MSG_DELRULE, 0,
-						  n->seq, n->rule);
-			break;
-		case NFT_COMPAT_SET_ADD:
-			nft_compat_set_batch_add(h, NFT_MSG_NEWSET,
-						 NLM_F_CREATE, n->seq, n->set);
-			nft_compat_setelem_batch_add(h, NFT_MSG_NEWSETELEM,
-						     NLM_F_CREATE, &n->seq, n->set);
-			seq = n->seq;
-			break;
-		}
+	r = nftnl_rule_alloc();
+	if (!r)
+		return -1;
 
-		mnl_nft_batch_continue(h->batch);
-	}
+	nftnl_rule_set_str(r, NFTNL_RULE_TABLE,
+			   nftnl_rule_get_str(old, NFTNL_RULE_TABLE));
+	nftnl_rule_set_str(r, NFTNL_RULE_CHAIN,
+			   nftnl_rule_get_str(old, NFTNL_RULE_CHAIN));
+	nftnl_rule_set_u64(r, NFTNL_RULE_HANDLE,
+			   nftnl_rule_get_u64(old, NFTNL_RULE_HANDLE));
 
-	switch (action) {
-	case NFT_COMPAT_COMMIT:
-		mnl_batch_end(h->batch, seq++);
-		break;
-	case NFT_COMPAT_ABORT:
-		break;
+	obj = batch_rule_add(h, NFT_COMPAT_RULE_DELETE, r);
+	if (!obj) {
+		nftnl_rule_free(r);
+		return -1;
 	}
+	obj->implicit = 1;
+	return 0;
+}
 
-	errno = 0;
-	ret = mnl_batch_talk(h, seq);
-	if (ret && errno == ERESTART) {
-		nft_rebuild_cache(h);
+/* Turn the appends of the rules in chain @c into the steps from the rules
+ * of @live, the same chain in the kernel.
+ */
+static int nft_diff_chain(struct nft_handle *h, struct nftnl_chain *c,
+			  struct nftnl_chain *live,
+			  const struct nft_diff_obj *objs, unsigned int nobjs,
+			  struct xt_diff_stats *stats)
+{
+	struct nft_diff_chain d = { .h = h };
+	unsigned int nold = 0, nnew = 0, nsteps, i;
+	struct nftnl_rule_iter *iter;
+	struct xt_diff_step *steps;
+	struct obj_update *obj;
+	struct nftnl_rule *r;
+	uint64_t anchor = 0;
+	int ret = -1;
 
-		nft_refresh_transaction(h);
+	nold = nft_rule_count(h, live);
+	nnew = nft_rule_count(h, c);
 
-		list_for_each_entry_safe(err, ne, &h->err_list, head)
-			mnl_err_list_free(err);
+	d.old = xtables_calloc(nold + 1, sizeof(*d.old));
+	d.old_fp = xtables_calloc(nold + 1, sizeof(*d.old_fp));
+	d.new = xtables_calloc(nnew + 1, sizeof(*d.new));
+	d.new_fp = xtables_calloc(nnew + 1, sizeof(*d.new_fp));
+	steps = xtables_calloc(nold + nnew + 1, sizeof(*steps));
 
-		mnl_batch_reset(h->batch);
-		goto retry;
+	i = 0;
+	iter = nftnl_rule_iter_create(live);
+	if (!iter)
+		goto out;
+	while ((r = nftnl_rule_iter_next(iter)) && i < nold) {
+		d.old[i] = r;
+		d.old_fp[i++] = nft_rule_fingerprint(r);
 	}
+	nftnl_rule_iter_destroy(iter);
 
 	i = 0;
-	buflen = sizeof(errmsg);
+	iter = nftnl_rule_iter_create(c);
+	if (!iter)
+		goto out;
+	while ((r = nftnl_rule_iter_next(iter)) && i < nnew) {
+		d.new[i] = nft_diff_obj_find(objs, nobjs, r);
+		d.new_fp[i++] = nft_rule_fingerprint(r);
+	}
+	nftnl_rule_iter_destroy(iter);
 
-	list_for_each_entry_safe(n, tmp, &h->obj_list, head) {
-		list_for_each_entry_safe(err, ne, &h->err_list, head) {
-			if (err->seqnum > n->seq)
+	nsteps = xt_diff_rules(nold, nnew, nft_diff_same, &d, steps, stats);
+
+	/* Backwards, so that each rule to insert knows the next one staying
+	 * in the kernel, which it goes in front of. Rules without one are
+	 * appended.
+	 */
+	for (i = nsteps; i-- > 0; ) {
+		obj = steps[i].op == XT_DIFF_DELETE ? NULL : d.new[steps[i].new];
+
+		switch (steps[i].op) {
+		case XT_DIFF_KEEP:
+			obj->skip = 1;
+			obj->diff = 1;
+			anchor = nftnl_rule_get_u64(d.old[steps[i].old],
+						    NFTNL_RULE_HANDLE);
+			break;
+		case XT_DIFF_REPLACE:
+			anchor = nftnl_rule_get_u64(d.old[steps[i].old],
+						    NFTNL_RULE_HANDLE);
+			nftnl_rule_set_u64(obj->rule, NFTNL_RULE_HANDLE, anchor);
+			obj->type = NFT_COMPAT_RULE_REPLACE;
+			obj->diff = 1;
+			break;
+		case XT_DIFF_INSERT:
+			if (!anchor)
 				break;
+			nftnl_rule_set_u64(obj->rule, NFTNL_RULE_POSITION,
+					   anchor);
+			obj->type = NFT_COMPAT_RULE_INSERT;
+			obj->diff = 1;
+			break;
+		case XT_DIFF_DELETE:
+			if (nft_diff_rule_del(h, d.old[steps[i].old]) < 0)
+				goto out;
+			break;
+		}
+	}
+	ret = 0;
+out:
+	free(steps);
+	free(d.new_fp);
+	free(d.new);
+	free(d.old_fp);
+	free(d.old);
+	return ret;
+}
+
+/* Chains only found in the kernel are flushed first and deleted after
+ * that, as they may jump to each other.
+ */
+static int nft_diff_chain_del(struct nft_handle *h, const char *table,
+			      struct nftnl_chain_list *live,
+			      struct nftnl_chain_list *list, bool flush,
+			      struct xt_diff_stats *stats)
+{
+	struct nftnl_chain_list_iter *iter;
+	struct obj_update *obj = NULL;
+	struct nftnl_chain *c, *del;
+	struct nftnl_rule *r;
+	const char *name;
+	int ret = 0;
+
+	iter = nftnl_chain_list_iter_create(live);
+	if (!iter)
+		return -1;
+
+	for (c = nftnl_chain_list_iter_next(iter); c;
+	     c = nftnl_chain_list_iter_next(iter)) {
+		name = nftnl_chain_get_str(c, NFTNL_CHAIN_NAME);
+		if (nftnl_chain_list_lookup_byname(list, name))
+			continue;
 
-			if (err->seqnum == n->seq && show_errors) {
-				if (n->error.lineno == 0)
-					show_errors = false;
-				len = mnl_append_error(h, n, err, errmsg + i, buflen);
-				if (len > 0 && len <= buflen) {
-					buflen -= len;
-					i += len;
-				}
+		if (flush) {
+			r = nftnl_rule_alloc();
+			if (!r) {
+				ret = -1;
+				break;
 			}
-			mnl_err_list_free(err);
+			nftnl_rule_set_str(r, NFTNL_RULE_TABLE, table);
+			nftnl_rule_set_str(r, NFTNL_RULE_CHAIN, name);
+			obj = batch_rule_add(h, NFT_COMPAT_RULE_FLUSH, r);
+			if (!obj)
+				nftnl_rule_free(r);
+			stats->deleted += nft_rule_count(h, c);
+		} else {
+			del = nftnl_chain_alloc();
+			if (!del) {
+				ret = -1;
+				break;
+			}
+			nftnl_chain_set_str(del, NFTNL_CHAIN_TABLE, table);
+			nftnl_chain_set_str(del, NFTNL_CHAIN_NAME, name);
+			obj = batch_add(h, NFT_COMPAT_CHAIN_USER_DEL, del);
+			if (!obj)
+				nftnl_chain_free(del);
+			stats->chains_deleted++;
 		}
-		batch_obj_del(h, n);
+		if (!obj) {
+			ret = -1;
+			break;
+		}
+		obj->implicit = 1;
 	}
+	nftnl_chain_list_iter_destroy(iter);
 
-	nft_release_cache(h);
-	mnl_batch_reset(h->batch);
+	return ret;
+}
 
-	if (i)
-		xtables_error(RESOURCE_PROBLEM, "%s", errmsg);
+struct nft_diff_set_ids {
+	uint32_t	*ids;
+	unsigned int	n;
+	unsigned int	size;
+};
 
-	return ret == 0 ? 1 : 0;
+static int nft_diff_set_id_cb(struct nftnl_expr *e, void *data)
+{
+	const char *name = nftnl_expr_get_str(e, NFTNL_EXPR_NAME);
+	struct nft_diff_set_ids *d = data;
+
+	if (strcmp(name, "lookup") ||
+	    !nftnl_expr_is_set(e, NFTNL_EXPR_LOOKUP_SET_ID))
+		return 0;
+
+	if (d->n == d->size) {
+		d->size = d->size ? d->size * 2 : 64;
+		d->ids = xtables_realloc(d->ids, d->size * sizeof(*d->ids));
+	}
+	d->ids[d->n++] = nftnl_expr_get_u32(e, NFTNL_EXPR_LOOKUP_SET_ID);
+	return 0;
 }
 
-static int ebt_add_policy_rule(struct nftnl_chain *c, void *data)
+static int nft_diff_u32_cmp(const void *a, const void *b)
 {
-	uint32_t policy = nftnl_chain_get_u32(c, NFTNL_CHAIN_POLICY);
-	struct iptables_command_state cs = {
-		.eb.bitmask = EBT_NOPROTO,
-	};
-	struct nftnl_udata_buf *udata;
-	struct nft_handle *h = data;
-	struct nftnl_rule *r;
-	const char *pname;
-
-	if (nftnl_chain_get(c, NFTNL_CHAIN_HOOKNUM))
-		return 0; /* ignore base chains */
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
 
-	if (!nftnl_chain_is_set(c, NFTNL_CHAIN_POLICY))
-		return 0;
+	return x < y ? -1 : x > y;
+}
 
-	nftnl_chain_unset(c, NFTNL_CHAIN_POLICY);
+/* Anonymous sets of rules left alone are not needed either. */
+static void nft_diff_sets(struct nft_handle *h, const char *table)
+{
+	struct nft_diff_set_ids d = {};
+	struct obj_update *n;
+	uint32_t id;
 
-	switch (policy) {
-	case NFT_RETURN:
-		return 0; /* return policy is default for nft chains */
-	case NF_ACCEPT:
-		pname = "ACCEPT";
-		break;
-	case NF_DROP:
-		pname = "DROP";
-		break;
-	default:
-		return -1;
+	list_for_each_entry(n, &h->obj_list, head) {
+		if (n->skip || (n->type != NFT_COMPAT_RULE_APPEND &&
+				n->type != NFT_COMPAT_RULE_INSERT &&
+				n->type != NFT_COMPAT_RULE_REPLACE) ||
+		    strcmp(nft_obj_table(n), table))
+			continue;
+		nftnl_expr_foreach(n->rule, nft_diff_set_id_cb, &d);
 	}
+	if (d.n)
+		qsort(d.ids, d.n, sizeof(*d.ids), nft_diff_u32_cmp);
 
-	command_jump(&cs, pname);
+	list_for_each_entry(n, &h->obj_list, head) {
+		if (n->skip || n->type != NFT_COMPAT_SET_ADD ||
+		    !(nftnl_set_get_u32(n->set, NFTNL_SET_FLAGS) &
+		      NFT_SET_ANONYMOUS) ||
+		    strcmp(nft_obj_table(n), table))
+			continue;
 
-	r = nft_rule_new(h, nftnl_chain_get_str(c, NFTNL_CHAIN_NAME),
-			 nftnl_chain_get_str(c, NFTNL_CHAIN_TABLE), &cs);
-	if (!r)
-		return -1;
+		id = nftnl_set_get_u32(n->set, NFTNL_SET_ID);
+		if (d.n &&
+		    bsearch(&id, d.ids, d.n, sizeof(*d.ids), nft_diff_u32_cmp))
+			continue;
+		n->skip = 1;
+		n->diff = 1;
+	}
+	free(d.ids);
+}
 
-	udata = nftnl_udata_buf_alloc(NFT_USERDATA_MAXLEN);
-	if (!udata)
-		return -1;
+static void nft_diff_table(struct nft_handle *h, struct obj_update *flush)
+{
+	const char *table = nftnl_table_get_str(flush->table, NFTNL_TABLE_NAME);
+	struct nftnl_chain_list *live = NULL, *list;
+	struct xt_diff_stats stats = {};
+	struct nftnl_chain_list_iter *iter = NULL;
+	unsigned int nobjs = 0, size = 0;
+	struct nft_diff_obj *objs = NULL;
+	struct nftnl_rule_iter *riter;
+	const struct builtin_table *t;
+	struct nftnl_chain *c, *lc;
+	struct obj_update *n;
+	struct nftnl_rule *r;
+	bool ok = true;
 
-	if (!nftnl_udata_put_u32(udata, UDATA_TYPE_EBTABLES_POLICY, 1))
-		return -1;
+	t = nft_table_builtin_find(h, table);
+	list = t ? h->cache->table[t->type].chains : NULL;
+	if (!list)
+		return;
 
-	nftnl_rule_set_data(r, NFTNL_RULE_USERDATA,
-			    nftnl_udata_buf_data(udata),
-			    nftnl_udata_buf_len(udata));
-	nftnl_udata_buf_free(udata);
+	list_for_each_entry(n, &h->obj_list, head) {
+		if (n->skip || strcmp(nft_obj_table(n), table))
+			continue;
 
-	if (!batch_rule_add(h, NFT_COMPAT_RULE_APPEND, r)) {
-		nftnl_rule_free(r);
-		return -1;
+		switch (n->type) {
+		case NFT_COMPAT_TABLE_FLUSH:
+			ok = n == flush;
+			break;
+		case NFT_COMPAT_TABLE_ADD:
+		case NFT_COMPAT_CHAIN_ADD:
+		case NFT_COMPAT_CHAIN_UPDATE:
+		case NFT_COMPAT_SET_ADD:
+			continue;
+		case NFT_COMPAT_CHAIN_USER_ADD:
+		case NFT_COMPAT_RULE_APPEND:
+			if (nobjs == size) {
+				size = size ? size * 2 : 64;
+				objs = xtables_realloc(objs,
+						       size * sizeof(*objs));
+			}
+			objs[nobjs].ptr = n->ptr;
+			objs[nobjs++].obj = n;
+			continue;
+		default:
+			ok = false;
+			break;
+		}
+		if (!ok)
+			goto out;
 	}
+	qsort(objs, nobjs, sizeof(*objs), nft_diff_obj_cmp);
 
-	return 0;
-}
+	/* each restored rule must come with its append */
+	iter = nftnl_chain_list_iter_create(list);
+	if (!iter)
+		goto out;
+	for (c = nftnl_chain_list_iter_next(iter); c && ok;
+	     c = nftnl_chain_list_iter_next(iter)) {
+		riter = nftnl_rule_iter_create(c);
+		if (!riter)
+			goto out;
+		while ((r = nftnl_rule_iter_next(riter)) && ok)
+			ok = nft_diff_obj_find(objs, nobjs, r) != NULL;
+		nftnl_rule_iter_destroy(riter);
+	}
+	nftnl_chain_list_iter_destroy(iter);
+	iter = NULL;
+	if (!ok)
+		goto out;
 
-int ebt_set_user_chain_policy(struct nft_handle *h, const char *table,
-			      const char *chain, const char *policy)
-{
-	struct nftnl_chain *c = nft_chain_find(h, table, chain);
-	int pval;
+	live = nft_table_fetch(h, table);
+	if (!live)
+		goto out;
 
-	if (!c)
-		return 0;
+	iter = nftnl_chain_list_iter_create(list);
+	if (!iter)
+		goto out;
+	for (c = nftnl_chain_list_iter_next(iter); c;
+	     c = nftnl_chain_list_iter_next(iter)) {
+		lc = nftnl_chain_list_lookup_byname(live,
+				nftnl_chain_get_str(c, NFTNL_CHAIN_NAME));
+		if (!lc) {
+			stats.chains_added++;
+			stats.inserted += nft_rule_count(h, c);
+			continue;
+		}
 
-	if (!strcmp(policy, "DROP"))
-		pval = NF_DROP;
-	else if (!strcmp(policy, "ACCEPT"))
-		pval = NF_ACCEPT;
-	else if (!strcmp(policy, "RETURN"))
-		pval = NFT_RETURN;
-	else
-		return 0;
+		n = nft_diff_obj_find(objs, nobjs, c);
+		if (n) {
+			n->skip = 1;
+			n->diff = 1;
+		}
 
-	nft_build_cache(h, c);
+		if (nft_diff_chain(h, c, lc, objs, nobjs, &stats) < 0)
+			xtables_error(OTHER_PROBLEM, "Can't allocate memory");
+	}
 
-	nftnl_chain_set_u32(c, NFTNL_CHAIN_POLICY, pval);
-	return 1;
+	if (nft_diff_chain_del(h, table, live, list, true, &stats) < 0 ||
+	    nft_diff_chain_del(h, table, live, list, false, &stats) < 0)
+		xtables_error(OTHER_PROBLEM, "Can't allocate memory");
+
+	nft_diff_sets(h, table);
+
+	flush->skip = 1;
+	flush->diff = 1;
+
+	xt_diff_print(table, &stats);
+out:
+	if (iter)
+		nftnl_chain_list_iter_destroy(iter);
+	if (live)
+		nftnl_chain_list_free(live);
+	free(objs);
 }
 
-static void nft_bridge_commit_prepare(struct nft_handle *h)
+static void nft_diff(struct nft_handle *h)
 {
-	const struct builtin_table *t;
-	struct nftnl_chain_list *list;
-	int i;
-
-	for (i = 0; i < NFT_TABLE_MAX; i++) {
-		t = &h->tables[i];
+	struct obj_update *n;
 
-		if (!t->name)
+	/* The transaction is being retried, start over. Objects added by
+	 * the previous run are gone already, see nft_refresh_transaction().
+	 */
+	list_for_each_entry(n, &h->obj_list, head) {
+		if (!n->diff)
 			continue;
 
-		list = h->cache->table[t->type].chains;
-		if (!list)
+		n->diff = 0;
+		switch (n->type) {
+		case NFT_COMPAT_TABLE_FLUSH:
 			continue;
+		case NFT_COMPAT_RULE_INSERT:
+		case NFT_COMPAT_RULE_REPLACE:
+			nftnl_rule_unset(n->rule, NFTNL_RULE_POSITION);
+			nftnl_rule_unset(n->rule, NFTNL_RULE_HANDLE);
+			n->type = NFT_COMPAT_RULE_APPEND;
+			break;
+		default:
+			break;
+		}
+		n->skip = 0;
+	}
 
-		nftnl_chain_list_foreach(list, ebt_add_policy_rule, h);
+	list_for_each_entry(n, &h->obj_list, head) {
+		if (n->type == NFT_COMPAT_TABLE_FLUSH && !n->skip)
+			nft_diff_table(h, n);
 	}
 }
 
 int nft_commit(struct nft_handle *h)
 {
+	if (h->optimize &&
+	    (h->family == NFPROTO_IPV4 || h->family == NFPROTO_IPV6))
+		nft_optimize(h);
+	if (h->diff)
+		nft_diff(h);
+
 	return nft_action(h, NFT_COMPAT_COMMIT);
 }
 
@@ -3164,8 +6858,39 @@ out:
 struct chain_zero_data {
 	struct nft_handle	*handle;
 	bool			verbose;
+	bool			reset;	/* rule counters reset by the kernel */
 };
 
+static int nft_expr_zero_counter(struct nftnl_expr *e, void *data)
+{
+	if (!strcmp(nftnl_expr_get_str(e, NFTNL_EXPR_NAME), "counter")) {
+		nftnl_expr_set_u64(e, NFTNL_EXPR_CTR_PACKETS, 0);
+		nftnl_expr_set_u64(e, NFTNL_EXPR_CTR_BYTES, 0);
+	}
+	return 0;
+}
+
+/* Rules of @c queued in the batch are not known to the kernel yet, zero
+ * them before they are sent.
+ */
+static void nft_chain_zero_pending(struct nft_handle *h, struct nftnl_chain *c)
+{
+	const char *chain = nftnl_chain_get_str(c, NFTNL_CHAIN_NAME);
+	const char *table = nftnl_chain_get_str(c, NFTNL_CHAIN_TABLE);
+	struct obj_update *n;
+
+	list_for_each_entry(n, &h->obj_list, head) {
+		if (n->skip || (n->type != NFT_COMPAT_RULE_APPEND &&
+				n->type != NFT_COMPAT_RULE_INSERT) ||
+		    nftnl_rule_is_set(n->rule, NFTNL_RULE_HANDLE) ||
+		    strcmp(nft_obj_table(n), table) ||
+		    strcmp(nftnl_rule_get_str(n->rule, NFTNL_RULE_CHAIN), chain))
+			continue;
+
+		nftnl_expr_foreach(n->rule, nft_expr_zero_counter, NULL);
+	}
+}
+
 static int __nft_chain_zero_counters(struct nftnl_chain *c, void *data)
 {
 	struct chain_zero_data *d = data;
@@ -3186,6 +6911,12 @@ static int __nft_chain_zero_counters(struct nftnl_chain *c, void *data)
 			return -1;
 	}
 
+	/* the kernel reset all it knows of, no need to fetch the rules */
+	if (d->reset) {
+		nft_chain_zero_pending(h, c);
+		return 0;
+	}
+
 	nft_build_cache(h, c);
 
 	iter = nftnl_rule_iter_create(c);
@@ -3220,7 +6951,17 @@ static int __nft_chain_zero_counters(struct nftnl_chain *c, void *data)
 
 		nftnl_expr_iter_destroy(ei);
 
-		if (zero_needed) {
+		/* rules not in the kernel yet are sent with zeroed counters */
+		if (!nftnl_rule_is_set(r, NFTNL_RULE_HANDLE))
+			zero_needed = false;
+
+		if (zero_needed && nft_cache_merged_find(h, r)) {
+			/* the kernel only knows the merged rule */
+			if (nft_opt_split(h, r, NULL, NFT_OPT_SPLIT_ZERO) < 0) {
+				nftnl_rule_iter_destroy(iter);
+				return -1;
+			}
+		} else if (zero_needed) {
 			/*
 			 * Unset RULE_POSITION for older kernels, we want to replace
 			 * rule based on its handle only.
@@ -3260,11 +7001,18 @@ int nft_chain_zero_counters(struct nft_handle *h, const char *chain,
 			errno = ENOENT;
 			return 0;
 		}
+	}
+
+	d.reset = !h->restore && !nft_rule_reset(h, table, chain, 0);
 
+	if (chain) {
 		ret = __nft_chain_zero_counters(c, &d);
 		goto err;
 	}
 
+	if (!d.reset)
+		nft_build_table_cache(h, table);
+
 	ret = nftnl_chain_list_foreach(list, __nft_chain_zero_counters, &d);
 err:
 	/* the core expects 1 for success and 0 for error */
@@ -3289,17 +7037,50 @@ static const char *supported_exprs[] = {
 	"counter",
 	"immediate",
 	"lookup",
+	"range",
+	"ct",
+	"byteorder",
+	"dynset",
 };
 
 
+/* Whether @expr may stem from a match or target translated to native
+ * expressions. Those are only taken in certain forms, which is up to the
+ * rule decoder to tell.
+ */
+static bool nft_is_expr_native(struct nftnl_expr *expr, const char *name)
+{
+	static const char *native_exprs[] = {
+		"lookup", "range", "ct", "byteorder", "dynset",
+	};
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(native_exprs); i++) {
+		if (strcmp(native_exprs[i], name) == 0)
+			return true;
+	}
+
+	if (!strcmp(name, "meta"))
+		return nftnl_expr_is_set(expr, NFTNL_EXPR_META_SREG) ||
+		       nftnl_expr_get_u32(expr, NFTNL_EXPR_META_KEY) ==
+		       NFT_META_MARK;
+	if (!strcmp(name, "payload"))
+		return nftnl_expr_get_u32(expr, NFTNL_EXPR_PAYLOAD_BASE) ==
+		       NFT_PAYLOAD_TRANSPORT_HEADER;
+	return false;
+}
+
 static int nft_is_expr_compatible(struct nftnl_expr *expr, void *data)
 {
 	const char *name = nftnl_expr_get_str(expr, NFTNL_EXPR_NAME);
+	bool *native = data;
 	int i;
 
 	for (i = 0; i < ARRAY_SIZE(supported_exprs); i++) {
-		if (strcmp(supported_exprs[i], name) == 0)
+		if (strcmp(supported_exprs[i], name) == 0) {
+			*native |= nft_is_expr_native(expr, name);
 			return 0;
+		}
 	}
 
 	if (!strcmp(name, "limit") &&
@@ -3312,7 +7093,26 @@ static int nft_is_expr_compatible(struct nftnl_expr *expr, void *data)
 
 static int nft_is_rule_compatible(struct nftnl_rule *rule, void *data)
 {
-	return nftnl_expr_foreach(rule, nft_is_expr_compatible, NULL);
+	struct iptables_command_state cs = {};
+	struct nft_handle *h = data;
+	bool native = false, ok;
+
+	/* a merged rule not listed as the rules it stands for, see
+	 * nft_opt_expand()
+	 */
+	if (nft_rule_is_optimized(rule))
+		return -1;
+
+	if (nftnl_expr_foreach(rule, nft_is_expr_compatible, &native))
+		return -1;
+	if (!native)
+		return 0;
+
+	/* native forms iptables has no equivalent of are left out on decoding */
+	ok = h->ops->rule_to_cs(h, rule, &cs);
+	h->ops->clear_cs(&cs);
+
+	return ok ? 0 : -1;
 }
 
 static int nft_is_chain_compatible(struct nftnl_chain *c, void *data)
@@ -3326,7 +7126,7 @@ static int nft_is_chain_compatible(struct nftnl_chain *c, void *data)
 
 	nft_build_cache(h, c);
 
-	if (nftnl_rule_foreach(c, nft_is_rule_compatible, NULL))
+	if (nftnl_rule_foreach(c, nft_is_rule_compatible, h))
 		return -1;
 
 	if (!nft_chain_builtin(c))
@@ -3358,6 +7158,10 @@ bool nft_is_table_compatible(struct nft_handle *h,
 {
 	struct nftnl_chain_list *clist;
 
+	/* one dump for all chains instead of one per chain checked */
+	if (!chain)
+		nft_build_table_cache(h, table);
+
 	clist = nft_chain_list_get(h, table, chain);
 	if (clist == NULL)
 		return false;
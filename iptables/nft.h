@@ -40,21 +40,44 @@ struct nft_cache {
 	struct {
 		struct nftnl_chain_list *chains;
 		struct nftnl_set_list	*sets;
+		/* per-chain state, see nft-cache.c */
+		struct hlist_head	*chain_state;
+		/* whole table fetched up to this level */
+		enum nft_cache_level	level;
+		bool			sets_loaded;
 		bool			initialized;
 	} table[NFT_TABLE_MAX];
 };
 
+/* Per-transaction allocations, released all at once after commit/abort. */
+struct nft_arena_chunk;
+
+struct nft_arena {
+	struct nft_arena_chunk	*chunks;
+	size_t			used;
+	/* statistics, reported in verbose mode */
+	unsigned int		allocs;
+	unsigned int		chunk_allocs;
+	size_t			high_water;
+};
+
+struct obj_update;
+
 struct nft_handle {
 	int			family;
 	struct mnl_socket	*nl;
 	int			nlsndbuffsiz;
 	int			nlrcvbuffsiz;
+	bool			nlcapack;
 	uint32_t		portid;
 	uint32_t		seq;
 	uint32_t		nft_genid;
 	uint32_t		rule_id;
 	struct list_head	obj_list;
 	int			obj_list_num;
+	struct nft_arena	arena;
+	struct obj_update	**obj_seq;
+	uint32_t		obj_seq_size;
 	struct nftnl_batch	*batch;
 	struct list_head	err_list;
 	struct nft_family_ops	*ops;
@@ -65,8 +88,27 @@ struct nft_handle {
 	enum nft_cache_level	cache_level;
 	bool			restore;
 	bool			noflush;
+	/* rule is built for lookup only, see nft_rule_find() */
+	bool			rule_needle;
+	/* -m set and -j SET use named sets, see XTABLES_NATIVE_SETS */
+	bool			native_sets;
+	/* merge rules into set lookups on commit, see nft_optimize() */
+	bool			optimize;
+	/* apply only what differs from the kernel ruleset, see nft_diff() */
+	bool			diff;
+	/* --diff with --counters: rules whose counters differ are replaced */
+	bool			diff_counters;
+	/* --verbose count of the command, stats are printed at -v -v */
+	int			verbose;
 	int8_t			config_done;
 
+	/* cache statistics, reported in verbose mode */
+	struct {
+		unsigned int	rule_dumps;
+		unsigned int	rule_dumps_saved;
+		unsigned int	restarts;
+	} cache_stats;
+
 	/* meta data, for error reporting */
 	struct {
 		unsigned int	lineno;
@@ -82,6 +124,7 @@ int mnl_talk(struct nft_handle *h, struct nlmsghdr *nlh,
 	     void *data);
 int nft_init(struct nft_handle *h, int family, const struct builtin_table *t);
 void nft_fini(struct nft_handle *h);
+void nft_print_stats(struct nft_handle *h);
 int nft_restart(struct nft_handle *h);
 
 /*
@@ -113,6 +156,8 @@ const struct builtin_chain *nft_chain_builtin_find(const struct builtin_table *t
 bool nft_chain_exists(struct nft_handle *h, const char *table, const char *chain);
 void nft_bridge_chain_postprocess(struct nft_handle *h,
 				  struct nftnl_chain *c);
+void nft_opt_chain_postprocess(struct nft_handle *h, struct nftnl_chain *c,
+			       struct nftnl_set_list *sets);
 
 
 /*
@@ -129,6 +174,10 @@ int nft_rule_replace(struct nft_handle *h, const char *chain, const char *table,
 int nft_rule_list(struct nft_handle *h, const char *chain, const char *table, int rulenum, unsigned int format);
 int nft_rule_list_save(struct nft_handle *h, const char *chain, const char *table, int rulenum, int counters);
 int nft_rule_save(struct nft_handle *h, const char *table, unsigned int format);
+int nft_rule_save_counters(struct nft_handle *h, const char *table);
+int nft_snapshot_save(struct nft_handle *h, FILE *f, const char *table);
+int nft_snapshot_restore(struct nft_handle *h, FILE *f, const char *table,
+			 bool counters, bool test);
 int nft_rule_flush(struct nft_handle *h, const char *chain, const char *table, bool verbose);
 int nft_rule_zero_counters(struct nft_handle *h, const char *chain, const char *table, int rulenum);
 
@@ -138,10 +187,16 @@ int nft_rule_zero_counters(struct nft_handle *h, const char *chain, const char *
 int add_counters(struct nftnl_rule *r, uint64_t packets, uint64_t bytes);
 int add_verdict(struct nftnl_rule *r, int verdict);
 int add_match(struct nft_handle *h, struct nftnl_rule *r, struct xt_entry_match *m);
-int add_target(struct nftnl_rule *r, struct xt_entry_target *t);
+int add_target(struct nft_handle *h, struct nftnl_rule *r,
+	       struct xt_entry_target *t);
 int add_jumpto(struct nftnl_rule *r, const char *name, int verdict);
-int add_action(struct nftnl_rule *r, struct iptables_command_state *cs, bool goto_set);
+int add_action(struct nft_handle *h, struct nftnl_rule *r,
+	       struct iptables_command_state *cs, bool goto_set);
+int add_addr_list(struct nft_handle *h, struct nftnl_rule *r,
+		  const struct addr_mask *s, const struct addr_mask *d);
 char *get_comment(const void *data, uint32_t data_len);
+struct nftnl_set *nft_set_batch_lookup_byid(struct nft_handle *h,
+					    uint32_t set_id);
 
 enum nft_rule_print {
 	NFT_RULE_APPEND,
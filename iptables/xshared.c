@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <config.h>
 #include <ctype.h>
 #include <getopt.h>
@@ -13,6 +14,8 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/time.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <xtables.h>
@@ -114,6 +117,719 @@ struct xtables_match *load_proto(struct iptables_command_state *cs)
 			  cs->options & OPT_NUMERIC, &cs->matches);
 }
 
+/*
+ * Restore parses line after line loading the same extensions in the same
+ * order, so rather than merging their options into a fresh getopt table for
+ * each line, the tables merged for restore are kept, keyed by the table an
+ * extension's options were merged into. A cached table reached again brings
+ * the offset its extension was given back along.
+ */
+#define XS_OPTS_CACHE_BUCKETS	64
+
+struct xs_opts_cache {
+	struct xs_opts_cache	*next;
+	const struct option	*oldopts;
+	const void		*extopts;
+	unsigned int		offset;
+	struct option		*opts;
+};
+
+static struct xs_opts_cache *xs_opts_cache[XS_OPTS_CACHE_BUCKETS];
+
+static unsigned int xs_opts_cache_hash(const struct option *oldopts,
+				       const void *extopts)
+{
+	uintptr_t key = (uintptr_t)oldopts ^ ((uintptr_t)extopts >> 4);
+
+	return (key ^ (key >> 6) ^ (key >> 12)) % XS_OPTS_CACHE_BUCKETS;
+}
+
+/*
+ * Restore looks long options up in the cached tables by prefix rather than
+ * having getopt_long() walk each table once per option. Every cached table,
+ * and the original one, gets an index of its entries sorted by name, built
+ * the first time an option is looked up in it. Tables with no index, i.e.
+ * anything merged outside of restore, are walked in table order.
+ */
+struct xs_opts_index {
+	struct xs_opts_index	*next;
+	const struct option	*opts;
+	const struct option	**sorted;
+	unsigned int		n;
+};
+
+static struct xs_opts_index *xs_opts_index[XS_OPTS_CACHE_BUCKETS];
+
+static unsigned int xs_opts_index_hash(const struct option *opts)
+{
+	uintptr_t key = (uintptr_t)opts >> 4;
+
+	return (key ^ (key >> 6) ^ (key >> 12)) % XS_OPTS_CACHE_BUCKETS;
+}
+
+static struct xs_opts_index *xs_opts_index_add(const struct option *opts)
+{
+	unsigned int hash = xs_opts_index_hash(opts);
+	struct xs_opts_index *x;
+
+	x = xtables_calloc(1, sizeof(*x));
+	x->opts = opts;
+	x->next = xs_opts_index[hash];
+	xs_opts_index[hash] = x;
+	return x;
+}
+
+static int xs_opts_index_cmp(const void *a, const void *b)
+{
+	const struct option *oa = *(const struct option **)a;
+	const struct option *ob = *(const struct option **)b;
+	int ret = strcmp(oa->name, ob->name);
+
+	/* equal names keep their table order, getopt takes the first one */
+	if (ret == 0)
+		ret = oa < ob ? -1 : oa > ob;
+	return ret;
+}
+
+static struct xs_opts_index *xs_opts_index_get(const struct option *opts)
+{
+	struct xs_opts_index *x;
+	unsigned int i;
+
+	for (x = xs_opts_index[xs_opts_index_hash(opts)]; x; x = x->next) {
+		if (x->opts == opts)
+			break;
+	}
+	if (x == NULL) {
+		if (opts != xt_params->orig_opts)
+			return NULL;
+		x = xs_opts_index_add(opts);
+	}
+	if (x->sorted != NULL)
+		return x;
+
+	while (opts[x->n].name != NULL)
+		x->n++;
+	x->sorted = xtables_malloc((x->n + 1) * sizeof(*x->sorted));
+	for (i = 0; i < x->n; i++)
+		x->sorted[i] = &opts[i];
+	qsort(x->sorted, x->n, sizeof(*x->sorted), xs_opts_index_cmp);
+	return x;
+}
+
+static struct option *xs_merge_opts(const struct iptables_command_state *cs,
+				    struct option *oldopts,
+				    const struct option *extra_opts,
+				    const struct xt_option_entry *x6_options,
+				    unsigned int *offset)
+{
+	const void *extopts = x6_options ? (const void *)x6_options :
+					   (const void *)extra_opts;
+	struct xs_opts_cache *c;
+	struct option *opts;
+	unsigned int hash;
+
+	if (extopts == NULL)
+		return oldopts;
+
+	if (!cs->restore) {
+		if (x6_options != NULL)
+			opts = xtables_options_xfrm(xt_params->orig_opts,
+						    oldopts, x6_options,
+						    offset);
+		else
+			opts = xtables_merge_options(xt_params->orig_opts,
+						     oldopts, extra_opts,
+						     offset);
+		if (opts == NULL)
+			xtables_error(OTHER_PROBLEM, "can't alloc memory!");
+		return opts;
+	}
+
+	hash = xs_opts_cache_hash(oldopts, extopts);
+	for (c = xs_opts_cache[hash]; c; c = c->next) {
+		if (c->oldopts == oldopts && c->extopts == extopts) {
+			*offset = c->offset;
+			return c->opts;
+		}
+	}
+
+	/* merging frees the current table, which is a cached one */
+	xt_params->opts = xt_params->orig_opts;
+	if (x6_options != NULL)
+		opts = xtables_options_xfrm(xt_params->orig_opts, oldopts,
+					    x6_options, offset);
+	else
+		opts = xtables_merge_options(xt_params->orig_opts, oldopts,
+					     extra_opts, offset);
+	if (opts == NULL)
+		xtables_error(OTHER_PROBLEM, "can't alloc memory!");
+
+	c = xtables_malloc(sizeof(*c));
+	c->oldopts = oldopts;
+	c->extopts = extopts;
+	c->offset = *offset;
+	c->opts = opts;
+	c->next = xs_opts_cache[hash];
+	xs_opts_cache[hash] = c;
+	xs_opts_index_add(opts);
+	return opts;
+}
+
+void xs_free_opts(const struct iptables_command_state *cs)
+{
+	if (cs->restore)
+		xt_params->opts = NULL;
+	else
+		xtables_free_opts(1);
+}
+
+void xs_opts_cache_free(void)
+{
+	struct xs_opts_index *x, *xnext;
+	struct xs_opts_cache *c, *next;
+	unsigned int i;
+
+	for (i = 0; i < XS_OPTS_CACHE_BUCKETS; i++) {
+		for (c = xs_opts_cache[i]; c; c = next) {
+			next = c->next;
+			free(c->opts);
+			free(c);
+		}
+		xs_opts_cache[i] = NULL;
+	}
+
+	for (i = 0; i < XS_OPTS_CACHE_BUCKETS; i++) {
+		for (x = xs_opts_index[i]; x; x = xnext) {
+			xnext = x->next;
+			free(x->sorted);
+			free(x);
+		}
+		xs_opts_index[i] = NULL;
+	}
+}
+
+/*
+ * Find the long option NAME, NAMELEN bytes of it, in OPTS the way
+ * getopt_long() does: an exact match wins, else a unique prefix match.
+ * Prefix matches differing only in name, i.e. aliases, are not ambiguous.
+ */
+static const struct option *xs_long_opt(const struct option *opts,
+					const char *name, size_t namelen,
+					bool *ambig)
+{
+	const struct option *p, *pfound = NULL;
+	struct xs_opts_index *x = xs_opts_index_get(opts);
+	unsigned int lo, hi, mid;
+
+	*ambig = false;
+
+	if (x == NULL) {
+		for (p = opts; p->name != NULL; p++) {
+			if (strncmp(p->name, name, namelen))
+				continue;
+			if (strlen(p->name) == namelen) {
+				*ambig = false;
+				return p;
+			}
+			if (pfound == NULL)
+				pfound = p;
+			else if (pfound->has_arg != p->has_arg ||
+				 pfound->flag != p->flag ||
+				 pfound->val != p->val)
+				*ambig = true;
+		}
+		return pfound;
+	}
+
+	lo = 0;
+	hi = x->n;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (strncmp(x->sorted[mid]->name, name, namelen) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	/* names starting with NAME sort after NAME itself */
+	for (hi = lo; hi < x->n; hi++) {
+		p = x->sorted[hi];
+		if (strncmp(p->name, name, namelen))
+			break;
+		if (hi == lo && p->name[namelen] == '\0')
+			return p;
+		if (pfound == NULL || p < pfound)
+			pfound = p;
+	}
+	for (; lo < hi; lo++) {
+		p = x->sorted[lo];
+		if (pfound->has_arg != p->has_arg ||
+		    pfound->flag != p->flag || pfound->val != p->val)
+			*ambig = true;
+	}
+	return pfound;
+}
+
+/*
+ * getopt_long() for the command parsers. Outside of restore this is the
+ * libc one. Restore runs the parser once per rule line, growing the option
+ * table with each extension loaded, and with getopt_long() scanning the
+ * whole table for every long option that added up to a good share of the
+ * restore. There options are looked up in the cached tables' indexes
+ * instead; everything else behaves like getopt_long() with OPTSTRING
+ * starting in '-', i.e. non-options are returned in order as 1, and with
+ * opterr cleared.
+ */
+int xs_getopt_long(const struct iptables_command_state *cs, int argc,
+		   char *const argv[], const char *optstring,
+		   const struct option *longopts)
+{
+	static char *nextchar;
+	const struct option *p;
+	const char *temp;
+	char *nameend;
+	bool ambig;
+	char c;
+
+	if (!cs->restore)
+		return getopt_long(argc, argv, optstring, longopts, NULL);
+
+	optarg = NULL;
+	if (optind == 0) {
+		optind = 1;
+		nextchar = NULL;
+	}
+	if (*optstring == '-')
+		optstring++;
+
+	if (nextchar == NULL || *nextchar == '\0') {
+		if (optind >= argc)
+			return -1;
+		if (!strcmp(argv[optind], "--")) {
+			optind++;
+			return -1;
+		}
+		if (argv[optind][0] != '-' || argv[optind][1] == '\0') {
+			optarg = argv[optind++];
+			return 1;
+		}
+		if (argv[optind][1] == '-') {
+			nextchar = NULL;
+			for (nameend = argv[optind] + 2;
+			     *nameend && *nameend != '='; nameend++)
+				;
+			p = xs_long_opt(longopts, argv[optind] + 2,
+					nameend - argv[optind] - 2, &ambig);
+			optind++;
+			if (p == NULL || ambig) {
+				optopt = 0;
+				return '?';
+			}
+			if (*nameend) {
+				if (p->has_arg == no_argument) {
+					optopt = p->val;
+					return '?';
+				}
+				optarg = nameend + 1;
+			} else if (p->has_arg == required_argument) {
+				if (optind >= argc) {
+					optopt = p->val;
+					return *optstring == ':' ? ':' : '?';
+				}
+				optarg = argv[optind++];
+			}
+			if (p->flag != NULL) {
+				*p->flag = p->val;
+				return 0;
+			}
+			return p->val;
+		}
+		nextchar = argv[optind] + 1;
+	}
+
+	c = *nextchar++;
+	temp = strchr(optstring, c);
+	if (*nextchar == '\0')
+		optind++;
+	if (temp == NULL || c == ':' || c == ';') {
+		optopt = c;
+		return '?';
+	}
+	if (temp[1] == ':') {
+		if (*nextchar != '\0') {
+			optarg = nextchar;
+			optind++;
+		} else if (temp[2] != ':') {
+			if (optind >= argc) {
+				optopt = c;
+				c = *optstring == ':' ? ':' : '?';
+			} else {
+				optarg = argv[optind++];
+			}
+		}
+		nextchar = NULL;
+	}
+	return c;
+}
+
+/*
+ * Generated rulesets repeat the same match and target fragments, i.e. an
+ * extension along with its options, over and over. Restore keeps what
+ * their parsing and final check came up with in a trie of the option calls
+ * made to each extension, a node holding the call's option id, inversion,
+ * argument and the rule's address part at the time, which is what parsers
+ * get to look at. As long as a fragment follows a path some earlier rule
+ * took, its calls are held back: they are known to succeed, and if it ends
+ * where an earlier one did, its payload is copied from there instead of
+ * being parsed and checked again. Once it leaves the known paths, the
+ * calls held back are replayed and parsing goes on as usual, so errors are
+ * raised at the very option they were raised at before.
+ */
+union xs_parse_fw {
+	struct ipt_ip		ip;
+	struct ip6t_ip6		ipv6;
+};
+
+struct xs_parse_node {
+	struct xs_parse_node		*next;		/* hash chain */
+	const struct xs_parse_node	*parent;	/* NULL for the root */
+	const char			*name;		/* root only */
+	uint8_t				revision;	/* root only */
+	bool				target;		/* root only */
+	unsigned int			id;
+	bool				invert;
+	char				*arg;
+	union xs_parse_fw		fw;
+	/* outcome of the final check of fragments ending here */
+	void				*payload;
+	unsigned int			xflags;
+};
+
+struct xs_parse_frag {
+	struct xtables_match		*match;
+	struct xtables_target		*target;
+	struct xs_parse_node		*node;
+	bool				eager;
+};
+
+static struct {
+	struct xs_parse_node	**hash;
+	unsigned int		hash_size;
+	unsigned int		nodes;
+	struct xs_parse_frag	*frags;
+	unsigned int		nfrags;
+	unsigned int		frags_size;
+	unsigned int		lookups;
+	unsigned int		hits;
+} xs_parse_cache;
+
+static size_t xs_parse_fw_len(void)
+{
+	return afinfo->family == NFPROTO_IPV4 ? sizeof(struct ipt_ip) :
+						sizeof(struct ip6t_ip6);
+}
+
+static unsigned int xs_parse_node_hash(const struct xs_parse_node *n)
+{
+	const unsigned char *p;
+	unsigned int hash;
+
+	if (n->parent == NULL) {
+		hash = n->revision ^ (n->target << 8);
+		p = (const unsigned char *)n->name;
+	} else {
+		hash = (uintptr_t)n->parent ^ ((uintptr_t)n->parent >> 12) ^
+		       n->id ^ (n->invert << 8);
+		p = (const unsigned char *)n->arg;
+	}
+	for (; p && *p; p++)
+		hash = hash * 31 + *p;
+
+	return hash;
+}
+
+static bool xs_parse_node_eq(const struct xs_parse_node *a,
+			     const struct xs_parse_node *b)
+{
+	if (a->parent != b->parent)
+		return false;
+	if (a->parent == NULL)
+		return a->revision == b->revision && a->target == b->target &&
+		       !strcmp(a->name, b->name);
+
+	if (a->id != b->id || a->invert != b->invert)
+		return false;
+	if (a->arg == NULL || b->arg == NULL) {
+		if (a->arg != b->arg)
+			return false;
+	} else if (strcmp(a->arg, b->arg)) {
+		return false;
+	}
+	return !memcmp(&a->fw, &b->fw, xs_parse_fw_len());
+}
+
+static void xs_parse_hash_grow(void)
+{
+	unsigned int size = xs_parse_cache.hash_size ?
+			    xs_parse_cache.hash_size * 2 : 256;
+	struct xs_parse_node **hash, *n, *next;
+	unsigned int i, h;
+
+	hash = xtables_calloc(size, sizeof(*hash));
+	for (i = 0; i < xs_parse_cache.hash_size; i++) {
+		for (n = xs_parse_cache.hash[i]; n; n = next) {
+			next = n->next;
+			h = xs_parse_node_hash(n) % size;
+			n->next = hash[h];
+			hash[h] = n;
+		}
+	}
+	free(xs_parse_cache.hash);
+	xs_parse_cache.hash = hash;
+	xs_parse_cache.hash_size = size;
+}
+
+/* Find @key in the trie, adding a copy of it if it is not there yet. */
+static struct xs_parse_node *xs_parse_node_get(const struct xs_parse_node *key,
+					       bool *created)
+{
+	struct xs_parse_node *n;
+	unsigned int h;
+
+	*created = false;
+	if (xs_parse_cache.hash_size) {
+		h = xs_parse_node_hash(key) % xs_parse_cache.hash_size;
+		for (n = xs_parse_cache.hash[h]; n; n = n->next)
+			if (xs_parse_node_eq(n, key))
+				return n;
+	}
+
+	if (xs_parse_cache.nodes >= xs_parse_cache.hash_size)
+		xs_parse_hash_grow();
+
+	n = xtables_malloc(sizeof(*n));
+	*n = *key;
+	if (key->arg != NULL) {
+		n->arg = strdup(key->arg);
+		if (n->arg == NULL)
+			xtables_error(RESOURCE_PROBLEM, "strdup");
+	}
+	n->payload = NULL;
+
+	h = xs_parse_node_hash(n) % xs_parse_cache.hash_size;
+	n->next = xs_parse_cache.hash[h];
+	xs_parse_cache.hash[h] = n;
+	xs_parse_cache.nodes++;
+	*created = true;
+	return n;
+}
+
+static struct xs_parse_frag *
+xs_parse_frag_get(const struct iptables_command_state *cs,
+		  struct xtables_match *m, struct xtables_target *t)
+{
+	struct xs_parse_node key = {};
+	struct xs_parse_frag *frag;
+	unsigned int i;
+	bool created;
+
+	if (!cs->restore ||
+	    (afinfo->family != NFPROTO_IPV4 && afinfo->family != NFPROTO_IPV6))
+		return NULL;
+	if (m != NULL ? m->x6_parse == NULL || m->udata_size :
+			t->x6_parse == NULL || t->udata_size)
+		return NULL;
+
+	for (i = 0; i < xs_parse_cache.nfrags; i++) {
+		frag = &xs_parse_cache.frags[i];
+		if (frag->match == m && frag->target == t)
+			return frag;
+	}
+
+	if (xs_parse_cache.nfrags == xs_parse_cache.frags_size) {
+		xs_parse_cache.frags_size = xs_parse_cache.frags_size * 2 ?: 8;
+		xs_parse_cache.frags =
+			xtables_realloc(xs_parse_cache.frags,
+					xs_parse_cache.frags_size *
+					sizeof(*xs_parse_cache.frags));
+	}
+
+	key.name = m != NULL ? m->name : t->name;
+	key.revision = m != NULL ? m->revision : t->revision;
+	key.target = t != NULL;
+
+	frag = &xs_parse_cache.frags[xs_parse_cache.nfrags++];
+	frag->match = m;
+	frag->target = t;
+	frag->node = xs_parse_node_get(&key, &created);
+	frag->eager = false;
+	return frag;
+}
+
+static void xs_parse_call(struct iptables_command_state *cs,
+			  const struct xs_parse_frag *frag, unsigned int id,
+			  bool invert)
+{
+	if (frag->match != NULL)
+		xtables_option_mpcall(id + frag->match->option_offset,
+				      cs->argv, invert, frag->match, &cs->fw);
+	else
+		xtables_option_tpcall(id + frag->target->option_offset,
+				      cs->argv, invert, frag->target, &cs->fw);
+}
+
+/* make the calls held back on the way to @node */
+static void xs_parse_replay(struct iptables_command_state *cs,
+			    const struct xs_parse_frag *frag,
+			    const struct xs_parse_node *node)
+{
+	if (node->parent == NULL)
+		return;
+
+	xs_parse_replay(cs, frag, node->parent);
+	optarg = node->arg;
+	memcpy(&cs->fw, &node->fw, xs_parse_fw_len());
+	xs_parse_call(cs, frag, node->id, node->invert);
+}
+
+static void xs_parse_catch_up(struct iptables_command_state *cs,
+			      struct xs_parse_frag *frag)
+{
+	union xs_parse_fw fw;
+	char *arg = optarg;
+
+	memcpy(&fw, &cs->fw, xs_parse_fw_len());
+	xs_parse_replay(cs, frag, frag->node);
+	memcpy(&cs->fw, &fw, xs_parse_fw_len());
+	optarg = arg;
+	frag->eager = true;
+}
+
+static void xs_option_call(struct iptables_command_state *cs,
+			   struct xtables_match *m, struct xtables_target *t)
+{
+	struct xs_parse_frag *frag = xs_parse_frag_get(cs, m, t);
+	struct xs_parse_node key = {}, *child;
+	bool created;
+
+	if (frag == NULL) {
+		if (m != NULL)
+			xtables_option_mpcall(cs->c, cs->argv, cs->invert,
+					      m, &cs->fw);
+		else
+			xtables_option_tpcall(cs->c, cs->argv, cs->invert,
+					      t, &cs->fw);
+		return;
+	}
+
+	key.parent = frag->node;
+	key.id = cs->c - (m != NULL ? m->option_offset : t->option_offset);
+	key.invert = cs->invert;
+	key.arg = optarg;
+	memcpy(&key.fw, &cs->fw, xs_parse_fw_len());
+
+	child = xs_parse_node_get(&key, &created);
+	if (created && !frag->eager)
+		xs_parse_catch_up(cs, frag);
+	if (frag->eager)
+		xs_parse_call(cs, frag, key.id, key.invert);
+	frag->node = child;
+}
+
+static void xs_option_fcall_one(struct iptables_command_state *cs,
+				struct xtables_match *m,
+				struct xtables_target *t)
+{
+	struct xs_parse_frag *frag = xs_parse_frag_get(cs, m, t);
+	struct xs_parse_node *node;
+	void **payload;
+	size_t size;
+
+	if (frag == NULL) {
+		if (m != NULL)
+			xtables_option_mfcall(m);
+		else
+			xtables_option_tfcall(t);
+		return;
+	}
+
+	node = frag->node;
+	payload = m != NULL ? (void **)&m->m : (void **)&t->t;
+	xs_parse_cache.lookups++;
+
+	if (!frag->eager && node->payload != NULL) {
+		size = m != NULL ? ((struct xt_entry_match *)node->payload)->u.match_size :
+				   ((struct xt_entry_target *)node->payload)->u.target_size;
+		*payload = xtables_realloc(*payload, size);
+		memcpy(*payload, node->payload, size);
+		if (m != NULL)
+			m->mflags = node->xflags;
+		else
+			t->tflags = node->xflags;
+		xs_parse_cache.hits++;
+		return;
+	}
+
+	if (!frag->eager)
+		xs_parse_catch_up(cs, frag);
+	if (m != NULL) {
+		xtables_option_mfcall(m);
+		size = m->m->u.match_size;
+		node->xflags = m->mflags;
+	} else {
+		xtables_option_tfcall(t);
+		size = t->t->u.target_size;
+		node->xflags = t->tflags;
+	}
+	free(node->payload);
+	node->payload = xtables_malloc(size);
+	memcpy(node->payload, *payload, size);
+}
+
+/* final checks of the rule's matches and target, see xs_option_call() */
+void xs_option_fcall(struct iptables_command_state *cs)
+{
+	struct xtables_rule_match *matchp;
+
+	for (matchp = cs->matches; matchp; matchp = matchp->next)
+		xs_option_fcall_one(cs, matchp->match, NULL);
+	if (cs->target != NULL)
+		xs_option_fcall_one(cs, NULL, cs->target);
+
+	xs_parse_cache.nfrags = 0;
+}
+
+void xs_parse_cache_print(void)
+{
+	if (!xs_parse_cache.lookups)
+		return;
+
+	fprintf(stderr, "option parse cache: %u of %u match and target "
+		"fragment(s) reused (%u%%), %u node(s)\n",
+		xs_parse_cache.hits, xs_parse_cache.lookups,
+		xs_parse_cache.hits * 100 / xs_parse_cache.lookups,
+		xs_parse_cache.nodes);
+}
+
+void xs_parse_cache_free(void)
+{
+	struct xs_parse_node *n, *next;
+	unsigned int i;
+
+	for (i = 0; i < xs_parse_cache.hash_size; i++) {
+		for (n = xs_parse_cache.hash[i]; n; n = next) {
+			next = n->next;
+			free(n->arg);
+			free(n->payload);
+			free(n);
+		}
+	}
+	free(xs_parse_cache.hash);
+	free(xs_parse_cache.frags);
+	memset(&xs_parse_cache, 0, sizeof(xs_parse_cache));
+}
+
 int command_default(struct iptables_command_state *cs,
 		    struct xtables_globals *gl)
 {
@@ -124,8 +840,7 @@ int command_default(struct iptables_command_state *cs,
 	    (cs->target->parse != NULL || cs->target->x6_parse != NULL) &&
 	    cs->c >= cs->target->option_offset &&
 	    cs->c < cs->target->option_offset + XT_OPTION_OFFSET_SCALE) {
-		xtables_option_tpcall(cs->c, cs->argv, cs->invert,
-				      cs->target, &cs->fw);
+		xs_option_call(cs, NULL, cs->target);
 		return 0;
 	}
 
@@ -138,7 +853,7 @@ int command_default(struct iptables_command_state *cs,
 		if (cs->c < matchp->match->option_offset ||
 		    cs->c >= matchp->match->option_offset + XT_OPTION_OFFSET_SCALE)
 			continue;
-		xtables_option_mpcall(cs->c, cs->argv, cs->invert, m, &cs->fw);
+		xs_option_call(cs, m, NULL);
 		return 0;
 	}
 
@@ -157,18 +872,8 @@ int command_default(struct iptables_command_state *cs,
 		m->m->u.user.revision = m->revision;
 		xs_init_match(m);
 
-		if (m->x6_options != NULL)
-			gl->opts = xtables_options_xfrm(gl->orig_opts,
-							gl->opts,
-							m->x6_options,
-							&m->option_offset);
-		else
-			gl->opts = xtables_merge_options(gl->orig_opts,
-							 gl->opts,
-							 m->extra_opts,
-							 &m->option_offset);
-		if (gl->opts == NULL)
-			xtables_error(OTHER_PROBLEM, "can't alloc memory!");
+		gl->opts = xs_merge_opts(cs, gl->opts, m->extra_opts,
+					 m->x6_options, &m->option_offset);
 		optind--;
 		/* Indicate to rerun getopt *immediately* */
  		return 1;
@@ -246,57 +951,185 @@ void xs_init_match(struct xtables_match *match)
 		match->init(match->m);
 }
 
-static int xtables_lock(int wait, struct timeval *wait_interval)
+/*
+ * Waiting for the xtables lock blocks in flock() until it is released or a
+ * timer set to the seconds given to --wait interrupts the call. The timer
+ * keeps firing every XT_LOCK_REFIRE_USEC after that in case the first signal
+ * came in just before flock() was entered.
+ */
+#define XT_LOCK_REFIRE_USEC	10000
+
+static volatile sig_atomic_t xt_lock_timed_out;
+
+static void xt_lock_alarm(int sig)
 {
-	struct timeval time_left, wait_time;
-	int fd, i = 0;
+	xt_lock_timed_out = 1;
+}
 
-	time_left.tv_sec = wait;
-	time_left.tv_usec = 0;
+/*
+ * With XTABLES_LOCK_QUEUE set in the environment, waiters take the lock in
+ * the order they came in. Each one draws a ticket from the counter at the
+ * start of XT_LOCK_QUEUE_NAME, holds an OFD lock on the byte of its ticket
+ * until it releases the xtables lock and waits for the byte of the ticket
+ * before to be unlocked. The locks go away with their holder, so one which
+ * gave up or died lets the next one through. The xtables lock is still what
+ * keeps programs apart, queueing or not.
+ */
+#define XT_LOCK_QUEUE_NAME	XT_LOCK_NAME ".queue"
+#define XT_LOCK_QUEUE_SLOTS	65536
+
+static int xt_lock_queue_fd = -1;
 
-	fd = open(XT_LOCK_NAME, O_CREAT, 0600);
+static int xt_lock_byte(int fd, int cmd, short type, uint32_t slot)
+{
+	struct flock fl = {
+		.l_type		= type,
+		.l_whence	= SEEK_SET,
+		.l_start	= slot,
+		.l_len		= 1,
+	};
+
+	while (fcntl(fd, cmd, &fl) < 0) {
+		if (errno != EINTR || xt_lock_timed_out)
+			return -1;
+	}
+	return 0;
+}
+
+static int xt_lock_queue(int wait, bool *contended)
+{
+	uint32_t ticket, next;
+	int fd;
+
+	fd = open(XT_LOCK_QUEUE_NAME, O_CREAT | O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		fprintf(stderr, "Can't open %s, not queueing: %s\n",
+			XT_LOCK_QUEUE_NAME, strerror(errno));
+		return XT_LOCK_NOT_ACQUIRED;
+	}
+
+	/* slot 0 guards the counter, tickets use the slots after it */
+	if (xt_lock_byte(fd, F_OFD_SETLKW, F_WRLCK, 0) < 0)
+		goto busy;
+	if (pread(fd, &ticket, sizeof(ticket), 0) != sizeof(ticket))
+		ticket = 0;
+	ticket %= XT_LOCK_QUEUE_SLOTS;
+	next = (ticket + 1) % XT_LOCK_QUEUE_SLOTS;
+	if (pwrite(fd, &next, sizeof(next), 0) != sizeof(next) ||
+	    xt_lock_byte(fd, F_OFD_SETLK, F_WRLCK, 1 + ticket) < 0) {
+		close(fd);
+		return XT_LOCK_NOT_ACQUIRED;
+	}
+	xt_lock_byte(fd, F_OFD_SETLK, F_UNLCK, 0);
+
+	ticket = (ticket + XT_LOCK_QUEUE_SLOTS - 1) % XT_LOCK_QUEUE_SLOTS;
+	if (xt_lock_byte(fd, F_OFD_SETLK, F_WRLCK, 1 + ticket) < 0) {
+		if (wait == 0)
+			goto busy;
+		*contended = true;
+		if (xt_lock_byte(fd, F_OFD_SETLKW, F_WRLCK, 1 + ticket) < 0)
+			goto busy;
+	}
+	xt_lock_byte(fd, F_OFD_SETLK, F_UNLCK, 1 + ticket);
+
+	return fd;
+busy:
+	close(fd);
+	return XT_LOCK_BUSY;
+}
+
+static int xtables_lock(int wait, struct timespec *waited)
+{
+	struct itimerval timer = {
+		.it_interval.tv_usec	= XT_LOCK_REFIRE_USEC,
+		.it_value.tv_sec	= wait,
+	};
+	struct sigaction sa = {
+		.sa_handler	= xt_lock_alarm,
+	}, old_sa;
+	bool queue = getenv("XTABLES_LOCK_QUEUE") != NULL;
+	bool contended = !queue;
+	struct timespec start;
+	int fd, lock;
+
+	fd = open(XT_LOCK_NAME, O_CREAT | O_CLOEXEC, 0600);
 	if (fd < 0) {
 		fprintf(stderr, "Fatal: can't open lock file %s: %s\n",
 			XT_LOCK_NAME, strerror(errno));
 		return XT_LOCK_FAILED;
 	}
 
-	if (wait == -1) {
-		if (flock(fd, LOCK_EX) == 0)
+	if (!queue) {
+		if (flock(fd, LOCK_EX | LOCK_NB) == 0)
 			return fd;
+		if (wait == 0)
+			return XT_LOCK_BUSY;
+	}
 
-		fprintf(stderr, "Can't lock %s: %s\n", XT_LOCK_NAME,
-			strerror(errno));
-		return XT_LOCK_BUSY;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	xt_lock_timed_out = 0;
+	if (wait > 0) {
+		sigaction(SIGALRM, &sa, &old_sa);
+		setitimer(ITIMER_REAL, &timer, NULL);
 	}
 
-	while (1) {
-		if (flock(fd, LOCK_EX | LOCK_NB) == 0)
-			return fd;
-		else if (timercmp(&time_left, wait_interval, <))
-			return XT_LOCK_BUSY;
+	lock = fd;
+	if (queue) {
+		xt_lock_queue_fd = xt_lock_queue(wait, &contended);
+		if (xt_lock_queue_fd == XT_LOCK_BUSY)
+			lock = XT_LOCK_BUSY;
+	}
 
-		if (++i % 10 == 0) {
-			fprintf(stderr, "Another app is currently holding the xtables lock; "
-				"still %lds %ldus time ahead to have a chance to grab the lock...\n",
-				time_left.tv_sec, time_left.tv_usec);
+	if (lock >= 0 && flock(fd, LOCK_EX | LOCK_NB) != 0) {
+		contended = true;
+		if (wait == 0)
+			lock = XT_LOCK_BUSY;
+		while (lock >= 0 && flock(fd, LOCK_EX) != 0) {
+			if (errno == EINTR && !xt_lock_timed_out)
+				continue;
+			if (errno != EINTR)
+				fprintf(stderr, "Can't lock %s: %s\n",
+					XT_LOCK_NAME, strerror(errno));
+			lock = XT_LOCK_BUSY;
 		}
+	}
 
-		wait_time = *wait_interval;
-		select(0, NULL, NULL, NULL, &wait_time);
-		timersub(&time_left, wait_interval, &time_left);
+	if (wait > 0) {
+		memset(&timer, 0, sizeof(timer));
+		setitimer(ITIMER_REAL, &timer, NULL);
+		sigaction(SIGALRM, &old_sa, NULL);
 	}
+	if (lock < 0 && xt_lock_queue_fd >= 0) {
+		close(xt_lock_queue_fd);
+		xt_lock_queue_fd = -1;
+	}
+	if (!contended)
+		return lock;
+
+	clock_gettime(CLOCK_MONOTONIC, waited);
+	waited->tv_sec -= start.tv_sec;
+	waited->tv_nsec -= start.tv_nsec;
+	if (waited->tv_nsec < 0) {
+		waited->tv_sec--;
+		waited->tv_nsec += 1000000000;
+	}
+	return lock;
 }
 
 void xtables_unlock(int lock)
 {
 	if (lock >= 0)
 		close(lock);
+	if (xt_lock_queue_fd >= 0) {
+		close(xt_lock_queue_fd);
+		xt_lock_queue_fd = -1;
+	}
 }
 
-int xtables_lock_or_exit(int wait, struct timeval *wait_interval)
+int xtables_lock_or_exit(int wait, bool verbose)
 {
-	int lock = xtables_lock(wait, wait_interval);
+	struct timespec waited = {};
+	int lock = xtables_lock(wait, &waited);
 
 	if (lock == XT_LOCK_FAILED) {
 		xtables_free_opts(1);
@@ -313,6 +1146,10 @@ int xtables_lock_or_exit(int wait, struct timeval *wait_interval)
 		exit(RESOURCE_PROBLEM);
 	}
 
+	if (verbose && (waited.tv_sec || waited.tv_nsec))
+		fprintf(stderr, "Waited %ld.%06lds for the xtables lock\n",
+			(long)waited.tv_sec, waited.tv_nsec / 1000);
+
 	return lock;
 }
 
@@ -417,6 +1254,242 @@ inline bool xs_has_arg(int argc, char *argv[])
 	       argv[optind][0] != '!';
 }
 
+struct xt_snapshot_hdr {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	kind;
+	uint32_t	family;
+	uint32_t	wordsize;	/* legacy blobs follow the kernel ABI */
+};
+
+struct xt_snapshot_rec {
+	uint32_t	type;
+	uint32_t	len;
+};
+
+static const char *xt_snapshot_kind_name[] = {
+	[XT_SNAPSHOT_LEGACY]	= "legacy",
+	[XT_SNAPSHOT_NFT]	= "nf_tables",
+};
+
+void xt_snapshot_write_hdr(FILE *f, enum xt_snapshot_kind kind, int family)
+{
+	struct xt_snapshot_hdr hdr = {
+		.magic		= XT_SNAPSHOT_MAGIC,
+		.version	= XT_SNAPSHOT_VERSION,
+		.kind		= kind,
+		.family		= family,
+		.wordsize	= sizeof(long),
+	};
+
+	if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+		xtables_error(OTHER_PROBLEM, "Can't write snapshot: %s",
+			      strerror(errno));
+}
+
+void xt_snapshot_read_hdr(FILE *f, enum xt_snapshot_kind kind, int family)
+{
+	struct xt_snapshot_hdr hdr;
+
+	if (fread(&hdr, sizeof(hdr), 1, f) != 1 ||
+	    memcmp(hdr.magic, XT_SNAPSHOT_MAGIC, sizeof(XT_SNAPSHOT_MAGIC)))
+		xtables_error(PARAMETER_PROBLEM, "Input is not a snapshot");
+
+	if (hdr.version != XT_SNAPSHOT_VERSION)
+		xtables_error(PARAMETER_PROBLEM,
+			      "Snapshot version %u is not supported",
+			      hdr.version);
+
+	if (hdr.wordsize != sizeof(long))
+		xtables_error(PARAMETER_PROBLEM,
+			      "Snapshot was taken on a %u-bit system, not %zu-bit",
+			      hdr.wordsize * 8, sizeof(long) * 8);
+
+	if (hdr.kind != kind)
+		xtables_error(PARAMETER_PROBLEM,
+			      "Snapshot was taken from %s, not %s",
+			      hdr.kind <= XT_SNAPSHOT_NFT ?
+			      xt_snapshot_kind_name[hdr.kind] : "unknown",
+			      xt_snapshot_kind_name[kind]);
+
+	if (hdr.family != family)
+		xtables_error(PARAMETER_PROBLEM,
+			      "Snapshot is for family %u, not %d",
+			      hdr.family, family);
+}
+
+void xt_snapshot_write(FILE *f, uint32_t type, const void *data,
+		       uint32_t len)
+{
+	struct xt_snapshot_rec rec = {
+		.type	= type,
+		.len	= len,
+	};
+
+	if (fwrite(&rec, sizeof(rec), 1, f) != 1 ||
+	    fwrite(data, 1, len, f) != len)
+		xtables_error(OTHER_PROBLEM, "Can't write snapshot: %s",
+			      strerror(errno));
+}
+
+/* Next record, to be freed by the caller, or NULL at the end. Records
+ * longer than @maxlen are rejected as corrupt.
+ */
+void *xt_snapshot_read(FILE *f, uint32_t *type, uint32_t *len,
+		       uint32_t maxlen)
+{
+	struct xt_snapshot_rec rec;
+	void *data;
+
+	if (fread(&rec, sizeof(rec), 1, f) != 1) {
+		if (ferror(f))
+			xtables_error(OTHER_PROBLEM, "Can't read snapshot: %s",
+				      strerror(errno));
+		return NULL;
+	}
+
+	if (rec.len > maxlen)
+		xtables_error(PARAMETER_PROBLEM, "Snapshot is corrupt");
+
+	data = xtables_malloc(rec.len ? rec.len : 1);
+	if (fread(data, 1, rec.len, f) != rec.len)
+		xtables_error(PARAMETER_PROBLEM, "Snapshot is truncated");
+
+	*type = rec.type;
+	*len = rec.len;
+	return data;
+}
+
+/* How far to look ahead for the chains to line up again after a rule that
+ * differs, before giving up and replacing it.
+ */
+#define XT_DIFF_WINDOW	8
+
+static unsigned int xt_diff_step(struct xt_diff_step *steps, unsigned int n,
+				 enum xt_diff_op op, unsigned int old,
+				 unsigned int new)
+{
+	steps[n].op = op;
+	steps[n].old = old;
+	steps[n].new = new;
+	return n + 1;
+}
+
+/* Align @nold kernel rules with @nnew restored ones, @same telling whether
+ * two of them are equal. Common leading and trailing rules are kept, rules
+ * in between are kept as long as both chains agree, differing ones are
+ * inserted or deleted if the chains line up again within a few rules, and
+ * replaced otherwise. @steps must hold @nold + @nnew entries, the number of
+ * steps is returned.
+ */
+unsigned int xt_diff_rules(unsigned int nold, unsigned int nnew,
+			   bool (*same)(unsigned int old, unsigned int new,
+					void *data),
+			   void *data, struct xt_diff_step *steps,
+			   struct xt_diff_stats *stats)
+{
+	unsigned int head = 0, tail = 0, i, j, d, n = 0;
+
+	while (head < nold && head < nnew && same(head, head, data))
+		head++;
+	while (tail < nold - head && tail < nnew - head &&
+	       same(nold - 1 - tail, nnew - 1 - tail, data))
+		tail++;
+
+	for (i = 0; i < head; i++)
+		n = xt_diff_step(steps, n, XT_DIFF_KEEP, i, i);
+
+	i = j = head;
+	while (i < nold - tail && j < nnew - tail) {
+		if (same(i, j, data)) {
+			n = xt_diff_step(steps, n, XT_DIFF_KEEP, i++, j++);
+			continue;
+		}
+
+		for (d = 1; d <= XT_DIFF_WINDOW; d++) {
+			if (i + d < nold - tail && same(i + d, j, data))
+				break;
+			if (j + d < nnew - tail && same(i, j + d, data))
+				break;
+		}
+		if (d > XT_DIFF_WINDOW) {
+			n = xt_diff_step(steps, n, XT_DIFF_REPLACE, i++, j++);
+		} else if (i + d < nold - tail && same(i + d, j, data)) {
+			for (; d; d--)
+				n = xt_diff_step(steps, n, XT_DIFF_DELETE,
+						 i++, 0);
+		} else {
+			for (; d; d--)
+				n = xt_diff_step(steps, n, XT_DIFF_INSERT,
+						 0, j++);
+		}
+	}
+	while (i < nold - tail)
+		n = xt_diff_step(steps, n, XT_DIFF_DELETE, i++, 0);
+	while (j < nnew - tail)
+		n = xt_diff_step(steps, n, XT_DIFF_INSERT, 0, j++);
+
+	for (; i < nold; i++, j++)
+		n = xt_diff_step(steps, n, XT_DIFF_KEEP, i, j);
+
+	for (i = 0; i < n; i++) {
+		switch (steps[i].op) {
+		case XT_DIFF_KEEP:
+			stats->kept++;
+			break;
+		case XT_DIFF_REPLACE:
+			stats->replaced++;
+			break;
+		case XT_DIFF_INSERT:
+			stats->inserted++;
+			break;
+		case XT_DIFF_DELETE:
+			stats->deleted++;
+			break;
+		}
+	}
+	return n;
+}
+
+void xt_diff_print(const char *table, const struct xt_diff_stats *stats)
+{
+	printf("# %s: %u rule(s) unchanged, %u inserted, %u replaced, "
+	       "%u deleted, %u chain(s) added, %u deleted\n", table,
+	       stats->kept, stats->inserted, stats->replaced, stats->deleted,
+	       stats->chains_added, stats->chains_deleted);
+}
+
+static bool xt_extension_family(uint8_t family)
+{
+	return family == afinfo->family || family == NFPROTO_UNSPEC;
+}
+
+/* Size of the userspace-visible data of a match or target, looked up
+ * without cloning the extension.
+ */
+size_t xt_userspacesize(const char *name, bool is_target)
+{
+	struct xtables_target *t;
+	struct xtables_match *m;
+
+	if (is_target) {
+		for (t = xtables_targets; t; t = t->next) {
+			if (!strcmp(t->name, name) &&
+			    xt_extension_family(t->family))
+				return t->userspacesize;
+		}
+		t = xtables_find_target(name, XTF_TRY_LOAD);
+		return t ? t->userspacesize : 0;
+	}
+
+	for (m = xtables_matches; m; m = m->next) {
+		if (!strcmp(m->name, name) && xt_extension_family(m->family))
+			return m->userspacesize;
+	}
+	m = xtables_find_match(name, XTF_TRY_LOAD, NULL);
+	return m ? m->userspacesize : 0;
+}
+
 /* function adding one argument to store, updating argc
  * returns if argument added, does not return otherwise */
 void add_argv(struct argv_store *store, const char *what, int quoted)
@@ -461,24 +1534,46 @@ void save_argv(struct argv_store *dst, struct argv_store *src)
 	src->argc = 0;
 }
 
+/*
+ * Parameters are unquoted in place: what is kept of a parameter never
+ * outgrows the part of the line it was read from, so it is moved down over
+ * the quotes and escapes dropped and terminated right there.
+ */
+#define XT_PARAM_MAXLEN	1024
+
 struct xt_param_buf {
-	char	buffer[1024];
-	int 	len;
+	char	*start;
+	char	*end;
 };
 
-static void add_param(struct xt_param_buf *param, const char *curchar)
+static void add_param(struct xt_param_buf *param, const char *curchar,
+		      size_t len)
 {
-	param->buffer[param->len++] = *curchar;
-	if (param->len >= sizeof(param->buffer))
+	if (param->end != curchar)
+		memmove(param->end, curchar, len);
+	param->end += len;
+	if (param->end - param->start >= XT_PARAM_MAXLEN)
 		xtables_error(PARAMETER_PROBLEM,
 			      "Parameter too long!");
 }
 
+static void end_param(struct argv_store *store, struct xt_param_buf *param,
+		      char *next, int quoted)
+{
+	*param->end = '\0';
+	add_argv(store, param->start, quoted);
+	param->start = param->end = next;
+}
+
 void add_param_to_argv(struct argv_store *store, char *parsestart, int line)
 {
 	int quote_open = 0, escaped = 0, quoted = 0;
-	struct xt_param_buf param = {};
+	struct xt_param_buf param = {
+		.start	= parsestart,
+		.end	= parsestart,
+	};
 	char *curchar;
+	size_t len;
 
 	/* After fighting with strtok enough, here's now
 	 * a 'real' parser. According to Rusty I'm now no
@@ -487,19 +1582,19 @@ void add_param_to_argv(struct argv_store *store, char *parsestart, int line)
 	for (curchar = parsestart; *curchar; curchar++) {
 		if (quote_open) {
 			if (escaped) {
-				add_param(&param, curchar);
+				add_param(&param, curchar, 1);
 				escaped = 0;
 				continue;
 			} else if (*curchar == '\\') {
 				escaped = 1;
 				continue;
-			} else if (*curchar == '"') {
-				quote_open = 0;
-				*curchar = '"';
-			} else {
-				add_param(&param, curchar);
+			} else if (*curchar != '"') {
+				len = strcspn(curchar, "\\\"");
+				add_param(&param, curchar, len);
+				curchar += len - 1;
 				continue;
 			}
+			quote_open = 0;
 		} else {
 			if (*curchar == '"') {
 				quote_open = 1;
@@ -514,26 +1609,25 @@ void add_param_to_argv(struct argv_store *store, char *parsestart, int line)
 		case ' ':
 		case '\t':
 		case '\n':
-			if (!param.len) {
+			if (param.end == param.start) {
 				/* two spaces? */
+				param.start = param.end = curchar + 1;
 				continue;
 			}
 			break;
 		default:
-			/* regular character, copy to buffer */
-			add_param(&param, curchar);
+			/* regular characters, copy up to the next special one */
+			len = strcspn(curchar, " \t\n\"");
+			add_param(&param, curchar, len);
+			curchar += len - 1;
 			continue;
 		}
 
-		param.buffer[param.len] = '\0';
-		add_argv(store, param.buffer, quoted);
-		param.len = 0;
+		end_param(store, &param, curchar + 1, quoted);
 		quoted = 0;
 	}
-	if (param.len) {
-		param.buffer[param.len] = '\0';
-		add_argv(store, param.buffer, 0);
-	}
+	if (param.end != param.start)
+		end_param(store, &param, curchar, 0);
 }
 
 #ifdef DEBUG
@@ -664,15 +1758,8 @@ void command_match(struct iptables_command_state *cs)
 	if (m == m->next)
 		return;
 	/* Merge options for non-cloned matches */
-	if (m->x6_options != NULL)
-		opts = xtables_options_xfrm(xt_params->orig_opts, opts,
-					    m->x6_options, &m->option_offset);
-	else if (m->extra_opts != NULL)
-		opts = xtables_merge_options(xt_params->orig_opts, opts,
-					     m->extra_opts, &m->option_offset);
-	if (opts == NULL)
-		xtables_error(OTHER_PROBLEM, "can't alloc memory!");
-	xt_params->opts = opts;
+	xt_params->opts = xs_merge_opts(cs, opts, m->extra_opts,
+					m->x6_options, &m->option_offset);
 }
 
 const char *xt_parse_target(const char *targetname)
@@ -724,17 +1811,9 @@ void command_jump(struct iptables_command_state *cs, const char *jumpto)
 	cs->target->t->u.user.revision = cs->target->revision;
 	xs_init_target(cs->target);
 
-	if (cs->target->x6_options != NULL)
-		opts = xtables_options_xfrm(xt_params->orig_opts, opts,
-					    cs->target->x6_options,
-					    &cs->target->option_offset);
-	else
-		opts = xtables_merge_options(xt_params->orig_opts, opts,
-					     cs->target->extra_opts,
-					     &cs->target->option_offset);
-	if (opts == NULL)
-		xtables_error(OTHER_PROBLEM, "can't alloc memory!");
-	xt_params->opts = opts;
+	xt_params->opts = xs_merge_opts(cs, opts, cs->target->extra_opts,
+					cs->target->x6_options,
+					&cs->target->option_offset);
 }
 
 char cmd2char(int option)
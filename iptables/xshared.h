@@ -4,6 +4,7 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <netinet/in.h>
 #include <net/if.h>
 #include <linux/netfilter_arp/arp_tables.h>
@@ -58,6 +59,8 @@ enum {
 };
 #define NUMBER_OF_CMD		16
 
+struct addr_mask;
+struct option;
 struct xtables_globals;
 struct xtables_rule_match;
 struct xtables_target;
@@ -131,6 +134,8 @@ struct iptables_command_state {
 	const char *jumpto;
 	char **argv;
 	bool restore;
+	/* -s and -d lists nft keeps in one rule, see add_addr_list() */
+	const struct addr_mask *saddrs, *daddrs;
 };
 
 typedef int (*mainfunc_t)(int, char **);
@@ -162,8 +167,9 @@ extern void xs_init_match(struct xtables_match *);
  * XT_LOCK_FAILED : The lock could not be acquired.
  *
  * XT_LOCK_BUSY : The lock was held by another process. xtables_lock only
- * returns this value when |wait| == false. If |wait| == true, xtables_lock
- * will not return unless the lock has been acquired.
+ * returns this value when |wait| == 0 or the lock was not released within
+ * |wait| seconds. If |wait| == -1, xtables_lock will not return unless the
+ * lock has been acquired.
  *
  * XT_LOCK_NOT_ACQUIRED : We have not yet attempted to acquire the lock.
  */
@@ -173,7 +179,7 @@ enum {
 	XT_LOCK_NOT_ACQUIRED  = -3,
 };
 extern void xtables_unlock(int lock);
-extern int xtables_lock_or_exit(int wait, struct timeval *tv);
+extern int xtables_lock_or_exit(int wait, bool verbose);
 
 int parse_wait_time(int argc, char *argv[]);
 void parse_wait_interval(int argc, char *argv[], struct timeval *wait_interval);
@@ -181,6 +187,68 @@ int parse_counters(const char *string, struct xt_counters *ctr);
 bool tokenize_rule_counters(char **bufferp, char **pcnt, char **bcnt, int line);
 bool xs_has_arg(int argc, char *argv[]);
 
+/*
+ * Binary snapshot written by *-save -b and read back by *-restore -b: a
+ * header followed by typed records. Legacy snapshots hold the table info
+ * and entries blob as the kernel hands them out, nf_tables ones hold
+ * netlink messages, the record type being the message type.
+ */
+#define XT_SNAPSHOT_MAGIC	"xtsnap"
+#define XT_SNAPSHOT_VERSION	1
+
+enum xt_snapshot_kind {
+	XT_SNAPSHOT_LEGACY,
+	XT_SNAPSHOT_NFT,
+};
+
+enum {
+	XT_SNAPSHOT_INFO	= 0x10000,	/* struct ipt_getinfo */
+	XT_SNAPSHOT_ENTRIES,			/* entries blob */
+};
+
+void xt_snapshot_write_hdr(FILE *f, enum xt_snapshot_kind kind, int family);
+void xt_snapshot_read_hdr(FILE *f, enum xt_snapshot_kind kind, int family);
+void xt_snapshot_write(FILE *f, uint32_t type, const void *data,
+		       uint32_t len);
+void *xt_snapshot_read(FILE *f, uint32_t *type, uint32_t *len,
+		       uint32_t maxlen);
+
+/*
+ * restore --diff: the rules of a chain being restored are aligned with the
+ * ones in the kernel, which turns into the steps to get from the latter to
+ * the former. Steps refer to rules by their index in either chain.
+ */
+enum xt_diff_op {
+	XT_DIFF_KEEP,
+	XT_DIFF_REPLACE,
+	XT_DIFF_INSERT,
+	XT_DIFF_DELETE,
+};
+
+struct xt_diff_step {
+	enum xt_diff_op	op;
+	unsigned int	old;		/* kernel rule, unless XT_DIFF_INSERT */
+	unsigned int	new;		/* restored rule, unless XT_DIFF_DELETE */
+};
+
+struct xt_diff_stats {
+	unsigned int	kept;
+	unsigned int	inserted;
+	unsigned int	replaced;
+	unsigned int	deleted;
+	unsigned int	chains_added;
+	unsigned int	chains_deleted;
+};
+
+unsigned int xt_diff_rules(unsigned int nold, unsigned int nnew,
+			   bool (*same)(unsigned int old, unsigned int new,
+					void *data),
+			   void *data, struct xt_diff_step *steps,
+			   struct xt_diff_stats *stats);
+void xt_diff_print(const char *table, const struct xt_diff_stats *stats);
+
+size_t xt_userspacesize(const char *name, bool is_target);
+
 extern const struct xtables_afinfo *afinfo;
 
 #define MAX_ARGC	255
@@ -207,6 +275,14 @@ void print_ifaces(const char *iniface, const char *outiface, uint8_t invflags,
 		  unsigned int format);
 
 void command_match(struct iptables_command_state *cs);
+void xs_free_opts(const struct iptables_command_state *cs);
+void xs_opts_cache_free(void);
+int xs_getopt_long(const struct iptables_command_state *cs, int argc,
+		   char *const argv[], const char *optstring,
+		   const struct option *longopts);
+void xs_option_fcall(struct iptables_command_state *cs);
+void xs_parse_cache_print(void);
+void xs_parse_cache_free(void);
 const char *xt_parse_target(const char *targetname);
 void command_jump(struct iptables_command_state *cs, const char *jumpto);
 
@@ -26,6 +26,8 @@ static int counters, verbose;
 /* Keeping track of external matches and targets.  */
 static const struct option options[] = {
 	{.name = "counters", .has_arg = false, .val = 'c'},
+	{.name = "binary",   .has_arg = false, .val = 'b'},
+	{.name = "diff",     .has_arg = false, .val = 'd'},
 	{.name = "verbose",  .has_arg = false, .val = 'v'},
 	{.name = "version",       .has_arg = 0, .val = 'V'},
 	{.name = "test",     .has_arg = false, .val = 't'},
@@ -37,6 +39,7 @@ static const struct option options[] = {
 	{.name = "ipv6",     .has_arg = false, .val = '6'},
 	{.name = "wait",          .has_arg = 2, .val = 'w'},
 	{.name = "wait-interval", .has_arg = 2, .val = 'W'},
+	{.name = "optimize", .has_arg = false, .val = 'O'},
 	{NULL},
 };
 
@@ -45,8 +48,10 @@ static const struct option options[] = {
 
 static void print_usage(const char *name, const char *version)
 {
-	fprintf(stderr, "Usage: %s [-c] [-v] [-V] [-t] [-h] [-n] [-T table] [-M command] [-4] [-6] [file]\n"
+	fprintf(stderr, "Usage: %s [-b] [-c] [-d] [-v] [-V] [-t] [-h] [-n] [-T table] [-M command] [-4] [-6] [-O] [file]\n"
+			"	   [ --binary ]\n"
 			"	   [ --counters ]\n"
+			"	   [ --diff ]\n"
 			"	   [ --verbose ]\n"
 			"	   [ --version]\n"
 			"	   [ --test ]\n"
@@ -55,7 +60,8 @@ static void print_usage(const char *name, const char *version)
 			"	   [ --table=<TABLE> ]\n"
 			"	   [ --modprobe=<command> ]\n"
 			"	   [ --ipv4 ]\n"
-			"	   [ --ipv6 ]\n", name);
+			"	   [ --ipv6 ]\n"
+			"	   [ --optimize ]\n", name);
 }
 
 static const struct nft_xt_restore_cb restore_cb = {
@@ -173,9 +179,11 @@ static void xtables_restore_parse_line(struct nft_handle *h,
 						   chain);
 
 			}
+			/* --diff leaves the counters in the kernel alone */
 			if (cb->chain_set &&
-			    cb->chain_set(h, state->curtable->name,
-					  chain, policy, &count) < 0) {
+			    cb->chain_set(h, state->curtable->name, chain,
+					  policy, counters || !h->diff ?
+						  &count : NULL) < 0) {
 				xtables_error(OTHER_PROBLEM,
 					      "Can't set policy `%s' on `%s' line %u: %s\n",
 					      policy, chain, line,
@@ -364,7 +372,7 @@ xtables_restore_main(int family, const char *progname, int argc, char *argv[])
 		.commit = true,
 		.cb = &restore_cb,
 	};
-	bool noflush = false;
+	bool noflush = false, optimize = false, binary = false, diff = false;
 	struct nft_handle h;
 	int c;
 
@@ -379,14 +387,17 @@ xtables_restore_main(int family, const char *progname, int argc, char *argv[])
 		exit(1);
 	}
 
-	while ((c = getopt_long(argc, argv, "bcvVthnM:T:wW", options, NULL)) != -1) {
+	while ((c = getopt_long(argc, argv, "bcdvVthnM:T:wWO", options, NULL)) != -1) {
 		switch (c) {
 			case 'b':
-				fprintf(stderr, "-b/--binary option is not implemented\n");
+				binary = true;
 				break;
 			case 'c':
 				counters = 1;
 				break;
+			case 'd':
+				diff = true;
+				break;
 			case 'v':
 				verbose = 1;
 				break;
@@ -413,6 +424,9 @@ xtables_restore_main(int family, const char *progname, int argc, char *argv[])
 				if (!optarg && xs_has_arg(argc, argv))
 					optind++;
 				break;
+			case 'O':
+				optimize = true;
+				break;
 			default:
 				fprintf(stderr,
 					"Try `%s -h' for more information.\n",
@@ -463,10 +477,36 @@ xtables_restore_main(int family, const char *progname, int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 	h.noflush = noflush;
+	h.optimize = optimize;
+	h.diff = diff;
+	h.diff_counters = diff && counters;
 	h.restore = true;
 
-	xtables_restore_parse(&h, &p);
+	if (diff && (noflush || binary))
+		xtables_error(PARAMETER_PROBLEM,
+			      "--diff does not support --%s",
+			      noflush ? "noflush" : "binary");
+
+	if (binary) {
+		if (noflush)
+			xtables_error(PARAMETER_PROBLEM,
+				      "--binary does not support --noflush");
+		if (!nft_snapshot_restore(&h, p.in, p.tablename, counters,
+					  p.testing))
+			xtables_error(OTHER_PROBLEM,
+				      "Failed to restore snapshot: %s",
+				      nft_strerror(errno));
+	} else {
+		xtables_restore_parse(&h, &p);
+	}
+
+	if (verbose) {
+		nft_print_stats(&h);
+		xs_parse_cache_print();
+	}
 
+	xs_parse_cache_free();
+	xs_opts_cache_free();
 	nft_fini(&h);
 	fclose(p.in);
 	return 0;
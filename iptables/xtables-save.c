@@ -14,6 +14,7 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 #include <time.h>
 #include <netdb.h>
 #include <unistd.h>
@@ -32,9 +33,11 @@
 #define prog_name xtables_globals.program_name
 #define prog_vers xtables_globals.program_version
 
-static const char *ipt_save_optstring = "bcdt:M:f:V";
+static const char *ipt_save_optstring = "bcCdt:M:f:V";
 static const struct option ipt_save_options[] = {
+	{.name = "binary",   .has_arg = false, .val = 'b'},
 	{.name = "counters", .has_arg = false, .val = 'c'},
+	{.name = "counters-only", .has_arg = false, .val = 'C'},
 	{.name = "version",  .has_arg = false, .val = 'V'},
 	{.name = "dump",     .has_arg = false, .val = 'd'},
 	{.name = "table",    .has_arg = true,  .val = 't'},
@@ -63,6 +66,7 @@ static const struct option ebt_save_options[] = {
 struct do_output_data {
 	unsigned int format;
 	bool commit;
+	bool counters_only;
 };
 
 static int
@@ -75,6 +79,9 @@ __do_output(struct nft_handle *h, const char *tablename, void *data)
 	if (!nft_table_builtin_find(h, tablename))
 		return 0;
 
+	if (d->counters_only)
+		return !nft_rule_save_counters(h, tablename);
+
 	if (!nft_is_table_compatible(h, tablename, NULL)) {
 		printf("# Table `%s' is incompatible, use 'nft' tool.\n",
 		       tablename);
@@ -124,6 +131,125 @@ do_output(struct nft_handle *h, const char *tablename, struct do_output_data *d)
 	return ret;
 }
 
+/*
+ * Optional on-disk cache of the save output, enabled by pointing
+ * XTABLES_SAVE_CACHE_DIR to a directory. Each file starts with the ruleset
+ * generation ID it was rendered from, so checking whether it is still valid
+ * takes a single netlink round trip instead of a full ruleset dump.
+ */
+#define SAVE_CACHE_GENID	"# nf_tables generation %u\n"
+
+static void save_cache_path(char *path, size_t len, const char *dir,
+			    int family, const char *tablename,
+			    unsigned int format)
+{
+	snprintf(path, len, "%s/save-%d-%s-%x", dir, family,
+		 tablename ? tablename : "all", format);
+}
+
+/* Copy cached output to stdout, refreshing the header timestamps. */
+static void save_cache_copy(FILE *in)
+{
+	size_t size = 0;
+	char *buf = NULL;
+	time_t now;
+
+	while (getline(&buf, &size, in) != -1) {
+		if (!strncmp(buf, "# Generated by ", 15)) {
+			now = time(NULL);
+			printf("# Generated by %s v%s on %s", prog_name,
+			       prog_vers, ctime(&now));
+		} else if (!strncmp(buf, "# Completed on ", 15)) {
+			now = time(NULL);
+			printf("# Completed on %s", ctime(&now));
+		} else {
+			fputs(buf, stdout);
+		}
+	}
+	free(buf);
+}
+
+static bool save_cache_hit(struct nft_handle *h, const char *path)
+{
+	uint32_t genid, cached;
+	char buf[64];
+	FILE *f;
+
+	f = fopen(path, "re");
+	if (f == NULL)
+		return false;
+
+	if (!fgets(buf, sizeof(buf), f) ||
+	    sscanf(buf, SAVE_CACHE_GENID, &cached) != 1)
+		goto miss;
+
+	mnl_genid_get(h, &genid);
+	if (genid != cached)
+		goto miss;
+
+	save_cache_copy(f);
+	fclose(f);
+	nft_check_xt_legacy(h->family, true);
+	return true;
+miss:
+	fclose(f);
+	return false;
+}
+
+static int save_cache_fill(struct nft_handle *h, const char *path,
+			   const char *tablename, struct do_output_data *d)
+{
+	char tmp[PATH_MAX], buf[64];
+	int ret, fd, out;
+	uint32_t genid;
+	size_t len;
+	FILE *f;
+
+	snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+	fd = mkstemp(tmp);
+	if (fd < 0)
+		return do_output(h, tablename, d);
+
+	/* Fetched before the dump: if the ruleset changes meanwhile, the
+	 * cached copy is simply considered stale next time.
+	 */
+	mnl_genid_get(h, &genid);
+
+	fflush(stdout);
+	out = dup(STDOUT_FILENO);
+	if (out < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+		if (out >= 0)
+			close(out);
+		close(fd);
+		unlink(tmp);
+		return do_output(h, tablename, d);
+	}
+
+	printf(SAVE_CACHE_GENID, genid);
+	ret = do_output(h, tablename, d);
+	fflush(stdout);
+	dup2(out, STDOUT_FILENO);
+	close(out);
+
+	if (ret != 0 || rename(tmp, path) < 0)
+		unlink(tmp);
+
+	f = fdopen(fd, "r");
+	if (f == NULL) {
+		close(fd);
+		return ret;
+	}
+
+	rewind(f);
+	if (fgets(buf, sizeof(buf), f)) {
+		while ((len = fread(tmp, 1, sizeof(tmp), f)) > 0)
+			fwrite(tmp, 1, len, stdout);
+	}
+	fclose(f);
+
+	return ret;
+}
+
 /* Format:
  * :Chain name POLICY packets bytes
  * rule
@@ -137,8 +263,10 @@ xtables_save_main(int family, int argc, char *argv[],
 	struct do_output_data d = {
 		.format = FMT_NOCOUNTS,
 	};
+	char cache_path[PATH_MAX];
+	const char *cache_dir;
 	struct nft_handle h;
-	bool dump = false;
+	bool dump = false, binary = false;
 	FILE *file = NULL;
 	int ret, c;
 
@@ -154,11 +282,14 @@ xtables_save_main(int family, int argc, char *argv[],
 	while ((c = getopt_long(argc, argv, optstring, longopts, NULL)) != -1) {
 		switch (c) {
 		case 'b':
-			fprintf(stderr, "-b/--binary option is not implemented\n");
+			binary = true;
 			break;
 		case 'c':
 			d.format &= ~FMT_NOCOUNTS;
 			break;
+		case 'C':
+			d.counters_only = true;
+			break;
 
 		case 't':
 			/* Select specific table. */
@@ -239,7 +370,25 @@ xtables_save_main(int family, int argc, char *argv[],
 		exit(EXIT_FAILURE);
 	}
 
-	ret = do_output(&h, tablename, &d);
+	/* Counters change without a new generation ID, never cache them. */
+	cache_dir = getenv("XTABLES_SAVE_CACHE_DIR");
+	if (binary) {
+		if (tablename && !nft_table_builtin_find(&h, tablename)) {
+			fprintf(stderr, "Table `%s' does not exist\n",
+				tablename);
+			exit(1);
+		}
+		ret = !nft_snapshot_save(&h, stdout, tablename);
+	} else if (cache_dir && (d.format & FMT_NOCOUNTS) && !d.counters_only) {
+		save_cache_path(cache_path, sizeof(cache_path), cache_dir,
+				family, tablename, d.format);
+		if (save_cache_hit(&h, cache_path))
+			ret = 0;
+		else
+			ret = save_cache_fill(&h, cache_path, tablename, &d);
+	} else {
+		ret = do_output(&h, tablename, &d);
+	}
 	nft_fini(&h);
 	if (dump)
 		exit(0);
@@ -71,6 +71,9 @@ xtables_main(int family, const char *progname, int argc, char *argv[])
 	if (ret)
 		ret = nft_commit(&h);
 
+	if (h.verbose > 1)
+		nft_print_stats(&h);
+
 	nft_fini(&h);
 
 	if (!ret) {
@@ -329,7 +329,7 @@ static int do_command_xlate(struct nft_handle *h, int argc, char *argv[],
 		free(args.d.addr.v6);
 		free(args.d.mask.v6);
 	}
-	xtables_free_opts(1);
+	xs_free_opts(&cs);
 
 	return ret;
 }
@@ -562,6 +562,8 @@ static int xtables_restore_xlate_main(int family, const char *progname,
 	xtables_restore_parse(&h, &p);
 	printf("# Completed on %s", ctime(&now));
 
+	xs_parse_cache_free();
+	xs_opts_cache_free();
 	nft_fini(&h);
 	fclose(p.in);
 	exit(0);
@@ -340,6 +340,54 @@ set_option(unsigned int *options, unsigned int option, uint8_t *invflg,
 	}
 }
 
+/* nft matches -s and -d lists with a lookup in a set, a single rule then
+ * stands for all pairs of addresses, see add_addr_list(). Addresses with
+ * non-prefix masks are still expanded into one rule per pair, and so are two
+ * lists of which one holds ranges: a set of concatenated ranges needs Linux
+ * 5.6 and is rejected by older kernels.
+ */
+static bool
+collapse_addr_lists(struct iptables_command_state *cs, int family,
+		    const struct addr_mask *s, const struct addr_mask *d)
+{
+	unsigned int len;
+
+	if (family == AF_INET)
+		len = sizeof(struct in_addr);
+	else if (family == AF_INET6)
+		len = sizeof(struct in6_addr);
+	else
+		return false;
+
+	if ((s->naddrs <= 1 && d->naddrs <= 1) ||
+	    !nft_addr_list_ok(s, len) || !nft_addr_list_ok(d, len))
+		return false;
+
+	if (s->naddrs > 1 && d->naddrs > 1 &&
+	    (nft_addr_list_interval(s, len) || nft_addr_list_interval(d, len)))
+		return false;
+
+	cs->saddrs = s->naddrs > 1 ? s : NULL;
+	cs->daddrs = d->naddrs > 1 ? d : NULL;
+
+	if (family == AF_INET) {
+		cs->fw.ip.src.s_addr = cs->saddrs ? 0 : s->addr.v4->s_addr;
+		cs->fw.ip.smsk.s_addr = cs->saddrs ? 0 : s->mask.v4->s_addr;
+		cs->fw.ip.dst.s_addr = cs->daddrs ? 0 : d->addr.v4->s_addr;
+		cs->fw.ip.dmsk.s_addr = cs->daddrs ? 0 : d->mask.v4->s_addr;
+	} else {
+		memcpy(&cs->fw6.ipv6.src, cs->saddrs ? &in6addr_any :
+		       s->addr.v6, sizeof(struct in6_addr));
+		memcpy(&cs->fw6.ipv6.smsk, cs->saddrs ? &in6addr_any :
+		       s->mask.v6, sizeof(struct in6_addr));
+		memcpy(&cs->fw6.ipv6.dst, cs->daddrs ? &in6addr_any :
+		       d->addr.v6, sizeof(struct in6_addr));
+		memcpy(&cs->fw6.ipv6.dmsk, cs->daddrs ? &in6addr_any :
+		       d->mask.v6, sizeof(struct in6_addr));
+	}
+	return true;
+}
+
 static int
 add_entry(const char *chain,
 	  const char *table,
@@ -352,6 +400,17 @@ add_entry(const char *chain,
 	unsigned int i, j;
 	int ret = 1;
 
+	if (collapse_addr_lists(cs, family, &s, &d)) {
+		if (append)
+			ret = nft_rule_append(h, chain, table, cs, NULL,
+					      verbose);
+		else
+			ret = nft_rule_insert(h, chain, table, cs, rulenum,
+					      verbose);
+		cs->saddrs = cs->daddrs = NULL;
+		return ret;
+	}
+
 	for (i = 0; i < s.naddrs; i++) {
 		if (family == AF_INET) {
 			cs->fw.ip.src.s_addr = s.addr.v4[i].s_addr;
@@ -433,6 +492,14 @@ delete_entry(const char *chain, const char *table,
 	unsigned int i, j;
 	int ret = 1;
 
+	/* Rules added one per pair of addresses are handled below. */
+	if (collapse_addr_lists(cs, family, &s, &d)) {
+		ret = nft_rule_delete(h, chain, table, cs, verbose);
+		cs->saddrs = cs->daddrs = NULL;
+		if (ret)
+			return ret;
+	}
+
 	for (i = 0; i < s.naddrs; i++) {
 		if (family == AF_INET) {
 			cs->fw.ip.src.s_addr = s.addr.v4[i].s_addr;
@@ -473,6 +540,14 @@ check_entry(const char *chain, const char *table,
 	unsigned int i, j;
 	int ret = 1;
 
+	/* Rules added one per pair of addresses are handled below. */
+	if (collapse_addr_lists(cs, family, &s, &d)) {
+		ret = nft_rule_check(h, chain, table, cs, verbose);
+		cs->saddrs = cs->daddrs = NULL;
+		if (ret)
+			return ret;
+	}
+
 	for (i = 0; i < s.naddrs; i++) {
 		if (family == AF_INET) {
 			cs->fw.ip.src.s_addr = s.addr.v4[i].s_addr;
@@ -542,7 +617,6 @@ void do_parse(struct nft_handle *h, int argc, char *argv[],
 	      struct xtables_args *args)
 {
 	struct xtables_match *m;
-	struct xtables_rule_match *matchp;
 	bool wait_interval_set = false;
 	struct timeval wait_interval;
 	struct xtables_target *t;
@@ -552,6 +626,7 @@ void do_parse(struct nft_handle *h, int argc, char *argv[],
 	memset(cs, 0, sizeof(*cs));
 	cs->jumpto = "";
 	cs->argv = argv;
+	cs->restore = p->restore;
 
 	/* re-set optind to 0 in case do_command4 gets called
 	 * a second time */
@@ -572,9 +647,9 @@ void do_parse(struct nft_handle *h, int argc, char *argv[],
 	opterr = 0;
 
 	opts = xt_params->orig_opts;
-	while ((cs->c = getopt_long(argc, argv,
+	while ((cs->c = xs_getopt_long(cs, argc, argv,
 	   "-:A:C:D:R:I:L::S::M:F::Z::N:X::E:P:Vh::o:p:s:d:j:i:fbvw::W::nt:m:xc:g:46",
-					   opts, NULL)) != -1) {
+					   opts)) != -1) {
 		switch (cs->c) {
 			/*
 			 * Command selection
@@ -963,10 +1038,7 @@ void do_parse(struct nft_handle *h, int argc, char *argv[],
 		xtables_error(PARAMETER_PROBLEM,
 			      "--wait-interval only makes sense with --wait\n");
 
-	for (matchp = cs->matches; matchp; matchp = matchp->next)
-		xtables_option_mfcall(matchp->match);
-	if (cs->target != NULL)
-		xtables_option_tfcall(cs->target);
+	xs_option_fcall(cs);
 
 	/* Fix me: must put inverse options checking here --MN */
 
@@ -1141,6 +1213,8 @@ int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
 		exit_tryhelp(2);
 	}
 
+	h->verbose = p.verbose;
+
 	*table = p.table;
 
 	xtables_rule_matches_free(&cs.matches);
@@ -1160,7 +1234,7 @@ int do_commandx(struct nft_handle *h, int argc, char *argv[], char **table,
 		free(args.d.addr.v6);
 		free(args.d.mask.v6);
 	}
-	xtables_free_opts(1);
+	xs_free_opts(&cs);
 
 	return ret;
 }
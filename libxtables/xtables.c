@@ -194,14 +194,50 @@ static const char *xtables_libdir;
 /* the path to command to load kernel module */
 const char *xtables_modprobe_program;
 
-/* Keep track of matches/targets pending full registration: linked lists. */
-struct xtables_match *xtables_pending_matches;
-struct xtables_target *xtables_pending_targets;
-
 /* Keep track of fully registered external matches/targets: linked lists. */
 struct xtables_match *xtables_matches;
 struct xtables_target *xtables_targets;
 
+/*
+ * Pending extensions used to be kept on these lists. They now live in the
+ * name index below and the lists stay empty, but remain exported so as not
+ * to break the ABI.
+ */
+struct xtables_match *xtables_pending_matches;
+struct xtables_target *xtables_pending_targets;
+
+/*
+ * Extensions are looked up by name for every -m and -j, so they are also
+ * indexed by name. An entry holds the extensions of that name pending full
+ * registration, linked through their next pointer, the ones the kernel
+ * turned down the revision of for the family it was asked for, which are
+ * not asked about again, and where the registered ones of that name start
+ * on xtables_matches or xtables_targets, which keeps them next to each
+ * other ordered by preference.
+ */
+#define XT_EXT_INDEX_SIZE	256
+
+struct xt_ext_index {
+	struct xt_ext_index		*next;
+	const char			*name;
+	uint8_t				rejected_family;
+	union {
+		struct {
+			struct xtables_match	*pending;
+			struct xtables_match	*rejected;
+			struct xtables_match	*first;
+		} m;
+		struct {
+			struct xtables_target	*pending;
+			struct xtables_target	*rejected;
+			struct xtables_target	*first;
+		} t;
+	};
+};
+
+static struct xt_ext_index *xt_match_index[XT_EXT_INDEX_SIZE];
+static struct xt_ext_index *xt_target_index[XT_EXT_INDEX_SIZE];
+
 /* Fully register a match/target which was previously partially registered. */
 static bool xtables_fully_register_pending_match(struct xtables_match *me);
 static bool xtables_fully_register_pending_target(struct xtables_target *me);
@@ -551,34 +587,162 @@ void xtables_parse_interface(const char *arg, char *vianame,
 }
 
 #ifndef NO_SHARED_LIBS
+/*
+ * The build lists the extension files it installs in XTABLES_MANIFEST next
+ * to them. Unless the directory was changed after it was written, the
+ * manifest tells which files are there without probing for each one an
+ * extension could be in. If it lists XTABLES_BUNDLE, the shared object all
+ * extensions were linked into as well, that one is loaded once instead of
+ * the listed files.
+ */
+#define XTABLES_MANIFEST	"extensions.manifest"
+#define XTABLES_BUNDLE		"extensions.so"
+#define XT_MANIFEST_MAXSIZE	(1 << 16)
+
+enum xt_bundle_state {
+	XT_BUNDLE_NONE,
+	XT_BUNDLE_PENDING,
+	XT_BUNDLE_LOADED,
+};
+
+struct xt_manifest {
+	struct xt_manifest	*next;
+	const char		*dir;		/* in the search path */
+	unsigned int		dirlen;
+	bool			valid;
+	enum xt_bundle_state	bundle;
+	char			*data;
+	char			**files;	/* sorted */
+	unsigned int		nfiles;
+};
+
+static struct xt_manifest *xt_manifests;
+
+static int xt_manifest_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static bool xt_manifest_has(const struct xt_manifest *m, const char *file)
+{
+	return bsearch(&file, m->files, m->nfiles, sizeof(*m->files),
+		       xt_manifest_cmp) != NULL;
+}
+
+static void xt_manifest_read(struct xt_manifest *m)
+{
+	struct stat dsb, msb;
+	char path[256], *p, *end;
+	int fd;
+
+	snprintf(path, sizeof(path), "%.*s/" XTABLES_MANIFEST,
+		 m->dirlen, m->dir);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	snprintf(path, sizeof(path), "%.*s/", m->dirlen, m->dir);
+	if (fstat(fd, &msb) != 0 || stat(path, &dsb) != 0 ||
+	    msb.st_size > XT_MANIFEST_MAXSIZE)
+		goto out;
+	if (dsb.st_mtim.tv_sec > msb.st_mtim.tv_sec ||
+	    (dsb.st_mtim.tv_sec == msb.st_mtim.tv_sec &&
+	     dsb.st_mtim.tv_nsec > msb.st_mtim.tv_nsec))
+		goto out;
+
+	m->data = xtables_malloc(msb.st_size + 1);
+	if (read(fd, m->data, msb.st_size) != msb.st_size)
+		goto out;
+	m->data[msb.st_size] = '\0';
+
+	m->files = xtables_calloc(msb.st_size / 2 + 1, sizeof(*m->files));
+	for (p = m->data; *p != '\0'; p = end) {
+		end = p + strcspn(p, "\n");
+		if (*end != '\0')
+			*end++ = '\0';
+		if (*p != '\0' && *p != '#')
+			m->files[m->nfiles++] = p;
+	}
+	qsort(m->files, m->nfiles, sizeof(*m->files), xt_manifest_cmp);
+
+	m->valid = true;
+	if (xt_manifest_has(m, XTABLES_BUNDLE))
+		m->bundle = XT_BUNDLE_PENDING;
+out:
+	close(fd);
+}
+
+static struct xt_manifest *xt_manifest_get(const char *dir,
+					   unsigned int dirlen)
+{
+	struct xt_manifest *m;
+
+	for (m = xt_manifests; m != NULL; m = m->next)
+		if (m->dirlen == dirlen && strncmp(m->dir, dir, dirlen) == 0)
+			return m;
+
+	m = xtables_calloc(1, sizeof(*m));
+	m->dir = dir;
+	m->dirlen = dirlen;
+	xt_manifest_read(m);
+	m->next = xt_manifests;
+	xt_manifests = m;
+	return m;
+}
+
+static void xt_manifest_load_bundle(struct xt_manifest *m)
+{
+	char path[256];
+
+	snprintf(path, sizeof(path), "%.*s/" XTABLES_BUNDLE,
+		 m->dirlen, m->dir);
+	if (dlopen(path, RTLD_NOW) == NULL) {
+		fprintf(stderr, "%s: %s\n", path, dlerror());
+		m->bundle = XT_BUNDLE_NONE;
+		return;
+	}
+	m->bundle = XT_BUNDLE_LOADED;
+}
+
 static void *load_extension(const char *search_path, const char *af_prefix,
     const char *name, bool is_target)
 {
 	const char *all_prefixes[] = {af_prefix, "libxt_", NULL};
 	const char **prefix;
 	const char *dir = search_path, *next;
+	struct xt_manifest *m;
 	void *ptr = NULL;
 	struct stat sb;
-	char path[256];
+	char path[256], file[XT_EXTENSION_MAXNAMELEN + 16];
 
 	do {
 		next = strchr(dir, ':');
 		if (next == NULL)
 			next = dir + strlen(dir);
 
+		m = xt_manifest_get(dir, next - dir);
+
 		for (prefix = all_prefixes; *prefix != NULL; ++prefix) {
-			snprintf(path, sizeof(path), "%.*s/%s%s.so",
-			         (unsigned int)(next - dir), dir,
-			         *prefix, name);
+			snprintf(file, sizeof(file), "%s%s.so", *prefix, name);
+			snprintf(path, sizeof(path), "%.*s/%s",
+			         (unsigned int)(next - dir), dir, file);
 
-			if (stat(path, &sb) != 0) {
+			if (m->valid) {
+				if (!xt_manifest_has(m, file)) {
+					errno = ENOENT;
+					continue;
+				}
+			} else if (stat(path, &sb) != 0) {
 				if (errno == ENOENT)
 					continue;
 				fprintf(stderr, "%s: %s\n", path,
 					strerror(errno));
 				return NULL;
 			}
-			if (dlopen(path, RTLD_NOW) == NULL) {
+			if (m->bundle == XT_BUNDLE_PENDING)
+				xt_manifest_load_bundle(m);
+			if (m->bundle != XT_BUNDLE_LOADED &&
+			    dlopen(path, RTLD_NOW) == NULL) {
 				fprintf(stderr, "%s: %s\n", path, dlerror());
 				break;
 			}
@@ -612,12 +776,91 @@ static bool extension_cmp(const char *name1, const char *name2, uint32_t family)
 	return false;
 }
 
+static struct xt_ext_index *xt_ext_index_get(struct xt_ext_index **index,
+					     const char *name, bool create)
+{
+	struct xt_ext_index *idx;
+	unsigned int hash = 0;
+	const char *p;
+
+	for (p = name; *p; p++)
+		hash = hash * 31 + (unsigned char)*p;
+	index += hash % XT_EXT_INDEX_SIZE;
+
+	for (idx = *index; idx; idx = idx->next)
+		if (strcmp(idx->name, name) == 0)
+			return idx;
+
+	if (!create)
+		return NULL;
+
+	idx = xtables_calloc(1, sizeof(*idx));
+	idx->name = name;
+	idx->next = *index;
+	*index = idx;
+	return idx;
+}
+
+/* Ask the kernel again about revisions turned down for another family. */
+static void xt_match_index_unreject(struct xt_ext_index *idx)
+{
+	struct xtables_match *me;
+
+	if (idx->m.rejected == NULL || idx->rejected_family == afinfo->family)
+		return;
+
+	while ((me = idx->m.rejected) != NULL) {
+		idx->m.rejected = me->next;
+		me->next = idx->m.pending;
+		idx->m.pending = me;
+	}
+}
+
+static void xt_target_index_unreject(struct xt_ext_index *idx)
+{
+	struct xtables_target *me;
+
+	if (idx->t.rejected == NULL || idx->rejected_family == afinfo->family)
+		return;
+
+	while ((me = idx->t.rejected) != NULL) {
+		idx->t.rejected = me->next;
+		me->next = idx->t.pending;
+		idx->t.pending = me;
+	}
+}
+
+static void xt_match_index_first(const char *name)
+{
+	struct xt_ext_index *idx = xt_ext_index_get(xt_match_index, name,
+						    false);
+	struct xtables_match *ptr;
+
+	for (ptr = xtables_matches; ptr; ptr = ptr->next)
+		if (strcmp(ptr->name, name) == 0)
+			break;
+	idx->m.first = ptr;
+}
+
+static void xt_target_index_first(const char *name)
+{
+	struct xt_ext_index *idx = xt_ext_index_get(xt_target_index, name,
+						    false);
+	struct xtables_target *ptr;
+
+	for (ptr = xtables_targets; ptr; ptr = ptr->next)
+		if (strcmp(ptr->name, name) == 0)
+			break;
+	idx->t.first = ptr;
+}
+
 struct xtables_match *
 xtables_find_match(const char *name, enum xtables_tryload tryload,
 		   struct xtables_rule_match **matches)
 {
 	struct xtables_match **dptr;
-	struct xtables_match *ptr;
+	struct xtables_match *ptr = NULL;
+	struct xt_ext_index *idx;
 	const char *icmp6 = "icmp6";
 
 	if (strlen(name) >= XT_EXTENSION_MAXNAMELEN)
@@ -632,19 +875,33 @@ xtables_find_match(const char *name, enum xtables_tryload tryload,
 	     (strcmp(name,"icmp6") == 0) )
 		name = icmp6;
 
+	idx = xt_ext_index_get(xt_match_index, name, false);
+	if (idx == NULL)
+		goto not_found;
+
+	xt_match_index_unreject(idx);
+
 	/* Trigger delayed initialization */
-	for (dptr = &xtables_pending_matches; *dptr; ) {
+	for (dptr = &idx->m.pending; *dptr; ) {
 		if (extension_cmp(name, (*dptr)->name, (*dptr)->family)) {
 			ptr = *dptr;
 			*dptr = (*dptr)->next;
 			if (xtables_fully_register_pending_match(ptr))
 				continue;
-			*dptr = ptr;
+			ptr->next = idx->m.rejected;
+			idx->m.rejected = ptr;
+			idx->rejected_family = afinfo->family;
+			continue;
 		}
 		dptr = &((*dptr)->next);
 	}
 
-	for (ptr = xtables_matches; ptr; ptr = ptr->next) {
+	for (ptr = idx->m.first; ptr; ptr = ptr->next) {
+		/* past the registered ones of that name */
+		if (strcmp(name, ptr->name) != 0) {
+			ptr = NULL;
+			break;
+		}
 		if (extension_cmp(name, ptr->name, ptr->family)) {
 			struct xtables_match *clone;
 
@@ -665,6 +922,7 @@ xtables_find_match(const char *name, enum xtables_tryload tryload,
 		}
 	}
 
+not_found:
 #ifndef NO_SHARED_LIBS
 	if (!ptr && tryload != XTF_DONT_LOAD && tryload != XTF_DURING_LOAD) {
 		ptr = load_extension(xtables_libdir, afinfo->libprefix,
@@ -733,7 +991,8 @@ struct xtables_target *
 xtables_find_target(const char *name, enum xtables_tryload tryload)
 {
 	struct xtables_target **dptr;
-	struct xtables_target *ptr;
+	struct xtables_target *ptr = NULL;
+	struct xt_ext_index *idx;
 
 	/* Standard target? */
 	if (strcmp(name, "") == 0
@@ -743,19 +1002,33 @@ xtables_find_target(const char *name, enum xtables_tryload tryload)
 	    || strcmp(name, XTC_LABEL_RETURN) == 0)
 		name = "standard";
 
+	idx = xt_ext_index_get(xt_target_index, name, false);
+	if (idx == NULL)
+		goto not_found;
+
+	xt_target_index_unreject(idx);
+
 	/* Trigger delayed initialization */
-	for (dptr = &xtables_pending_targets; *dptr; ) {
+	for (dptr = &idx->t.pending; *dptr; ) {
 		if (extension_cmp(name, (*dptr)->name, (*dptr)->family)) {
 			ptr = *dptr;
 			*dptr = (*dptr)->next;
 			if (xtables_fully_register_pending_target(ptr))
 				continue;
-			*dptr = ptr;
+			ptr->next = idx->t.rejected;
+			idx->t.rejected = ptr;
+			idx->rejected_family = afinfo->family;
+			continue;
 		}
 		dptr = &((*dptr)->next);
 	}
 
-	for (ptr = xtables_targets; ptr; ptr = ptr->next) {
+	for (ptr = idx->t.first; ptr; ptr = ptr->next) {
+		/* past the registered ones of that name */
+		if (strcmp(name, ptr->name) != 0) {
+			ptr = NULL;
+			break;
+		}
 		if (extension_cmp(name, ptr->name, ptr->family)) {
 			struct xtables_target *clone;
 
@@ -776,6 +1049,7 @@ xtables_find_target(const char *name, enum xtables_tryload tryload)
 		}
 	}
 
+not_found:
 #ifndef NO_SHARED_LIBS
 	if (!ptr && tryload != XTF_DONT_LOAD && tryload != XTF_DURING_LOAD) {
 		ptr = load_extension(xtables_libdir, afinfo->libprefix,
@@ -904,6 +1178,8 @@ static void xtables_check_options(const char *name, const struct option *opt)
 
 void xtables_register_match(struct xtables_match *me)
 {
+	struct xt_ext_index *idx;
+
 	if (me->next) {
 		fprintf(stderr, "%s: match \"%s\" already registered\n",
 			xt_params->program_name, me->name);
@@ -957,8 +1233,9 @@ void xtables_register_match(struct xtables_match *me)
 
 
 	/* place on linked list of matches pending full registration */
-	me->next = xtables_pending_matches;
-	xtables_pending_matches = me;
+	idx = xt_ext_index_get(xt_match_index, me->name, true);
+	me->next = idx->m.pending;
+	idx->m.pending = me;
 }
 
 /**
@@ -1085,6 +1362,7 @@ static bool xtables_fully_register_pending_match(struct xtables_match *me)
 	me->m = NULL;
 	me->mflags = 0;
 
+	xt_match_index_first(me->name);
 	return true;
 }
 
@@ -1097,6 +1375,8 @@ void xtables_register_matches(struct xtables_match *match, unsigned int n)
 
 void xtables_register_target(struct xtables_target *me)
 {
+	struct xt_ext_index *idx;
+
 	if (me->next) {
 		fprintf(stderr, "%s: target \"%s\" already registered\n",
 			xt_params->program_name, me->name);
@@ -1153,8 +1433,9 @@ void xtables_register_target(struct xtables_target *me)
 		return;
 
 	/* place on linked list of targets pending full registration */
-	me->next = xtables_pending_targets;
-	xtables_pending_targets = me;
+	idx = xt_ext_index_get(xt_target_index, me->name, true);
+	me->next = idx->t.pending;
+	idx->t.pending = me;
 }
 
 static bool xtables_fully_register_pending_target(struct xtables_target *me)
@@ -1223,6 +1504,7 @@ static bool xtables_fully_register_pending_target(struct xtables_target *me)
 	me->t = NULL;
 	me->tflags = 0;
 
+	xt_target_index_first(me->name);
 	return true;
 }
 
@@ -1019,8 +1019,16 @@ void xtables_options_fcheck(const char *name, unsigned int xflags,
 			    const struct xt_option_entry *table)
 {
 	const struct xt_option_entry *entry, *other;
+	const struct xt_option_entry *byid[CHAR_BIT * sizeof(entry->id)] = {};
 	unsigned int i;
 
+	/* what xtables_option_lookup() would find, for each id */
+	if (xflags != 0)
+		for (entry = table; entry->name != NULL; ++entry)
+			if (entry->id < ARRAY_SIZE(byid) &&
+			    byid[entry->id] == NULL)
+				byid[entry->id] = entry;
+
 	for (entry = table; entry->name != NULL; ++entry) {
 		if (entry->flags & XTOPT_MAND &&
 		    !(xflags & (1 << entry->id)))
@@ -1031,14 +1039,14 @@ void xtables_options_fcheck(const char *name, unsigned int xflags,
 			/* Not required, not specified, thus skip. */
 			continue;
 
-		for (i = 0; i < CHAR_BIT * sizeof(entry->id); ++i) {
+		for (i = 0; i < ARRAY_SIZE(byid); ++i) {
 			if (entry->id == i)
 				/*
 				 * Avoid conflict with self. Multi-use check
 				 * was done earlier in xtables_option_parse.
 				 */
 				continue;
-			other = xtables_option_lookup(table, i);
+			other = byid[i];
 			if (other == NULL)
 				continue;
 			xtables_option_fcheck2(name, entry, other, xflags);